@@ -33,6 +33,8 @@
 #include "adlist.h"
 #include "zmalloc.h"
 
+static zslab listNodeSlab = ZSLAB_INIT("listNode",listNode);
+
 /* Create a new list. The created list can be freed with
  * AlFreeList(), but private value of every node need to be freed
  * by the user before to call AlFreeList().
@@ -65,7 +67,7 @@ void listRelease(list *list)
     while(len--) {
         next = current->next;
         if (list->free) list->free(current->value);
-        zfree(current);
+        zslab_free(&listNodeSlab,current);
         current = next;
     }
     zfree(list);
@@ -81,7 +83,7 @@ list *listAddNodeHead(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL)
+    if ((node = zslab_alloc(&listNodeSlab)) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -107,7 +109,7 @@ list *listAddNodeTail(list *list, void *value)
 {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL)
+    if ((node = zslab_alloc(&listNodeSlab)) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -126,7 +128,7 @@ list *listAddNodeTail(list *list, void *value)
 list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
     listNode *node;
 
-    if ((node = zmalloc(sizeof(*node))) == NULL)
+    if ((node = zslab_alloc(&listNodeSlab)) == NULL)
         return NULL;
     node->value = value;
     if (after) {
@@ -167,7 +169,7 @@ void listDelNode(list *list, listNode *node)
     else
         list->tail = node->prev;
     if (list->free) list->free(node->value);
-    zfree(node);
+    zslab_free(&listNodeSlab,node);
     list->len--;
 }
 
@@ -527,7 +527,7 @@ struct redisClient *createFakeClient(void) {
     c->obuf_soft_limit_reached_time = 0;
     c->watched_keys = listCreate();
     c->peerid = NULL;
-    listSetFreeMethod(c->reply,decrRefCountVoid);
+    listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
     initClientMultiState(c);
     return c;
@@ -556,7 +556,7 @@ int loadAppendOnlyFile(char *filename) {
     struct redisClient *fakeClient;
     FILE *fp = fopen(filename,"r");
     struct redis_stat sb;
-    int old_aof_state = server.aof_state;
+    int old_aof_state = server.aof_state, persistent;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of the latest well-formed command loaded. */
 
@@ -637,8 +637,12 @@ int loadAppendOnlyFile(char *filename) {
             exit(1);
         }
 
-        /* Run the command in the context of a fake client */
+        /* Run the command in the context of a fake client, in the
+         * persistent scope like call() does. */
+        fakeClient->cmd = cmd;
+        persistent = pheapDbBeginCommand(fakeClient);
         cmd->proc(fakeClient);
+        zmalloc_set_persistent_scope(persistent);
 
         /* The fake client should not have a reply */
         redisAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
@@ -714,7 +718,7 @@ int rioWriteBulkObject(rio *r, robj *obj) {
      * in a child process when this function is called). */
     if (obj->encoding == REDIS_ENCODING_INT) {
         return rioWriteBulkLongLong(r,(long)obj->ptr);
-    } else if (obj->encoding == REDIS_ENCODING_RAW) {
+    } else if (sdsEncodedObject(obj)) {
         return rioWriteBulkString(r,obj->ptr,sdslen(obj->ptr));
     } else {
         redisPanic("Unknown string encoding");
@@ -1080,6 +1084,14 @@ int rewriteAppendOnlyFileBackground(void) {
     long long start;
 
     if (server.aof_child_pid != -1) return REDIS_ERR;
+    /* See rdbSaveBackground() for why we can't fork. */
+    if (pheapIsPersistent()) {
+        redisLog(REDIS_WARNING,"Can't rewrite append only file in "
+                               "background: the dataset lives in the "
+                               "persistent heap.");
+        return REDIS_ERR;
+    }
+    tierPrepareFork();
     start = ustime();
     if ((childpid = fork()) == 0) {
         char tmpfile[256];
@@ -1131,6 +1143,9 @@ int rewriteAppendOnlyFileBackground(void) {
 void bgrewriteaofCommand(redisClient *c) {
     if (server.aof_child_pid != -1) {
         addReplyError(c,"Background append only file rewriting already in progress");
+    } else if (pheapIsPersistent()) {
+        addReplyError(c,"Can't BGREWRITEAOF: the dataset lives in the "
+                        "persistent heap");
     } else if (server.rdb_child_pid != -1) {
         server.aof_rewrite_scheduled = 1;
         addReplyStatus(c,"Background append only file rewriting scheduled");
@@ -64,6 +64,7 @@
 static pthread_t bio_threads[REDIS_BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[REDIS_BIO_NUM_OPS];
 static pthread_cond_t bio_condvar[REDIS_BIO_NUM_OPS];
+static pthread_cond_t bio_step_cond[REDIS_BIO_NUM_OPS]; /* A job completed. */
 static list *bio_jobs[REDIS_BIO_NUM_OPS];
 /* The following array is used to hold the number of pending jobs for every
  * OP type. This allows us to export the bioPendingJobsOfType() API that is
@@ -99,6 +100,7 @@ void bioInit(void) {
     for (j = 0; j < REDIS_BIO_NUM_OPS; j++) {
         pthread_mutex_init(&bio_mutex[j],NULL);
         pthread_cond_init(&bio_condvar[j],NULL);
+        pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
     }
@@ -176,6 +178,19 @@ void *bioProcessBackgroundJobs(void *arg) {
             close((long)job->arg1);
         } else if (type == REDIS_BIO_AOF_FSYNC) {
             aof_fsync((long)job->arg1);
+        } else if (type == REDIS_BIO_ALLOC_TRACE) {
+            /* arg1 is the trace file, arg2 is set when tracing was stopped
+             * and this is the final flush. */
+            if (zmalloc_trace_flush((long)job->arg1) == -1)
+                redisLog(REDIS_WARNING,
+                    "Error writing the allocation trace: %s", strerror(errno));
+            if (job->arg2) close((long)job->arg1);
+        } else if (type == REDIS_BIO_LAZY_FREE) {
+            lazyfreeDoJob(job->arg1);
+        } else if (type == REDIS_BIO_DICT_TABLE) {
+            /* arg1 is the job of a table to allocate, or NULL to release
+             * the table arg2 of arg3 bytes. */
+            rehashDoJob(job->arg1,job->arg2,(size_t)job->arg3);
         } else {
             redisPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -186,6 +201,9 @@ void *bioProcessBackgroundJobs(void *arg) {
         pthread_mutex_lock(&bio_mutex[type]);
         listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
+
+        /* Unblock the threads waiting in bioWaitPendingJobsLE(). */
+        pthread_cond_broadcast(&bio_step_cond[type]);
     }
 }
 
@@ -198,6 +216,15 @@ unsigned long long bioPendingJobsOfType(int type) {
     return val;
 }
 
+/* Wait until the number of pending jobs of the specified type is less than
+ * or equal to 'num'. */
+void bioWaitPendingJobsLE(int type, unsigned long long num) {
+    pthread_mutex_lock(&bio_mutex[type]);
+    while(bio_pending[type] > num)
+        pthread_cond_wait(&bio_step_cond[type],&bio_mutex[type]);
+    pthread_mutex_unlock(&bio_mutex[type]);
+}
+
 /* Kill the running bio threads in an unclean way. This function should be
  * used only when it's critical to stop the threads for some reason.
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
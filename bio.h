@@ -38,4 +38,7 @@ void bioKillThreads(void);
 /* Background job opcodes */
 #define REDIS_BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define REDIS_BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
-#define REDIS_BIO_NUM_OPS       2
+#define REDIS_BIO_ALLOC_TRACE   2 /* Write the allocation trace ring. */
+#define REDIS_BIO_LAZY_FREE     3 /* Release values unlinked from the DB. */
+#define REDIS_BIO_DICT_TABLE    4 /* Allocate or release keyspace tables. */
+#define REDIS_BIO_NUM_OPS       5
@@ -481,6 +481,125 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             server.notify_keyspace_events = flags;
+        } else if (!strcasecmp(argv[0],"allocator") && argc == 2) {
+            /* The allocator is actually selected by main() calling
+             * loadServerAllocatorConfig() before anything is allocated, so
+             * here we just check the directive is consistent with it. The
+             * "pheap" allocator is not the zmalloc backend, and disables
+             * the persistence and replication features that need a fork,
+             * see loadServerAllocatorConfig(). */
+            int pheap = !strcasecmp(argv[1],"pheap");
+
+            errno = EBUSY;
+            if (pheap != pheapIsPersistent() ||
+                (!pheap && zmalloc_set_backend(argv[1]) == -1))
+            {
+                if (errno == ENOENT) {
+                    err = "Unknown or not compiled in allocator";
+                } else {
+                    err = "The allocator can't be changed after startup "
+                          "(use the allocator directive in the main config "
+                          "file or the --allocator option, not an included "
+                          "file)";
+                }
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"pheap-file") && argc == 2) {
+            /* Already used by loadServerAllocatorConfig() at startup. */
+            zfree(server.pheap_file);
+            server.pheap_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"pheap-size") && argc == 2) {
+            server.pheap_size = memtoll(argv[1],NULL);
+            if (server.pheap_size <= 0) {
+                err = "Invalid persistent heap size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"hugepages") && argc == 2) {
+            /* Already applied by loadServerAllocatorConfig() at startup. */
+            if ((server.hugepages = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"hash-function") && argc == 2) {
+            /* Already selected by loadServerAllocatorConfig() at startup,
+             * initServer() warns if this is a different one. */
+            if ((server.hash_function = dictHashFunctionByName(argv[1])) == -1) {
+                err = "Invalid hash function. Use murmur2, siphash or xxhash";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-buckets") && argc == 2) {
+            if ((server.keyspace_buckets = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tiering") && argc == 2) {
+            if ((server.tier_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazyfree-lazy-eviction") && argc == 2) {
+            if ((server.lazyfree_lazy_eviction = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazyfree-lazy-expire") && argc == 2) {
+            if ((server.lazyfree_lazy_expire = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazyfree-lazy-server-del") &&
+                   argc == 2)
+        {
+            if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > REDIS_IO_THREADS_MAX_NUM)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"io-threads-do-reads") && argc == 2) {
+            if ((server.io_threads_do_reads = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rehash-prealloc") && argc == 2) {
+            if ((server.rehash_prealloc = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"activedefrag") && argc == 2) {
+            if ((server.active_defrag_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-threshold") &&
+                   argc == 2)
+        {
+            server.active_defrag_threshold = atoi(argv[1]);
+            if (server.active_defrag_threshold < 0) {
+                err = "Invalid active defrag threshold"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-cycle") && argc == 2) {
+            server.active_defrag_cycle = atoi(argv[1]);
+            if (server.active_defrag_cycle < 1 ||
+                server.active_defrag_cycle > 100)
+            {
+                err = "Invalid active defrag cycle"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"alloc-trace") && argc == 2) {
+            if ((server.alloc_trace = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"alloc-trace-file") && argc == 2) {
+            zfree(server.alloc_trace_file);
+            server.alloc_trace_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tier-file") && argc == 2) {
+            zfree(server.tier_file);
+            server.tier_file = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tier-size") && argc == 2) {
+            server.tier_size = memtoll(argv[1],NULL);
+            if (server.tier_size <= 0) {
+                err = "Invalid tier size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tier-cold-age") && argc == 2) {
+            server.tier_cold_age = atoi(argv[1]);
+            if (server.tier_cold_age < 0) {
+                err = "Invalid tier cold age"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"sentinel")) {
             /* argc == 1 is handled by main() as we need to enter the sentinel
              * mode ASAP. */
@@ -545,6 +664,143 @@ void loadServerConfig(char *filename, char *options) {
     sdsfree(config);
 }
 
+/* Memory allocated with an allocator backend can't be released by another
+ * one, so the "allocator" directive must be processed before anything at all
+ * is allocated with zmalloc(). This function is called by main() as the
+ * very first thing: it scans the config file (if any, and if not stdin) and
+ * the command line options looking for the allocator related directives,
+ * without using the heap, and selects the backend. The last occurrence wins,
+ * exactly like it happens for the other directives.
+ *
+ * The "hash-function" directive is handled here too, since the command
+ * table is hashed long before the configuration is loaded.
+ *
+ * Note that since "dir" was not processed yet, a relative "pheap-file" path
+ * is relative to the working directory Redis was started from.
+ *
+ * With "allocator pheap" the keyspace is allocated in the persistent heap
+ * stored in "pheap-file", and is found there again at restart (see
+ * pheapdb.c). The heap is a shared mapping, so a forked child would not see
+ * a point in time copy of the dataset. For this reason:
+ *
+ * - BGSAVE is refused, and there are no save points: Redis refuses to start
+ *   if "save" is configured, and CONFIG SET save only accepts "". SAVE and
+ *   the save at SHUTDOWN still work.
+ * - BGREWRITEAOF is refused and the AOF is never rewritten automatically,
+ *   so with "appendonly yes" the AOF grows without bound.
+ * - Replication is not possible: Redis refuses to start if "slaveof" is
+ *   configured, SLAVEOF is refused, and slaves can't SYNC with it. */
+static void allocatorConfigOption(char *name, char *value, char *allocator,
+                                  char *pheap_file, long long *pheap_size,
+                                  int *hugepages, int *hash_function)
+{
+    size_t len = strlen(value);
+
+    /* Remove quotes, that may be used in the config file. */
+    if (len >= 2 && (value[0] == '"' || value[0] == '\'') &&
+        value[len-1] == value[0])
+    {
+        value++;
+        len -= 2;
+    }
+    if (len >= REDIS_ALLOCATOR_OPTION_MAX) return;
+    if (!strcasecmp(name,"allocator")) {
+        memcpy(allocator,value,len);
+        allocator[len] = '\0';
+    } else if (!strcasecmp(name,"pheap-file")) {
+        memcpy(pheap_file,value,len);
+        pheap_file[len] = '\0';
+    } else if (!strcasecmp(name,"pheap-size")) {
+        char buf[REDIS_ALLOCATOR_OPTION_MAX];
+
+        memcpy(buf,value,len);
+        buf[len] = '\0';
+        *pheap_size = memtoll(buf,NULL);
+    } else if (!strcasecmp(name,"hugepages")) {
+        char buf[REDIS_ALLOCATOR_OPTION_MAX];
+
+        memcpy(buf,value,len);
+        buf[len] = '\0';
+        *hugepages = yesnotoi(buf);
+    } else if (!strcasecmp(name,"hash-function")) {
+        char buf[REDIS_ALLOCATOR_OPTION_MAX];
+
+        memcpy(buf,value,len);
+        buf[len] = '\0';
+        *hash_function = dictHashFunctionByName(buf);
+    }
+}
+
+static void allocatorConfigError(char *option, char *value, char *err) {
+    fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+    fprintf(stderr, ">>> '%s %s'\n", option, value);
+    fprintf(stderr, "%s\n", err);
+    exit(1);
+}
+
+void loadServerAllocatorConfig(int argc, char **argv) {
+    char name[REDIS_ALLOCATOR_OPTION_MAX], value[REDIS_ALLOCATOR_OPTION_MAX];
+    char allocator[REDIS_ALLOCATOR_OPTION_MAX] = "";
+    char pheap_file[REDIS_ALLOCATOR_OPTION_MAX] = REDIS_DEFAULT_PHEAP_FILE;
+    long long pheap_size = REDIS_DEFAULT_PHEAP_SIZE;
+    int hugepages = REDIS_DEFAULT_HUGEPAGES;
+    int hash_function = REDIS_DEFAULT_HASH_FUNCTION;
+    int j = 1, retval;
+
+    if (argc >= 2 && (argv[1][0] != '-' || argv[1][1] != '-')) {
+        char buf[REDIS_CONFIGLINE_MAX+1];
+        FILE *fp;
+
+        j++;
+        if (!(argv[1][0] == '-' && argv[1][1] == '\0') &&
+            (fp = fopen(argv[1],"r")) != NULL)
+        {
+            while(fgets(buf,REDIS_CONFIGLINE_MAX+1,fp) != NULL) {
+                if (sscanf(buf," %255s %255s",name,value) != 2) continue;
+                allocatorConfigOption(name,value,allocator,pheap_file,
+                                      &pheap_size,&hugepages,&hash_function);
+            }
+            fclose(fp);
+        }
+    }
+    for (; j+1 < argc; j++) {
+        if (argv[j][0] == '-' && argv[j][1] == '-')
+            allocatorConfigOption(argv[j]+2,argv[j+1],allocator,pheap_file,
+                                  &pheap_size,&hugepages,&hash_function);
+    }
+    /* An invalid name is reported by loadServerConfig(). */
+    if (hash_function != -1) dictSetHashFunction(hash_function);
+
+    /* Huge page arenas are anonymous memory: not used with the persistent
+     * heap, where everything must be allocated in the heap file. */
+    if (hugepages == 1 && strcasecmp(allocator,"pheap"))
+        zmalloc_enable_huge_pages(1);
+    if (allocator[0] == '\0') return;
+
+    /* The persistent heap must be mapped before it can be selected. Every
+     * object must be its own block of the heap in order to be validated
+     * at restart, so the slab caches are not used. */
+    if (!strcasecmp(allocator,"pheap")) {
+        zmalloc_enable_slabs(0);
+        retval = pheapOpen(pheap_file,pheap_size,0);
+        if (retval == PHEAP_ERR) {
+            allocatorConfigError("pheap-file",pheap_file,errno == EINVAL ?
+                "The file exists but is not a valid persistent heap" :
+                strerror(errno));
+        }
+        /* Only the keyspace is allocated in the heap (see pheapdb.c), the
+         * rest of the memory comes from the default allocator. */
+        zmalloc_set_persistent(pheapBackend.name,pheapOwns);
+        return;
+    }
+
+    if (zmalloc_set_backend(allocator) == -1) {
+        allocatorConfigError("allocator",allocator,errno == ENOENT ?
+            "Unknown or not compiled in allocator" :
+            "Can't switch allocator after memory was allocated");
+    }
+}
+
 /*-----------------------------------------------------------------------------
  * CONFIG SET implementation
  *----------------------------------------------------------------------------*/
@@ -552,8 +808,8 @@ void loadServerConfig(char *filename, char *options) {
 void configSetCommand(redisClient *c) {
     robj *o;
     long long ll;
-    redisAssertWithInfo(c,c->argv[2],c->argv[2]->encoding == REDIS_ENCODING_RAW);
-    redisAssertWithInfo(c,c->argv[2],c->argv[3]->encoding == REDIS_ENCODING_RAW);
+    redisAssertWithInfo(c,c->argv[2],sdsEncodedObject(c->argv[2]));
+    redisAssertWithInfo(c,c->argv[2],sdsEncodedObject(c->argv[3]));
     o = c->argv[3];
 
     if (!strcasecmp(c->argv[2]->ptr,"dbfilename")) {
@@ -606,6 +862,57 @@ void configSetCommand(redisClient *c) {
                 }
             }
         }
+    } else if (!strcasecmp(c->argv[2]->ptr,"lazyfree-lazy-eviction")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.lazyfree_lazy_eviction = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"lazyfree-lazy-expire")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.lazyfree_lazy_expire = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"lazyfree-lazy-server-del")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.lazyfree_lazy_server_del = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"rehash-prealloc")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.rehash_prealloc = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"activedefrag")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.active_defrag_enabled = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-threshold")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        server.active_defrag_threshold = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"active-defrag-cycle")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 1 || ll > 100) goto badfmt;
+        server.active_defrag_cycle = ll;
+    } else if (!strcasecmp(c->argv[2]->ptr,"alloc-trace")) {
+        int enable = yesnotoi(o->ptr);
+
+        if (enable == -1) goto badfmt;
+        if (enable && startAllocTrace() == REDIS_ERR) {
+            addReplyError(c,
+                "Unable to start the allocation trace. Check server logs.");
+            return;
+        }
+        if (!enable) stopAllocTrace();
+        server.alloc_trace = enable;
+    } else if (!strcasecmp(c->argv[2]->ptr,"alloc-trace-file")) {
+        zfree(server.alloc_trace_file);
+        server.alloc_trace_file = zstrdup(o->ptr);
+    } else if (!strcasecmp(c->argv[2]->ptr,"tier-cold-age")) {
+        if (getLongLongFromObject(o,&ll) == REDIS_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        server.tier_cold_age = ll;
     } else if (!strcasecmp(c->argv[2]->ptr,"hz")) {
         if (getLongLongFromObject(o,&ll) == REDIS_ERR || ll < 0) goto badfmt;
         server.hz = ll;
@@ -685,7 +992,15 @@ void configSetCommand(redisClient *c) {
         server.aof_load_truncated = yn;
     } else if (!strcasecmp(c->argv[2]->ptr,"save")) {
         int vlen, j;
-        sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
+        sds *v;
+
+        if (pheapIsPersistent() && sdslen(o->ptr)) {
+            addReplyError(c,"Save points can't be set: the dataset lives "
+                            "in the persistent heap, that can't be saved "
+                            "in background");
+            return;
+        }
+        v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
 
         /* Perform sanity check before setting the new config:
          * - Even number of args
@@ -921,13 +1236,18 @@ badfmt: /* Bad format errors */
     } \
 } while(0);
 
+/* Name of the allocator selected with the "allocator" directive. */
+static char *configAllocatorName(void) {
+    return pheapIsPersistent() ? "pheap" : (char*)zmalloc_backend_name();
+}
+
 void configGetCommand(redisClient *c) {
     robj *o = c->argv[2];
     void *replylen = addDeferredMultiBulkLength(c);
     char *pattern = o->ptr;
     char buf[128];
     int matches = 0;
-    redisAssertWithInfo(c,o,o->encoding == REDIS_ENCODING_RAW);
+    redisAssertWithInfo(c,o,sdsEncodedObject(o));
 
     /* String values */
     config_get_string_field("dbfilename",server.rdb_filename);
@@ -936,6 +1256,9 @@ void configGetCommand(redisClient *c) {
     config_get_string_field("unixsocket",server.unixsocket);
     config_get_string_field("logfile",server.logfile);
     config_get_string_field("pidfile",server.pidfile);
+    config_get_string_field("pheap-file",server.pheap_file);
+    config_get_string_field("tier-file",server.tier_file);
+    config_get_string_field("alloc-trace-file",server.alloc_trace_file);
 
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
@@ -982,6 +1305,14 @@ void configGetCommand(redisClient *c) {
     config_get_numerical_field("min-slaves-to-write",server.repl_min_slaves_to_write);
     config_get_numerical_field("min-slaves-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.hz);
+    config_get_numerical_field("io-threads",server.io_threads_num);
+    config_get_numerical_field("pheap-size",server.pheap_size);
+    config_get_numerical_field("tier-size",server.tier_size);
+    config_get_numerical_field("tier-cold-age",server.tier_cold_age);
+    config_get_numerical_field("active-defrag-threshold",
+            server.active_defrag_threshold);
+    config_get_numerical_field("active-defrag-cycle",
+            server.active_defrag_cycle);
 
     /* Bool (yes/no) values */
     config_get_bool_field("no-appendfsync-on-rewrite",
@@ -996,6 +1327,19 @@ void configGetCommand(redisClient *c) {
     config_get_bool_field("rdbcompression", server.rdb_compression);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
+    config_get_bool_field("tiering", server.tier_enabled);
+    config_get_bool_field("alloc-trace", server.alloc_trace);
+    config_get_bool_field("activedefrag", server.active_defrag_enabled);
+    config_get_bool_field("lazyfree-lazy-eviction",
+            server.lazyfree_lazy_eviction);
+    config_get_bool_field("lazyfree-lazy-expire",
+            server.lazyfree_lazy_expire);
+    config_get_bool_field("lazyfree-lazy-server-del",
+            server.lazyfree_lazy_server_del);
+    config_get_bool_field("rehash-prealloc", server.rehash_prealloc);
+    config_get_bool_field("io-threads-do-reads", server.io_threads_do_reads);
+    config_get_bool_field("hugepages", server.hugepages);
+    config_get_bool_field("keyspace-buckets", server.keyspace_buckets);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
     config_get_bool_field("aof-rewrite-incremental-fsync",
@@ -1010,6 +1354,16 @@ void configGetCommand(redisClient *c) {
         addReplyBulkCString(c,server.aof_state == REDIS_AOF_OFF ? "no" : "yes");
         matches++;
     }
+    if (stringmatch(pattern,"allocator",0)) {
+        addReplyBulkCString(c,"allocator");
+        addReplyBulkCString(c,configAllocatorName());
+        matches++;
+    }
+    if (stringmatch(pattern,"hash-function",0)) {
+        addReplyBulkCString(c,"hash-function");
+        addReplyBulkCString(c,(char*)dictHashFunctionName(server.hash_function));
+        matches++;
+    }
     if (stringmatch(pattern,"dir",0)) {
         char buf[1024];
 
@@ -1707,6 +2061,31 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"syslog-ident",server.syslog_ident,REDIS_DEFAULT_SYSLOG_IDENT);
     rewriteConfigSyslogfacilityOption(state);
     rewriteConfigSaveOption(state);
+    rewriteConfigStringOption(state,"allocator",configAllocatorName(),ZMALLOC_DEFAULT_BACKEND);
+    rewriteConfigStringOption(state,"pheap-file",server.pheap_file,REDIS_DEFAULT_PHEAP_FILE);
+    rewriteConfigBytesOption(state,"pheap-size",server.pheap_size,REDIS_DEFAULT_PHEAP_SIZE);
+    rewriteConfigYesNoOption(state,"hugepages",server.hugepages,REDIS_DEFAULT_HUGEPAGES);
+    rewriteConfigYesNoOption(state,"keyspace-buckets",server.keyspace_buckets,REDIS_DEFAULT_KEYSPACE_BUCKETS);
+    rewriteConfigEnumOption(state,"hash-function",server.hash_function,
+        "murmur2", DICT_HASH_MURMUR2,
+        "siphash", DICT_HASH_SIPHASH,
+        "xxhash", DICT_HASH_XXHASH,
+        NULL, REDIS_DEFAULT_HASH_FUNCTION);
+    rewriteConfigYesNoOption(state,"tiering",server.tier_enabled,REDIS_DEFAULT_TIERING);
+    rewriteConfigStringOption(state,"tier-file",server.tier_file,REDIS_DEFAULT_TIER_FILE);
+    rewriteConfigBytesOption(state,"tier-size",server.tier_size,REDIS_DEFAULT_TIER_SIZE);
+    rewriteConfigNumericalOption(state,"tier-cold-age",server.tier_cold_age,REDIS_DEFAULT_TIER_COLD_AGE);
+    rewriteConfigYesNoOption(state,"alloc-trace",server.alloc_trace,REDIS_DEFAULT_ALLOC_TRACE);
+    rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,REDIS_DEFAULT_ACTIVE_DEFRAG);
+    rewriteConfigNumericalOption(state,"active-defrag-threshold",server.active_defrag_threshold,REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD);
+    rewriteConfigNumericalOption(state,"active-defrag-cycle",server.active_defrag_cycle,REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE);
+    rewriteConfigStringOption(state,"alloc-trace-file",server.alloc_trace_file,REDIS_DEFAULT_ALLOC_TRACE_FILE);
+    rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,REDIS_DEFAULT_LAZYFREE_LAZY_EVICTION);
+    rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,REDIS_DEFAULT_LAZYFREE_LAZY_EXPIRE);
+    rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,REDIS_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
+    rewriteConfigYesNoOption(state,"rehash-prealloc",server.rehash_prealloc,REDIS_DEFAULT_REHASH_PREALLOC);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,REDIS_DEFAULT_IO_THREADS_NUM);
+    rewriteConfigYesNoOption(state,"io-threads-do-reads",server.io_threads_do_reads,REDIS_DEFAULT_IO_THREADS_DO_READS);
     rewriteConfigNumericalOption(state,"databases",server.dbnum,REDIS_DEFAULT_DBNUM);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,REDIS_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,REDIS_DEFAULT_RDB_COMPRESSION);
@@ -1796,6 +2175,7 @@ void configCommand(redisClient *c) {
     } else if (!strcasecmp(c->argv[1]->ptr,"resetstat")) {
         if (c->argc != 2) goto badarity;
         resetServerStats();
+        zmalloc_reset_class_stats();
         resetCommandTableStats();
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"rewrite")) {
@@ -39,8 +39,9 @@ void SlotToKeyDel(robj *key);
  * C-level DB API
  *----------------------------------------------------------------------------*/
 
-robj *lookupKey(redisDb *db, robj *key) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+/* Return the value of the entry 'de' of the main dict, or NULL if 'de' is
+ * NULL, updating the access time as any lookup does. */
+static robj *lookupKeyEntry(dictEntry *de) {
     if (de) {
         robj *val = dictGetVal(de);
 
@@ -49,12 +50,19 @@ robj *lookupKey(redisDb *db, robj *key) {
          * a copy on write madness. */
         if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
             val->lru = server.lruclock;
+
+        /* Values in the second memory tier are moved back to DRAM. */
+        if (server.tier_enabled) tierPromote(val);
         return val;
     } else {
         return NULL;
     }
 }
 
+robj *lookupKey(redisDb *db, robj *key) {
+    return lookupKeyEntry(dictFind(db->dict,key->ptr));
+}
+
 robj *lookupKeyRead(redisDb *db, robj *key) {
     robj *val;
 
@@ -84,12 +92,78 @@ robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
     return o;
 }
 
+/* Lookup 'count' keys like lookupKeyRead() does, storing the value of
+ * keys[j] in vals[j]. The keys are resolved with dictFindBatch(), so that
+ * commands reading many keys, like MGET, don't stall on the cache miss of
+ * every key one after the other. */
+void lookupKeysRead(redisDb *db, robj **keys, robj **vals, int count) {
+    dictEntry *des[DICT_FIND_BATCH];
+    void *ptrs[DICT_FIND_BATCH];
+    int j, i, n;
+
+    for (j = 0; j < count; j += n) {
+        n = count-j < DICT_FIND_BATCH ? count-j : DICT_FIND_BATCH;
+        for (i = 0; i < n; i++) ptrs[i] = keys[j+i]->ptr;
+
+        /* Expire the keys first, as the deletion of an expired key may
+         * move the entries of the other keys. Keys not in the expires
+         * dict are skipped, as expireIfNeeded() has nothing to do then. */
+        if (dictSize(db->expires) > 0) {
+            dictFindBatch(db->expires,ptrs,des,n);
+            for (i = 0; i < n; i++)
+                if (des[i]) expireIfNeeded(db,keys[j+i]);
+        }
+        dictFindBatch(db->dict,ptrs,des,n);
+        for (i = 0; i < n; i++) {
+            vals[j+i] = lookupKeyEntry(des[i]);
+            if (vals[j+i] == NULL)
+                server.stat_keyspace_misses++;
+            else
+                server.stat_keyspace_hits++;
+        }
+    }
+}
+
+/* Prefetch the buckets of up to DICT_FIND_BATCH keys, taken every 'step'
+ * elements of 'keys', both in the main dict and in the expires. Commands
+ * that modify the keyspace while going through their keys, like DEL or
+ * MSET, call it at the start of every group of DICT_FIND_BATCH keys, so
+ * that the lookups of the group find their buckets in the cache. */
+void dbPrefetchKeys(redisDb *db, robj **keys, int count, int step) {
+    void *ptrs[DICT_FIND_BATCH];
+    int j;
+
+    if (count > DICT_FIND_BATCH) count = DICT_FIND_BATCH;
+    for (j = 0; j < count; j++) ptrs[j] = keys[j*step]->ptr;
+    dictPrefetch(db->dict,ptrs,count);
+    if (dictSize(db->expires) > 0) dictPrefetch(db->expires,ptrs,count);
+}
+
+/* Keys are allocated in the arena of the database when there is one. The
+ * expires dict shares the keys, and both the dictionaries allocate their
+ * entries from the arena too: this way a flush only needs to release the
+ * values, see emptyDbKeys(). */
+static sds dbCreateKey(redisDb *db, sds key) {
+    size_t len = sdslen(key);
+
+    if (db->arena == NULL) return sdsdup(key);
+    return sdsnewlenAt(zarena_alloc(db->arena,sdsReqSize(len)),key,len);
+}
+
+/* Key destructor of the main dict, 'db' is the dict private data. */
+void dbFreeKey(redisDb *db, sds key) {
+    if (db == NULL || db->arena == NULL)
+        sdsfree(key);
+    else
+        zarena_free(db->arena,sdsAllocPtr(key),sdsAllocSize(key));
+}
+
 /* Add the key to the DB. It's up to the caller to increment the reference
  * counter of the value if needed.
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
+    sds copy = dbCreateKey(db,key->ptr);
     int retval = dictAdd(db->dict, copy, val);
 
     redisAssertWithInfo(NULL,key,retval == REDIS_OK);
@@ -156,7 +230,7 @@ robj *dbRandomKey(redisDb *db) {
 }
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
-int dbDelete(redisDb *db, robj *key) {
+int dbSyncDelete(redisDb *db, robj *key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -167,6 +241,14 @@ int dbDelete(redisDb *db, robj *key) {
     }
 }
 
+/* Delete a key as dbSyncDelete() or dbAsyncDelete() according to the
+ * "lazyfree-lazy-server-del" option. This is used by the commands deleting
+ * keys as a side effect, like RENAME overwriting its target. */
+int dbDelete(redisDb *db, robj *key) {
+    return server.lazyfree_lazy_server_del ? dbAsyncDelete(db,key) :
+                                             dbSyncDelete(db,key);
+}
+
 /* Prepare the string object stored at 'key' to be modified destructively
  * to implement commands like SETBIT or APPEND.
  *
@@ -174,7 +256,9 @@ int dbDelete(redisDb *db, robj *key) {
  * are true:
  *
  * 1) The object 'o' is shared (refcount > 1), we don't want to affect
- *    other users.
+ *    other users. This includes the clients that still have to write it
+ *    as a reply, since large values are referenced by the reply list
+ *    instead of being copied (see addReply()).
  * 2) The object encoding is not "RAW".
  *
  * If the object is found in one of the above conditions (or both) by the
@@ -205,15 +289,49 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
     return o;
 }
 
+/* Create the main dictionary and the expires of 'db', that share the
+ * allocator of the database: with an arena the chained tables allocate their
+ * entries from it. Bucketed tables are used if "keyspace-buckets" is on,
+ * but not with the persistent heap, whose validation walks chained tables. */
+void dbCreateDicts(redisDb *db) {
+    if (server.keyspace_buckets && !pheapIsPersistent()) {
+        db->dict = dictCreateBucketed(&dbDictType,db);
+        db->expires = dictCreateBucketed(&keyptrDictType,NULL);
+    } else {
+        db->dict = dictCreate(&dbDictType,db);
+        db->expires = dictCreate(&keyptrDictType,NULL);
+        if (db->arena) {
+            zslab *entries = zarena_slab(db->arena,sizeof(dictEntry));
+
+            dictSetEntrySlab(db->dict,entries);
+            dictSetEntrySlab(db->expires,entries);
+        }
+    }
+}
+
+/* Remove all the keys of 'db', returning how many they were. With an arena
+ * only the values are released one by one (they are reference counted and
+ * may be shared), while keys and hash table entries are dropped at once. */
+long long emptyDbKeys(redisDb *db, void(callback)(void*)) {
+    long long removed = dictSize(db->dict);
+
+    if (db->arena) {
+        dictDrop(db->dict,callback);
+        dictDrop(db->expires,callback);
+        zarena_drop(db->arena);
+    } else {
+        dictEmpty(db->dict,callback);
+        dictEmpty(db->expires,callback);
+    }
+    return removed;
+}
+
 long long emptyDb(void(callback)(void*)) {
     int j;
     long long removed = 0;
 
-    for (j = 0; j < server.dbnum; j++) {
-        removed += dictSize(server.db[j].dict);
-        dictEmpty(server.db[j].dict,callback);
-        dictEmpty(server.db[j].expires,callback);
-    }
+    for (j = 0; j < server.dbnum; j++)
+        removed += emptyDbKeys(server.db+j,callback);
     return removed;
 }
 
@@ -245,17 +363,40 @@ void signalFlushedDb(int dbid) {
  * Type agnostic commands operating on the key space
  *----------------------------------------------------------------------------*/
 
+/* Parse the optional ASYNC argument of FLUSHDB and FLUSHALL. Returns
+ * REDIS_ERR after replying with an error if the syntax is wrong. */
+static int getFlushCommandAsync(redisClient *c, int *async) {
+    *async = 0;
+    if (c->argc > 1) {
+        if (c->argc > 2 || strcasecmp(c->argv[1]->ptr,"async")) {
+            addReply(c,shared.syntaxerr);
+            return REDIS_ERR;
+        }
+        *async = 1;
+    }
+    return REDIS_OK;
+}
+
 void flushdbCommand(redisClient *c) {
-    server.dirty += dictSize(c->db->dict);
+    int async;
+
+    if (getFlushCommandAsync(c,&async) == REDIS_ERR) return;
     signalFlushedDb(c->db->id);
-    dictEmpty(c->db->dict,NULL);
-    dictEmpty(c->db->expires,NULL);
+    server.dirty += async ? emptyDbAsync(c->db) : emptyDbKeys(c->db,NULL);
     addReply(c,shared.ok);
 }
 
 void flushallCommand(redisClient *c) {
+    int async, j;
+
+    if (getFlushCommandAsync(c,&async) == REDIS_ERR) return;
     signalFlushedDb(-1);
-    server.dirty += emptyDb(NULL);
+    if (async) {
+        for (j = 0; j < server.dbnum; j++)
+            server.dirty += emptyDbAsync(server.db+j);
+    } else {
+        server.dirty += emptyDb(NULL);
+    }
     addReply(c,shared.ok);
     if (server.rdb_child_pid != -1) {
         kill(server.rdb_child_pid,SIGUSR1);
@@ -271,12 +412,20 @@ void flushallCommand(redisClient *c) {
     server.dirty++;
 }
 
-void delCommand(redisClient *c) {
+/* DEL releases the values synchronously, UNLINK in background when they
+ * are big enough (see lazyfree.c). */
+static void delGenericCommand(redisClient *c, int lazy) {
     int deleted = 0, j;
 
     for (j = 1; j < c->argc; j++) {
+        int ok;
+
+        if ((j-1) % DICT_FIND_BATCH == 0)
+            dbPrefetchKeys(c->db,c->argv+j,c->argc-j,1);
         expireIfNeeded(c->db,c->argv[j]);
-        if (dbDelete(c->db,c->argv[j])) {
+        ok = lazy ? dbAsyncDelete(c->db,c->argv[j]) :
+                    dbSyncDelete(c->db,c->argv[j]);
+        if (ok) {
             signalModifiedKey(c->db,c->argv[j]);
             notifyKeyspaceEvent(REDIS_NOTIFY_GENERIC,
                 "del",c->argv[j],c->db->id);
@@ -287,6 +436,14 @@ void delCommand(redisClient *c) {
     addReplyLongLong(c,deleted);
 }
 
+void delCommand(redisClient *c) {
+    delGenericCommand(c,0);
+}
+
+void unlinkCommand(redisClient *c) {
+    delGenericCommand(c,1);
+}
+
 void existsCommand(redisClient *c) {
     expireIfNeeded(c->db,c->argv[1]);
     if (dbExists(c->db,c->argv[1])) {
@@ -837,7 +994,8 @@ int expireIfNeeded(redisDb *db, robj *key) {
     propagateExpire(db,key);
     notifyKeyspaceEvent(REDIS_NOTIFY_EXPIRED,
         "expired",key,db->id);
-    return dbDelete(db,key);
+    return server.lazyfree_lazy_expire ? dbAsyncDelete(db,key) :
+                                         dbSyncDelete(db,key);
 }
 
 /*-----------------------------------------------------------------------------
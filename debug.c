@@ -252,6 +252,13 @@ void computeDatasetDigest(unsigned char *final) {
     }
 }
 
+/* Callback used by DEBUG MALLOC-STATS to collect the allocator report. */
+static void debugMallocStatsWriteCallback(void *privdata, const char *s) {
+    sds *report = privdata;
+
+    *report = sdscat(*report,s);
+}
+
 void debugCommand(redisClient *c) {
     if (!strcasecmp(c->argv[1]->ptr,"segfault")) {
         *((char*)-1) = 'x';
@@ -314,7 +321,7 @@ void debugCommand(redisClient *c) {
         val = dictGetVal(de);
         key = dictGetKey(de);
 
-        if (val->type != REDIS_STRING || val->encoding != REDIS_ENCODING_RAW) {
+        if (val->type != REDIS_STRING || !sdsEncodedObject(val)) {
             addReplyError(c,"Not an sds encoded string.");
         } else {
             addReplyStatusFormat(c,
@@ -329,10 +336,15 @@ void debugCommand(redisClient *c) {
         long keys, j;
         robj *key, *val;
         char buf[128];
+        int persistent;
 
         if (getLongFromObjectOrReply(c, c->argv[2], &keys, NULL) != REDIS_OK)
             return;
+        /* DEBUG is not a write command, enter the persistent scope here
+         * for what is added to the keyspace, see pheapDbBeginCommand(). */
+        persistent = zmalloc_set_persistent_scope(1);
         dictExpand(c->db->dict,keys);
+        zmalloc_set_persistent_scope(persistent);
         for (j = 0; j < keys; j++) {
             snprintf(buf,sizeof(buf),"key:%lu",j);
             key = createStringObject(buf,strlen(buf));
@@ -341,8 +353,10 @@ void debugCommand(redisClient *c) {
                 continue;
             }
             snprintf(buf,sizeof(buf),"value:%lu",j);
+            persistent = zmalloc_set_persistent_scope(1);
             val = createStringObject(buf,strlen(buf));
             dbAdd(c->db,key,val);
+            zmalloc_set_persistent_scope(persistent);
             decrRefCount(key);
         }
         addReply(c,shared.ok);
@@ -370,6 +384,65 @@ void debugCommand(redisClient *c) {
     {
         server.active_expire_enabled = atoi(c->argv[2]->ptr);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"malloc-stats") && c->argc == 2) {
+        sds report = sdscatprintf(sdsempty(),"Allocator: %s\n",
+            zmalloc_backend_name());
+
+        zmalloc_backend_stats(debugMallocStatsWriteCallback,&report);
+        addReplyBulkCBuffer(c,report,sdslen(report));
+        sdsfree(report);
+    } else if (!strcasecmp(c->argv[1]->ptr,"allocstats") && c->argc == 2) {
+        size_t used = zmalloc_used_memory();
+        sds report = sdscatprintf(sdsempty(),
+            "Allocator: %s, used memory: %zu bytes\n\n"
+            "%10s %14s %14s %14s %14s  %s\n",
+            zmalloc_backend_name(), used,
+            "class", "allocs", "frees", "reallocs", "bytes", "bytes share");
+        int j;
+
+        for (j = 0; j < ZMALLOC_NUM_CLASSES; j++) {
+            zmallocClassStats cs;
+            char name[32];
+            int bar;
+
+            zmalloc_get_class_stats(j,&cs);
+            if (!cs.allocs && !cs.reallocs && !cs.bytes) continue;
+            if (cs.size) snprintf(name,sizeof(name),"<= %zu",cs.size);
+            else snprintf(name,sizeof(name),"> %d",ZMALLOC_CLASS_MAX);
+            bar = used ? (int)((double)cs.bytes*50/used) : 0;
+            if (bar > 50) bar = 50;
+            report = sdscatprintf(report,"%10s %14llu %14llu %14llu %14zu  ",
+                name, cs.allocs, cs.frees, cs.reallocs, cs.bytes);
+            while(bar--) report = sdscatlen(report,"#",1);
+            report = sdscatlen(report,"\n",1);
+        }
+        addReplyBulkCBuffer(c,report,sdslen(report));
+        sdsfree(report);
+    } else if (!strcasecmp(c->argv[1]->ptr,"dict-resize") &&
+               (c->argc == 3 || c->argc == 4))
+    {
+        /* DEBUG DICT-RESIZE <size> [EXPIRES]: size the table of the main
+         * dict (or the expires) of the current DB for <size> keys, before
+         * a bulk load. The table is allocated in background and installed
+         * by the cron, INFO keyspace shows it as prealloc_bytes meanwhile. */
+        long long size;
+        int expires = 0;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[2],&size,NULL) != REDIS_OK)
+            return;
+        if (c->argc == 4) {
+            if (strcasecmp(c->argv[3]->ptr,"expires")) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            expires = 1;
+        }
+        if (size <= 0 || rehashResize(c->db,expires,size) == REDIS_ERR) {
+            addReplyError(c,"The table is already big enough for the "
+                            "requested size, or is being resized");
+            return;
+        }
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"error") && c->argc == 3) {
         sds errstr = sdsnewlen("-",1);
 
@@ -411,7 +484,7 @@ void _redisAssertPrintClientInfo(redisClient *c) {
         char *arg;
 
         if (c->argv[j]->type == REDIS_STRING &&
-            c->argv[j]->encoding == REDIS_ENCODING_RAW)
+            sdsEncodedObject(c->argv[j]))
         {
             arg = (char*) c->argv[j]->ptr;
         } else {
@@ -428,7 +501,7 @@ void redisLogObjectDebugInfo(robj *o) {
     redisLog(REDIS_WARNING,"Object type: %d", o->type);
     redisLog(REDIS_WARNING,"Object encoding: %d", o->encoding);
     redisLog(REDIS_WARNING,"Object refcount: %d", o->refcount);
-    if (o->type == REDIS_STRING && o->encoding == REDIS_ENCODING_RAW) {
+    if (o->type == REDIS_STRING && sdsEncodedObject(o)) {
         redisLog(REDIS_WARNING,"Object raw string len: %zu", sdslen(o->ptr));
         if (sdslen(o->ptr) < 4096) {
             sds repr = sdscatrepr(sdsempty(),o->ptr,sdslen(o->ptr));
@@ -806,6 +879,7 @@ void sigsegvHandler(int sig, siginfo_t *info, void *secret) {
     ucontext_t *uc = (ucontext_t*) secret;
     sds infostring, clients;
     struct sigaction act;
+    int j;
     REDIS_NOTUSED(info);
 
     bugReportStart();
@@ -822,8 +896,12 @@ void sigsegvHandler(int sig, siginfo_t *info, void *secret) {
     /* Log INFO and CLIENT LIST */
     redisLog(REDIS_WARNING, "--- INFO OUTPUT");
     infostring = genRedisInfoString("all");
-    infostring = sdscatprintf(infostring, "hash_init_value: %u\n",
-        dictGetHashFunctionSeed());
+    infostring = sdscatprintf(infostring, "hash_function: %s\nhash_init_value: ",
+        dictHashFunctionName(dictGetHashFunction()));
+    for (j = 0; j < DICT_HASH_SEED_LEN; j++)
+        infostring = sdscatprintf(infostring, "%02x",
+            dictGetHashFunctionSeed()[j]);
+    infostring = sdscat(infostring, "\n");
     redisLogRaw(REDIS_WARNING, infostring);
     redisLog(REDIS_WARNING, "--- CLIENT LIST OUTPUT");
     clients = getAllClientsInfoString();
@@ -964,3 +1042,70 @@ void disableWatchdog(void) {
     sigaction(SIGALRM, &act, NULL);
     server.watchdog_period = 0;
 }
+
+/* ============================ Allocation trace ============================ */
+
+/* When "alloc-trace" is enabled zmalloc records every allocation and release
+ * in a ring buffer (see zmalloc_trace_start()). The ring is written to
+ * "alloc-trace-file" by the REDIS_BIO_ALLOC_TRACE background thread, so the
+ * main thread never blocks on disk I/O because of tracing. The resulting file
+ * can be replayed against different allocators with redis-alloc-replay. */
+
+/* Create the trace file and start recording. Returns REDIS_ERR if the file
+ * can't be created. */
+int startAllocTrace(void) {
+    zmallocTraceHeader hdr;
+    int fd;
+
+    if (server.alloc_trace_fd != -1) return REDIS_OK;
+    /* A trace that is still being flushed to the previous file must be
+     * completely written before the ring restarts from scratch. */
+    bioWaitPendingJobsLE(REDIS_BIO_ALLOC_TRACE,0);
+
+    fd = open(server.alloc_trace_file,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) {
+        redisLog(REDIS_WARNING,"Can't open the allocation trace file %s: %s",
+            server.alloc_trace_file, strerror(errno));
+        return REDIS_ERR;
+    }
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic,ZMALLOC_TRACE_MAGIC,sizeof(hdr.magic));
+    hdr.record_size = sizeof(zmallocTraceRecord);
+    if (write(fd,&hdr,sizeof(hdr)) != sizeof(hdr) ||
+        zmalloc_trace_start() == -1)
+    {
+        redisLog(REDIS_WARNING,"Can't start the allocation trace: %s",
+            strerror(errno));
+        close(fd);
+        return REDIS_ERR;
+    }
+    server.alloc_trace_fd = fd;
+    redisLog(REDIS_NOTICE,"Allocation trace started on %s",
+        server.alloc_trace_file);
+    return REDIS_OK;
+}
+
+/* Stop recording. The records still in the ring are flushed, and the file
+ * closed, by the background thread. */
+void stopAllocTrace(void) {
+    unsigned long long records, dropped;
+
+    if (server.alloc_trace_fd == -1) return;
+    zmalloc_trace_stop();
+    bioCreateBackgroundJob(REDIS_BIO_ALLOC_TRACE,
+        (void*)(long)server.alloc_trace_fd,(void*)1,NULL);
+    server.alloc_trace_fd = -1;
+    zmalloc_trace_get_stats(&records,&dropped);
+    redisLog(REDIS_NOTICE,"Allocation trace stopped: %llu records, "
+                          "%llu dropped", records, dropped);
+}
+
+/* Called by serverCron(): ask the background thread to flush the ring,
+ * unless the previous flush is still in progress. */
+void allocTraceCron(void) {
+    if (server.alloc_trace_fd == -1 || zmalloc_trace_pending() == 0) return;
+    if (bioPendingJobsOfType(REDIS_BIO_ALLOC_TRACE) == 0) {
+        bioCreateBackgroundJob(REDIS_BIO_ALLOC_TRACE,
+            (void*)(long)server.alloc_trace_fd,NULL,NULL);
+    }
+}
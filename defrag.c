@@ -0,0 +1,152 @@
+/* Active defragmentation.
+ *
+ * After many values are deleted, the memory of the values that remain is
+ * scattered among mostly empty pages that the allocator can't give back to
+ * the operating system, and the fragmentation ratio stays high. When
+ * "activedefrag" is enabled and the fragmentation is over
+ * "active-defrag-threshold" percent, serverCron() incrementally scans the
+ * keyspace with dictScan() and, for every key, asks the allocator if the
+ * key, the value object and its payload (sds, ziplist or intset) sit in a
+ * sparsely used run of blocks (see zmalloc_defrag() and zslab_defrag()).
+ * If so they are copied to a new allocation and the pointers in the dict
+ * entry are updated, so that the sparse runs progressively empty and can be
+ * released.
+ *
+ * Like the active expire cycle, every call runs for a limited amount of
+ * time, that is "active-defrag-cycle" percent of the serverCron() period.
+ * Nothing is moved while a child is saving, since this would only duplicate
+ * pages because of copy on write.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+
+/* Move the sds 's' if the allocator suggests it. Returns the new sds, or
+ * NULL if it was not moved. */
+static sds activeDefragSds(sds s) {
+    void *oldptr = sdsAllocPtr(s);
+    void *newptr = zmalloc_defrag(oldptr);
+
+    return newptr ? (char*)newptr+(s-(char*)oldptr) : NULL;
+}
+
+/* Move the payload of 'o' and the object itself if it is worth it. Returns
+ * the new object, or NULL if only the payload, or nothing, was moved. */
+static robj *activeDefragObject(robj *o) {
+    void *newptr = NULL;
+
+    switch(o->encoding) {
+    case REDIS_ENCODING_RAW:
+        if (o->type == REDIS_STRING) newptr = activeDefragSds(o->ptr);
+        break;
+    case REDIS_ENCODING_ZIPLIST:
+    case REDIS_ENCODING_INTSET:
+        newptr = zmalloc_defrag(o->ptr);
+        break;
+    }
+    if (newptr) {
+        o->ptr = newptr;
+        server.stat_active_defrag_hits++;
+    }
+    if ((newptr = defragObject(o)) != NULL) server.stat_active_defrag_hits++;
+    return newptr;
+}
+
+/* dictScan() callback: defrag the key and the value of 'de'. */
+static void activeDefragScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    dictEntry *entry = (dictEntry*)de;
+    sds key = dictGetKey(entry), newkey;
+    robj *newval;
+
+    /* The expires dict shares the key: it must be looked up while the old
+     * key is still valid. */
+    dictEntry *ede = dictSize(db->expires) ? dictFind(db->expires,key) : NULL;
+
+    /* Keys allocated in the database arena are never moved. */
+    if (db->arena == NULL && (newkey = activeDefragSds(key)) != NULL) {
+        entry->key = newkey;
+        if (ede) ede->key = newkey;
+        server.stat_active_defrag_hits++;
+    }
+    if ((newval = activeDefragObject(dictGetVal(entry))) != NULL)
+        entry->v.val = newval;
+}
+
+/* Called by databasesCron(). Start a new scan of the keyspace if the
+ * fragmentation is over the threshold, or continue the current one. */
+void activeDefragCycle(void) {
+    static int current_db = -1;         /* -1 when no scan is in progress. */
+    static unsigned long cursor = 0;
+    static size_t start_rss = 0;
+    long long start = ustime(), timelimit;
+    int iterations = 0;
+
+    if (!server.active_defrag_enabled) {
+        current_db = -1;
+        server.active_defrag_running = 0;
+        return;
+    }
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+
+    if (current_db == -1) {
+        float frag =
+            zmalloc_get_fragmentation_ratio(server.resident_set_size);
+
+        if (frag*100 < 100+server.active_defrag_threshold) return;
+        redisLog(REDIS_VERBOSE,"Starting active defrag, fragmentation %.2f",
+            frag);
+        current_db = 0;
+        cursor = 0;
+        start_rss = server.resident_set_size;
+    }
+
+    timelimit = 1000000*server.active_defrag_cycle/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    do {
+        redisDb *db = server.db+current_db;
+
+        cursor = dictScan(db->dict,cursor,activeDefragScanCallback,db);
+        if (cursor == 0 && ++current_db == server.dbnum) {
+            /* Scan completed: account what was given back to the OS. */
+            size_t rss = zmalloc_get_rss();
+
+            if (rss < start_rss)
+                server.stat_active_defrag_reclaimed += start_rss-rss;
+            redisLog(REDIS_VERBOSE,"Active defrag done, fragmentation %.2f",
+                zmalloc_get_fragmentation_ratio(rss));
+            current_db = -1;
+            break;
+        }
+        /* Checking the time is not free: do it every 16 buckets. */
+    } while ((++iterations & 15) || ustime()-start <= timelimit);
+    server.active_defrag_running = current_db != -1;
+}
@@ -3,7 +3,8 @@
  * This file implements in memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or by buckets of 16 inline entries for dictionaries created with
+ * dictCreateBucketed(). See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -47,6 +48,11 @@
 #include "zmalloc.h"
 #include "redisassert.h"
 
+#if defined(__SSE2__) && !defined(DICT_NO_SIMD)
+#include <emmintrin.h>
+#define DICT_TAG_SIMD 1
+#endif
+
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
  * for Redis, as we use copy-on-write and don't want to move too much memory
@@ -58,12 +64,69 @@
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Releases the old table at the end of a rehashing. */
+static void (*dict_table_free)(void *table, size_t bytes) = zfree_huge;
+
+/* Hash table entries are allocated from a slab cache, see zmalloc.c. */
+static zslab dictEntrySlab = ZSLAB_INIT("dictEntry",dictEntry);
+#define dictEntryCache(d) ((d)->entry_slab ? (d)->entry_slab : &dictEntrySlab)
+
+/* Bucketed dictionaries (see dictCreateBucketed()) store the entries inline
+ * in the table instead of chaining separately allocated dictEntry
+ * structures. Every bucket holds DICT_BUCKET_SLOTS key/value pairs, plus
+ * 8 bits of the hash of every key (the tag). The tags come first, as the
+ * control group of a Swiss table: a lookup compares all of them at once and
+ * only touches the slots, and the keys, whose tag matches. When a bucket is
+ * full the new entries go in an overflow bucket linked to it: this way an
+ * element is always found starting from the bucket at hash & sizemask like
+ * in chained tables, and dictScan() and the incremental rehashing work the
+ * same. With DICT_BUCKET_CAPACITY elements per bucket on average at most,
+ * about one bucket in ten overflows before the table is expanded.
+ *
+ * A slot has the same layout as the first two fields of a dictEntry, so
+ * pointers to slots are returned to the caller as dictEntry pointers and
+ * all the dictGetKey() / dictGetVal() like macros work unmodified. The
+ * 'next' field of such entries can't be accessed. */
+typedef struct dictSlot {
+    void *key;
+    union {
+        void *val;
+        uint64_t u64;
+        int64_t s64;
+        double d;
+    } v;
+} dictSlot;
+
+typedef struct dictBucket {
+    uint8_t tags[DICT_BUCKET_SLOTS];    /* Hash tag of the used slots. */
+    uint16_t presence;                  /* Bit N set if slot N is used. */
+    struct dictBucket *child;           /* Overflow bucket or NULL. */
+    dictSlot slots[DICT_BUCKET_SLOTS];
+} dictBucket;
+
+#define DICT_BUCKET_FULL ((1<<DICT_BUCKET_SLOTS)-1)
+#define dictBuckets(ht) ((dictBucket*)(ht)->table)
+#define dictSlotEntry(b,j) ((dictEntry*)&(b)->slots[j])
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static int _dictKeyIndex(dict *ht, const void *key);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static dictEntry *_dictBucketAddRaw(dict *d, void *key);
+static int _dictBucketDelete(dict *d, const void *key, int nofree);
+static dictEntry *_dictBucketFind(dict *d, const void *key, unsigned int h);
+static inline uint8_t _dictTag(unsigned int h);
+static inline unsigned int _dictTagMatch(dictBucket *b, uint8_t tag);
+static void _dictBucketRehashStep(dict *d);
+static void _dictBucketFreeOverflow(dictht *ht, unsigned long from);
+static void _dictBucketClear(dict *d, dictht *ht, int drop,
+                             void(callback)(void *));
+static dictEntry *_dictBucketNext(dictIterator *iter);
+static dictEntry *_dictBucketRandom(dict *d);
+static void _dictBucketScan(dictBucket *b, dictScanFunction *fn,
+                            void *privdata);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -79,16 +142,52 @@ unsigned int dictIntHashFunction(unsigned int key)
     return key;
 }
 
-static uint32_t dict_hash_function_seed = 5381;
+/* The hash function of dictGenHashFunction() and dictGenCaseHashFunction(),
+ * and its seed: both must be set before anything is hashed, and never
+ * changed later. The seed is a SipHash key, the other functions use only
+ * its first bytes. */
+static int dict_hash_function = DICT_HASH_SIPHASH;
+static uint8_t dict_hash_function_seed[DICT_HASH_SEED_LEN];
+
+static const char *dict_hash_function_names[] = {"murmur2","siphash","xxhash"};
 
-void dictSetHashFunctionSeed(uint32_t seed) {
-    dict_hash_function_seed = seed;
+void dictSetHashFunctionSeed(uint8_t *seed) {
+    memcpy(dict_hash_function_seed,seed,sizeof(dict_hash_function_seed));
 }
 
-uint32_t dictGetHashFunctionSeed(void) {
+uint8_t *dictGetHashFunctionSeed(void) {
     return dict_hash_function_seed;
 }
 
+void dictSetHashFunction(int type) {
+    dict_hash_function = type;
+}
+
+int dictGetHashFunction(void) {
+    return dict_hash_function;
+}
+
+/* Return the DICT_HASH_* type named 'name', or -1 if there is no such hash
+ * function. */
+int dictHashFunctionByName(const char *name) {
+    int j;
+
+    for (j = 0; j <= DICT_HASH_XXHASH; j++)
+        if (!strcasecmp(name,dict_hash_function_names[j])) return j;
+    return -1;
+}
+
+const char *dictHashFunctionName(int type) {
+    return dict_hash_function_names[type];
+}
+
+static uint32_t dictMurmurSeed(void) {
+    uint32_t seed;
+
+    memcpy(&seed,dict_hash_function_seed,sizeof(seed));
+    return seed;
+}
+
 /* MurmurHash2, by Austin Appleby
  * Note - This code makes a few assumptions about how your machine behaves -
  * 1. We can read a 4-byte value from any address without crashing
@@ -100,10 +199,10 @@ uint32_t dictGetHashFunctionSeed(void) {
  * 2. It will not produce the same results on little-endian and big-endian
  *    machines.
  */
-unsigned int dictGenHashFunction(const void *key, int len) {
+static unsigned int dictMurmurHash2(const void *key, int len) {
     /* 'm' and 'r' are mixing constants generated offline.
      They're not really 'magic', they just happen to work well.  */
-    uint32_t seed = dict_hash_function_seed;
+    uint32_t seed = dictMurmurSeed();
     const uint32_t m = 0x5bd1e995;
     const int r = 24;
 
@@ -144,14 +243,147 @@ unsigned int dictGenHashFunction(const void *key, int len) {
 }
 
 /* And a case insensitive hash function (based on djb hash) */
-unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = (unsigned int)dict_hash_function_seed;
+static unsigned int dictDjbCaseHash(const unsigned char *buf, int len) {
+    unsigned int hash = dictMurmurSeed();
 
     while (len--)
         hash = ((hash << 5) + hash) + (tolower(*buf++)); /* hash * 33 + c */
     return hash;
 }
 
+/* xxHash64, by Yann Collet: a fast non cryptographic hash. Inputs of 32
+ * bytes or more are consumed 32 bytes at a time by four independent lanes,
+ * so that the multiplications of different lanes overlap in the pipeline,
+ * the tail 8 bytes at a time. Like MurmurHash2 it offers no protection
+ * against hash flooding: use it only when the clients are trusted. */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxhRotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Turn the upper case ASCII letters of the 8 bytes in 'w' into lower case,
+ * see sipLower64() in siphash.c. */
+static inline uint64_t xxhLower64(uint64_t w) {
+    uint64_t low7 = w & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t upper = (low7 + 0x3f3f3f3f3f3f3f3fULL) &
+                     ~(low7 + 0x2525252525252525ULL) &
+                     ~w & 0x8080808080808080ULL;
+    return w | (upper >> 2);
+}
+
+/* Load 8 bytes as a little endian integer, in lower case if 'nocase'. */
+static inline uint64_t xxhLoad64(const uint8_t *p, int nocase) {
+    uint64_t w = (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+                 ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+                 ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+                 ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+    return nocase ? xxhLower64(w) : w;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxhRotl(acc,31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val) {
+    acc ^= xxhRound(0,val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t xxhash64(const uint8_t *p, size_t len, uint64_t seed,
+                                int nocase)
+{
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const uint8_t *limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        do {
+            v1 = xxhRound(v1,xxhLoad64(p,nocase));
+            v2 = xxhRound(v2,xxhLoad64(p+8,nocase));
+            v3 = xxhRound(v3,xxhLoad64(p+16,nocase));
+            v4 = xxhRound(v4,xxhLoad64(p+24,nocase));
+            p += 32;
+        } while (p <= limit);
+        h = xxhRotl(v1,1) + xxhRotl(v2,7) + xxhRotl(v3,12) + xxhRotl(v4,18);
+        h = xxhMergeRound(h,v1);
+        h = xxhMergeRound(h,v2);
+        h = xxhMergeRound(h,v3);
+        h = xxhMergeRound(h,v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxhRound(0,xxhLoad64(p,nocase));
+        h = xxhRotl(h,27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        uint64_t w = (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+                     ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24);
+        if (nocase) w = xxhLower64(w);
+        h ^= w * XXH_PRIME64_1;
+        h = xxhRotl(h,23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (nocase ? tolower(*p) : *p) * XXH_PRIME64_5;
+        h = xxhRotl(h,11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t dictXXHashSeed(void) {
+    uint64_t seed;
+
+    memcpy(&seed,dict_hash_function_seed,sizeof(seed));
+    return seed;
+}
+
+/* Hash 'len' bytes at 'key' with the selected hash function. The 64 bit
+ * functions are truncated to the 32 bits used by the hash tables. */
+unsigned int dictGenHashFunction(const void *key, int len) {
+    switch(dict_hash_function) {
+    case DICT_HASH_SIPHASH:
+        return (unsigned int)siphash(key,len,dict_hash_function_seed);
+    case DICT_HASH_XXHASH:
+        return (unsigned int)xxhash64(key,len,dictXXHashSeed(),0);
+    default:
+        return dictMurmurHash2(key,len);
+    }
+}
+
+/* Case insensitive version of dictGenHashFunction(). With "murmur2" the
+ * original djb hash is used. */
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
+    switch(dict_hash_function) {
+    case DICT_HASH_SIPHASH:
+        return (unsigned int)siphash_nocase(buf,len,dict_hash_function_seed);
+    case DICT_HASH_XXHASH:
+        return (unsigned int)xxhash64(buf,len,dictXXHashSeed(),1);
+    default:
+        return dictDjbCaseHash(buf,len);
+    }
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -174,6 +406,19 @@ dict *dictCreate(dictType *type,
     return d;
 }
 
+/* Create a new bucketed hash table. It has the same API and semantics of
+ * the chained ones, but lookups usually need a single cache miss, and no
+ * memory is allocated per entry. However entries move when the table is
+ * rehashed, so the dictEntry pointers returned by the API are only valid
+ * up to the next call that may perform a rehashing step, and
+ * dictSetEntrySlab() has no effect. */
+dict *dictCreateBucketed(dictType *type, void *privDataPtr) {
+    dict *d = dictCreate(type,privDataPtr);
+
+    d->bucketed = 1;
+    return d;
+}
+
 /* Initialize the hash table */
 int _dictInit(dict *d, dictType *type,
         void *privDataPtr)
@@ -182,11 +427,18 @@ int _dictInit(dict *d, dictType *type,
     _dictReset(&d->ht[1]);
     d->type = type;
     d->privdata = privDataPtr;
+    d->entry_slab = NULL;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->bucketed = 0;
     return DICT_OK;
 }
 
+/* Bytes used by a table of 'size' buckets. */
+static size_t _dictTableBytes(dict *d, unsigned long size) {
+    return size*(d->bucketed ? sizeof(dictBucket) : sizeof(dictEntry*));
+}
+
 /* Resize the table to the minimal size that contains all the elements,
  * but with the invariant of a USED/BUCKETS ratio near to <= 1 */
 int dictResize(dict *d)
@@ -200,21 +452,31 @@ int dictResize(dict *d)
     return dictExpand(d, minimal);
 }
 
-/* Expand or create the hash table */
-int dictExpand(dict *d, unsigned long size)
+/* Number of buckets of the table that dictExpand(d,size) allocates. */
+static unsigned long _dictExpandSize(dict *d, unsigned long size) {
+    /* Bucketed tables need a bucket every DICT_BUCKET_CAPACITY elements. */
+    if (d->bucketed)
+        size = (size+DICT_BUCKET_CAPACITY-1)/DICT_BUCKET_CAPACITY;
+    return _dictNextPower(size);
+}
+
+/* Expand or create the hash table, using 'table' if not NULL. */
+static int _dictExpand(dict *d, unsigned long size, void *table)
 {
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize;
 
     /* the size is invalid if it is smaller than the number of
      * elements already inside the hash table */
     if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
+    realsize = _dictExpandSize(d,size);
+
     /* Allocate the new hash table and initialize all pointers to NULL */
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
+    n.table = table ? table : zmalloc_huge_calloc(_dictTableBytes(d,realsize));
     n.used = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
@@ -230,6 +492,39 @@ int dictExpand(dict *d, unsigned long size)
     return DICT_OK;
 }
 
+/* Expand or create the hash table */
+int dictExpand(dict *d, unsigned long size)
+{
+    return _dictExpand(d,size,NULL);
+}
+
+/* Bytes of the table dictExpand(d,size) allocates. */
+size_t dictExpandBytes(dict *d, unsigned long size) {
+    return _dictTableBytes(d,_dictExpandSize(d,size));
+}
+
+/* Like dictExpand(), but using 'table', dictExpandBytes(d,size) bytes set to
+ * zero and allocated with zmalloc_huge_calloc(), that is owned by the dict
+ * on success. This allows to allocate big tables (and fault their pages in)
+ * out of the thread using the dict. */
+int dictExpandWithTable(dict *d, unsigned long size, void *table) {
+    return _dictExpand(d,size,table);
+}
+
+/* Bytes used by the tables of 'd', both of them while rehashing. The
+ * overflow buckets of bucketed tables are not included. */
+size_t dictTableMemory(dict *d) {
+    return _dictTableBytes(d,d->ht[0].size)+_dictTableBytes(d,d->ht[1].size);
+}
+
+/* Set the function releasing the old table once a rehashing completes, by
+ * default zfree_huge(). Releasing a big table may take a while, since all
+ * its pages must be unmapped, and it happens in the middle of whatever
+ * operation performed the last rehashing step. */
+void dictSetTableFreeFunction(void (*fn)(void *table, size_t bytes)) {
+    dict_table_free = fn;
+}
+
 /* Performs N steps of incremental rehashing. Returns 1 if there are still
  * keys to move from the old to the new hash table, otherwise 0 is returned.
  * Note that a rehashing step consists in moving a bucket (that may have more
@@ -242,7 +537,8 @@ int dictRehash(dict *d, int n) {
 
         /* Check if we already rehashed the whole table... */
         if (d->ht[0].used == 0) {
-            zfree(d->ht[0].table);
+            if (d->bucketed) _dictBucketFreeOverflow(&d->ht[0],d->rehashidx);
+            dict_table_free(d->ht[0].table,_dictTableBytes(d,d->ht[0].size));
             d->ht[0] = d->ht[1];
             _dictReset(&d->ht[1]);
             d->rehashidx = -1;
@@ -252,6 +548,10 @@ int dictRehash(dict *d, int n) {
         /* Note that rehashidx can't overflow as we are sure there are more
          * elements because ht[0].used != 0 */
         assert(d->ht[0].size > (unsigned long)d->rehashidx);
+        if (d->bucketed) {
+            _dictBucketRehashStep(d);
+            continue;
+        }
         while(d->ht[0].table[d->rehashidx] == NULL) d->rehashidx++;
         de = d->ht[0].table[d->rehashidx];
         /* Move all the keys in this bucket from the old to the new hash HT */
@@ -335,6 +635,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
     dictEntry *entry;
     dictht *ht;
 
+    if (d->bucketed) return _dictBucketAddRaw(d,key);
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
@@ -344,7 +645,7 @@ dictEntry *dictAddRaw(dict *d, void *key)
 
     /* Allocate the memory and store the new entry */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    entry = zslab_alloc(dictEntryCache(d));
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
@@ -373,7 +674,7 @@ int dictReplace(dict *d, void *key, void *val)
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    auxentry = *entry;
+    auxentry.v = entry->v;
     dictSetVal(d, entry, val);
     dictFreeVal(d, &auxentry);
     return 0;
@@ -399,6 +700,7 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
     int table;
 
     if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+    if (d->bucketed) return _dictBucketDelete(d,key,nofree);
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
 
@@ -417,7 +719,7 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
                     dictFreeKey(d, he);
                     dictFreeVal(d, he);
                 }
-                zfree(he);
+                zslab_free(dictEntryCache(d),he);
                 d->ht[table].used--;
                 return DICT_OK;
             }
@@ -437,10 +739,16 @@ int dictDeleteNoFree(dict *ht, const void *key) {
     return dictGenericDelete(ht,key,1);
 }
 
-/* Destroy an entire dictionary */
-int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
+/* Destroy an entire dictionary. When 'drop' is true only the values are
+ * released: keys and entries belong to an arena freed in bulk. */
+int _dictClear(dict *d, dictht *ht, int drop, void(callback)(void *)) {
     unsigned long i;
 
+    if (d->bucketed) {
+        _dictBucketClear(d,ht,drop,callback);
+        return DICT_OK;
+    }
+
     /* Free all the elements */
     for (i = 0; i < ht->size && ht->used > 0; i++) {
         dictEntry *he, *nextHe;
@@ -450,15 +758,17 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
-            dictFreeKey(d, he);
             dictFreeVal(d, he);
-            zfree(he);
+            if (!drop) {
+                dictFreeKey(d, he);
+                zslab_free(dictEntryCache(d),he);
+            }
             ht->used--;
             he = nextHe;
         }
     }
     /* Free the table and the allocated cache structure */
-    zfree(ht->table);
+    zfree_huge(ht->table,_dictTableBytes(d,ht->size));
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -467,19 +777,18 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
 /* Clear & Release the hash table */
 void dictRelease(dict *d)
 {
-    _dictClear(d,&d->ht[0],NULL);
-    _dictClear(d,&d->ht[1],NULL);
+    _dictClear(d,&d->ht[0],0,NULL);
+    _dictClear(d,&d->ht[1],0,NULL);
     zfree(d);
 }
 
-dictEntry *dictFind(dict *d, const void *key)
+/* Search 'key', whose hash is 'h', in both the tables. */
+static dictEntry *_dictFindHashed(dict *d, const void *key, unsigned int h)
 {
     dictEntry *he;
-    unsigned int h, idx, table;
+    unsigned int idx, table;
 
-    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
-    if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
+    if (d->bucketed) return _dictBucketFind(d,key,h);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
@@ -493,6 +802,13 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+dictEntry *dictFind(dict *d, const void *key)
+{
+    if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    return _dictFindHashed(d,key,dictHashKey(d, key));
+}
+
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
 
@@ -500,6 +816,106 @@ void *dictFetchValue(dict *d, const void *key) {
     return he ? dictGetVal(he) : NULL;
 }
 
+/* Hash the 'n' keys, storing the hashes in 'h', and prefetch their buckets.
+ * Then, with the buckets on their way to the cache, prefetch the first entry
+ * of every bucket. For bucketed tables, whose slots are in other cache lines
+ * than the tags, the first slot with a matching tag is prefetched instead,
+ * and its key in a third pass. Nothing is dereferenced that a lookup would
+ * not read. */
+static void _dictPrefetchHashed(dict *d, void **keys, unsigned int *h,
+                                unsigned long n)
+{
+    unsigned long i;
+    int table;
+
+    for (i = 0; i < n; i++) {
+        h[i] = dictHashKey(d, keys[i]);
+        for (table = 0; table <= 1; table++) {
+            dictht *ht = &d->ht[table];
+
+            if (d->bucketed)
+                __builtin_prefetch(dictBuckets(ht)+(h[i] & ht->sizemask));
+            else
+                __builtin_prefetch(ht->table+(h[i] & ht->sizemask));
+            if (!dictIsRehashing(d)) break;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        for (table = 0; table <= 1; table++) {
+            dictht *ht = &d->ht[table];
+
+            if (d->bucketed) {
+                dictBucket *b = dictBuckets(ht)+(h[i] & ht->sizemask);
+                unsigned int m = _dictTagMatch(b,_dictTag(h[i]));
+
+                if (m) __builtin_prefetch(b->slots+__builtin_ctz(m));
+            } else {
+                dictEntry *he = ht->table[h[i] & ht->sizemask];
+
+                if (he) __builtin_prefetch(he);
+            }
+            if (!dictIsRehashing(d)) break;
+        }
+    }
+    if (!d->bucketed) return;
+    for (i = 0; i < n; i++) {
+        for (table = 0; table <= 1; table++) {
+            dictht *ht = &d->ht[table];
+            dictBucket *b = dictBuckets(ht)+(h[i] & ht->sizemask);
+            unsigned int m = _dictTagMatch(b,_dictTag(h[i]));
+
+            if (m) __builtin_prefetch(b->slots[__builtin_ctz(m)].key);
+            if (!dictIsRehashing(d)) break;
+        }
+    }
+}
+
+/* Lookup 'count' keys at once, storing in entries[j] the entry of keys[j],
+ * or NULL if it is not in the dictionary.
+ *
+ * A plain dictFind() loop stalls on the cache miss of every bucket before
+ * it even knows where the next key lives. Here the keys are processed in
+ * groups of DICT_FIND_BATCH: all the keys of the group are hashed and their
+ * buckets prefetched, and only then the keys are compared, so that the
+ * memory accesses of the different keys overlap.
+ *
+ * The returned entries are valid only until the next modification of the
+ * dictionary. */
+void dictFindBatch(dict *d, void **keys, dictEntry **entries,
+                   unsigned long count)
+{
+    unsigned int h[DICT_FIND_BATCH];
+    unsigned long j, i, n;
+
+    if (d->ht[0].size == 0) {
+        for (j = 0; j < count; j++) entries[j] = NULL;
+        return;
+    }
+    /* Perform the rehashing steps of all the lookups before resolving any
+     * key: they move the entries of bucketed tables. */
+    for (j = 0; j < count && dictIsRehashing(d); j++) _dictRehashStep(d);
+
+    for (j = 0; j < count; j += n) {
+        n = count-j < DICT_FIND_BATCH ? count-j : DICT_FIND_BATCH;
+        _dictPrefetchHashed(d,keys+j,h,n);
+        for (i = 0; i < n; i++)
+            entries[j+i] = _dictFindHashed(d,keys[j+i],h[i]);
+    }
+}
+
+/* Prefetch the buckets of up to DICT_FIND_BATCH keys without resolving
+ * them. This is for callers that modify the dictionary while going through
+ * their keys, so that the entries of dictFindBatch() can't be kept: the
+ * following dictFind() or dictAdd() of every key finds its bucket in the
+ * cache. */
+void dictPrefetch(dict *d, void **keys, unsigned long count) {
+    unsigned int h[DICT_FIND_BATCH];
+
+    if (d->ht[0].size == 0) return;
+    if (count > DICT_FIND_BATCH) count = DICT_FIND_BATCH;
+    _dictPrefetchHashed(d,keys,h,count);
+}
+
 /* A fingerprint is a 64 bit number that represents the state of the dictionary
  * at a given time, it's just a few dict properties xored together.
  * When an unsafe iterator is initialized, we get the dict fingerprint, and check
@@ -548,6 +964,8 @@ dictIterator *dictGetIterator(dict *d)
     iter->safe = 0;
     iter->entry = NULL;
     iter->nextEntry = NULL;
+    iter->bucket = NULL;
+    iter->slot = 0;
     return iter;
 }
 
@@ -560,6 +978,7 @@ dictIterator *dictGetSafeIterator(dict *d) {
 
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (iter->d->bucketed) return _dictBucketNext(iter);
     while (1) {
         if (iter->entry == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
@@ -613,6 +1032,7 @@ dictEntry *dictGetRandomKey(dict *d)
     int listlen, listele;
 
     if (dictSize(d) == 0) return NULL;
+    if (d->bucketed) return _dictBucketRandom(d);
     if (dictIsRehashing(d)) _dictRehashStep(d);
     if (dictIsRehashing(d)) {
         do {
@@ -755,10 +1175,14 @@ unsigned long dictScan(dict *d,
         m0 = t0->sizemask;
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            fn(privdata, de);
-            de = de->next;
+        if (d->bucketed) {
+            _dictBucketScan(dictBuckets(t0)+(v & m0),fn,privdata);
+        } else {
+            de = t0->table[v & m0];
+            while (de) {
+                fn(privdata, de);
+                de = de->next;
+            }
         }
 
     } else {
@@ -775,20 +1199,28 @@ unsigned long dictScan(dict *d,
         m1 = t1->sizemask;
 
         /* Emit entries at cursor */
-        de = t0->table[v & m0];
-        while (de) {
-            fn(privdata, de);
-            de = de->next;
+        if (d->bucketed) {
+            _dictBucketScan(dictBuckets(t0)+(v & m0),fn,privdata);
+        } else {
+            de = t0->table[v & m0];
+            while (de) {
+                fn(privdata, de);
+                de = de->next;
+            }
         }
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            de = t1->table[v & m1];
-            while (de) {
-                fn(privdata, de);
-                de = de->next;
+            if (d->bucketed) {
+                _dictBucketScan(dictBuckets(t1)+(v & m1),fn,privdata);
+            } else {
+                de = t1->table[v & m1];
+                while (de) {
+                    fn(privdata, de);
+                    de = de->next;
+                }
             }
 
             /* Increment bits not covered by the smaller mask */
@@ -810,11 +1242,317 @@ unsigned long dictScan(dict *d,
     return v;
 }
 
+/* ------------------------- bucketed tables -------------------------------- */
+
+/* The low bits of the hash select the bucket, so the tag is taken from the
+ * high bits of a multiplicative mix of the whole hash. */
+static inline uint8_t _dictTag(unsigned int h) {
+    return (uint8_t)((h*2654435769U) >> 24);
+}
+
+#ifndef DICT_TAG_SIMD
+/* Return a bitmask with the bit N set if the byte N of 'w' is 'tag'. The
+ * matching bytes are turned to zero, their high bit is set if the low 7 bits
+ * and the byte itself are zero (without carries from the nearby bytes), and
+ * the multiplication gathers the eight high bits in the top byte. */
+static inline unsigned int _dictTagMatch8(uint64_t w, uint8_t tag) {
+    uint64_t x = w ^ (tag * 0x0101010101010101ULL);
+
+    x = ~(((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x |
+          0x7f7f7f7f7f7f7f7fULL);
+    return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
+#endif
+
+/* Return a bitmask with the bit N set if the slot N of 'b' is used and has
+ * the tag 'tag'. With SSE2 the 16 tags are compared with a single vector
+ * compare, otherwise eight at a time in 64 bit words. */
+static inline unsigned int _dictTagMatch(dictBucket *b, uint8_t tag) {
+#ifdef DICT_TAG_SIMD
+    __m128i tags = _mm_loadu_si128((const __m128i*)b->tags);
+    unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(tags,
+                                       _mm_set1_epi8((char)tag)));
+#else
+    unsigned int m = _dictTagMatch8(xxhLoad64(b->tags,0),tag) |
+                     _dictTagMatch8(xxhLoad64(b->tags+8,0),tag) << 8;
+#endif
+    return m & b->presence;
+}
+
+/* Number of used slots in the bucket 'b', not counting the overflow ones. */
+static int _dictBucketUsed(dictBucket *b) {
+    return __builtin_popcount(b->presence);
+}
+
+/* Search 'key', with hash 'h', in the table 'ht'. On success the bucket
+ * holding it is returned and the slot is stored in '*slot'. If 'parent' is
+ * not NULL it is set to the bucket linking to the returned one, or to NULL
+ * if the key is in the first bucket of the chain. */
+static dictBucket *_dictBucketLookup(dict *d, dictht *ht, const void *key,
+                                     unsigned int h, int *slot,
+                                     dictBucket **parent)
+{
+    dictBucket *b = dictBuckets(ht)+(h & ht->sizemask), *prev = NULL;
+    uint8_t tag = _dictTag(h);
+
+    do {
+        unsigned int m = _dictTagMatch(b,tag);
+
+        /* Only the keys with a matching tag are compared. */
+        while(m) {
+            int j = __builtin_ctz(m);
+
+            if (dictCompareKeys(d, key, b->slots[j].key)) {
+                *slot = j;
+                if (parent) *parent = prev;
+                return b;
+            }
+            m &= m-1;
+        }
+        prev = b;
+        b = b->child;
+    } while(b);
+    return NULL;
+}
+
+/* Take a free slot for an element with hash 'h' in the table 'ht', linking
+ * a new overflow bucket to the chain if all the buckets are full. */
+static dictSlot *_dictBucketInsert(dictht *ht, unsigned int h) {
+    dictBucket *b = dictBuckets(ht)+(h & ht->sizemask);
+    int j;
+
+    while(b->presence == DICT_BUCKET_FULL) {
+        if (b->child == NULL) b->child = zcalloc(sizeof(dictBucket));
+        b = b->child;
+    }
+    j = __builtin_ctz(~b->presence);
+    b->presence |= 1<<j;
+    b->tags[j] = _dictTag(h);
+    ht->used++;
+    return &b->slots[j];
+}
+
+static dictEntry *_dictBucketAddRaw(dict *d, void *key) {
+    dictEntry *entry;
+    unsigned int h;
+    int table, slot;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (_dictExpandIfNeeded(d) == DICT_ERR) return NULL;
+
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        if (_dictBucketLookup(d,&d->ht[table],key,h,&slot,NULL))
+            return NULL;
+        if (!dictIsRehashing(d)) break;
+    }
+    entry = (dictEntry*)
+        _dictBucketInsert(dictIsRehashing(d) ? &d->ht[1] : &d->ht[0],h);
+    dictSetKey(d, entry, key);
+    return entry;
+}
+
+static int _dictBucketDelete(dict *d, const void *key, int nofree) {
+    dictBucket *b, *parent;
+    unsigned int h;
+    int table, slot;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        b = _dictBucketLookup(d,&d->ht[table],key,h,&slot,&parent);
+        if (b) {
+            dictEntry *he = dictSlotEntry(b,slot);
+
+            if (!nofree) {
+                dictFreeKey(d, he);
+                dictFreeVal(d, he);
+            }
+            b->presence &= ~(1<<slot);
+            d->ht[table].used--;
+            /* Release the overflow bucket once empty, but not while a safe
+             * iterator may be pointing to it. */
+            if (parent && b->presence == 0 && d->iterators == 0) {
+                parent->child = b->child;
+                zfree(b);
+            }
+            return DICT_OK;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return DICT_ERR; /* not found */
+}
+
+static dictEntry *_dictBucketFind(dict *d, const void *key, unsigned int h) {
+    dictBucket *b;
+    int table, slot;
+
+    for (table = 0; table <= 1; table++) {
+        b = _dictBucketLookup(d,&d->ht[table],key,h,&slot,NULL);
+        if (b) return dictSlotEntry(b,slot);
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+/* Move the chain of buckets at rehashidx from the old to the new table.
+ * Empty chains are skipped, but chains made only of empty overflow buckets
+ * (see _dictBucketDelete()) are not, so that they are released. */
+static void _dictBucketRehashStep(dict *d) {
+    dictBucket *head = dictBuckets(&d->ht[0]), *b, *next;
+    int j;
+
+    while(head[d->rehashidx].presence == 0 &&
+          head[d->rehashidx].child == NULL) d->rehashidx++;
+    head += d->rehashidx;
+    for (b = head; b; b = next) {
+        next = b->child;
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if (!(b->presence & (1<<j))) continue;
+            *_dictBucketInsert(&d->ht[1],dictHashKey(d, b->slots[j].key)) =
+                b->slots[j];
+            d->ht[0].used--;
+        }
+        if (b != head) zfree(b);
+    }
+    head->presence = 0;
+    head->child = NULL;
+    d->rehashidx++;
+}
+
+/* Release the empty overflow buckets of 'ht', once all its elements were
+ * moved, still linked to the buckets from 'from' on: the ones before were
+ * already visited by _dictBucketRehashStep(). */
+static void _dictBucketFreeOverflow(dictht *ht, unsigned long from) {
+    unsigned long i;
+
+    for (i = from; i < ht->size; i++) {
+        dictBucket *b = dictBuckets(ht)[i].child, *next;
+
+        for (; b; b = next) {
+            next = b->child;
+            zfree(b);
+        }
+    }
+}
+
+/* Release every element of the table 'ht' (only the values if 'drop' is
+ * true, see dictDrop()), the overflow buckets and the table itself. */
+static void _dictBucketClear(dict *d, dictht *ht, int drop,
+                             void(callback)(void *))
+{
+    unsigned long i;
+
+    for (i = 0; i < ht->size; i++) {
+        dictBucket *head = dictBuckets(ht)+i, *b, *next;
+        int j;
+
+        if (callback && (i & 65535) == 0) callback(d->privdata);
+        for (b = head; b; b = next) {
+            next = b->child;
+            for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+                dictEntry *he = dictSlotEntry(b,j);
+
+                if (!(b->presence & (1<<j))) continue;
+                dictFreeVal(d, he);
+                if (!drop) dictFreeKey(d, he);
+                ht->used--;
+            }
+            if (b != head) zfree(b);
+        }
+    }
+    zfree_huge(ht->table,_dictTableBytes(d,ht->size));
+    _dictReset(ht);
+}
+
+static dictEntry *_dictBucketNext(dictIterator *iter) {
+    while (1) {
+        if (iter->bucket == NULL) {
+            dictht *ht = &iter->d->ht[iter->table];
+            if (iter->index == -1 && iter->table == 0) {
+                if (iter->safe)
+                    iter->d->iterators++;
+                else
+                    iter->fingerprint = dictFingerprint(iter->d);
+            }
+            iter->index++;
+            if (iter->index >= (long) ht->size) {
+                if (dictIsRehashing(iter->d) && iter->table == 0) {
+                    iter->table++;
+                    iter->index = 0;
+                    ht = &iter->d->ht[1];
+                } else {
+                    break;
+                }
+            }
+            iter->bucket = dictBuckets(ht)+iter->index;
+            iter->slot = 0;
+        }
+        /* The user may delete the returned entry: the bucket is not
+         * released while a safe iterator is active. */
+        while (iter->slot < DICT_BUCKET_SLOTS) {
+            int j = iter->slot++;
+
+            if (iter->bucket->presence & (1<<j))
+                return dictSlotEntry(iter->bucket,j);
+        }
+        iter->bucket = iter->bucket->child;
+        iter->slot = 0;
+    }
+    return NULL;
+}
+
+static dictEntry *_dictBucketRandom(dict *d) {
+    dictBucket *head, *b;
+    unsigned long h;
+    int count, j;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    while(1) {
+        if (dictIsRehashing(d)) {
+            h = random() % (d->ht[0].size+d->ht[1].size);
+            head = (h >= d->ht[0].size) ?
+                dictBuckets(&d->ht[1])+(h - d->ht[0].size) :
+                dictBuckets(&d->ht[0])+h;
+        } else {
+            head = dictBuckets(&d->ht[0])+(random() & d->ht[0].sizemask);
+        }
+        count = 0;
+        for (b = head; b; b = b->child) count += _dictBucketUsed(b);
+        if (count) break;
+    }
+
+    /* Select a random element of the chain. */
+    count = random() % count;
+    for (b = head; b; b = b->child) {
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if ((b->presence & (1<<j)) && count-- == 0)
+                return dictSlotEntry(b,j);
+        }
+    }
+    return NULL; /* Not reached. */
+}
+
+/* Call 'fn' for every element of the chain of buckets starting at 'b'. */
+static void _dictBucketScan(dictBucket *b, dictScanFunction *fn,
+                            void *privdata)
+{
+    int j;
+
+    for (; b; b = b->child) {
+        for (j = 0; j < DICT_BUCKET_SLOTS; j++) {
+            if (b->presence & (1<<j)) fn(privdata, dictSlotEntry(b,j));
+        }
+    }
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
 static int _dictExpandIfNeeded(dict *d)
 {
+    unsigned long slots;
+
     /* Incremental rehashing already in progress. Return. */
     if (dictIsRehashing(d)) return DICT_OK;
 
@@ -825,9 +1563,10 @@ static int _dictExpandIfNeeded(dict *d)
      * table (global setting) or we should avoid it but the ratio between
      * elements/buckets is over the "safe" threshold, we resize doubling
      * the number of buckets. */
-    if (d->ht[0].used >= d->ht[0].size &&
+    slots = d->ht[0].size*(d->bucketed ? DICT_BUCKET_CAPACITY : 1);
+    if (d->ht[0].used >= slots &&
         (dict_can_resize ||
-         d->ht[0].used/d->ht[0].size > dict_force_resize_ratio))
+         d->ht[0].used/slots > dict_force_resize_ratio))
     {
         return dictExpand(d, d->ht[0].used*2);
     }
@@ -878,8 +1617,25 @@ static int _dictKeyIndex(dict *d, const void *key)
 }
 
 void dictEmpty(dict *d, void(callback)(void*)) {
-    _dictClear(d,&d->ht[0],callback);
-    _dictClear(d,&d->ht[1],callback);
+    _dictClear(d,&d->ht[0],0,callback);
+    _dictClear(d,&d->ht[1],0,callback);
+    d->rehashidx = -1;
+    d->iterators = 0;
+}
+
+/* Allocate the entries of 'd' from 'slab' instead of the shared cache.
+ * Must be called while the dictionary is still empty. */
+void dictSetEntrySlab(dict *d, zslab *slab) {
+    d->entry_slab = slab;
+}
+
+/* Like dictEmpty(), but the keys and the entries are not released, only
+ * the values are passed to the val destructor. This is used when keys and
+ * entries were allocated from an arena (see zarena_create()) that the
+ * caller is going to drop all at once. */
+void dictDrop(dict *d, void(callback)(void*)) {
+    _dictClear(d,&d->ht[0],1,callback);
+    _dictClear(d,&d->ht[1],1,callback);
     d->rehashidx = -1;
     d->iterators = 0;
 }
@@ -1016,3 +1772,329 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringDestructor,         /* val destructor */
 };
 #endif
+
+#ifdef DICT_BENCHMARK_MAIN
+/* Keyspace lookup benchmark, to compare normal and huge pages, and chained
+ * and bucketed tables. Compile and run with:
+ *
+ *   gcc -O2 -DDICT_BENCHMARK_MAIN dict.c siphash.c zmalloc.c -lpthread \
+ *       -o dict-bench
+ *   ./dict-bench [keys] [hugepages: yes|no] [table: chained|bucketed] \
+ *       [keys: strings|ints]
+ *
+ * Lookups of existing (hit) and missing keys (miss) are timed, with the
+ * number of key comparisons each of them performed on average, both one
+ * key at a time with dictFind() and in groups with dictFindBatch().
+ * The keyspace is emulated with string keys and small value objects, served
+ * by a slab cache like robj, that point to a separately allocated payload.
+ * GET looks up the key and reads the payload, SET replaces the object. The
+ * mean and 99th percentile latency of a sample of the operations is
+ * reported. Huge pages require either reserved pages (vm.nr_hugepages) or
+ * transparent huge pages in "madvise" or "always" mode.
+ *
+ * With "ints" the keys are integers stored in the key pointers, there are
+ * no values and only the lookups are timed: the table, sized for all the
+ * keys in advance, is the only memory used, so that 100 million keys fit in
+ * a few GB. Add -DDICT_NO_SIMD to
+ * compare the scalar tag match with the SSE2 one. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SAMPLE 16 /* Time one operation every BENCH_SAMPLE. */
+#define BENCH_MISS_KEYS 1000000 /* Missing keys to look up. */
+
+typedef struct benchValue {
+    unsigned int lru;
+    int refcount;
+    char *payload;
+} benchValue;
+
+static zslab benchValueSlab = ZSLAB_INIT("value",benchValue);
+
+void _redisAssert(char *estr, char *file, int line) {
+    fprintf(stderr,"ASSERTION FAILED %s:%d '%s'\n", file, line, estr);
+}
+
+static unsigned int benchHash(const void *key) {
+    return dictGenHashFunction(key,strlen(key));
+}
+
+static long long bench_compares = 0;
+
+static int benchKeyCompare(void *privdata, const void *key1,
+                           const void *key2)
+{
+    DICT_NOTUSED(privdata);
+    bench_compares++;
+    return strcmp(key1,key2) == 0;
+}
+
+static dictType benchDictType = {
+    benchHash, NULL, NULL, benchKeyCompare, NULL, NULL
+};
+
+static benchValue *benchCreateValue(void) {
+    benchValue *v = zslab_alloc(&benchValueSlab);
+
+    v->lru = 0;
+    v->refcount = 1;
+    v->payload = zmalloc(16);
+    memset(v->payload,'x',16);
+    return v;
+}
+
+static long long nstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+static int cmplong(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* Perform 'ops' random GET (set == 0) or SET operations. */
+static void bench(dict *d, char **keys, long numkeys, long ops, int set) {
+    long long *lat = zmalloc(sizeof(long long)*(ops/BENCH_SAMPLE+1));
+    long long start = nstime(), total;
+    long j, samples = 0;
+    volatile char sink = 0;
+
+    for (j = 0; j < ops; j++) {
+        char *key = keys[random() % numkeys];
+        long long t = (j % BENCH_SAMPLE) ? 0 : nstime();
+        dictEntry *de = dictFind(d,key);
+        benchValue *v = dictGetVal(de);
+
+        if (set) {
+            benchValue *nv = benchCreateValue();
+
+            dictSetVal(d,de,nv);
+            zfree(v->payload);
+            zslab_free(&benchValueSlab,v);
+        } else {
+            v->lru = (unsigned int)j;
+            sink += v->payload[0];
+        }
+        if (t) lat[samples++] = nstime()-t;
+    }
+    total = nstime()-start;
+    qsort(lat,samples,sizeof(long long),cmplong);
+    printf("%s: %.1f ns/op mean, p99 %lld ns\n", set ? "SET" : "GET",
+        (double)total/ops, lat[samples*99/100]);
+    zfree(lat);
+    (void)sink;
+}
+
+/* Perform 'ops' lookups of random keys, that are all expected to be found
+ * (miss == 0) or not. */
+static void benchLookup(dict *d, char **keys, long numkeys, long ops,
+                        int miss, int batch)
+{
+    dictEntry *entries[DICT_FIND_BATCH];
+    void *batchkeys[DICT_FIND_BATCH];
+    long long start, total;
+    long j, found = 0;
+    int i;
+
+    bench_compares = 0;
+    start = nstime();
+    if (batch) {
+        for (j = 0; j < ops; j += DICT_FIND_BATCH) {
+            for (i = 0; i < DICT_FIND_BATCH; i++)
+                batchkeys[i] = keys[random() % numkeys];
+            dictFindBatch(d,batchkeys,entries,DICT_FIND_BATCH);
+            for (i = 0; i < DICT_FIND_BATCH; i++)
+                if (entries[i] != NULL) found++;
+        }
+        ops = j;
+    } else {
+        for (j = 0; j < ops; j++)
+            if (dictFind(d,keys[random() % numkeys]) != NULL) found++;
+    }
+    total = nstime()-start;
+    printf("%s%s: %.1f ns/op, %.3f key compares/op, %ld found\n",
+        miss ? "MISS" : "HIT", batch ? " (batch)" : "", (double)total/ops,
+        (double)bench_compares/ops, found);
+}
+
+static unsigned int benchIntHash(const void *key) {
+    return dictIntHashFunction((unsigned int)(unsigned long)key);
+}
+
+static int benchIntCompare(void *privdata, const void *key1,
+                           const void *key2)
+{
+    DICT_NOTUSED(privdata);
+    bench_compares++;
+    return key1 == key2;
+}
+
+static dictType benchIntDictType = {
+    benchIntHash, NULL, NULL, benchIntCompare, NULL, NULL
+};
+
+/* Like benchLookup() for the integer keys from 'first' to 'first+numkeys-1'. */
+static void benchIntLookup(dict *d, long first, long numkeys, long ops,
+                           int miss, int batch)
+{
+    dictEntry *entries[DICT_FIND_BATCH];
+    void *batchkeys[DICT_FIND_BATCH];
+    long long start, total;
+    long j, found = 0;
+    int i;
+
+    bench_compares = 0;
+    start = nstime();
+    if (batch) {
+        for (j = 0; j < ops; j += DICT_FIND_BATCH) {
+            for (i = 0; i < DICT_FIND_BATCH; i++)
+                batchkeys[i] = (void*)(first + random() % numkeys);
+            dictFindBatch(d,batchkeys,entries,DICT_FIND_BATCH);
+            for (i = 0; i < DICT_FIND_BATCH; i++)
+                if (entries[i] != NULL) found++;
+        }
+        ops = j;
+    } else {
+        for (j = 0; j < ops; j++)
+            if (dictFind(d,(void*)(first + random() % numkeys)) != NULL)
+                found++;
+    }
+    total = nstime()-start;
+    printf("%s%s: %.1f ns/op, %.3f key compares/op, %ld found\n",
+        miss ? "MISS" : "HIT", batch ? " (batch)" : "", (double)total/ops,
+        (double)bench_compares/ops, found);
+}
+
+static void benchInts(dict *d, long numkeys, int bucketed) {
+    size_t used = zmalloc_used_memory();
+    long j;
+
+    dictExpand(d,numkeys);
+    for (j = 1; j <= numkeys; j++) dictAdd(d,(void*)j,NULL);
+    used = zmalloc_used_memory()-used;
+    printf("%ld integer keys, %s table using %.1f bytes per key\n", numkeys,
+           bucketed ? "bucketed" : "chained", (double)used/numkeys);
+    benchIntLookup(d,1,numkeys,numkeys,0,0);
+    benchIntLookup(d,1,numkeys,numkeys,0,1);
+    benchIntLookup(d,numkeys+1,numkeys,numkeys,1,0);
+    benchIntLookup(d,numkeys+1,numkeys,numkeys,1,1);
+}
+
+int main(int argc, char **argv) {
+    long numkeys = argc > 1 ? atol(argv[1]) : 5000000, j;
+    int huge = argc > 2 && !strcasecmp(argv[2],"yes");
+    int bucketed = argc > 3 && !strcasecmp(argv[3],"bucketed");
+    int ints = argc > 4 && !strcasecmp(argv[4],"ints");
+    dictType *type = ints ? &benchIntDictType : &benchDictType;
+    size_t mapped, hugetlb_maps, thp_maps, used;
+    benchValue **vals;
+    char **keys, **misskeys;
+    dict *d;
+
+    zmalloc_enable_huge_pages(huge);
+    d = bucketed ? dictCreateBucketed(type,NULL) : dictCreate(type,NULL);
+    if (ints) {
+        benchInts(d,numkeys,bucketed);
+        return 0;
+    }
+    keys = zmalloc(sizeof(char*)*numkeys);
+    vals = zmalloc(sizeof(benchValue*)*numkeys);
+    for (j = 0; j < numkeys; j++) {
+        keys[j] = zmalloc(24);
+        snprintf(keys[j],24,"key:%ld",j);
+        vals[j] = benchCreateValue();
+    }
+    used = zmalloc_used_memory();
+    for (j = 0; j < numkeys; j++) dictAdd(d,keys[j],vals[j]);
+    used = zmalloc_used_memory()-used;
+    zfree(vals);
+    zmalloc_get_huge_stats(&mapped,&hugetlb_maps,&thp_maps);
+    printf("%ld keys, %s table using %.1f bytes per key, huge pages %s "
+           "(%zu bytes mapped, %zu hugetlb maps, %zu THP maps)\n", numkeys,
+           bucketed ? "bucketed" : "chained", (double)used/numkeys,
+           huge ? "yes" : "no", mapped, hugetlb_maps, thp_maps);
+    benchLookup(d,keys,numkeys,numkeys,0,0);
+    benchLookup(d,keys,numkeys,numkeys,0,1);
+    misskeys = zmalloc(sizeof(char*)*BENCH_MISS_KEYS);
+    for (j = 0; j < BENCH_MISS_KEYS; j++) {
+        misskeys[j] = zmalloc(24);
+        snprintf(misskeys[j],24,"miss:%ld",j);
+    }
+    benchLookup(d,misskeys,BENCH_MISS_KEYS,numkeys,1,0);
+    benchLookup(d,misskeys,BENCH_MISS_KEYS,numkeys,1,1);
+    bench(d,keys,numkeys,numkeys*2,0);
+    bench(d,keys,numkeys,numkeys*2,1);
+    return 0;
+}
+#endif
+
+#ifdef DICT_HASH_BENCHMARK_MAIN
+/* Throughput of the hash functions across key lengths. Compile and run with:
+ *
+ *   gcc -O2 -DDICT_HASH_BENCHMARK_MAIN dict.c siphash.c zmalloc.c \
+ *       -lpthread -o dict-hash-bench
+ *   ./dict-hash-bench [iterations]
+ *
+ * Every key length is hashed 'iterations' times at different offsets of a
+ * buffer, by both dictGenHashFunction() and dictGenCaseHashFunction(). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long nstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+void _redisAssert(char *estr, char *file, int line) {
+    fprintf(stderr,"ASSERTION FAILED %s:%d '%s'\n", file, line, estr);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000, j;
+    int lens[] = {8, 16, 24, 32, 64, 100, 128, 256, 1024};
+    int numlens = sizeof(lens)/sizeof(lens[0]), l, type, nocase;
+    unsigned char buf[1024+64], seed[DICT_HASH_SEED_LEN];
+    volatile unsigned int sink = 0;
+
+    for (j = 0; j < (long)sizeof(buf); j++) buf[j] = 'A' + random() % 58;
+    for (j = 0; j < DICT_HASH_SEED_LEN; j++) seed[j] = random();
+    dictSetHashFunctionSeed(seed);
+
+    printf("%-8s %-6s", "hash", "case");
+    for (l = 0; l < numlens; l++) printf(" %9d", lens[l]);
+    printf("   (ns/hash, GB/s for the longest)\n");
+    for (type = DICT_HASH_MURMUR2; type <= DICT_HASH_XXHASH; type++) {
+        dictSetHashFunction(type);
+        for (nocase = 0; nocase <= 1; nocase++) {
+            double gbs = 0;
+
+            printf("%-8s %-6s", dictHashFunctionName(type),
+                nocase ? "nocase" : "exact");
+            for (l = 0; l < numlens; l++) {
+                long long start = nstime(), total;
+                unsigned int h = 0;
+
+                for (j = 0; j < iterations; j++) {
+                    unsigned char *p = buf+((j+h) & 63);
+
+                    h = nocase ? dictGenCaseHashFunction(p,lens[l]) :
+                                 dictGenHashFunction(p,lens[l]);
+                }
+                sink += h;
+                total = nstime()-start;
+                printf(" %9.2f", (double)total/iterations);
+                gbs = (double)lens[l]*iterations/total;
+            }
+            printf("   %.2f\n", gbs);
+        }
+    }
+    return 0;
+}
+#endif
@@ -3,7 +3,8 @@
  * This file implements in-memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto-resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or by buckets of 16 inline entries for dictionaries created with
+ * dictCreateBucketed(). See the source code for more information... :)
  *
  * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -65,7 +66,9 @@ typedef struct dictType {
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
- * implement incremental rehashing, for the old to the new table. */
+ * implement incremental rehashing, for the old to the new table.
+ * In bucketed dictionaries 'table' is actually an array of 'size' buckets,
+ * see dictCreateBucketed(). */
 typedef struct dictht {
     dictEntry **table;
     unsigned long size;
@@ -76,9 +79,11 @@ typedef struct dictht {
 typedef struct dict {
     dictType *type;
     void *privdata;
+    struct zslab *entry_slab; /* Cache of the entries, NULL for the shared one. */
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int iterators; /* number of iterators currently running */
+    int bucketed; /* Entries inline in 16 slot buckets instead of chaining. */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -90,6 +95,8 @@ typedef struct dictIterator {
     long index;
     int table, safe;
     dictEntry *entry, *nextEntry;
+    struct dictBucket *bucket; /* Bucket and slot of bucketed dicts. */
+    int slot;
     /* unsafe iterator fingerprint for misuse detection. */
     long long fingerprint;
 } dictIterator;
@@ -99,6 +106,22 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Entries in every bucket of a bucketed dict: the 16 tags of a bucket are
+ * compared at once, see _dictTagMatch(). Tables are expanded when they hold
+ * DICT_BUCKET_CAPACITY elements per bucket, so that few buckets overflow. */
+#define DICT_BUCKET_SLOTS 16
+#define DICT_BUCKET_CAPACITY 12
+
+/* Hash functions of dictGenHashFunction(), see dictSetHashFunction(). */
+#define DICT_HASH_MURMUR2 0 /* MurmurHash2 (djb for the case insensitive). */
+#define DICT_HASH_SIPHASH 1 /* SipHash-1-3, keyed: resists hash flooding. */
+#define DICT_HASH_XXHASH 2  /* xxHash64, the fastest for long keys. */
+#define DICT_HASH_SEED_LEN 16
+
+/* Keys whose buckets dictFindBatch() prefetches before resolving them, and
+ * most keys prefetched by a dictPrefetch() call. */
+#define DICT_FIND_BATCH 16
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -142,13 +165,19 @@ typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 #define dictGetSignedIntegerVal(he) ((he)->v.s64)
 #define dictGetUnsignedIntegerVal(he) ((he)->v.u64)
 #define dictGetDoubleVal(he) ((he)->v.d)
-#define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
+#define dictSlots(d) (((d)->ht[0].size+(d)->ht[1].size)* \
+                      ((d)->bucketed ? DICT_BUCKET_CAPACITY : 1))
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
+dict *dictCreateBucketed(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
+size_t dictExpandBytes(dict *d, unsigned long size);
+int dictExpandWithTable(dict *d, unsigned long size, void *table);
+size_t dictTableMemory(dict *d);
+void dictSetTableFreeFunction(void (*fn)(void *table, size_t bytes));
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key);
 int dictReplace(dict *d, void *key, void *val);
@@ -158,6 +187,9 @@ int dictDeleteNoFree(dict *d, const void *key);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);
+void dictFindBatch(dict *d, void **keys, dictEntry **entries,
+                   unsigned long count);
+void dictPrefetch(dict *d, void **keys, unsigned long count);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
 dictIterator *dictGetSafeIterator(dict *d);
@@ -168,12 +200,21 @@ void dictPrintStats(dict *d);
 unsigned int dictGenHashFunction(const void *key, int len);
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
+void dictSetEntrySlab(dict *d, struct zslab *slab);
+void dictDrop(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
-void dictSetHashFunctionSeed(unsigned int initval);
-unsigned int dictGetHashFunctionSeed(void);
+void dictSetHashFunctionSeed(uint8_t *seed);
+uint8_t *dictGetHashFunctionSeed(void);
+void dictSetHashFunction(int type);
+int dictGetHashFunction(void);
+int dictHashFunctionByName(const char *name);
+const char *dictHashFunctionName(int type);
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t siphash_nocase(const uint8_t *in, const size_t inlen,
+                        const uint8_t *k);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
 
 /* Hash table types */
@@ -0,0 +1,437 @@
+/* Lazy freeing of values.
+ *
+ * Releasing a list, set, sorted set or hash with millions of elements takes
+ * a long time, and the server would be blocked meanwhile. With UNLINK,
+ * FLUSHDB ASYNC and FLUSHALL ASYNC (and optionally for expires, evictions
+ * and implicit deletions) the value is only unlinked from the keyspace in
+ * the main thread, and a REDIS_BIO_LAZY_FREE job reclaims its memory in
+ * background. Small values are still freed synchronously, since creating
+ * the job would cost more than freeing them.
+ *
+ * Values are unlinked only if their reference count is one, but elements
+ * of aggregate values (robj strings) may be shared with other values,
+ * client reply lists, and so forth, and reference counts are not atomic.
+ * The bio thread frees an element only if the value being released holds
+ * all its references: then nothing else can reach it. Otherwise the
+ * element may be still in use by the main thread, and its references are
+ * queued so that lazyfreeCron() drops them from the main thread.
+ *
+ * The memory that is going to be reclaimed is estimated sampling a few
+ * elements, and reported as pending, so that maxmemory eviction does not
+ * evict more keys than needed while the bio thread catches up.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include "bio.h"
+
+/* Values with a free effort (see lazyfreeGetFreeEffort()) not bigger than
+ * this are freed synchronously. */
+#define LAZYFREE_THRESHOLD 64
+
+/* Elements sampled to estimate the size of a value. */
+#define LAZYFREE_SAMPLES 5
+
+/* Objects released by the bio thread reclaimed per batch, and time spent
+ * reclaiming them per call of lazyfreeCron(). */
+#define LAZYFREE_DRAIN_BATCH 1024
+#define LAZYFREE_DRAIN_USEC 1000
+
+typedef struct lazyfreeJob {
+    robj *obj;              /* Value to release, or NULL for a database. */
+    dict *dict, *expires;   /* Database to release. */
+    zarena *arena;          /* Arena of the database keys, or NULL. */
+    size_t bytes;           /* Estimated memory to reclaim. */
+} lazyfreeJob;
+
+static pthread_mutex_t lazyfree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t lazyfree_pending_objects = 0;
+static size_t lazyfree_pending_bytes = 0;
+
+/* Elements whose references must be dropped by the main thread. */
+static robj **lazyfree_deferred = NULL;
+static size_t lazyfree_deferred_len = 0, lazyfree_deferred_size = 0;
+
+#if defined(__ATOMIC_RELAXED)
+#define lazyfreeRefCount(o) __atomic_load_n(&(o)->refcount,__ATOMIC_RELAXED)
+#else
+#define lazyfreeRefCount(o) (*(volatile int*)&(o)->refcount)
+#endif
+
+/* ---------------------------- Main thread side ---------------------------- */
+
+/* Lazy freeing is not used with a persistent heap: blocks must be released
+ * by the main thread, inside the transactions of the heap. */
+static int lazyfreeEnabled(void) {
+    return !pheapIsPersistent();
+}
+
+/* Return the number of allocations the release of 'obj' is going to
+ * perform, roughly. */
+size_t lazyfreeGetFreeEffort(robj *obj) {
+    if (obj->type == REDIS_LIST && obj->encoding == REDIS_ENCODING_LINKEDLIST) {
+        return listLength((list*)obj->ptr);
+    } else if (obj->type == REDIS_SET && obj->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)obj->ptr);
+    } else if (obj->type == REDIS_ZSET &&
+               obj->encoding == REDIS_ENCODING_SKIPLIST)
+    {
+        return ((zset*)obj->ptr)->zsl->length;
+    } else if (obj->type == REDIS_HASH && obj->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)obj->ptr);
+    } else {
+        return 1; /* Everything else is a single allocation. */
+    }
+}
+
+static size_t lazyfreeStringSize(robj *o) {
+    size_t size = sizeof(robj);
+
+    if (o->encoding == REDIS_ENCODING_RAW)
+        size += sdsAllocSize(o->ptr);
+    else if (o->encoding == REDIS_ENCODING_EMBSTR)
+        size += sdsReqSize(sdslen(o->ptr));
+    return size;
+}
+
+/* Sample a few elements of the dict 'd' to estimate its size. */
+static size_t lazyfreeDictSize(dict *d, int withvals) {
+    size_t sampled = 0;
+    int j;
+
+    if (dictSize(d) == 0) return sizeof(dict);
+    for (j = 0; j < LAZYFREE_SAMPLES; j++) {
+        dictEntry *de = dictGetRandomKey(d);
+
+        sampled += lazyfreeStringSize(dictGetKey(de));
+        if (withvals) sampled += lazyfreeStringSize(dictGetVal(de));
+    }
+    return sizeof(dict) + dictSlots(d)*sizeof(dictEntry*) +
+           dictSize(d)*(sizeof(dictEntry)+sampled/LAZYFREE_SAMPLES);
+}
+
+/* Estimate the memory used by 'o' sampling a few of its elements. */
+size_t lazyfreeEstimateObject(robj *o) {
+    size_t size = sizeof(robj), sampled = 0, samples = 0;
+
+    if (o->type == REDIS_STRING) return lazyfreeStringSize(o);
+    switch(o->encoding) {
+    case REDIS_ENCODING_ZIPLIST:
+        size += ziplistBlobLen(o->ptr);
+        break;
+    case REDIS_ENCODING_INTSET:
+        size += intsetBlobLen(o->ptr);
+        break;
+    case REDIS_ENCODING_LINKEDLIST: {
+        list *l = o->ptr;
+        listNode *ln = listFirst(l);
+
+        for (; ln && samples < LAZYFREE_SAMPLES; ln = ln->next, samples++)
+            sampled += lazyfreeStringSize(listNodeValue(ln));
+        size += sizeof(list);
+        if (samples)
+            size += listLength(l)*(sizeof(listNode)+sampled/samples);
+        break;
+    }
+    case REDIS_ENCODING_HT:
+        size += lazyfreeDictSize(o->ptr,o->type == REDIS_HASH);
+        break;
+    case REDIS_ENCODING_SKIPLIST: {
+        zset *zs = o->ptr;
+        zskiplistNode *zn = zs->zsl->header->level[0].forward;
+
+        for (; zn && samples < LAZYFREE_SAMPLES;
+             zn = zn->level[0].forward, samples++)
+        {
+            sampled += zmalloc_size(zn)+lazyfreeStringSize(zn->obj);
+        }
+        /* Elements are shared by the dict and the skiplist. */
+        size += sizeof(zset)+sizeof(zskiplist)+
+                dictSlots(zs->dict)*sizeof(dictEntry*)+
+                zs->zsl->length*sizeof(dictEntry);
+        if (samples) size += zs->zsl->length*(sampled/samples);
+        break;
+    }
+    }
+    return size;
+}
+
+static void lazyfreeSubmit(lazyfreeJob *job) {
+    pthread_mutex_lock(&lazyfree_mutex);
+    lazyfree_pending_objects++;
+    lazyfree_pending_bytes += job->bytes;
+    pthread_mutex_unlock(&lazyfree_mutex);
+    bioCreateBackgroundJob(REDIS_BIO_LAZY_FREE,job,NULL,NULL);
+}
+
+/* Release 'obj' in background if it is worth it, otherwise just drop the
+ * reference. */
+void lazyfreeObject(robj *obj) {
+    lazyfreeJob *job;
+
+    if (!lazyfreeEnabled() || obj->refcount != 1 ||
+        lazyfreeGetFreeEffort(obj) <= LAZYFREE_THRESHOLD)
+    {
+        decrRefCount(obj);
+        return;
+    }
+    job = zcalloc(sizeof(*job));
+    job->obj = obj;
+    job->bytes = lazyfreeEstimateObject(obj);
+    lazyfreeSubmit(job);
+}
+
+/* Delete a key, value and associated expiration entry if any, from the DB.
+ * Like dbSyncDelete(), but the value is released by lazyfreeObject(). */
+int dbAsyncDelete(redisDb *db, robj *key) {
+    dictEntry *de;
+
+    /* Deleting an entry from the expires dict will not free the sds of
+     * the key, because it is shared with the main dictionary. */
+    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if ((de = dictFind(db->dict,key->ptr)) == NULL) return 0;
+
+    /* Unlink the value first: the destructor of the dict ignores NULL. */
+    lazyfreeObject(dictGetVal(de));
+    dictSetVal(db->dict,de,NULL);
+    dictDelete(db->dict,key->ptr);
+    return 1;
+}
+
+/* Empty 'db' replacing its dictionaries (and arena) with new ones, while the
+ * old ones are released in background. Returns the number of keys removed. */
+long long emptyDbAsync(redisDb *db) {
+    long long removed = dictSize(db->dict);
+    lazyfreeJob *job;
+    size_t sampled = 0;
+    int j;
+
+    if (!lazyfreeEnabled() || removed == 0) return emptyDbKeys(db,NULL);
+
+    job = zcalloc(sizeof(*job));
+    job->dict = db->dict;
+    job->expires = db->expires;
+    job->arena = db->arena;
+    for (j = 0; j < LAZYFREE_SAMPLES; j++)
+        sampled += lazyfreeEstimateObject(dictGetVal(dictGetRandomKey(db->dict)));
+    job->bytes = (dictSlots(db->dict)+dictSlots(db->expires))*sizeof(dictEntry*)+
+                 removed*(sampled/LAZYFREE_SAMPLES);
+    job->bytes += db->arena ? zarena_used_memory(db->arena) :
+                  (dictSize(db->dict)+dictSize(db->expires))*sizeof(dictEntry);
+
+    db->arena = db->arena ? zarena_create() : NULL;
+    dbCreateDicts(db);
+    lazyfreeSubmit(job);
+    return removed;
+}
+
+/* Drop the references the bio thread could not drop itself, and reclaim
+ * the objects it released to the slab caches of the main thread. Called by
+ * serverCron(). */
+void lazyfreeCron(void) {
+    robj **deferred;
+    size_t len, j;
+    long long start = ustime();
+
+    /* Releasing a value of millions of elements pushes all of them on the
+     * remote stacks of the caches at once. They are reclaimed a batch at
+     * a time, for up to LAZYFREE_DRAIN_USEC per call, so that the memory
+     * becomes reusable without stalling the main thread. */
+    while(zmalloc_drain_slabs(LAZYFREE_DRAIN_BATCH) == LAZYFREE_DRAIN_BATCH &&
+          ustime()-start < LAZYFREE_DRAIN_USEC);
+
+    if (lazyfree_deferred_len == 0) return; /* Racy but harmless check. */
+    pthread_mutex_lock(&lazyfree_mutex);
+    deferred = lazyfree_deferred;
+    len = lazyfree_deferred_len;
+    lazyfree_deferred = NULL;
+    lazyfree_deferred_len = lazyfree_deferred_size = 0;
+    pthread_mutex_unlock(&lazyfree_mutex);
+
+    for (j = 0; j < len; j++) decrRefCount(deferred[j]);
+    zfree(deferred);
+}
+
+size_t lazyfreeGetPendingObjects(void) {
+    size_t objects;
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    objects = lazyfree_pending_objects;
+    pthread_mutex_unlock(&lazyfree_mutex);
+    return objects;
+}
+
+size_t lazyfreeGetPendingBytes(void) {
+    size_t bytes;
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    bytes = lazyfree_pending_bytes;
+    pthread_mutex_unlock(&lazyfree_mutex);
+    return bytes;
+}
+
+/* ----------------------------- Bio thread side ---------------------------- */
+
+static void lazyfreeDefer(robj *o, int refs) {
+    pthread_mutex_lock(&lazyfree_mutex);
+    while(refs--) {
+        if (lazyfree_deferred_len == lazyfree_deferred_size) {
+            lazyfree_deferred_size = lazyfree_deferred_size ?
+                                     lazyfree_deferred_size*2 : 1024;
+            lazyfree_deferred = zrealloc(lazyfree_deferred,
+                sizeof(robj*)*lazyfree_deferred_size);
+        }
+        lazyfree_deferred[lazyfree_deferred_len++] = o;
+    }
+    pthread_mutex_unlock(&lazyfree_mutex);
+}
+
+/* Drop the 'refs' references to the element 'o' held by the value being
+ * released. Elements are always strings. */
+static void lazyfreeElement(robj *o, int refs) {
+    if (lazyfreeRefCount(o) != refs) {
+        lazyfreeDefer(o,refs);
+        return;
+    }
+    o->refcount = 1;
+    decrRefCount(o);
+}
+
+static void lazyfreeElementVoid(void *o) {
+    lazyfreeElement(o,1);
+}
+
+static void lazyfreeElementDestructor(void *privdata, void *o) {
+    DICT_NOTUSED(privdata);
+    if (o) lazyfreeElement(o,1);
+}
+
+static void lazyfreeObjectDestructor(void *privdata, void *o);
+void dictSdsDestructor(void *privdata, void *val);
+
+/* Only the destructors are used to release a dict. */
+static dictType lazyfreeSetDictType = {
+    NULL, NULL, NULL, NULL, lazyfreeElementDestructor, NULL
+};
+
+static dictType lazyfreeHashDictType = {
+    NULL, NULL, NULL, NULL, lazyfreeElementDestructor, lazyfreeElementDestructor
+};
+
+static dictType lazyfreeZsetDictType = {
+    NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static dictType lazyfreeDbDictType = {
+    NULL, NULL, NULL, NULL, dictSdsDestructor, lazyfreeObjectDestructor
+};
+
+static dictType lazyfreeArenaDictType = {
+    NULL, NULL, NULL, NULL, NULL, lazyfreeObjectDestructor
+};
+
+static void lazyfreeZset(zset *zs) {
+    zskiplistNode *node = zs->zsl->header->level[0].forward, *next;
+
+    /* Every element is referenced by both the dict and the skiplist. */
+    zs->dict->type = &lazyfreeZsetDictType;
+    dictRelease(zs->dict);
+    zfree(zs->zsl->header);
+    while(node) {
+        next = node->level[0].forward;
+        lazyfreeElement(node->obj,2);
+        zfree(node);
+        node = next;
+    }
+    zfree(zs->zsl);
+    zfree(zs);
+}
+
+/* Release a value unlinked from the keyspace. */
+static void lazyfreeFreeObject(robj *o) {
+    if (lazyfreeRefCount(o) != 1) {
+        /* Values of a flushed database may be shared as well. */
+        lazyfreeDefer(o,1);
+        return;
+    }
+    switch(o->encoding) {
+    case REDIS_ENCODING_LINKEDLIST:
+        ((list*)o->ptr)->free = lazyfreeElementVoid;
+        break;
+    case REDIS_ENCODING_HT:
+        ((dict*)o->ptr)->type = (o->type == REDIS_HASH) ?
+                                &lazyfreeHashDictType : &lazyfreeSetDictType;
+        break;
+    case REDIS_ENCODING_SKIPLIST:
+        lazyfreeZset(o->ptr);
+        freeObjectStruct(o);
+        return;
+    }
+    /* Now the value can be released as usual. */
+    decrRefCount(o);
+}
+
+static void lazyfreeObjectDestructor(void *privdata, void *o) {
+    DICT_NOTUSED(privdata);
+    if (o) lazyfreeFreeObject(o);
+}
+
+/* Called by the bio thread for REDIS_BIO_LAZY_FREE jobs. */
+void lazyfreeDoJob(void *arg) {
+    lazyfreeJob *job = arg;
+
+    if (job->obj) {
+        lazyfreeFreeObject(job->obj);
+    } else if (job->arena) {
+        /* Keys and entries belong to the arena: release only the values,
+         * then the whole arena. It is owned by the main thread, but this
+         * thread can drop it: emptyDbAsync() gave the db a new arena before
+         * submitting the job, so no other thread can reach this one anymore
+         * (see zslab_drop()). */
+        job->dict->type = &lazyfreeArenaDictType;
+        dictDrop(job->dict,NULL);
+        dictDrop(job->expires,NULL);
+        dictRelease(job->dict);
+        dictRelease(job->expires);
+        zarena_release(job->arena);
+    } else {
+        job->dict->type = &lazyfreeDbDictType;
+        dictRelease(job->expires);
+        dictRelease(job->dict);
+    }
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    lazyfree_pending_objects--;
+    lazyfree_pending_bytes -= job->bytes;
+    pthread_mutex_unlock(&lazyfree_mutex);
+    zfree(job);
+}
@@ -29,21 +29,117 @@
 
 #include "redis.h"
 #include <sys/uio.h>
+#include <limits.h>
 #include <math.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static void setProtocolError(redisClient *c, int pos);
+static void releaseQueryBuffer(sds s);
+
+/* Non zero while processEventsWhileBlocked() runs the event loop. */
+static int io_threads_blocked_loop = 0;
 
 /* To evaluate the output buffer size of a client we need to get size of
  * allocated objects, however we can't used zmalloc_size() directly on sds
  * strings because of the trick they use to work (the header is before the
  * returned pointer), so we use this helper function. */
 size_t zmalloc_size_sds(sds s) {
-    return zmalloc_size(s-sizeof(struct sdshdr));
+    return zmalloc_size(sdsAllocPtr(s));
+}
+
+/* ------------------------------ Reply chunks ------------------------------
+ *
+ * The reply list of a client is made of clientReplyBlock chunks. Replies
+ * are copied in byte chunks of REDIS_REPLY_CHUNK_BYTES (allocation size,
+ * header included), that are recycled through a pool shared by all the
+ * clients instead of being released, so that queueing and writing replies
+ * rarely calls the allocator. String objects of REDIS_REPLY_REF_MIN_BYTES
+ * or more are not copied but referenced by a reference chunk.
+ *
+ * The memory accounted in reply_bytes is the exact size of the chunk
+ * allocations (plus the referenced strings), so the output buffer limits
+ * see the real memory used by a client. */
+
+#define REDIS_REPLY_CHUNK_PAYLOAD \
+    (REDIS_REPLY_CHUNK_BYTES-sizeof(clientReplyBlock))
+
+static clientReplyBlock *reply_pool[REDIS_REPLY_POOL_MAX];
+static int reply_pool_len = 0;
+
+/* Return an empty byte chunk of REDIS_REPLY_CHUNK_PAYLOAD bytes. */
+static clientReplyBlock *createReplyChunk(void) {
+    clientReplyBlock *b;
+
+    if (reply_pool_len) {
+        b = reply_pool[--reply_pool_len];
+    } else {
+        b = zmalloc(REDIS_REPLY_CHUNK_BYTES);
+        b->obj = NULL;
+        b->size = REDIS_REPLY_CHUNK_PAYLOAD;
+        b->memory = zmalloc_size(b);
+    }
+    b->used = 0;
+    return b;
+}
+
+/* Return a byte chunk of exactly 'len' bytes, holding 's'. */
+static clientReplyBlock *createSizedReplyChunk(const char *s, size_t len) {
+    clientReplyBlock *b = zmalloc(sizeof(*b)+len);
+
+    b->obj = NULL;
+    b->size = b->used = len;
+    b->memory = zmalloc_size(b);
+    memcpy(b->buf,s,len);
+    return b;
+}
+
+/* Return a reference chunk for 'o', taking ownership of the reference. */
+static clientReplyBlock *createReplyReference(robj *o) {
+    clientReplyBlock *b = zmalloc(sizeof(*b));
+
+    b->obj = o;
+    b->size = b->used = 0;
+    b->memory = zmalloc_size(b)+getStringObjectSdsUsedMemory(o);
+    return b;
 }
 
+/* List free method of the reply list: chunks of the pool size go back to
+ * the pool. */
+void freeClientReplyValue(void *o) {
+    clientReplyBlock *b = o;
+
+    if (b == NULL) return; /* See addDeferredMultiBulkLength(). */
+    if (b->obj) {
+        decrRefCount(b->obj);
+        zfree(b);
+    } else if (b->size == REDIS_REPLY_CHUNK_PAYLOAD &&
+               reply_pool_len < REDIS_REPLY_POOL_MAX)
+    {
+        reply_pool[reply_pool_len++] = b;
+    } else {
+        zfree(b);
+    }
+}
+
+/* List dup method of the reply list, see copyClientOutputBuffer(). */
 void *dupClientReplyValue(void *o) {
-    incrRefCount((robj*)o);
-    return o;
+    clientReplyBlock *b = o, *copy;
+
+    if (b->obj) {
+        incrRefCount(b->obj);
+        copy = createReplyReference(b->obj);
+        copy->memory = b->memory;
+    } else if (b->size == REDIS_REPLY_CHUNK_PAYLOAD) {
+        copy = createReplyChunk();
+        memcpy(copy->buf,b->buf,b->used);
+        copy->used = b->used;
+    } else {
+        copy = createSizedReplyChunk(b->buf,b->used);
+    }
+    return copy;
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -76,7 +172,7 @@ redisClient *createClient(int fd) {
     c->fd = fd;
     c->name = NULL;
     c->bufpos = 0;
-    c->querybuf = sdsempty();
+    c->querybuf = NULL; /* See clientBorrowQueryBuffer(). */
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
@@ -85,6 +181,7 @@ redisClient *createClient(int fd) {
     c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
+    c->sentnodes = 0;
     c->flags = 0;
     c->ctime = c->lastinteraction = server.unixtime;
     c->authenticated = 0;
@@ -96,7 +193,7 @@ redisClient *createClient(int fd) {
     c->reply = listCreate();
     c->reply_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
-    listSetFreeMethod(c->reply,decrRefCountVoid);
+    listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
     c->bpop.keys = dictCreate(&setDictType,NULL);
     c->bpop.timeout = 0;
@@ -125,7 +222,13 @@ redisClient *createClient(int fd) {
  *
  * Typically gets called every time a reply is built, before adding more
  * data to the clients output buffers. If the function returns REDIS_ERR no
- * data should be appended to the output buffers. */
+ * data should be appended to the output buffers.
+ *
+ * With I/O threads the write handler is not installed: the client is queued
+ * in server.clients_pending_write, and handleClientsWithPendingWrites()
+ * writes the replies of all the queued clients in parallel before returning
+ * to the event loop, installing the handler only if the socket could not
+ * take everything. */
 int prepareClientToWrite(redisClient *c) {
     if (c->flags & REDIS_LUA_CLIENT) return REDIS_OK;
     if ((c->flags & REDIS_MASTER) &&
@@ -133,26 +236,20 @@ int prepareClientToWrite(redisClient *c) {
     if (c->fd <= 0) return REDIS_ERR; /* Fake client */
     if (c->bufpos == 0 && listLength(c->reply) == 0 &&
         (c->replstate == REDIS_REPL_NONE ||
-         c->replstate == REDIS_REPL_ONLINE) &&
-        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
-        sendReplyToClient, c) == AE_ERR) return REDIS_ERR;
-    return REDIS_OK;
-}
-
-/* Create a duplicate of the last object in the reply list when
- * it is not exclusively owned by the reply list. */
-robj *dupLastObjectIfNeeded(list *reply) {
-    robj *new, *cur;
-    listNode *ln;
-    redisAssert(listLength(reply) > 0);
-    ln = listLast(reply);
-    cur = listNodeValue(ln);
-    if (cur->refcount > 1) {
-        new = dupStringObject(cur);
-        decrRefCount(cur);
-        listNodeValue(ln) = new;
+         c->replstate == REDIS_REPL_ONLINE))
+    {
+        if (server.io_threads_num > 1) {
+            if (!(c->flags & REDIS_PENDING_WRITE)) {
+                c->flags |= REDIS_PENDING_WRITE;
+                listAddNodeTail(server.clients_pending_write,c);
+            }
+        } else if (aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+                   sendReplyToClient, c) == AE_ERR)
+        {
+            return REDIS_ERR;
+        }
     }
-    return listNodeValue(ln);
+    return REDIS_OK;
 }
 
 /* -----------------------------------------------------------------------------
@@ -176,96 +273,84 @@ int _addReplyToBuffer(redisClient *c, char *s, size_t len) {
     return REDIS_OK;
 }
 
-void _addReplyObjectToList(redisClient *c, robj *o) {
-    robj *tail;
+/* Copy 's' at the end of the reply list: the free space of the last byte
+ * chunk is filled first, then chunks are taken from the pool.
+ *
+ * The functions adding to the reply list may be called by write commands,
+ * that run in the persistent scope of zmalloc when the keyspace is in the
+ * persistent heap (see pheapDbBeginCommand()). Replies are transient, so
+ * they leave the scope while allocating. */
+void _addReplyStringToList(redisClient *c, char *s, size_t len) {
+    listNode *ln = listLast(c->reply);
+    clientReplyBlock *tail = ln ? listNodeValue(ln) : NULL;
+    size_t n;
+    int persistent;
 
     if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
 
-    if (listLength(c->reply) == 0) {
-        incrRefCount(o);
-        listAddNodeTail(c->reply,o);
-        c->reply_bytes += zmalloc_size_sds(o->ptr);
-    } else {
-        tail = listNodeValue(listLast(c->reply));
+    if (tail && tail->obj == NULL && tail->used < tail->size) {
+        n = tail->size-tail->used;
+        if (n > len) n = len;
+        memcpy(tail->buf+tail->used,s,n);
+        tail->used += n;
+        s += n;
+        len -= n;
+    }
+    persistent = zmalloc_set_persistent_scope(0);
+    while(len) {
+        tail = createReplyChunk();
+        n = len < tail->size ? len : tail->size;
+        memcpy(tail->buf,s,n);
+        tail->used = n;
+        listAddNodeTail(c->reply,tail);
+        c->reply_bytes += tail->memory;
+        s += n;
+        len -= n;
+    }
+    zmalloc_set_persistent_scope(persistent);
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
 
-        /* Append to this object when possible. */
-        if (tail->ptr != NULL &&
-            sdslen(tail->ptr)+sdslen(o->ptr) <= REDIS_REPLY_CHUNK_BYTES)
-        {
-            c->reply_bytes -= zmalloc_size_sds(tail->ptr);
-            tail = dupLastObjectIfNeeded(c->reply);
-            tail->ptr = sdscatlen(tail->ptr,o->ptr,sdslen(o->ptr));
-            c->reply_bytes += zmalloc_size_sds(tail->ptr);
-        } else {
-            incrRefCount(o);
-            listAddNodeTail(c->reply,o);
-            c->reply_bytes += zmalloc_size_sds(o->ptr);
-        }
+void _addReplyObjectToList(redisClient *c, robj *o) {
+    clientReplyBlock *b;
+    int persistent;
+
+    if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
+
+    if (sdslen(o->ptr) < REDIS_REPLY_REF_MIN_BYTES) {
+        _addReplyStringToList(c,o->ptr,sdslen(o->ptr));
+        return;
     }
+    incrRefCount(o);
+    persistent = zmalloc_set_persistent_scope(0);
+    b = createReplyReference(o);
+    listAddNodeTail(c->reply,b);
+    zmalloc_set_persistent_scope(persistent);
+    c->reply_bytes += b->memory;
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
 /* This method takes responsibility over the sds. When it is no longer
  * needed it will be free'd, otherwise it ends up in a robj. */
 void _addReplySdsToList(redisClient *c, sds s) {
-    robj *tail;
+    clientReplyBlock *b;
+    int persistent;
 
     if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
         sdsfree(s);
         return;
     }
 
-    if (listLength(c->reply) == 0) {
-        listAddNodeTail(c->reply,createObject(REDIS_STRING,s));
-        c->reply_bytes += zmalloc_size_sds(s);
-    } else {
-        tail = listNodeValue(listLast(c->reply));
-
-        /* Append to this object when possible. */
-        if (tail->ptr != NULL &&
-            sdslen(tail->ptr)+sdslen(s) <= REDIS_REPLY_CHUNK_BYTES)
-        {
-            c->reply_bytes -= zmalloc_size_sds(tail->ptr);
-            tail = dupLastObjectIfNeeded(c->reply);
-            tail->ptr = sdscatlen(tail->ptr,s,sdslen(s));
-            c->reply_bytes += zmalloc_size_sds(tail->ptr);
-            sdsfree(s);
-        } else {
-            listAddNodeTail(c->reply,createObject(REDIS_STRING,s));
-            c->reply_bytes += zmalloc_size_sds(s);
-        }
-    }
-    asyncCloseClientOnOutputBufferLimitReached(c);
-}
-
-void _addReplyStringToList(redisClient *c, char *s, size_t len) {
-    robj *tail;
-
-    if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
-
-    if (listLength(c->reply) == 0) {
-        robj *o = createStringObject(s,len);
-
-        listAddNodeTail(c->reply,o);
-        c->reply_bytes += zmalloc_size_sds(o->ptr);
-    } else {
-        tail = listNodeValue(listLast(c->reply));
-
-        /* Append to this object when possible. */
-        if (tail->ptr != NULL &&
-            sdslen(tail->ptr)+len <= REDIS_REPLY_CHUNK_BYTES)
-        {
-            c->reply_bytes -= zmalloc_size_sds(tail->ptr);
-            tail = dupLastObjectIfNeeded(c->reply);
-            tail->ptr = sdscatlen(tail->ptr,s,len);
-            c->reply_bytes += zmalloc_size_sds(tail->ptr);
-        } else {
-            robj *o = createStringObject(s,len);
-
-            listAddNodeTail(c->reply,o);
-            c->reply_bytes += zmalloc_size_sds(o->ptr);
-        }
+    if (sdslen(s) < REDIS_REPLY_REF_MIN_BYTES) {
+        _addReplyStringToList(c,s,sdslen(s));
+        sdsfree(s);
+        return;
     }
+    persistent = zmalloc_set_persistent_scope(0);
+    b = createReplyReference(createObject(REDIS_STRING,s));
+    listAddNodeTail(c->reply,b);
+    zmalloc_set_persistent_scope(persistent);
+    c->reply_bytes += b->memory;
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
@@ -283,9 +368,17 @@ void addReply(redisClient *c, robj *obj) {
      *
      * If the encoding is RAW and there is room in the static buffer
      * we'll be able to send the object to the client without
-     * messing with its page. */
-    if (obj->encoding == REDIS_ENCODING_RAW) {
-        if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != REDIS_OK)
+     * messing with its page.
+     *
+     * Large values are never copied instead: the reply list references
+     * the object and the value is written to the socket directly from its
+     * buffer. Touching the page of the object costs less than copying the
+     * value, and there is no transient copy counted against maxmemory.
+     * If the key is modified before the write completes, the command gets
+     * a copy from dbUnshareStringValue() since the object is shared. */
+    if (sdsEncodedObject(obj)) {
+        if (sdslen(obj->ptr) >= REDIS_REPLY_REF_MIN_BYTES ||
+            _addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != REDIS_OK)
             _addReplyObjectToList(c,obj);
     } else if (obj->encoding == REDIS_ENCODING_INT) {
         /* Optimization: if there is room in the static buffer for 32 bytes
@@ -316,7 +409,9 @@ void addReplySds(redisClient *c, sds s) {
         sdsfree(s);
         return;
     }
-    if (_addReplyToBuffer(c,s,sdslen(s)) == REDIS_OK) {
+    if (sdslen(s) < REDIS_REPLY_REF_MIN_BYTES &&
+        _addReplyToBuffer(c,s,sdslen(s)) == REDIS_OK)
+    {
         sdsfree(s);
     } else {
         /* This method free's the sds when it is no longer needed. */
@@ -378,36 +473,50 @@ void addReplyStatusFormat(redisClient *c, const char *fmt, ...) {
 /* Adds an empty object to the reply list that will contain the multi bulk
  * length, which is not known when this function is called. */
 void *addDeferredMultiBulkLength(redisClient *c) {
+    int persistent;
+
     /* Note that we install the write event here even if the object is not
      * ready to be sent, since we are sure that before returning to the
-     * event loop setDeferredMultiBulkLength() will be called. */
+     * event loop setDeferredMultiBulkLength() will be called. The node has
+     * no chunk until then. */
     if (prepareClientToWrite(c) != REDIS_OK) return NULL;
-    listAddNodeTail(c->reply,createObject(REDIS_STRING,NULL));
+    persistent = zmalloc_set_persistent_scope(0);
+    listAddNodeTail(c->reply,NULL);
+    zmalloc_set_persistent_scope(persistent);
     return listLast(c->reply);
 }
 
-/* Populate the length object and try gluing it to the next chunk. */
+/* Populate the length, storing it in the free space of the previous chunk
+ * or at the start of the next one when possible, so that a chunk is
+ * allocated for it only when both are full. */
 void setDeferredMultiBulkLength(redisClient *c, void *node, long length) {
     listNode *ln = (listNode*)node;
-    robj *len, *next;
+    clientReplyBlock *prev, *next, *b;
+    char lenstr[32];
+    size_t len;
 
     /* Abort when *node is NULL (see addDeferredMultiBulkLength). */
     if (node == NULL) return;
 
-    len = listNodeValue(ln);
-    len->ptr = sdscatprintf(sdsempty(),"*%ld\r\n",length);
-    c->reply_bytes += zmalloc_size_sds(len->ptr);
-    if (ln->next != NULL) {
-        next = listNodeValue(ln->next);
-
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next->ptr != NULL) {
-            c->reply_bytes -= zmalloc_size_sds(len->ptr);
-            c->reply_bytes -= zmalloc_size_sds(next->ptr);
-            len->ptr = sdscatlen(len->ptr,next->ptr,sdslen(next->ptr));
-            c->reply_bytes += zmalloc_size_sds(len->ptr);
-            listDelNode(c->reply,ln->next);
-        }
+    len = snprintf(lenstr,sizeof(lenstr),"*%ld\r\n",length);
+    prev = ln->prev ? listNodeValue(ln->prev) : NULL;
+    next = ln->next ? listNodeValue(ln->next) : NULL;
+    if (prev && prev->obj == NULL && prev->size-prev->used >= len) {
+        memcpy(prev->buf+prev->used,lenstr,len);
+        prev->used += len;
+        listDelNode(c->reply,ln);
+    } else if (next && next->obj == NULL && next->size-next->used >= len) {
+        memmove(next->buf+len,next->buf,next->used);
+        memcpy(next->buf,lenstr,len);
+        next->used += len;
+        listDelNode(c->reply,ln);
+    } else {
+        int persistent = zmalloc_set_persistent_scope(0);
+
+        b = createSizedReplyChunk(lenstr,len);
+        zmalloc_set_persistent_scope(persistent);
+        listNodeValue(ln) = b;
+        c->reply_bytes += b->memory;
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
@@ -471,7 +580,7 @@ void addReplyMultiBulkLen(redisClient *c, long length) {
 void addReplyBulkLen(redisClient *c, robj *obj) {
     size_t len;
 
-    if (obj->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(obj)) {
         len = sdslen(obj->ptr);
     } else {
         long n = (long)obj->ptr;
@@ -670,7 +779,7 @@ void freeClient(redisClient *c) {
     }
 
     /* Free the query buffer */
-    sdsfree(c->querybuf);
+    releaseQueryBuffer(c->querybuf);
     c->querybuf = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
@@ -734,6 +843,9 @@ void freeClient(redisClient *c) {
      * we lost the connection with the master. */
     if (c->flags & REDIS_MASTER) replicationHandleMasterDisconnection();
 
+    /* Remove from the queues of the I/O threads. */
+    unlinkClientFromPendingLists(c);
+
     /* If this client was scheduled for async freeing we need to remove it
      * from the queue. */
     if (c->flags & REDIS_CLOSE_ASAP) {
@@ -761,6 +873,25 @@ void freeClientAsync(redisClient *c) {
     listAddNodeTail(server.clients_to_close,c);
 }
 
+/* Remove 'c' from the lists of clients waiting for the I/O threads. Called
+ * when the client is freed, or its connection cached (for masters). */
+void unlinkClientFromPendingLists(redisClient *c) {
+    listNode *ln;
+
+    if (c->flags & REDIS_PENDING_WRITE) {
+        ln = listSearchKey(server.clients_pending_write,c);
+        redisAssert(ln != NULL);
+        listDelNode(server.clients_pending_write,ln);
+        c->flags &= ~REDIS_PENDING_WRITE;
+    }
+    if (c->flags & REDIS_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        redisAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~REDIS_PENDING_READ;
+    }
+}
+
 void freeClientsInAsyncFreeQueue(void) {
     while (listLength(server.clients_to_close)) {
         listNode *ln = listFirst(server.clients_to_close);
@@ -772,49 +903,100 @@ void freeClientsInAsyncFreeQueue(void) {
     }
 }
 
-void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    redisClient *c = privdata;
-    int nwritten = 0, totwritten = 0, objlen;
-    size_t objmem;
-    robj *o;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
+/* Write to the socket of 'c' as much as possible of its output buffers,
+ * up to REDIS_MAX_WRITE_PER_EVENT bytes. Nothing is released here: the
+ * reply list nodes completely written are counted in c->sentnodes, and
+ * c->sentlen is the offset in the static buffer, or in the first node not
+ * completely written. This is the part of writeToClient() the I/O threads
+ * perform, so it must not touch anything but the client: the objects
+ * referenced by the reply list may be shared with other clients, and
+ * their reference count, like the pool of the chunks, can only be changed
+ * by the main thread.
+ *
+ * The static buffer and up to IOV_MAX list nodes are gathered in a single
+ * writev(2) call, so that a reply made of many objects (LRANGE, pipelined
+ * commands) does not cost a system call for every object.
+ *
+ * Returns the number of bytes written, or -1 on errors (with errno set). */
+static ssize_t _writeToClient(redisClient *c) {
+    struct iovec iov[IOV_MAX];
+    ssize_t nwritten = 0, totwritten = 0;
+    listNode *ln = listFirst(c->reply);
+
+    while(1) {
+        listNode *next;
+        size_t iovbytes = 0, offset, left;
+        int iovcnt = 0;
+
+        /* Skip the empty chunks at the head of the list. */
+        while(c->bufpos == 0 && ln &&
+              replyBlockLen((clientReplyBlock*)listNodeValue(ln)) == 0)
+        {
+            c->sentnodes++;
+            ln = listNextNode(ln);
+        }
+        if (c->bufpos == 0 && ln == NULL) break;
 
-    while(c->bufpos > 0 || listLength(c->reply)) {
+        /* Gather the buffer and the chunks, from the first byte not yet
+         * written, up to REDIS_MAX_WRITE_PER_EVENT bytes. */
+        offset = c->sentlen;
         if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if (c->sentlen == c->bufpos) {
+            iov[iovcnt].iov_base = c->buf+c->sentlen;
+            iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+            iovbytes += iov[iovcnt++].iov_len;
+            offset = 0;
+        }
+        for (next = ln; next && iovcnt < IOV_MAX &&
+                        iovbytes < REDIS_MAX_WRITE_PER_EVENT;
+             next = listNextNode(next))
+        {
+            clientReplyBlock *b = listNodeValue(next);
+
+            if (replyBlockLen(b) == 0) continue;
+            iov[iovcnt].iov_base = replyBlockData(b)+offset;
+            iov[iovcnt].iov_len = replyBlockLen(b)-offset;
+            iovbytes += iov[iovcnt++].iov_len;
+            offset = 0;
+        }
+
+        if (iovcnt == 1)
+            nwritten = write(c->fd,iov[0].iov_base,iov[0].iov_len);
+        else
+            nwritten = writev(c->fd,iov,iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+
+        /* Advance past what was written: first the static buffer, then the
+         * chunks, counting the ones completely written. */
+        left = nwritten;
+        if (c->bufpos > 0) {
+            if (left < (size_t)(c->bufpos-c->sentlen)) {
+                c->sentlen += left;
+                left = 0;
+            } else {
+                left -= c->bufpos-c->sentlen;
                 c->bufpos = 0;
                 c->sentlen = 0;
             }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = sdslen(o->ptr);
-            objmem = zmalloc_size_sds(o->ptr);
+        }
+        while(left && ln) {
+            clientReplyBlock *b = listNodeValue(ln);
+            size_t blocklen = replyBlockLen(b);
 
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
+            if (left < blocklen-c->sentlen) {
+                c->sentlen += left;
+                break;
             }
+            left -= blocklen-c->sentlen;
+            c->sentlen = 0;
+            c->sentnodes++;
+            ln = listNextNode(ln);
+        }
 
-            nwritten = write(fd, ((char*)o->ptr)+c->sentlen,objlen-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+        /* A short write means the socket buffer is full: don't wait for
+         * EAGAIN from one more call. */
+        if ((size_t)nwritten < iovbytes) break;
 
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                c->reply_bytes -= objmem;
-            }
-        }
         /* Note that we avoid to send more than REDIS_MAX_WRITE_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -827,16 +1009,7 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory)) break;
     }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            redisLog(REDIS_VERBOSE,
-                "Error writing to client: %s", strerror(errno));
-            freeClient(c);
-            return;
-        }
-    }
+    if (nwritten == -1 && errno != EAGAIN) return -1;
     if (totwritten > 0) {
         /* For clients representing masters we don't count sending data
          * as an interaction, since we always send REPLCONF ACK commands
@@ -844,13 +1017,60 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
          * We just rely on data / pings received for timeout detection. */
         if (!(c->flags & REDIS_MASTER)) c->lastinteraction = server.unixtime;
     }
+    return totwritten;
+}
+
+/* Complete in the main thread a write performed by _writeToClient(),
+ * releasing the reply list nodes that were written. Once everything was
+ * sent the write handler is removed, if installed, and the client closed
+ * if it was waiting for the reply to be sent. Returns REDIS_ERR if the
+ * client was freed. */
+static int _writeToClientDone(redisClient *c, int handler_installed) {
+    while(c->sentnodes) {
+        listNode *ln = listFirst(c->reply);
+        clientReplyBlock *b = listNodeValue(ln);
+
+        c->reply_bytes -= b->memory;
+        listDelNode(c->reply,ln);
+        c->sentnodes--;
+    }
+    if (c->flags & REDIS_IO_ERROR) {
+        freeClient(c);
+        return REDIS_ERR;
+    }
     if (c->bufpos == 0 && listLength(c->reply) == 0) {
         c->sentlen = 0;
-        aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+        if (handler_installed) aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
 
         /* Close connection after entire reply has been sent. */
-        if (c->flags & REDIS_CLOSE_AFTER_REPLY) freeClient(c);
+        if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
+            freeClient(c);
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+/* Write the output buffers of 'c' to its socket. When called by the write
+ * handler 'handler_installed' is true, and the handler is removed once
+ * there is nothing left to write. Returns REDIS_ERR if the client was
+ * freed because of an error, or because it had to be closed after the
+ * reply. */
+int writeToClient(redisClient *c, int handler_installed) {
+    if (_writeToClient(c) == -1) {
+        redisLog(REDIS_VERBOSE,
+            "Error writing to client: %s", strerror(errno));
+        c->flags |= REDIS_IO_ERROR;
     }
+    return _writeToClientDone(c,handler_installed);
+}
+
+/* Write event handler. */
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+    writeToClient(privdata,1);
 }
 
 /* resetClient prepare the client to process the next command */
@@ -935,10 +1155,34 @@ static void setProtocolError(redisClient *c, int pos) {
     sdsrange(c->querybuf,pos,-1);
 }
 
+/* Store a command argument parsed by processMultibulkBuffer() in c->argv.
+ * Objects are allocated from a slab cache only the main thread can use, so
+ * when the query is parsed by an I/O thread (REDIS_PENDING_READ) the bare
+ * sds string is stored instead, and createArgvObjects() turns the
+ * arguments into objects once back in the main thread. */
+static void addArgvString(redisClient *c, sds s) {
+    if (c->flags & REDIS_PENDING_READ)
+        ((sds*)c->argv)[c->argc++] = s;
+    else
+        c->argv[c->argc++] = createObject(REDIS_STRING,s);
+}
+
+/* Turn into objects the arguments parsed by an I/O thread. */
+static void createArgvObjects(redisClient *c) {
+    int j;
+
+    for (j = 0; j < c->argc; j++)
+        c->argv[j] = createObject(REDIS_STRING,((sds*)c->argv)[j]);
+}
+
+/* Parse a multi bulk query. I/O threads can't reply: on protocol errors
+ * they just stop, leaving the query to the main thread that will parse it
+ * again from the same point, this time reporting the error. */
 int processMultibulkBuffer(redisClient *c) {
     char *newline = NULL;
     int pos = 0, ok;
     long long ll;
+    int threaded = c->flags & REDIS_PENDING_READ;
 
     if (c->multibulklen == 0) {
         /* The client should have been reset */
@@ -948,6 +1192,7 @@ int processMultibulkBuffer(redisClient *c) {
         newline = strchr(c->querybuf,'\r');
         if (newline == NULL) {
             if (sdslen(c->querybuf) > REDIS_INLINE_MAX_SIZE) {
+                if (threaded) return REDIS_ERR;
                 addReplyError(c,"Protocol error: too big mbulk count string");
                 setProtocolError(c,0);
             }
@@ -963,6 +1208,7 @@ int processMultibulkBuffer(redisClient *c) {
         redisAssertWithInfo(c,NULL,c->querybuf[0] == '*');
         ok = string2ll(c->querybuf+1,newline-(c->querybuf+1),&ll);
         if (!ok || ll > 1024*1024) {
+            if (threaded) return REDIS_ERR;
             addReplyError(c,"Protocol error: invalid multibulk length");
             setProtocolError(c,pos);
             return REDIS_ERR;
@@ -988,6 +1234,7 @@ int processMultibulkBuffer(redisClient *c) {
             newline = strchr(c->querybuf+pos,'\r');
             if (newline == NULL) {
                 if (sdslen(c->querybuf) > REDIS_INLINE_MAX_SIZE) {
+                    if (threaded) break;
                     addReplyError(c,
                         "Protocol error: too big bulk count string");
                     setProtocolError(c,0);
@@ -1001,6 +1248,7 @@ int processMultibulkBuffer(redisClient *c) {
                 break;
 
             if (c->querybuf[pos] != '$') {
+                if (threaded) break;
                 addReplyErrorFormat(c,
                     "Protocol error: expected '$', got '%c'",
                     c->querybuf[pos]);
@@ -1010,6 +1258,7 @@ int processMultibulkBuffer(redisClient *c) {
 
             ok = string2ll(c->querybuf+pos+1,newline-(c->querybuf+pos+1),&ll);
             if (!ok || ll < 0 || ll > 512*1024*1024) {
+                if (threaded) break;
                 addReplyError(c,"Protocol error: invalid bulk length");
                 setProtocolError(c,pos);
                 return REDIS_ERR;
@@ -1046,16 +1295,15 @@ int processMultibulkBuffer(redisClient *c) {
                 c->bulklen >= REDIS_MBULK_BIG_ARG &&
                 (signed) sdslen(c->querybuf) == c->bulklen+2)
             {
-                c->argv[c->argc++] = createObject(REDIS_STRING,c->querybuf);
                 sdsIncrLen(c->querybuf,-2); /* remove CRLF */
+                addArgvString(c,c->querybuf);
                 c->querybuf = sdsempty();
                 /* Assume that if we saw a fat argument we'll see another one
                  * likely... */
                 c->querybuf = sdsMakeRoomFor(c->querybuf,c->bulklen+2);
                 pos = 0;
             } else {
-                c->argv[c->argc++] =
-                    createStringObject(c->querybuf+pos,c->bulklen);
+                addArgvString(c,sdsnewlen(c->querybuf+pos,c->bulklen));
                 pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1073,16 +1321,69 @@ int processMultibulkBuffer(redisClient *c) {
     return REDIS_ERR;
 }
 
+/* ----------------------------- Query buffers -----------------------------
+ *
+ * A client owns a query buffer only while it has a query to process: the
+ * buffer is taken from a pool shared by all the clients before reading from
+ * the socket, and given back once processInputBuffer() consumed it, so that
+ * idle connections use no query buffer at all. A client keeps its buffer as
+ * long as it holds a partially read command. The pool is only accessed by
+ * the main thread: the clients read by the I/O threads get their buffer
+ * when they are queued, see postponeClientRead(). */
+
+static sds querybuf_pool[REDIS_QUERYBUF_POOL_MAX];
+static int querybuf_pool_len = 0;
+
+int queryBufferPoolSize(void) {
+    return querybuf_pool_len;
+}
+
+/* Put 's' in the pool, or free it if the pool is full, or if it is too small
+ * or too big to be reused for any client. */
+static void releaseQueryBuffer(sds s) {
+    if (s == NULL) return;
+    sdsclear(s);
+    if (querybuf_pool_len == REDIS_QUERYBUF_POOL_MAX ||
+        sdsavail(s) < REDIS_IOBUF_LEN || sdsavail(s) > REDIS_IOBUF_LEN*4)
+    {
+        sdsfree(s);
+    } else {
+        querybuf_pool[querybuf_pool_len++] = s;
+    }
+}
+
+/* Make sure 'c' has a query buffer before reading from its socket. */
+static void clientBorrowQueryBuffer(redisClient *c) {
+    if (c->querybuf) return;
+    if (querybuf_pool_len) {
+        c->querybuf = querybuf_pool[--querybuf_pool_len];
+        server.stat_querybuf_pool_hits++;
+    } else {
+        c->querybuf = sdsnewlen(NULL,REDIS_IOBUF_LEN);
+        sdsclear(c->querybuf);
+        server.stat_querybuf_pool_misses++;
+    }
+}
+
+/* Give the query buffer of 'c' back to the pool if there is nothing left to
+ * process in it, and no command is partially read. */
+static void clientReleaseQueryBuffer(redisClient *c) {
+    if (c->querybuf == NULL || sdslen(c->querybuf) || c->multibulklen)
+        return;
+    releaseQueryBuffer(c->querybuf);
+    c->querybuf = NULL;
+}
+
 void processInputBuffer(redisClient *c) {
     /* Keep processing while there is something in the input buffer */
-    while(sdslen(c->querybuf)) {
+    while(c->querybuf && sdslen(c->querybuf)) {
         /* Immediately abort if the client is in the middle of something. */
-        if (c->flags & REDIS_BLOCKED) return;
+        if (c->flags & REDIS_BLOCKED) break;
 
         /* REDIS_CLOSE_AFTER_REPLY closes the connection once the reply is
          * written to the client. Make sure to not let the reply grow after
          * this flag has been set (i.e. don't process more commands). */
-        if (c->flags & REDIS_CLOSE_AFTER_REPLY) return;
+        if (c->flags & REDIS_CLOSE_AFTER_REPLY) break;
 
         /* Determine request type when unknown. */
         if (!c->reqtype) {
@@ -1110,16 +1411,17 @@ void processInputBuffer(redisClient *c) {
                 resetClient(c);
         }
     }
+    clientReleaseQueryBuffer(c);
 }
 
-void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    redisClient *c = (redisClient*) privdata;
+/* Read from the socket of 'c' into its query buffer. This is the part of
+ * readQueryFromClient() the I/O threads perform. Returns the number of bytes
+ * read, 0 if there was nothing to read, or -1 if the connection was closed
+ * or an error occurred. */
+static int _readQueryFromClient(redisClient *c) {
     int nread, readlen;
     size_t qblen;
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
 
-    server.current_client = c;
     readlen = REDIS_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
@@ -1138,28 +1440,24 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
-    nread = read(fd, c->querybuf+qblen, readlen);
+    nread = read(c->fd, c->querybuf+qblen, readlen);
     if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
-        } else {
-            redisLog(REDIS_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
-            return;
-        }
+        if (errno == EAGAIN) return 0;
+        redisLog(REDIS_VERBOSE, "Reading from client: %s",strerror(errno));
+        return -1;
     } else if (nread == 0) {
         redisLog(REDIS_VERBOSE, "Client closed connection");
-        freeClient(c);
-        return;
-    }
-    if (nread) {
-        sdsIncrLen(c->querybuf,nread);
-        c->lastinteraction = server.unixtime;
-        if (c->flags & REDIS_MASTER) c->reploff += nread;
-    } else {
-        server.current_client = NULL;
-        return;
+        return -1;
     }
+    sdsIncrLen(c->querybuf,nread);
+    c->lastinteraction = server.unixtime;
+    if (c->flags & REDIS_MASTER) c->reploff += nread;
+    return nread;
+}
+
+/* Close the client if its query buffer is over the limit. Returns REDIS_ERR
+ * if the client was freed. */
+static int checkClientQueryBufferLimit(redisClient *c) {
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1167,9 +1465,60 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         redisLog(REDIS_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
+        freeClient(c);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* When the I/O threads are active and also read queries, the read handler
+ * just queues the client in server.clients_pending_read, and
+ * handleClientsWithPendingReads() reads and parses the queries of all the
+ * queued clients in parallel before returning to the event loop. Returns
+ * 1 if the read must not be performed now. */
+static int postponeClientRead(redisClient *c) {
+    /* Already queued: the query will be read and executed soon. */
+    if (c->flags & REDIS_PENDING_READ) return 1;
+
+    /* Masters, slaves and clients in the middle of something are served by
+     * the main thread, like every client while the event loop is blocked
+     * in processEventsWhileBlocked(). */
+    if (!server.io_threads_active || !server.io_threads_do_reads ||
+        io_threads_blocked_loop ||
+        c->flags & (REDIS_MASTER|REDIS_SLAVE|REDIS_BLOCKED|
+                    REDIS_CLOSE_AFTER_REPLY)) return 0;
+
+    c->flags |= REDIS_PENDING_READ;
+    clientBorrowQueryBuffer(c);
+    listAddNodeTail(server.clients_pending_read,c);
+    return 1;
+}
+
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    redisClient *c = (redisClient*) privdata;
+    int nread;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+
+    if (postponeClientRead(c)) return;
+
+    server.current_client = c;
+    clientBorrowQueryBuffer(c);
+    nread = _readQueryFromClient(c);
+    if (nread == -1) {
         freeClient(c);
         return;
     }
+    if (nread == 0) {
+        clientReleaseQueryBuffer(c);
+        server.current_client = NULL;
+        return;
+    }
+    if (checkClientQueryBufferLimit(c) == REDIS_ERR) {
+        server.current_client = NULL;
+        return;
+    }
     processInputBuffer(c);
     server.current_client = NULL;
 }
@@ -1186,7 +1535,8 @@ void getClientsMaxBuffers(unsigned long *longest_output_list,
         c = listNodeValue(ln);
 
         if (listLength(c->reply) > lol) lol = listLength(c->reply);
-        if (sdslen(c->querybuf) > bib) bib = sdslen(c->querybuf);
+        if (c->querybuf && sdslen(c->querybuf) > bib)
+            bib = sdslen(c->querybuf);
     }
     *longest_output_list = lol;
     *biggest_input_buffer = bib;
@@ -1288,8 +1638,8 @@ sds catClientInfoString(sds s, redisClient *client) {
         (int) dictSize(client->pubsub_channels),
         (int) listLength(client->pubsub_patterns),
         (client->flags & REDIS_MULTI) ? client->mstate.count : -1,
-        (unsigned long long) sdslen(client->querybuf),
-        (unsigned long long) sdsavail(client->querybuf),
+        (unsigned long long) (client->querybuf ? sdslen(client->querybuf) : 0),
+        (unsigned long long) (client->querybuf ? sdsavail(client->querybuf) : 0),
         (unsigned long long) client->bufpos,
         (unsigned long long) listLength(client->reply),
         (unsigned long long) getClientOutputBufferMemoryUsage(client),
@@ -1511,9 +1861,7 @@ void rewriteClientCommandArgument(redisClient *c, int i, robj *newval) {
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(redisClient *c) {
-    unsigned long list_item_size = sizeof(listNode)+sizeof(robj);
-
-    return c->reply_bytes + (list_item_size*listLength(c->reply));
+    return c->reply_bytes + (sizeof(listNode)*listLength(c->reply));
 }
 
 /* Get the class of a client, used in order to enforce limits to different
@@ -1619,7 +1967,7 @@ void flushSlavesOutputBuffers(void) {
         int events;
 
         events = aeGetFileEvents(server.el,slave->fd);
-        if (events & AE_WRITABLE &&
+        if ((events & AE_WRITABLE || slave->flags & REDIS_PENDING_WRITE) &&
             slave->replstate == REDIS_REPL_ONLINE &&
             listLength(slave->reply))
         {
@@ -1643,10 +1991,279 @@ void flushSlavesOutputBuffers(void) {
 int processEventsWhileBlocked(void) {
     int iterations = 4; /* See the function top-comment. */
     int count = 0;
+    int persistent;
+
+    /* beforeSleep() is not called here, so the replies queued for the I/O
+     * threads are written by the main thread after every iteration. The
+     * clients are served out of the persistent scope of the loading code. */
+    io_threads_blocked_loop++;
+    persistent = zmalloc_set_persistent_scope(0);
     while (iterations--) {
         int events = aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
+        events += handleClientsWithPendingWrites();
         if (!events) break;
         count += events;
     }
+    zmalloc_set_persistent_scope(persistent);
+    io_threads_blocked_loop--;
     return count;
 }
+
+/* ------------------------------ Threaded I/O ------------------------------
+ *
+ * With "io-threads" greater than one, reading queries from sockets and
+ * writing replies to them is performed by a pool of threads, while commands
+ * are still executed by the main thread, one after the other:
+ *
+ * 1) While processing the events, the read handler does not read, but just
+ *    queues the client in server.clients_pending_read (if reads are
+ *    threaded as well, see "io-threads-do-reads"), and new replies queue
+ *    the client in server.clients_pending_write instead of installing the
+ *    write handler.
+ *
+ * 2) Before sleeping, handleClientsWithPendingReads() distributes the
+ *    queued clients among the threads, the main thread included, that read
+ *    their sockets and parse the first command of every query. Then the
+ *    main thread executes the commands, in the order the clients were
+ *    queued.
+ *
+ * 3) handleClientsWithPendingWrites() does the same with the replies, and
+ *    installs the write handler of the clients with replies left to write,
+ *    that will be written by the main thread like without I/O threads.
+ *
+ * While the threads work the main thread only serves its own share of the
+ * clients, so the threads can access the clients without locking. They
+ * can allocate memory, but must not create objects, change reference
+ * counts, or touch the event loop: whatever needs it is left to the main
+ * thread once the threads are done. The threads are only woken up when
+ * there are enough clients to make it worthwhile (io_threads_active). */
+
+#define IO_THREADS_OP_READ 0
+#define IO_THREADS_OP_WRITE 1
+
+static pthread_t io_threads[REDIS_IO_THREADS_MAX_NUM];
+static list *io_threads_list[REDIS_IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_threads_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_threads_done = PTHREAD_COND_INITIALIZER;
+static unsigned long io_threads_round = 0; /* Incremented for every batch. */
+static int io_threads_pending = 0;  /* Threads still serving the batch. */
+static int io_threads_op;           /* IO_THREADS_OP_* of the batch. */
+
+/* Read the query of a client queued in server.clients_pending_read, and
+ * parse its first command if it starts a new one. */
+static void ioThreadsReadFromClient(redisClient *c) {
+    int nread = _readQueryFromClient(c);
+
+    if (nread == -1) {
+        c->flags |= REDIS_IO_ERROR;
+        return;
+    }
+    if (nread == 0 || c->reqtype != 0 || c->querybuf[0] != '*') return;
+    c->reqtype = REDIS_REQ_MULTIBULK;
+    processMultibulkBuffer(c);
+    c->flags |= REDIS_PENDING_COMMAND;
+}
+
+/* Write the replies of a client queued in server.clients_pending_write. */
+static void ioThreadsWriteToClient(redisClient *c) {
+    if (_writeToClient(c) == -1) {
+        redisLog(REDIS_VERBOSE,
+            "Error writing to client: %s", strerror(errno));
+        c->flags |= REDIS_IO_ERROR;
+    }
+}
+
+static void ioThreadsProcess(list *clients, int op) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = listNodeValue(ln);
+
+        if (op == IO_THREADS_OP_READ)
+            ioThreadsReadFromClient(c);
+        else
+            ioThreadsWriteToClient(c);
+    }
+}
+
+static void *ioThreadMain(void *arg) {
+    long id = (long) arg;
+    unsigned long round = 0;
+    sigset_t sigset;
+
+    /* Block SIGALRM so that only the main thread receives the watchdog
+     * signal, like the bio threads do. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        redisLog(REDIS_WARNING,
+            "Warning: can't mask SIGALRM in I/O thread: %s", strerror(errno));
+
+    pthread_mutex_lock(&io_threads_mutex);
+    while(1) {
+        while (io_threads_round == round)
+            pthread_cond_wait(&io_threads_start,&io_threads_mutex);
+        round = io_threads_round;
+        pthread_mutex_unlock(&io_threads_mutex);
+
+        ioThreadsProcess(io_threads_list[id],io_threads_op);
+        while (listLength(io_threads_list[id]))
+            listDelNode(io_threads_list[id],listFirst(io_threads_list[id]));
+
+        pthread_mutex_lock(&io_threads_mutex);
+        if (--io_threads_pending == 0)
+            pthread_cond_signal(&io_threads_done);
+    }
+    return NULL;
+}
+
+/* Start the I/O threads, if configured. */
+void initThreadedIO(void) {
+    long j;
+
+    server.io_threads_active = 0;
+    if (server.io_threads_num == 1) return;
+
+    for (j = 0; j < server.io_threads_num; j++) {
+        io_threads_list[j] = listCreate();
+        if (j == 0) continue; /* Thread 0 is the main thread. */
+        if (pthread_create(&io_threads[j],NULL,ioThreadMain,(void*)j) != 0) {
+            redisLog(REDIS_WARNING,"Fatal: Can't initialize I/O threads.");
+            exit(1);
+        }
+    }
+}
+
+/* Serve 'clients' with the I/O threads: the clients are distributed round
+ * robin, the main thread serving its share as well, and the function
+ * returns when all the threads are done. With too few clients to wake up
+ * the threads, everything is served by the main thread. Returns the number
+ * of clients served by the threads. */
+static int ioThreadsRun(list *clients, int op) {
+    listIter li;
+    listNode *ln;
+    int j = 0;
+
+    if (!server.io_threads_active || io_threads_blocked_loop ||
+        listLength(clients) < (unsigned long)server.io_threads_num*2)
+    {
+        ioThreadsProcess(clients,op);
+        return 0;
+    }
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li))) {
+        listAddNodeTail(io_threads_list[j],listNodeValue(ln));
+        if (++j == server.io_threads_num) j = 0;
+    }
+
+    pthread_mutex_lock(&io_threads_mutex);
+    io_threads_op = op;
+    io_threads_pending = server.io_threads_num-1;
+    io_threads_round++;
+    pthread_cond_broadcast(&io_threads_start);
+    pthread_mutex_unlock(&io_threads_mutex);
+
+    ioThreadsProcess(io_threads_list[0],op);
+    while (listLength(io_threads_list[0]))
+        listDelNode(io_threads_list[0],listFirst(io_threads_list[0]));
+
+    pthread_mutex_lock(&io_threads_mutex);
+    while (io_threads_pending)
+        pthread_cond_wait(&io_threads_done,&io_threads_mutex);
+    pthread_mutex_unlock(&io_threads_mutex);
+    return listLength(clients);
+}
+
+/* Read the queries of the clients in server.clients_pending_read, then
+ * execute them. Called by beforeSleep(). Returns the number of clients
+ * processed. */
+int handleClientsWithPendingReads(void) {
+    int processed = listLength(server.clients_pending_read);
+    listIter li;
+    listNode *ln;
+
+    if (processed == 0) return 0;
+    server.stat_io_reads_processed +=
+        ioThreadsRun(server.clients_pending_read,IO_THREADS_OP_READ);
+
+    /* Create the objects of all the parsed commands first: executing a
+     * command may free other clients, or serve events of other clients
+     * while blocked, and they must find a consistent argv. */
+    listRewind(server.clients_pending_read,&li);
+    while((ln = listNext(&li))) {
+        redisClient *c = listNodeValue(ln);
+
+        if (c->flags & REDIS_PENDING_COMMAND) createArgvObjects(c);
+    }
+
+    while(listLength(server.clients_pending_read)) {
+        redisClient *c;
+        int parsed;
+
+        ln = listFirst(server.clients_pending_read);
+        c = listNodeValue(ln);
+        listDelNode(server.clients_pending_read,ln);
+        parsed = c->flags & REDIS_PENDING_COMMAND;
+        c->flags &= ~(REDIS_PENDING_READ|REDIS_PENDING_COMMAND);
+
+        if (c->flags & REDIS_IO_ERROR) {
+            freeClient(c);
+            continue;
+        }
+        if (checkClientQueryBufferLimit(c) == REDIS_ERR) continue;
+
+        /* Execute the command parsed by the thread, like
+         * processInputBuffer() would, then process the rest of the query
+         * (pipelined commands) in the main thread. */
+        server.current_client = c;
+        if (parsed && c->multibulklen == 0 &&
+            !(c->flags & (REDIS_BLOCKED|REDIS_CLOSE_AFTER_REPLY)))
+        {
+            if (c->argc == 0) {
+                resetClient(c);
+            } else if (processCommand(c) == REDIS_OK) {
+                resetClient(c);
+            }
+        }
+        processInputBuffer(c);
+        server.current_client = NULL;
+    }
+    return processed;
+}
+
+/* Write the replies of the clients in server.clients_pending_write, and
+ * install the write handler of the clients with replies left to write.
+ * Called by beforeSleep(), and by processEventsWhileBlocked(). Returns the
+ * number of clients processed. */
+int handleClientsWithPendingWrites(void) {
+    int processed = listLength(server.clients_pending_write);
+
+    if (processed == 0) return 0;
+
+    /* The threads are used, for writes and for the reads of the next
+     * iteration, only while there are enough clients to serve. */
+    server.io_threads_active = server.io_threads_num > 1 &&
+        processed >= server.io_threads_num*2;
+    server.stat_io_writes_processed +=
+        ioThreadsRun(server.clients_pending_write,IO_THREADS_OP_WRITE);
+
+    while(listLength(server.clients_pending_write)) {
+        listNode *ln = listFirst(server.clients_pending_write);
+        redisClient *c = listNodeValue(ln);
+
+        listDelNode(server.clients_pending_write,ln);
+        c->flags &= ~REDIS_PENDING_WRITE;
+        if (_writeToClientDone(c,0) == REDIS_ERR) continue;
+        if ((c->bufpos || listLength(c->reply)) &&
+            aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+                              sendReplyToClient,c) == AE_ERR)
+        {
+            freeClientAsync(c);
+        }
+    }
+    return processed;
+}
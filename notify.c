@@ -97,10 +97,14 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
     robj *chanobj, *eventobj;
     int len = -1;
     char buf[24];
+    int persistent;
 
     /* If notifications for this class of events are off, return ASAP. */
     if (!(server.notify_keyspace_events & type)) return;
 
+    /* Called by write commands: the messages are not part of the keyspace,
+     * don't allocate them in the persistent heap. */
+    persistent = zmalloc_set_persistent_scope(0);
     eventobj = createStringObject(event,strlen(event));
 
     /* __keyspace@<db>__:<key> <event> notifications. */
@@ -127,4 +131,5 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
         decrRefCount(chanobj);
     }
     decrRefCount(eventobj);
+    zmalloc_set_persistent_scope(persistent);
 }
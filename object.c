@@ -36,8 +36,10 @@
 #define strtold(a,b) ((long double)strtod((a),(b)))
 #endif
 
+static zslab robjSlab = ZSLAB_INIT("robj",robj);
+
 robj *createObject(int type, void *ptr) {
-    robj *o = zmalloc(sizeof(*o));
+    robj *o = zslab_alloc(&robjSlab);
     o->type = type;
     o->encoding = REDIS_ENCODING_RAW;
     o->ptr = ptr;
@@ -52,9 +54,31 @@ robj *createStringObject(char *ptr, size_t len) {
     return createObject(REDIS_STRING,sdsnewlen(ptr,len));
 }
 
+/* Create a string object with encoding REDIS_ENCODING_EMBSTR, that is an
+ * object where the sds string is allocated in the same chunk as the object
+ * itself: a single allocation, and no pointer to follow to reach the
+ * string. The string can't be modified in place, see
+ * dbUnshareStringValue(). */
+robj *createEmbeddedStringObject(char *ptr, size_t len) {
+    robj *o = zmalloc(sizeof(robj)+sdsReqSize(len));
+
+    o->type = REDIS_STRING;
+    o->encoding = REDIS_ENCODING_EMBSTR;
+    o->ptr = sdsnewlenAt(o+1,ptr,len);
+    o->refcount = 1;
+
+    /* Set the LRU to the current lruclock (minutes resolution). */
+    o->lru = server.lruclock;
+    return o;
+}
+
 robj *createStringObjectFromLongLong(long long value) {
     robj *o;
-    if (value >= 0 && value < REDIS_SHARED_INTEGERS) {
+    /* The shared integers are not in the persistent heap: the keyspace
+     * stored there can't reference them. */
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS &&
+        !pheapIsPersistent())
+    {
         incrRefCount(shared.integers[value]);
         o = shared.integers[value];
     } else {
@@ -94,7 +118,9 @@ robj *createStringObjectFromLongDouble(long double value) {
 }
 
 robj *dupStringObject(robj *o) {
-    redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_RAW);
+    redisAssertWithInfo(NULL,o,sdsEncodedObject(o));
+    if (o->encoding == REDIS_ENCODING_EMBSTR)
+        return createEmbeddedStringObject(o->ptr,sdslen(o->ptr));
     return createStringObject(o->ptr,sdslen(o->ptr));
 }
 
@@ -230,12 +256,34 @@ void decrRefCount(robj *o) {
         case REDIS_HASH: freeHashObject(o); break;
         default: redisPanic("Unknown object type"); break;
         }
-        zfree(o);
+        freeObjectStruct(o);
     } else {
         o->refcount--;
     }
 }
 
+/* Release the object structure alone, once its value was already released
+ * by other means (see lazyfree.c). */
+void freeObjectStruct(robj *o) {
+    if (o->encoding == REDIS_ENCODING_EMBSTR)
+        zfree(o);
+    else
+        zslab_free(&robjSlab,o);
+}
+
+/* Move the object structure out of a sparse slab page, see defrag.c. Only
+ * objects referenced once can be moved. Returns the new object, or NULL if
+ * it was not moved. */
+robj *defragObject(robj *o) {
+    robj *newo;
+
+    if (o->refcount != 1) return NULL;
+    if (o->encoding != REDIS_ENCODING_EMBSTR) return zslab_defrag(&robjSlab,o);
+    if ((newo = zmalloc_defrag(o)) != NULL) newo->ptr = (char*)newo+
+        ((char*)o->ptr-(char*)o);
+    return newo;
+}
+
 /* This variant of decrRefCount() gets its argument as void, and is useful
  * as free method in data structures that expect a 'void free_object(void*)'
  * prototype for the free method. */
@@ -284,7 +332,7 @@ robj *tryObjectEncoding(robj *o) {
     sds s = o->ptr;
     size_t len;
 
-    if (o->encoding != REDIS_ENCODING_RAW)
+    if (!sdsEncodedObject(o))
         return o; /* Already encoded */
 
     /* It's not safe to encode shared objects: shared objects can be shared
@@ -298,18 +346,21 @@ robj *tryObjectEncoding(robj *o) {
     /* Check if we can represent this string as a long integer */
     len = sdslen(s);
     if (len > 21 || !string2l(s,len,&value)) {
-        /* We can't encode the object...
-         *
-         * Do the last try, and at least optimize the SDS string inside
+        /* We can't encode the object as an integer. If the string is small
+         * use the EMBSTR encoding, that needs a single allocation. */
+        if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT) {
+            robj *emb;
+
+            if (o->encoding == REDIS_ENCODING_EMBSTR) return o;
+            emb = createEmbeddedStringObject(s,len);
+            decrRefCount(o);
+            return emb;
+        }
+
+        /* Do the last try, and at least optimize the SDS string inside
          * the string object to require little space, in case there
-         * is more than 10% of free space at the end of the SDS string.
-         *
-         * We do that for larger strings, using the arbitrary value
-         * of 32 bytes. This code was backported from the unstable branch
-         * where this is performed when the object is too large to be
-         * encoded as EMBSTR. */
-        if (len > 32 &&
-            o->encoding == REDIS_ENCODING_RAW &&
+         * is more than 10% of free space at the end of the SDS string. */
+        if (o->encoding == REDIS_ENCODING_RAW &&
             sdsavail(s) > len/10)
         {
             o->ptr = sdsRemoveFreeSpace(o->ptr);
@@ -324,8 +375,10 @@ robj *tryObjectEncoding(robj *o) {
      *
      * Note that we also avoid using shared integers when maxmemory is used
      * because every object needs to have a private LRU field for the LRU
-     * algorithm to work well. */
-    if ((server.maxmemory == 0 ||
+     * algorithm to work well, and with the persistent heap, where the shared
+     * objects are not allocated. */
+    if (!pheapIsPersistent() &&
+        (server.maxmemory == 0 ||
          (server.maxmemory_policy != REDIS_MAXMEMORY_VOLATILE_LRU &&
           server.maxmemory_policy != REDIS_MAXMEMORY_ALLKEYS_LRU)) &&
         value >= 0 && value < REDIS_SHARED_INTEGERS)
@@ -333,6 +386,12 @@ robj *tryObjectEncoding(robj *o) {
         decrRefCount(o);
         incrRefCount(shared.integers[value]);
         return shared.integers[value];
+    } else if (o->encoding == REDIS_ENCODING_EMBSTR) {
+        /* The object structure is part of the string allocation. */
+        decrRefCount(o);
+        o = createObject(REDIS_STRING,(void*) value);
+        o->encoding = REDIS_ENCODING_INT;
+        return o;
     } else {
         o->encoding = REDIS_ENCODING_INT;
         sdsfree(o->ptr);
@@ -346,7 +405,7 @@ robj *tryObjectEncoding(robj *o) {
 robj *getDecodedObject(robj *o) {
     robj *dec;
 
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         incrRefCount(o);
         return o;
     }
@@ -378,14 +437,14 @@ int compareStringObjectsWithFlags(robj *a, robj *b, int flags) {
     size_t alen, blen, minlen;
 
     if (a == b) return 0;
-    if (a->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(a)) {
         alen = ll2string(bufa,sizeof(bufa),(long) a->ptr);
         astr = bufa;
     } else {
         astr = a->ptr;
         alen = sdslen(astr);
     }
-    if (b->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(b)) {
         blen = ll2string(bufb,sizeof(bufb),(long) b->ptr);
         bstr = bufb;
     } else {
@@ -419,7 +478,8 @@ int collateStringObjects(robj *a, robj *b) {
  * this function is faster then checking for (compareStringObject(a,b) == 0)
  * because it can perform some more optimization. */
 int equalStringObjects(robj *a, robj *b) {
-    if (a->encoding != REDIS_ENCODING_RAW && b->encoding != REDIS_ENCODING_RAW){
+    if (a->encoding == REDIS_ENCODING_INT &&
+        b->encoding == REDIS_ENCODING_INT){
         return a->ptr == b->ptr;
     } else {
         return compareStringObjects(a,b) == 0;
@@ -428,7 +488,7 @@ int equalStringObjects(robj *a, robj *b) {
 
 size_t stringObjectLen(robj *o) {
     redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
     } else {
         char buf[32];
@@ -437,6 +497,19 @@ size_t stringObjectLen(robj *o) {
     }
 }
 
+/* Return the memory used by the sds string at o->ptr, for output buffer
+ * accounting. EMBSTR strings share the allocation with the object, so we
+ * can't call zmalloc_size() on their header: the string length is a good
+ * enough approximation for them. */
+size_t getStringObjectSdsUsedMemory(robj *o) {
+    redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
+    switch(o->encoding) {
+    case REDIS_ENCODING_RAW: return zmalloc_size_sds(o->ptr);
+    case REDIS_ENCODING_EMBSTR: return sdslen(o->ptr);
+    default: return 0; /* Just integer encoding for now. */
+    }
+}
+
 int getDoubleFromObject(robj *o, double *target) {
     double value;
     char *eptr;
@@ -445,7 +518,7 @@ int getDoubleFromObject(robj *o, double *target) {
         value = 0;
     } else {
         redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             errno = 0;
             value = strtod(o->ptr, &eptr);
             if (isspace(((char*)o->ptr)[0]) ||
@@ -487,7 +560,7 @@ int getLongDoubleFromObject(robj *o, long double *target) {
         value = 0;
     } else {
         redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             errno = 0;
             value = strtold(o->ptr, &eptr);
             if (isspace(((char*)o->ptr)[0]) || eptr[0] != '\0' ||
@@ -525,7 +598,7 @@ int getLongLongFromObject(robj *o, long long *target) {
         value = 0;
     } else {
         redisAssertWithInfo(NULL,o,o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             errno = 0;
             value = strtoll(o->ptr, &eptr, 10);
             if (isspace(((char*)o->ptr)[0]) || eptr[0] != '\0' ||
@@ -574,6 +647,7 @@ int getLongFromObjectOrReply(redisClient *c, robj *o, long *target, const char *
 char *strEncoding(int encoding) {
     switch(encoding) {
     case REDIS_ENCODING_RAW: return "raw";
+    case REDIS_ENCODING_EMBSTR: return "embstr";
     case REDIS_ENCODING_INT: return "int";
     case REDIS_ENCODING_HT: return "hashtable";
     case REDIS_ENCODING_LINKEDLIST: return "linkedlist";
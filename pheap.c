@@ -0,0 +1,1114 @@
+/* Persistent heap allocator.
+ *
+ * This file implements a simple allocator carving blocks out of a large file
+ * mapped in memory with MAP_SHARED. When the file lives on a DAX capable
+ * file system backed by non volatile memory the mapping is the persistent
+ * memory itself, otherwise (tmpfs, regular files) the page cache emulates it,
+ * which is handy for testing.
+ *
+ * The heap is mapped every time at the same virtual address (recorded in the
+ * file header), so that plain pointers stored inside the heap remain valid
+ * across restarts. A root pointer, also stored in the header, allows the
+ * application to find its data structures again after a restart.
+ *
+ * DESIGN
+ * ------
+ *
+ * The file starts with a header page, followed by the blocks. Every block
+ * starts with a 16 bytes header holding its total size, its size class and
+ * the epoch (the number of times the heap was opened) when it was allocated.
+ *
+ * Small requests are rounded to one of PHEAP_NUM_CLASSES size classes, and
+ * free blocks of every class are kept in a LIFO free list. Requests bigger
+ * than the largest class are rounded to the page size and served by a single
+ * first-fit list of large blocks, split when the remainder is big enough.
+ * When the free lists are empty new blocks are carved from the top of the
+ * heap.
+ *
+ * Since the blocks are laid out contiguously it is possible to walk the whole
+ * heap, and this is used by pheapSweep() that rebuilds the free lists from
+ * scratch, releasing the blocks of previous epochs that were not marked as
+ * reachable with pheapMark(). This way memory that was in use by volatile
+ * data structures when the previous process exited is reclaimed. This is
+ * also the only place where adjacent free blocks are coalesced.
+ *
+ * CRASH CONSISTENCY
+ * -----------------
+ *
+ * The header of every allocated block is made durable before the pointer is
+ * returned to the caller. Frees are not performed immediately: the blocks
+ * are remembered, and actually released only when the caller commits with
+ * pheapCommit(), at a point where its data structures are consistent. This
+ * way a crash in the middle of an update never leaves the application data
+ * structures pointing to a block that was released, or worse reused.
+ *
+ * The commit writes the offsets of the blocks to release in a log that
+ * follows the header page (the redo records), flags the log as committed,
+ * and only then releases the blocks. When an image is opened, the frees of
+ * a committed log are performed again. If there are more frees than log
+ * entries the commit is just split in more rounds: all the blocks are already
+ * unreachable, so every round is atomic on its own.
+ *
+ * Allocations are not logged: after a crash the blocks allocated by the last
+ * update are still used, and the caller is expected to find the ones it
+ * still references with pheapMark() and release the others with pheapSweep().
+ *
+ * Stores are made durable flushing the CPU cache lines (clwb, or clflushopt,
+ * or clflush, followed by sfence) when the heap is mapped with MAP_SYNC on a
+ * DAX file system. Otherwise the page cache is emulating the persistent
+ * memory and msync() is used instead, that is much slower.
+ *
+ * VOLATILE HEAPS
+ * --------------
+ *
+ * A heap opened with PHEAP_VOLATILE is just a big pool of file backed
+ * memory, used as a slower memory tier (see tier.c): its content is discarded
+ * every time it is opened, so there is no log and nothing is flushed. Since
+ * the mapping is shared, a forked child sees the blocks the parent releases
+ * being reused: pheapDeferFrees() allows to delay frees while a child is
+ * running.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "pheap.h"
+
+#define PHEAP_MAGIC "REDIS-PHEAP-003"
+#define PHEAP_PAGE 4096
+#define PHEAP_ALIGN 16
+#define PHEAP_CACHELINE 64
+#define PHEAP_HDR_SIZE (PHEAP_PAGE*16)  /* Header page plus the log. */
+/* Address we try to map new heaps at: far enough from the areas normally
+ * used by the program break, shared libraries and the stack. */
+#define PHEAP_DEFAULT_BASE ((uintptr_t)0x100000000000ULL)
+
+/* Size classes: 16 bytes steps up to 256 bytes, then four classes for every
+ * power of two up to 1 MB. Bigger blocks are "large" blocks. */
+#define PHEAP_SMALL_MAX 256
+#define PHEAP_CLASS_MAX (1024*1024)
+#define PHEAP_NUM_CLASSES (PHEAP_SMALL_MAX/PHEAP_ALIGN+4*12)
+#define PHEAP_CLASS_LARGE 0xffff
+
+/* Block flags. */
+#define PHEAP_BLOCK_USED (1<<0)
+#define PHEAP_BLOCK_MARK (1<<1)
+
+typedef struct pheapBlock {
+    uint64_t size;      /* Total size of the block, header included. */
+    uint32_t epoch;     /* Heap epoch at allocation time. */
+    uint16_t cls;       /* Size class or PHEAP_CLASS_LARGE. */
+    uint16_t flags;
+} pheapBlock;
+
+/* Free blocks store the pointer to the next free block in the payload. */
+typedef struct pheapFreeBlock {
+    pheapBlock hdr;
+    struct pheapFreeBlock *next;
+} pheapFreeBlock;
+
+/* Transaction log. The entries are the offsets of the blocks released by the
+ * commit. Only the first 'count' entries are valid. */
+#define PHEAP_LOG_IDLE 0
+#define PHEAP_LOG_COMMITTED 1
+#define PHEAP_LOG_ENTRIES ((PHEAP_HDR_SIZE-PHEAP_PAGE-PHEAP_CACHELINE)/8)
+
+typedef struct pheapLog {
+    uint64_t state;
+    uint64_t count;
+    uint64_t reserved[PHEAP_CACHELINE/8-2]; /* Entries in their own lines. */
+    uint64_t entry[PHEAP_LOG_ENTRIES];
+} pheapLog;
+
+/* Ways to make stores durable. */
+#define PHEAP_FLUSH_NONE -1    /* Volatile heap. */
+#define PHEAP_FLUSH_MSYNC 0
+#define PHEAP_FLUSH_CLFLUSH 1
+#define PHEAP_FLUSH_CLFLUSHOPT 2
+#define PHEAP_FLUSH_CLWB 3
+
+typedef struct pheapHeader {
+    char magic[16];
+    uint64_t base;      /* Virtual address the heap must be mapped at. */
+    uint64_t size;      /* Size of the heap (and of the file). */
+    uint64_t top;       /* Offset of the first byte never allocated. */
+    uint64_t used;      /* Bytes in used blocks. */
+    uint64_t root;      /* Application root pointer. */
+    uint64_t clean;     /* Set to 1 by pheapMarkClean(). */
+    uint32_t epoch;     /* Incremented every time the heap is opened. */
+    uint32_t reserved;
+    pheapFreeBlock *free[PHEAP_NUM_CLASSES];
+    pheapFreeBlock *large;
+} pheapHeader;
+
+static struct {
+    int fd;
+    int dax;
+    int was_clean;      /* The image we opened was closed cleanly. */
+    int flush;          /* PHEAP_FLUSH_* method in use. */
+    int is_volatile;    /* Opened with PHEAP_VOLATILE. */
+    int defer;          /* Frees are deferred, see pheapDeferFrees(). */
+    void **deferred;    /* Blocks whose free was deferred. */
+    size_t deferred_len, deferred_cap;
+    void **pending;     /* Blocks to release at the next commit. */
+    size_t pending_len, pending_cap;
+    pheapHeader *hdr;
+    pheapLog *log;
+    char *start;        /* First block. */
+    char *end;          /* End of the mapping. */
+    size_t free_blocks;
+    size_t log_recovered;   /* Log entries applied when opening. */
+    size_t commits;         /* Transactions committed. */
+    size_t flushed;         /* Bytes flushed (cache lines or pages). */
+    pthread_mutex_t lock;
+} heap = {-1, 0, 0, PHEAP_FLUSH_MSYNC, 0, 0, NULL, 0, 0, NULL, 0, 0, NULL,
+          NULL, NULL, NULL, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+zmallocBackend pheapBackend = {
+    "pheap",
+    pheapAlloc,
+    pheapCalloc,
+    pheapRealloc,
+    pheapFree,
+    pheapUsableSize,
+    NULL,
+    NULL
+};
+
+/* ---------------------------- Size classes -------------------------------- */
+
+/* Return the total block size (header included) of the specified class. */
+static size_t pheapClassSize(int cls) {
+    int step, shift;
+
+    if (cls < PHEAP_SMALL_MAX/PHEAP_ALIGN) return (size_t)(cls+1)*PHEAP_ALIGN;
+    cls -= PHEAP_SMALL_MAX/PHEAP_ALIGN;
+    shift = cls/4;
+    step = cls%4;
+    return ((size_t)PHEAP_SMALL_MAX << shift) +
+           (((size_t)PHEAP_SMALL_MAX << shift)/4)*(step+1);
+}
+
+/* Return the size class for a block of 'bsize' total bytes. */
+static int pheapSizeClass(size_t bsize) {
+    size_t base = PHEAP_SMALL_MAX;
+    int shift = 0, step;
+
+    if (bsize <= PHEAP_SMALL_MAX)
+        return (int)((bsize+PHEAP_ALIGN-1)/PHEAP_ALIGN)-1;
+    if (bsize > PHEAP_CLASS_MAX) return PHEAP_CLASS_LARGE;
+    while(bsize > base*2) {
+        base <<= 1;
+        shift++;
+    }
+    step = (int)((bsize-base+base/4-1)/(base/4))-1;
+    return PHEAP_SMALL_MAX/PHEAP_ALIGN + shift*4 + step;
+}
+
+/* ---------------------------- Persistence --------------------------------- */
+
+/* Select the best way to flush the CPU caches. Only used with DAX mappings:
+ * with the page cache, flushing the caches does not make stores durable. */
+static void pheapSelectFlush(void) {
+    if (heap.is_volatile) {
+        heap.flush = PHEAP_FLUSH_NONE;
+        return;
+    }
+    heap.flush = PHEAP_FLUSH_MSYNC;
+#if defined(__x86_64__) || defined(__i386__)
+    if (heap.dax) {
+        unsigned int eax, ebx, ecx, edx;
+
+        heap.flush = PHEAP_FLUSH_CLFLUSH;
+        if (__get_cpuid_max(0,NULL) >= 7) {
+            __cpuid_count(7,0,eax,ebx,ecx,edx);
+            if (ebx & (1<<24)) heap.flush = PHEAP_FLUSH_CLWB;
+            else if (ebx & (1<<23)) heap.flush = PHEAP_FLUSH_CLFLUSHOPT;
+        }
+    }
+#endif
+}
+
+/* Start writing back the cache lines in the specified range. The stores are
+ * only guaranteed to be durable after pheapDrain() returns. */
+static void pheapFlush(void *addr, size_t len) {
+    uintptr_t p = (uintptr_t)addr & ~((uintptr_t)PHEAP_CACHELINE-1);
+    uintptr_t end = (uintptr_t)addr + len;
+
+    if (heap.flush == PHEAP_FLUSH_NONE) return;
+    if (heap.flush == PHEAP_FLUSH_MSYNC) {
+        p = (uintptr_t)addr & ~((uintptr_t)PHEAP_PAGE-1);
+        msync((void*)p,end-p,MS_SYNC);
+        heap.flushed += (end-p+PHEAP_PAGE-1) & ~((uintptr_t)PHEAP_PAGE-1);
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    for (; p < end; p += PHEAP_CACHELINE) {
+        /* clwb and clflushopt are encoded as xsaveopt and clflush with the
+         * 0x66 prefix: this way older assemblers are fine. */
+        if (heap.flush == PHEAP_FLUSH_CLWB)
+            __asm__ volatile(".byte 0x66; xsaveopt %0"
+                             : "+m" (*(volatile char *)p));
+        else if (heap.flush == PHEAP_FLUSH_CLFLUSHOPT)
+            __asm__ volatile(".byte 0x66; clflush %0"
+                             : "+m" (*(volatile char *)p));
+        else
+            __asm__ volatile("clflush %0" : "+m" (*(volatile char *)p));
+        heap.flushed += PHEAP_CACHELINE;
+    }
+#endif
+}
+
+/* Wait for the flushes started by pheapFlush() to complete. */
+static void pheapDrain(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (heap.flush > PHEAP_FLUSH_MSYNC)
+        __asm__ volatile("sfence" ::: "memory");
+#endif
+}
+
+static void pheapPersist(void *addr, size_t len) {
+    pheapFlush(addr,len);
+    pheapDrain();
+}
+
+/* ------------------------------ Mapping ----------------------------------- */
+
+/* Map the file at the specified address. If 'fixed' is true the mapping must
+ * be obtained exactly at 'addr', otherwise it is just an hint. On success
+ * the address of the mapping is returned, otherwise MAP_FAILED. */
+static void *pheapMap(int fd, void *addr, size_t size, int fixed) {
+    void *p = MAP_FAILED;
+    int flags = MAP_SHARED;
+
+#if defined(MAP_FIXED_NOREPLACE)
+    if (fixed) flags |= MAP_FIXED_NOREPLACE;
+#endif
+#if defined(MAP_SYNC) && defined(MAP_SHARED_VALIDATE)
+    /* Try first with MAP_SYNC, that only succeeds on DAX file systems, where
+     * the CPU caches flushes are enough to make stores persistent. */
+    p = mmap(addr,size,PROT_READ|PROT_WRITE,
+             (flags & ~MAP_SHARED)|MAP_SHARED_VALIDATE|MAP_SYNC,fd,0);
+    heap.dax = (p != MAP_FAILED);
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(addr,size,PROT_READ|PROT_WRITE,flags,fd,0);
+    if (p == MAP_FAILED) return p;
+    if (fixed && p != addr) {
+        munmap(p,size);
+        errno = EADDRINUSE;
+        return MAP_FAILED;
+    }
+    return p;
+}
+
+static void pheapFormat(size_t size) {
+    pheapHeader *hdr = heap.hdr;
+
+    memset(hdr,0,sizeof(*hdr));
+    hdr->base = (uintptr_t)hdr;
+    hdr->size = size;
+    hdr->top = PHEAP_HDR_SIZE;
+    memset(heap.log,0,sizeof(*heap.log));
+    pheapSync();
+    /* Write the magic as the last thing, so that a crash while formatting
+     * leaves an invalid heap. */
+    memcpy(hdr->magic,PHEAP_MAGIC,sizeof(hdr->magic));
+    pheapSync();
+}
+
+/* If the previous process crashed while committing, perform again the frees
+ * of the committed log. Allocations are never reverted: the application may
+ * already reference the blocks, and pheapSweep() releases the ones it does
+ * not. Free lists are not touched, since they are rebuilt by pheapSweep(). */
+static int pheapRecoverLog(void) {
+    pheapLog *log = heap.log;
+    uint64_t j;
+
+    if (log->count > PHEAP_LOG_ENTRIES || log->state > PHEAP_LOG_COMMITTED)
+        return PHEAP_ERR;
+    for (j = 0; log->state == PHEAP_LOG_COMMITTED && j < log->count; j++) {
+        uint64_t off = log->entry[j];
+        pheapBlock *b;
+
+        if (off % PHEAP_ALIGN || off < PHEAP_HDR_SIZE ||
+            off >= heap.hdr->top) continue;
+        b = (pheapBlock*)((char*)heap.hdr + off);
+        b->flags = 0;
+        heap.log_recovered++;
+    }
+    log->count = 0;
+    log->state = PHEAP_LOG_IDLE;
+    return 0;
+}
+
+/* Check that the header describes a sane heap we are able to use. */
+static int pheapHeaderIsValid(pheapHeader *hdr, size_t filesize) {
+    if (memcmp(hdr->magic,PHEAP_MAGIC,sizeof(hdr->magic)) != 0) return 0;
+    if (hdr->size != filesize) return 0;
+    if (hdr->top < PHEAP_HDR_SIZE || hdr->top > hdr->size) return 0;
+    if (hdr->base % PHEAP_PAGE) return 0;
+    return 1;
+}
+
+/* Open (or create) the heap stored in 'filename'. A new file is created with
+ * the specified size, while an existing file is used with its current size.
+ * If 'flags' is PHEAP_VOLATILE the file is always truncated and a new heap
+ * of the specified size is created (see the top comment).
+ *
+ * On success PHEAP_NEW is returned if a new empty heap was created, or
+ * PHEAP_EXISTING if a valid heap image was found in the file: in that case
+ * pheapGetRoot() returns the root set by the previous process, and the caller
+ * should call pheapSweep() once it marked what it wants to retain.
+ * On error PHEAP_ERR is returned and errno is set. An existing file that does
+ * not contain a valid heap is not overwritten, and EINVAL is returned. */
+int pheapOpen(const char *filename, size_t size, int flags) {
+    struct stat sb;
+    pheapHeader probe;
+    void *p;
+    int fd, existing;
+    int oflags = O_RDWR|O_CREAT;
+
+    if (heap.hdr) {
+        errno = EBUSY;
+        return PHEAP_ERR;
+    }
+    if (flags & PHEAP_VOLATILE) oflags |= O_TRUNC;
+    if ((fd = open(filename,oflags,0644)) == -1) return PHEAP_ERR;
+    if (fstat(fd,&sb) == -1) goto err;
+    existing = sb.st_size != 0;
+
+    if (existing) {
+        if (pread(fd,&probe,sizeof(probe),0) != sizeof(probe) ||
+            !pheapHeaderIsValid(&probe,sb.st_size))
+        {
+            errno = EINVAL;
+            goto err;
+        }
+        size = sb.st_size;
+        p = pheapMap(fd,(void*)(uintptr_t)probe.base,size,1);
+    } else {
+        size -= size % PHEAP_PAGE;
+        if (size < PHEAP_HDR_SIZE*2) {
+            errno = EINVAL;
+            goto err;
+        }
+        if (ftruncate(fd,size) == -1) goto err;
+        p = pheapMap(fd,(void*)PHEAP_DEFAULT_BASE,size,0);
+    }
+    if (p == MAP_FAILED) goto err;
+
+    heap.fd = fd;
+    heap.hdr = p;
+    heap.log = (pheapLog*)((char*)p + PHEAP_PAGE);
+    heap.start = (char*)p + PHEAP_HDR_SIZE;
+    heap.end = (char*)p + size;
+    heap.is_volatile = (flags & PHEAP_VOLATILE) != 0;
+    pheapSelectFlush();
+    if (!existing) {
+        pheapFormat(size);
+    } else if (pheapRecoverLog() == PHEAP_ERR) {
+        munmap(p,size);
+        heap.hdr = NULL;
+        heap.log = NULL;
+        errno = EINVAL;
+        goto err;
+    }
+    heap.was_clean = existing && heap.hdr->clean;
+    heap.hdr->epoch++;
+    heap.hdr->clean = 0;
+    if (existing) {
+        int j;
+
+        /* Until pheapSweep() rebuilds them, don't trust the free lists of
+         * the previous process: new blocks are only carved from the top. */
+        for (j = 0; j < PHEAP_NUM_CLASSES; j++) heap.hdr->free[j] = NULL;
+        heap.hdr->large = NULL;
+    }
+    pheapSync();
+    zmalloc_register_backend(&pheapBackend);
+    return existing ? PHEAP_EXISTING : PHEAP_NEW;
+
+err:
+    close(fd);
+    return PHEAP_ERR;
+}
+
+int pheapIsOpen(void) {
+    return heap.hdr != NULL;
+}
+
+/* Return true if the heap is open and was not opened with PHEAP_VOLATILE. */
+int pheapIsPersistent(void) {
+    return heap.hdr != NULL && !heap.is_volatile;
+}
+
+int pheapOwns(void *ptr) {
+    return (char*)ptr >= heap.start && (char*)ptr < heap.end;
+}
+
+/* Make the heap content durable. On DAX mappings this is still correct
+ * since msync() flushes the CPU caches as well. */
+void pheapSync(void) {
+    if (heap.hdr && !heap.is_volatile)
+        msync(heap.hdr,heap.end-(char*)heap.hdr,MS_SYNC);
+}
+
+/* Flag the heap as closed cleanly: called at shutdown, the next process will
+ * know the image was not left in the middle of an update. */
+void pheapMarkClean(void) {
+    if (!heap.hdr) return;
+    pheapCommit();
+    pheapSync();
+    heap.hdr->clean = 1;
+    msync(heap.hdr,PHEAP_PAGE,MS_SYNC);
+}
+
+void *pheapGetRoot(void) {
+    return heap.hdr ? (void*)(uintptr_t)heap.hdr->root : NULL;
+}
+
+void pheapSetRoot(void *root) {
+    heap.hdr->root = (uintptr_t)root;
+}
+
+/* ---------------------------- Allocation ---------------------------------- */
+
+#define pheapBlockOf(ptr) ((pheapBlock*)((char*)(ptr)-sizeof(pheapBlock)))
+#define pheapPayloadOf(b) ((void*)((char*)(b)+sizeof(pheapBlock)))
+
+/* Carve a new block of 'bsize' bytes from the top of the heap. The new top
+ * is not stored: the caller does it with pheapRaiseTop() once the header of
+ * the block is durable. */
+static pheapBlock *pheapCarve(size_t bsize) {
+    pheapHeader *hdr = heap.hdr;
+    pheapBlock *b;
+
+    if (hdr->size - hdr->top < bsize) return NULL;
+    b = (pheapBlock*)((char*)hdr + hdr->top);
+    b->size = bsize;
+    return b;
+}
+
+static void pheapRaiseTop(pheapBlock *b) {
+    heap.hdr->top = ((char*)b - (char*)heap.hdr) + b->size;
+    pheapPersist(&heap.hdr->top,sizeof(heap.hdr->top));
+}
+
+/* Pop a large block of at least 'bsize' bytes from the large free list,
+ * splitting it if the remainder is at least a page. */
+static pheapBlock *pheapTakeLarge(size_t bsize) {
+    pheapFreeBlock **link = &heap.hdr->large, *fb;
+
+    while((fb = *link) != NULL) {
+        if (fb->hdr.size >= bsize) {
+            *link = fb->next;
+            heap.free_blocks--;
+            if (fb->hdr.size - bsize >= PHEAP_PAGE) {
+                pheapFreeBlock *rest = (pheapFreeBlock*)((char*)fb+bsize);
+
+                rest->hdr.size = fb->hdr.size - bsize;
+                rest->hdr.cls = PHEAP_CLASS_LARGE;
+                rest->hdr.flags = 0;
+                rest->next = heap.hdr->large;
+                heap.hdr->large = rest;
+                heap.free_blocks++;
+                fb->hdr.size = bsize;
+            }
+            return &fb->hdr;
+        }
+        link = &fb->next;
+    }
+    return NULL;
+}
+
+/* Put a block in the right free list. Called with the lock held. */
+static void pheapPushFree(pheapBlock *b) {
+    pheapFreeBlock *fb = (pheapFreeBlock*)b;
+
+    b->flags = 0;
+    if (b->cls == PHEAP_CLASS_LARGE) {
+        fb->next = heap.hdr->large;
+        heap.hdr->large = fb;
+    } else {
+        fb->next = heap.hdr->free[b->cls];
+        heap.hdr->free[b->cls] = fb;
+    }
+    heap.free_blocks++;
+}
+
+/* ---------------------------- Transactions -------------------------------- */
+
+/* Append 'ptr' to a growable array of pointers. Returns -1 when out of
+ * memory. Called with the lock held. */
+static int pheapRemember(void ***v, size_t *len, size_t *cap, void *ptr) {
+    if (*len == *cap) {
+        size_t newcap = *cap ? *cap*2 : 1024;
+        void **newv = realloc(*v,newcap*sizeof(void*));
+
+        if (newv == NULL) return -1;
+        *v = newv;
+        *cap = newcap;
+    }
+    (*v)[(*len)++] = ptr;
+    return 0;
+}
+
+/* Release the blocks freed since the previous commit. Called with the lock
+ * held. The blocks are logged and released in rounds of at most
+ * PHEAP_LOG_ENTRIES: since all of them are already unreachable, the commit
+ * does not need to be a single round to be atomic. */
+static void pheapLogCommit(void) {
+    pheapLog *log = heap.log;
+    size_t done = 0;
+
+    if (heap.pending_len == 0) return;
+    while(done < heap.pending_len) {
+        size_t j, n = heap.pending_len-done;
+
+        if (n > PHEAP_LOG_ENTRIES) n = PHEAP_LOG_ENTRIES;
+        for (j = 0; j < n; j++)
+            log->entry[j] = (char*)heap.pending[done+j] - (char*)heap.hdr;
+        pheapPersist(log->entry,n*sizeof(uint64_t));
+        log->count = n;
+        log->state = PHEAP_LOG_COMMITTED;
+        pheapPersist(log,PHEAP_CACHELINE);
+        /* The released headers are not flushed: if they are lost, the
+         * blocks are still unreachable and pheapSweep() releases them. */
+        for (j = 0; j < n; j++) {
+            pheapBlock *b = heap.pending[done+j];
+
+            heap.hdr->used -= b->size;
+            pheapPushFree(b);
+        }
+        log->count = 0;
+        log->state = PHEAP_LOG_IDLE;
+        pheapPersist(log,PHEAP_CACHELINE);
+        done += n;
+    }
+    heap.pending_len = 0;
+    heap.commits++;
+}
+
+/* Commit the current transaction: the blocks freed since the previous commit
+ * are actually released. The caller must call this function only when its
+ * data structures are in a consistent state, that is, when they no longer
+ * reference any of the freed blocks. */
+void pheapCommit(void) {
+    if (!heap.hdr) return;
+    pthread_mutex_lock(&heap.lock);
+    pheapLogCommit();
+    pthread_mutex_unlock(&heap.lock);
+}
+
+void *pheapAlloc(size_t size) {
+    size_t bsize = size + sizeof(pheapBlock);
+    pheapBlock *b;
+    int cls;
+
+    if (bsize < sizeof(pheapFreeBlock)) bsize = sizeof(pheapFreeBlock);
+    cls = pheapSizeClass(bsize);
+    if (cls == PHEAP_CLASS_LARGE)
+        bsize = (bsize+PHEAP_PAGE-1) & ~((size_t)PHEAP_PAGE-1);
+    else
+        bsize = pheapClassSize(cls);
+
+    pthread_mutex_lock(&heap.lock);
+    if (cls == PHEAP_CLASS_LARGE) {
+        b = pheapTakeLarge(bsize);
+    } else if (heap.hdr->free[cls]) {
+        pheapFreeBlock *fb = heap.hdr->free[cls];
+
+        heap.hdr->free[cls] = fb->next;
+        heap.free_blocks--;
+        b = &fb->hdr;
+    } else {
+        b = NULL;
+    }
+    if (b == NULL && (b = pheapCarve(bsize)) == NULL) {
+        pthread_mutex_unlock(&heap.lock);
+        return NULL;
+    }
+    b->epoch = heap.hdr->epoch;
+    b->cls = cls;
+    b->flags = PHEAP_BLOCK_USED;
+    pheapPersist(b,sizeof(*b));
+    if ((char*)b == (char*)heap.hdr + heap.hdr->top) pheapRaiseTop(b);
+    heap.hdr->used += b->size;
+    pthread_mutex_unlock(&heap.lock);
+    return pheapPayloadOf(b);
+}
+
+void *pheapCalloc(size_t size) {
+    void *ptr = pheapAlloc(size);
+
+    if (ptr) memset(ptr,0,size);
+    return ptr;
+}
+
+void pheapFree(void *ptr) {
+    pheapBlock *b;
+
+    if (ptr == NULL) return;
+    b = pheapBlockOf(ptr);
+    pthread_mutex_lock(&heap.lock);
+    if (!heap.is_volatile) {
+        /* If we are out of memory the block is leaked until the next
+         * restart, where pheapSweep() finds it is unreachable. */
+        pheapRemember(&heap.pending,&heap.pending_len,&heap.pending_cap,b);
+    } else if (heap.defer) {
+        /* Better to leak the block than to break the child. */
+        pheapRemember(&heap.deferred,&heap.deferred_len,
+                      &heap.deferred_cap,ptr);
+    } else {
+        heap.hdr->used -= b->size;
+        pheapPushFree(b);
+    }
+    pthread_mutex_unlock(&heap.lock);
+}
+
+/* When 'defer' is true the blocks of a volatile heap are not released by
+ * pheapFree() but just remembered, so that their content does not change
+ * under the feet of a forked child still reading the shared mapping. When
+ * called with 'defer' false the remembered blocks are finally released. */
+void pheapDeferFrees(int defer) {
+    size_t j;
+
+    if (!heap.hdr) return;
+    pthread_mutex_lock(&heap.lock);
+    heap.defer = defer;
+    if (!defer) {
+        for (j = 0; j < heap.deferred_len; j++) {
+            pheapBlock *b = pheapBlockOf(heap.deferred[j]);
+
+            heap.hdr->used -= b->size;
+            pheapPushFree(b);
+        }
+        heap.deferred_len = 0;
+    }
+    pthread_mutex_unlock(&heap.lock);
+}
+
+size_t pheapUsableSize(void *ptr) {
+    return pheapBlockOf(ptr)->size - sizeof(pheapBlock);
+}
+
+void *pheapRealloc(void *ptr, size_t size) {
+    size_t oldsize;
+    void *newptr;
+
+    if (ptr == NULL) return pheapAlloc(size);
+    oldsize = pheapUsableSize(ptr);
+    if (size <= oldsize && size >= oldsize/2) return ptr;
+    if ((newptr = pheapAlloc(size)) == NULL) return NULL;
+    memcpy(newptr,ptr,size < oldsize ? size : oldsize);
+    pheapFree(ptr);
+    return newptr;
+}
+
+/* ------------------------------ Recovery ---------------------------------- */
+
+/* Return true if 'ptr' looks like the start of a used block: it must belong
+ * to the heap and be preceded by a sane block header. This is used to
+ * validate pointers found in the image of a previous process before
+ * dereferencing them. */
+int pheapIsAllocated(void *ptr) {
+    pheapBlock *b;
+    char *top;
+
+    if (!heap.hdr || (uintptr_t)ptr % PHEAP_ALIGN) return 0;
+    top = (char*)heap.hdr + heap.hdr->top;
+    if ((char*)ptr < heap.start + sizeof(pheapBlock) || (char*)ptr >= top)
+        return 0;
+    b = pheapBlockOf(ptr);
+    if (!(b->flags & PHEAP_BLOCK_USED)) return 0;
+    if (b->size % PHEAP_ALIGN || b->size > (size_t)(top-(char*)b)) return 0;
+    if (b->cls == PHEAP_CLASS_LARGE) return b->size > PHEAP_CLASS_MAX;
+    return b->cls < PHEAP_NUM_CLASSES && b->size == pheapClassSize(b->cls);
+}
+
+/* Mark a block allocated by a previous epoch as reachable, so that the next
+ * pheapSweep() will retain it. Returns 1 if the block was not already marked
+ * and 0 if it was already marked, so that callers traversing graphs of
+ * objects know when to stop. If 'ptr' is not a valid used block -1 is
+ * returned and nothing is marked. */
+int pheapMark(void *ptr) {
+    pheapBlock *b;
+
+    if (!pheapIsAllocated(ptr)) return -1;
+    b = pheapBlockOf(ptr);
+    if (b->flags & PHEAP_BLOCK_MARK) return 0;
+    b->flags |= PHEAP_BLOCK_MARK;
+    return 1;
+}
+
+/* Walk all the blocks of the heap, rebuilding the free lists from scratch.
+ * Used blocks of previous epochs not marked with pheapMark() are released,
+ * as well as all the blocks of previous epochs if 'keep_marked' is false.
+ * Marks are cleared. Since the free lists of the previous process are not
+ * trusted this also works if it crashed in the middle of an update.
+ *
+ * Returns 0 on success, or PHEAP_ERR if the heap layout is found corrupted,
+ * in which case the heap is left untouched. */
+int pheapSweep(int keep_marked) {
+    pheapHeader *hdr = heap.hdr;
+    char *p, *top;
+    int j;
+
+    pthread_mutex_lock(&heap.lock);
+    top = (char*)hdr + hdr->top;
+
+    /* Validate the layout first, so that we don't touch a corrupted heap. */
+    for (p = heap.start; p < top; p += ((pheapBlock*)p)->size) {
+        pheapBlock *b = (pheapBlock*)p;
+
+        if (b->size < sizeof(pheapFreeBlock) || b->size % PHEAP_ALIGN ||
+            b->size > (size_t)(top-p) ||
+            (b->cls != PHEAP_CLASS_LARGE && b->cls >= PHEAP_NUM_CLASSES))
+        {
+            pthread_mutex_unlock(&heap.lock);
+            return PHEAP_ERR;
+        }
+    }
+
+    for (j = 0; j < PHEAP_NUM_CLASSES; j++) hdr->free[j] = NULL;
+    hdr->large = NULL;
+    hdr->used = 0;
+    heap.free_blocks = 0;
+    p = heap.start;
+    while(p < top) {
+        char *run = p;
+        size_t runlen = 0;
+        int blocks = 0;
+
+        /* Collect the run of consecutive free blocks starting here. */
+        while(p < top) {
+            pheapBlock *b = (pheapBlock*)p;
+
+            if ((b->flags & PHEAP_BLOCK_USED) &&
+                (b->epoch == hdr->epoch ||
+                 (keep_marked && (b->flags & PHEAP_BLOCK_MARK))))
+                break;
+            runlen += b->size;
+            blocks++;
+            p += b->size;
+        }
+
+        if (blocks && p == top) {
+            /* The run reaches the top: give it back to the unused area. */
+            hdr->top = run - (char*)hdr;
+        } else if (blocks > 1 && runlen > PHEAP_CLASS_MAX) {
+            /* Coalesce big runs into a single large block. */
+            pheapBlock *b = (pheapBlock*)run;
+
+            b->size = runlen;
+            b->cls = PHEAP_CLASS_LARGE;
+            pheapPushFree(b);
+        } else {
+            char *q;
+
+            for (q = run; q < p; q += ((pheapBlock*)q)->size)
+                pheapPushFree((pheapBlock*)q);
+        }
+
+        /* Retain the used block that terminated the run, if any. */
+        if (p < top) {
+            pheapBlock *b = (pheapBlock*)p;
+
+            b->flags &= ~PHEAP_BLOCK_MARK;
+            hdr->used += b->size;
+            p += b->size;
+        }
+    }
+    pthread_mutex_unlock(&heap.lock);
+    return 0;
+}
+
+void pheapGetStats(pheapStats *stats) {
+    memset(stats,0,sizeof(*stats));
+    if (!heap.hdr) return;
+    pthread_mutex_lock(&heap.lock);
+    stats->size = heap.hdr->size;
+    stats->used = heap.hdr->used;
+    stats->top = heap.hdr->top;
+    stats->free_blocks = heap.free_blocks;
+    stats->clean = heap.was_clean;
+    stats->dax = heap.dax;
+    stats->log_recovered = heap.log_recovered;
+    stats->commits = heap.commits;
+    stats->flushed = heap.flushed;
+    stats->deferred_frees = heap.deferred_len;
+    pthread_mutex_unlock(&heap.lock);
+}
+
+#ifdef PHEAP_TEST_MAIN
+/* Crash test and allocation cost microbenchmark. Compile and run with:
+ *
+ *   gcc -O2 -DPHEAP_TEST_MAIN pheap.c zmalloc.c -lpthread -o pheap-test
+ *   ./pheap-test /path/to/test.heap
+ *
+ * The crash test kills with SIGKILL a process updating a linked list stored
+ * in the heap, at random times, then checks that the next process finds the
+ * whole list valid. The benchmark compares the heap with the volatile
+ * allocator zmalloc.c was compiled with: libc malloc by default, add
+ * -DUSE_JEMALLOC and link libjemalloc to compare against jemalloc.
+ * The file is removed at exit. Use a file on a DAX file system to measure
+ * cache line flushes, or on tmpfs / a disk to measure the msync() fallback. */
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define CRASH_RUNS 20
+#define CRASH_NODES 20000       /* Max length of the list. */
+#define CRASH_BATCH 200         /* Updates per transaction. */
+#define CRASH_BIG_EVERY 50      /* Every N transactions delete most nodes. */
+#define CRASH_MAGIC 0x5245444953504845ULL
+
+/* The list is updated the way Redis updates its data structures: new blocks
+ * are filled and then linked with a single store, and blocks are unlinked
+ * before being freed. A value is replaced allocating a new one. */
+typedef struct crashValue {
+    uint32_t len;
+    unsigned char fill;
+    unsigned char data[];
+} crashValue;
+
+typedef struct crashNode {
+    struct crashNode *next;
+    crashValue *value;
+} crashNode;
+
+typedef struct crashRoot {
+    uint64_t magic;
+    crashNode *head;
+} crashRoot;
+
+static crashValue *crashNewValue(void) {
+    uint32_t len = 16 + rand() % 2000;
+    crashValue *v = pheapAlloc(sizeof(*v)+len);
+
+    v->len = len;
+    v->fill = rand();
+    memset(v->data,v->fill,len);
+    return v;
+}
+
+/* Validate and mark the list of the previous process, then sweep what is not
+ * reachable. Returns the number of nodes, or -1 if the list is not valid. */
+static long crashRecover(crashRoot **rootptr) {
+    crashRoot *root = pheapGetRoot();
+    crashNode *n;
+    long count = 0;
+    uint32_t j;
+
+    *rootptr = NULL;
+    if (root == NULL) return pheapSweep(0) == PHEAP_ERR ? -1 : 0;
+    if (pheapMark(root) != 1 || root->magic != CRASH_MAGIC) return -1;
+    for (n = root->head; n; n = n->next) {
+        crashValue *v = n->value;
+
+        if (pheapMark(n) != 1 || pheapMark(v) != 1 ||
+            pheapUsableSize(v) < sizeof(*v)+v->len) return -1;
+        for (j = 0; j < v->len; j++)
+            if (v->data[j] != v->fill) return -1;
+        count++;
+    }
+    if (pheapSweep(1) == PHEAP_ERR) return -1;
+    *rootptr = root;
+    return count;
+}
+
+/* Update the list forever, committing every CRASH_BATCH updates. Exits with
+ * status 2 if the list left by the previous process is not valid. */
+static void crashWriter(const char *filename) {
+    crashRoot *root;
+    long count, batches = 0;
+    int j;
+
+    if (pheapOpen(filename,64*1024*1024,0) == PHEAP_ERR ||
+        (count = crashRecover(&root)) == -1) exit(2);
+    srand(getpid());
+    if (root == NULL) {
+        root = pheapAlloc(sizeof(*root));
+        root->magic = CRASH_MAGIC;
+        root->head = NULL;
+        pheapSetRoot(root);
+    }
+    while(1) {
+        for (j = 0; j < CRASH_BATCH; j++) {
+            int op = rand() % 10;
+
+            if (count < CRASH_NODES && (op < 6 || count == 0)) {
+                crashNode *n = pheapAlloc(sizeof(*n));
+
+                n->value = crashNewValue();
+                n->next = root->head;
+                root->head = n;
+                count++;
+            } else if (op < 9) {
+                crashValue *old = root->head->value;
+
+                root->head->value = crashNewValue();
+                pheapFree(old);
+            } else if (root->head->next) {
+                crashNode *n = root->head->next;
+
+                root->head->next = n->next;
+                pheapFree(n->value);
+                pheapFree(n);
+                count--;
+            }
+        }
+        /* A big update freeing more blocks than the log can hold. */
+        if (++batches % CRASH_BIG_EVERY == 0) {
+            while(count > 10) {
+                crashNode *n = root->head;
+
+                root->head = n->next;
+                pheapFree(n->value);
+                pheapFree(n);
+                count--;
+            }
+        }
+        pheapCommit();
+    }
+}
+
+/* Returns 0 if all the runs recovered a valid list. */
+static int crashTest(const char *filename) {
+    int run, status;
+    long nodes = 0;
+    pid_t pid;
+
+    unlink(filename);
+    srand(time(NULL));
+    for (run = 0; run <= CRASH_RUNS; run++) {
+        if ((pid = fork()) == 0) {
+            if (run == CRASH_RUNS) {
+                crashRoot *root;
+
+                /* Last run: just check what the previous one left. */
+                if (pheapOpen(filename,0,0) != PHEAP_EXISTING) exit(2);
+                nodes = crashRecover(&root);
+                printf("Crash test: %d runs killed, %ld nodes recovered "
+                       "from the last one\n", CRASH_RUNS, nodes);
+                exit(nodes == -1 ? 2 : 0);
+            }
+            crashWriter(filename);
+        }
+        if (run < CRASH_RUNS) {
+            usleep(50000 + rand() % 200000);
+            kill(pid,SIGKILL);
+        }
+        waitpid(pid,&status,0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            printf("Crash test: the list was not valid after run %d\n", run);
+            return 1;
+        }
+    }
+    unlink(filename);
+    return 0;
+}
+
+#define BENCH_OPS 200000
+#define BENCH_BATCH 64      /* Allocations per transaction. */
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static void *ptrs[BENCH_BATCH];
+
+/* Allocate and free BENCH_OPS blocks of 'size' bytes in batches, committing
+ * after every batch like the event loop does. */
+static void bench(const char *name, void *(*alloc)(size_t),
+                  void (*release)(void*), int commit, size_t size)
+{
+    size_t flushed = heap.flushed;
+    long long start = usec(), elapsed;
+    int i, j;
+
+    for (i = 0; i < BENCH_OPS; i += BENCH_BATCH) {
+        for (j = 0; j < BENCH_BATCH; j++) ptrs[j] = alloc(size);
+        for (j = 0; j < BENCH_BATCH; j++) release(ptrs[j]);
+        if (commit) pheapCommit();
+    }
+    elapsed = usec()-start;
+    flushed = heap.flushed - flushed;
+    printf("%-10s %6zu bytes: %8.1f ns/op, %8.1f flushed bytes/op, "
+           "write amplification %.2fx\n",
+        name, size, (double)elapsed*1000/BENCH_OPS,
+        (double)flushed/BENCH_OPS, (double)flushed/BENCH_OPS/size);
+}
+
+static const char *flushname[] = {"msync","clflush","clflushopt","clwb"};
+
+int main(int argc, char **argv) {
+    size_t sizes[] = {16, 64, 256, 4096};
+    unsigned int j;
+
+    if (argc != 2) {
+        fprintf(stderr,"Usage: %s <heap file>\n", argv[0]);
+        return 1;
+    }
+    if (crashTest(argv[1])) return 1;
+    unlink(argv[1]);
+    if (pheapOpen(argv[1],256*1024*1024,0) == PHEAP_ERR) {
+        perror("pheapOpen");
+        return 1;
+    }
+    printf("Heap mapped %s, flushing with %s, %d ops, batches of %d, "
+           "volatile allocator %s\n",
+        heap.dax ? "with MAP_SYNC" : "from the page cache",
+        flushname[heap.flush], BENCH_OPS, BENCH_BATCH, ZMALLOC_LIB);
+    for (j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++) {
+        bench(ZMALLOC_LIB,zmalloc,zfree,0,sizes[j]);
+        bench("pheap",pheapAlloc,pheapFree,1,sizes[j]);
+    }
+    unlink(argv[1]);
+    return 0;
+}
+#endif
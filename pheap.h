@@ -0,0 +1,85 @@
+/* pheap.h -- persistent heap allocator API header file
+ * See pheap.c for more information.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PHEAP_H
+#define __PHEAP_H
+
+#include <stddef.h>
+#include "zmalloc.h"
+
+#define PHEAP_DEFAULT_SIZE (1024LL*1024*1024) /* 1 GB */
+
+/* Return values of pheapOpen(). */
+#define PHEAP_ERR -1
+#define PHEAP_NEW 0         /* A new, empty heap was created. */
+#define PHEAP_EXISTING 1    /* The file contained a previous heap image. */
+
+/* pheapOpen() flags. */
+#define PHEAP_VOLATILE (1<<0)   /* Discard the content, don't persist. */
+
+typedef struct pheapStats {
+    size_t size;            /* Size of the mapped file. */
+    size_t used;            /* Bytes in allocated blocks (headers included). */
+    size_t top;             /* Bytes ever carved from the file. */
+    size_t free_blocks;     /* Blocks sitting in the free lists. */
+    int clean;              /* Previous image was closed cleanly. */
+    int dax;                /* Mapped with MAP_SYNC (real persistent memory). */
+    size_t log_recovered;   /* Log entries applied when the heap was opened. */
+    size_t commits;         /* Transactions committed. */
+    size_t flushed;         /* Bytes written back to make stores durable. */
+    size_t deferred_frees;  /* Frees delayed by pheapDeferFrees(). */
+} pheapStats;
+
+extern zmallocBackend pheapBackend;
+
+int pheapOpen(const char *filename, size_t size, int flags);
+int pheapIsOpen(void);
+int pheapIsPersistent(void);
+int pheapOwns(void *ptr);
+void *pheapAlloc(size_t size);
+void *pheapCalloc(size_t size);
+void *pheapRealloc(void *ptr, size_t size);
+void pheapFree(void *ptr);
+size_t pheapUsableSize(void *ptr);
+void *pheapGetRoot(void);
+void pheapSetRoot(void *root);
+void pheapSync(void);
+void pheapMarkClean(void);
+void pheapCommit(void);
+void pheapDeferFrees(int defer);
+int pheapIsAllocated(void *ptr);
+int pheapMark(void *ptr);
+int pheapSweep(int keep_marked);
+void pheapGetStats(pheapStats *stats);
+
+#endif /* __PHEAP_H */
@@ -0,0 +1,503 @@
+/* Keyspace stored in the persistent heap.
+ *
+ * When Redis runs with the "pheap" allocator every object of the dataset
+ * lives in the persistent heap (see pheap.c), and the heap root records where
+ * the databases are. This file implements the restart path that re-attaches
+ * the keyspace found in the heap image instead of loading it from the RDB or
+ * AOF file.
+ *
+ * Re-attaching works this way:
+ *
+ * 1) As soon as the heap is mapped, before any dictionary is created, we
+ *    restore the hash function seed of the previous process, otherwise the
+ *    hash tables found in the image would be useless.
+ * 2) When the dataset would be loaded from disk, we walk every database
+ *    dict, every key and every value, validating all the pointers before
+ *    following them, and marking the blocks as reachable. Only the
+ *    structures are visited: the payload of strings, ziplists and intsets is
+ *    never touched, so the time needed is proportional to the number of
+ *    allocations, not to the size of the dataset.
+ * 3) Dictionaries and lists contain pointers to functions, that are fixed
+ *    since the executable may be mapped at a different address.
+ * 4) Finally the heap is swept: the blocks of the previous process that are
+ *    not part of the keyspace (argument copies, values of a command that was
+ *    interrupted, ...) are released.
+ *
+ * If the image fails validation it is discarded and the dataset is loaded
+ * from the RDB / AOF file as usual. Images that were not closed cleanly are
+ * accepted as well: the allocator log guarantees that no block referenced by
+ * the keyspace was released, and the validation pass checks that the lengths
+ * stored in strings, ziplists and intsets don't exceed their blocks.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include "endianconv.h"
+
+/* Root found in the heap image at startup, or NULL. */
+static redisHeapRoot *prevroot = NULL;
+
+/* State of the validation / marking walk. */
+typedef struct pheapWalk {
+    int err;                /* Set to the first inconsistency found. */
+    long long blocks;       /* Number of blocks retained. */
+    long long keys;         /* Number of keys found. */
+} pheapWalk;
+
+#define PHEAP_WALK_OK 0
+#define PHEAP_WALK_BAD_POINTER 1
+#define PHEAP_WALK_BAD_DICT 2
+#define PHEAP_WALK_BAD_OBJECT 3
+#define PHEAP_WALK_BAD_LIST 4
+#define PHEAP_WALK_BAD_LENGTH 5
+
+/* Smallest possible ziplist: header plus end marker. */
+#define PHEAP_WALK_ZIPLIST_MIN (sizeof(uint32_t)*2+sizeof(uint16_t)+1)
+
+static char *pheapWalkErrorString(int err) {
+    switch(err) {
+    case PHEAP_WALK_BAD_POINTER: return "invalid pointer";
+    case PHEAP_WALK_BAD_DICT: return "inconsistent hash table";
+    case PHEAP_WALK_BAD_OBJECT: return "invalid object type or encoding";
+    case PHEAP_WALK_BAD_LIST: return "inconsistent linked list";
+    case PHEAP_WALK_BAD_LENGTH: return "length exceeding its allocation";
+    default: return "no error";
+    }
+}
+
+/* Called by main() before anything is hashed: remember the root of the
+ * previous image and restore the hash function and seed it was created with.
+ * Sentinel has no keyspace, so the old image is just discarded. */
+void pheapDbInit(void) {
+    redisHeapRoot *root;
+
+    if (!pheapIsPersistent()) return;
+    if (server.sentinel_mode) {
+        if (pheapSweep(0) == PHEAP_ERR) {
+            fprintf(stderr,"The persistent heap is corrupted.\n");
+            exit(1);
+        }
+        return;
+    }
+    root = pheapGetRoot();
+    if (root == NULL || !pheapIsAllocated(root) ||
+        pheapUsableSize(root) < sizeof(*root) ||
+        root->magic != REDIS_HEAP_ROOT_MAGIC) return;
+    prevroot = root;
+    dictSetHashFunction(root->hash_function);
+    dictSetHashFunctionSeed(root->hash_seed);
+}
+
+/* Store in the heap root where the keyspace of this process is. Called by
+ * initServer() once the databases are created. */
+void pheapDbCreateRoot(void) {
+    redisHeapRoot *root;
+
+    if (!pheapIsPersistent()) return;
+    root = server.pheap_root = zmalloc(sizeof(*root));
+    root->magic = REDIS_HEAP_ROOT_MAGIC;
+    root->hash_function = dictGetHashFunction();
+    memcpy(root->hash_seed,dictGetHashFunctionSeed(),sizeof(root->hash_seed));
+    root->dbnum = server.dbnum;
+    root->db = server.db;
+    pheapSetRoot(root);
+}
+
+/* --------------------------- Validation walk ------------------------------ */
+
+/* Mark the block at 'ptr' as reachable. Returns 1 if the caller should visit
+ * the block content, 0 if it was already visited or is invalid. */
+static int pheapWalkMark(pheapWalk *w, void *ptr, size_t minsize) {
+    int retval;
+
+    if (w->err) return 0;
+    retval = pheapMark(ptr);
+    if (retval == -1 || (retval == 1 && pheapUsableSize(ptr) < minsize)) {
+        w->err = PHEAP_WALK_BAD_POINTER;
+        return 0;
+    }
+    w->blocks += retval;
+    return retval;
+}
+
+/* Mark a block whose payload is opaque, checking that the length stored in
+ * the payload itself does not exceed the block. */
+static void pheapWalkBlob(pheapWalk *w, void *ptr, size_t minsize,
+                          size_t (*getlen)(void *ptr))
+{
+    if (pheapWalkMark(w,ptr,minsize) && getlen(ptr) > pheapUsableSize(ptr))
+        w->err = PHEAP_WALK_BAD_LENGTH;
+}
+
+static size_t pheapZiplistLen(void *ptr) {
+    uint32_t bytes;
+
+    memcpy(&bytes,ptr,sizeof(bytes));
+    return intrev32ifbe(bytes);
+}
+
+static size_t pheapIntsetLen(void *ptr) {
+    intset *is = ptr;
+    uint32_t enc = intrev32ifbe(is->encoding);
+
+    if (enc != sizeof(int16_t) && enc != sizeof(int32_t) &&
+        enc != sizeof(int64_t)) return SIZE_MAX;
+    return sizeof(*is)+(size_t)intrev32ifbe(is->length)*enc;
+}
+
+/* The header size of an sds depends on its type byte, that is read only
+ * once we know it belongs to the heap. */
+static void pheapWalkSds(pheapWalk *w, sds s) {
+    char *sh;
+
+    if (w->err) return;
+    if (!pheapOwns(s-1)) {
+        w->err = PHEAP_WALK_BAD_POINTER;
+        return;
+    }
+    sh = sdsAllocPtr(s);
+    if (pheapWalkMark(w,sh,s-sh) && sdsAllocSize(s) > pheapUsableSize(sh))
+        w->err = PHEAP_WALK_BAD_LENGTH;
+}
+
+static void pheapWalkZiplist(pheapWalk *w, void *zl) {
+    pheapWalkBlob(w,zl,PHEAP_WALK_ZIPLIST_MIN,pheapZiplistLen);
+}
+
+static void pheapWalkObject(pheapWalk *w, robj *o);
+
+static void pheapWalkObjectVoid(pheapWalk *w, void *o) {
+    pheapWalkObject(w,o);
+}
+
+static void pheapWalkSdsVoid(pheapWalk *w, void *s) {
+    pheapWalkSds(w,s);
+}
+
+/* Validate and mark a dictionary, its tables and entries, calling 'walkkey'
+ * and 'walkval' (if not NULL) for every key and value. The dictType is set
+ * to 'type' since the function pointers of the previous executable may no
+ * longer be valid. */
+static void pheapWalkDict(pheapWalk *w, dict *d, dictType *type,
+                          void (*walkkey)(pheapWalk*, void*),
+                          void (*walkval)(pheapWalk*, void*))
+{
+    int t;
+
+    if (!pheapWalkMark(w,d,sizeof(*d))) {
+        /* Dictionaries are never shared. */
+        if (!w->err) w->err = PHEAP_WALK_BAD_DICT;
+        return;
+    }
+    d->type = type;
+    d->privdata = NULL;
+    d->entry_slab = NULL;
+    d->iterators = 0;
+    if (d->rehashidx == -1 && d->ht[1].size != 0) {
+        w->err = PHEAP_WALK_BAD_DICT;
+        return;
+    }
+
+    for (t = 0; t < 2; t++) {
+        dictht *ht = d->ht+t;
+        unsigned long j, count = 0;
+
+        if (ht->size == 0) {
+            if (ht->table != NULL || ht->used != 0)
+                w->err = PHEAP_WALK_BAD_DICT;
+            continue;
+        }
+        if ((ht->size & (ht->size-1)) || ht->sizemask != ht->size-1) {
+            w->err = PHEAP_WALK_BAD_DICT;
+            return;
+        }
+        if (!pheapWalkMark(w,ht->table,ht->size*sizeof(dictEntry*))) {
+            if (!w->err) w->err = PHEAP_WALK_BAD_DICT;
+            return;
+        }
+        for (j = 0; j < ht->size; j++) {
+            dictEntry *de = ht->table[j];
+
+            while(de) {
+                if (!pheapWalkMark(w,de,sizeof(*de)) || count == ht->used) {
+                    if (!w->err) w->err = PHEAP_WALK_BAD_DICT;
+                    return;
+                }
+                walkkey(w,de->key);
+                if (walkval) walkval(w,de->v.val);
+                if (w->err) return;
+                count++;
+                de = de->next;
+            }
+        }
+        if (count != ht->used) {
+            w->err = PHEAP_WALK_BAD_DICT;
+            return;
+        }
+    }
+}
+
+static void pheapWalkLinkedList(pheapWalk *w, list *l) {
+    listNode *ln, *prev = NULL;
+    unsigned long count = 0;
+
+    if (!pheapWalkMark(w,l,sizeof(*l))) {
+        if (!w->err) w->err = PHEAP_WALK_BAD_LIST;
+        return;
+    }
+    l->dup = NULL;
+    l->free = decrRefCountVoid;
+    l->match = NULL;
+    for (ln = l->head; ln; ln = ln->next) {
+        if (!pheapWalkMark(w,ln,sizeof(*ln)) || ln->prev != prev) {
+            if (!w->err) w->err = PHEAP_WALK_BAD_LIST;
+            return;
+        }
+        pheapWalkObject(w,ln->value);
+        if (w->err) return;
+        prev = ln;
+        count++;
+    }
+    if (l->tail != prev || l->len != count) w->err = PHEAP_WALK_BAD_LIST;
+}
+
+static void pheapWalkZset(pheapWalk *w, zset *zs) {
+    zskiplistNode *x;
+    unsigned long count = 0;
+
+    if (!pheapWalkMark(w,zs,sizeof(*zs))) {
+        if (!w->err) w->err = PHEAP_WALK_BAD_OBJECT;
+        return;
+    }
+    /* The values of the dict point to the scores inside the skiplist
+     * nodes, so they are not blocks and must not be marked. */
+    pheapWalkDict(w,zs->dict,&zsetDictType,pheapWalkObjectVoid,NULL);
+    if (!pheapWalkMark(w,zs->zsl,sizeof(zskiplist)) ||
+        !pheapWalkMark(w,zs->zsl->header,sizeof(zskiplistNode)))
+    {
+        if (!w->err) w->err = PHEAP_WALK_BAD_LIST;
+        return;
+    }
+    for (x = zs->zsl->header->level[0].forward; x; x = x->level[0].forward) {
+        if (!pheapWalkMark(w,x,sizeof(*x))) {
+            if (!w->err) w->err = PHEAP_WALK_BAD_LIST;
+            return;
+        }
+        pheapWalkObject(w,x->obj);
+        if (w->err) return;
+        count++;
+    }
+    if (zs->zsl->length != count || dictSize(zs->dict) != count)
+        w->err = PHEAP_WALK_BAD_LIST;
+}
+
+static void pheapWalkObject(pheapWalk *w, robj *o) {
+    /* Objects may be shared, visit them only the first time. */
+    if (!pheapWalkMark(w,o,sizeof(*o))) return;
+
+    switch(o->type) {
+    case REDIS_STRING:
+        if (o->encoding == REDIS_ENCODING_RAW) {
+            pheapWalkSds(w,o->ptr);
+        } else if (o->encoding == REDIS_ENCODING_EMBSTR) {
+            /* The sds lives in the same allocation, right after the
+             * object header. */
+            char *emb = (char*)(o+1);
+            size_t usable = pheapUsableSize(o);
+            sds s = o->ptr;
+
+            if (s <= emb || s > emb+sizeof(struct sdshdr64) ||
+                (size_t)(s-(char*)o) > usable ||
+                s-sdsHdrSize(s[-1]) != emb ||
+                sizeof(*o)+sdsAllocSize(s) > usable)
+                w->err = PHEAP_WALK_BAD_LENGTH;
+        } else if (o->encoding != REDIS_ENCODING_INT) {
+            w->err = PHEAP_WALK_BAD_OBJECT;
+        }
+        break;
+    case REDIS_LIST:
+        if (o->encoding == REDIS_ENCODING_ZIPLIST)
+            pheapWalkZiplist(w,o->ptr);
+        else if (o->encoding == REDIS_ENCODING_LINKEDLIST)
+            pheapWalkLinkedList(w,o->ptr);
+        else
+            w->err = PHEAP_WALK_BAD_OBJECT;
+        break;
+    case REDIS_SET:
+        if (o->encoding == REDIS_ENCODING_INTSET)
+            pheapWalkBlob(w,o->ptr,sizeof(intset),pheapIntsetLen);
+        else if (o->encoding == REDIS_ENCODING_HT)
+            pheapWalkDict(w,o->ptr,&setDictType,pheapWalkObjectVoid,NULL);
+        else
+            w->err = PHEAP_WALK_BAD_OBJECT;
+        break;
+    case REDIS_ZSET:
+        if (o->encoding == REDIS_ENCODING_ZIPLIST)
+            pheapWalkZiplist(w,o->ptr);
+        else if (o->encoding == REDIS_ENCODING_SKIPLIST)
+            pheapWalkZset(w,o->ptr);
+        else
+            w->err = PHEAP_WALK_BAD_OBJECT;
+        break;
+    case REDIS_HASH:
+        if (o->encoding == REDIS_ENCODING_ZIPLIST)
+            pheapWalkZiplist(w,o->ptr);
+        else if (o->encoding == REDIS_ENCODING_HT)
+            pheapWalkDict(w,o->ptr,&hashDictType,pheapWalkObjectVoid,
+                          pheapWalkObjectVoid);
+        else
+            w->err = PHEAP_WALK_BAD_OBJECT;
+        break;
+    default:
+        w->err = PHEAP_WALK_BAD_OBJECT;
+        break;
+    }
+}
+
+/* ----------------------------- Re-attach ---------------------------------- */
+
+/* Try to re-attach the keyspace found in the heap image. Returns REDIS_OK on
+ * success. Otherwise REDIS_ERR is returned and the image is discarded, so
+ * that the caller can load the dataset from the RDB or AOF file instead.
+ * In both cases the heap is swept, releasing all the memory of the previous
+ * process that is not part of the re-attached keyspace. */
+int pheapDbLoad(void) {
+    pheapWalk w = {PHEAP_WALK_OK, 0, 0};
+    redisHeapRoot *root = prevroot;
+    pheapStats ps;
+    long long start = ustime();
+    int j;
+
+    if (!pheapIsPersistent()) return REDIS_ERR;
+    prevroot = NULL;
+    pheapGetStats(&ps);
+
+    if (root == NULL) goto discard;
+    if (!ps.clean) {
+        redisLog(REDIS_WARNING,"The persistent heap was not closed cleanly "
+            "(%zu allocator log entries recovered), validating its content.",
+            ps.log_recovered);
+    }
+    if (root->dbnum != server.dbnum || !pheapIsAllocated(root->db) ||
+        pheapUsableSize(root->db) < sizeof(redisDb)*root->dbnum)
+    {
+        redisLog(REDIS_WARNING,"The persistent heap was created with a "
+                               "different number of databases, discarding "
+                               "its content.");
+        goto discard;
+    }
+
+    /* Validate and mark the whole keyspace. */
+    for (j = 0; j < server.dbnum && !w.err; j++) {
+        redisDb *db = root->db+j;
+
+        pheapWalkDict(&w,db->dict,&dbDictType,pheapWalkSdsVoid,
+                      pheapWalkObjectVoid);
+        if (w.err) break;
+        w.keys += dictSize(db->dict);
+        /* Keys of the expires dict are shared with the main dict. */
+        pheapWalkDict(&w,db->expires,&keyptrDictType,pheapWalkSdsVoid,NULL);
+    }
+    if (w.err) {
+        redisLog(REDIS_WARNING,"The persistent heap failed validation (%s), "
+                               "discarding its content.",
+                               pheapWalkErrorString(w.err));
+        goto discard;
+    }
+
+    /* Replace the empty dictionaries created by initServer() with the ones
+     * found in the image. */
+    for (j = 0; j < server.dbnum; j++) {
+        dictRelease(server.db[j].dict);
+        dictRelease(server.db[j].expires);
+        server.db[j].dict = root->db[j].dict;
+        server.db[j].expires = root->db[j].expires;
+    }
+    if (pheapSweep(1) == PHEAP_ERR) {
+        redisLog(REDIS_WARNING,"The persistent heap is corrupted. Exiting.");
+        exit(1);
+    }
+    redisLog(REDIS_NOTICE,"DB re-attached from the persistent heap: "
+        "%lld keys, %lld blocks, %.3f seconds",
+        w.keys, w.blocks, (float)(ustime()-start)/1000000);
+    return REDIS_OK;
+
+discard:
+    if (pheapSweep(0) == PHEAP_ERR) {
+        redisLog(REDIS_WARNING,"The persistent heap is corrupted. Exiting.");
+        exit(1);
+    }
+    return REDIS_ERR;
+}
+
+/* --------------------------- Persistent scope ----------------------------- */
+
+/* Only the keyspace is allocated in the persistent heap: clients, query
+ * buffers, replies and every other transient allocation stay in the volatile
+ * allocator. Code that adds to the keyspace enters the persistent scope of
+ * zmalloc, so that what it allocates with zmalloc() and zcalloc() comes from
+ * the heap (reallocations and frees always go to the allocator owning the
+ * pointer). The scope is entered:
+ *
+ * - By call() around write commands, see pheapDbBeginCommand().
+ * - While creating the databases and loading the RDB or AOF file.
+ * - By the code modifying the keyspace outside of commands: resizing of the
+ *   hash tables, serving of the clients blocked on lists, DEBUG POPULATE.
+ *
+ * Every pointer stored in the keyspace must be in the heap, otherwise the
+ * validation walk discards the image at restart. */
+
+/* Called by call() before executing the command of 'c'. Write commands
+ * run in the persistent scope. Their arguments are moved to the heap as
+ * well, since commands like SET or LPUSH store the argument objects in the
+ * keyspace as they are. Key names are not moved, the keyspace stores a copy
+ * of them. Returns the previous scope, that the caller restores with
+ * zmalloc_set_persistent_scope() once the command returns. */
+int pheapDbBeginCommand(redisClient *c) {
+    int *keys, numkeys, old, j, k;
+
+    if (!pheapIsPersistent() || !(c->cmd->flags & REDIS_CMD_WRITE))
+        return zmalloc_set_persistent_scope(0);
+
+    keys = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys,0);
+    old = zmalloc_set_persistent_scope(1);
+    for (j = 1; j < c->argc; j++) {
+        robj *o = c->argv[j];
+
+        for (k = 0; k < numkeys && keys[k] != j; k++);
+        if (k < numkeys || zmalloc_is_persistent(o)) continue;
+        c->argv[j] = sdsEncodedObject(o) ? dupStringObject(o) :
+                     createStringObjectFromLongLong((long)o->ptr);
+        decrRefCount(o);
+    }
+    getKeysFreeResult(keys);
+    return old;
+}
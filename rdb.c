@@ -325,7 +325,7 @@ int rdbSaveStringObject(rio *rdb, robj *obj) {
     if (obj->encoding == REDIS_ENCODING_INT) {
         return rdbSaveLongLongAsStringObject(rdb,(long)obj->ptr);
     } else {
-        redisAssertWithInfo(NULL,obj,obj->encoding == REDIS_ENCODING_RAW);
+        redisAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
         return rdbSaveRawString(rdb,obj->ptr,sdslen(obj->ptr));
     }
 }
@@ -721,9 +721,19 @@ int rdbSaveBackground(char *filename) {
 
     if (server.rdb_child_pid != -1) return REDIS_ERR;
 
+    /* The persistent heap is a MAP_SHARED mapping: a child would not get a
+     * point in time copy of the dataset, but see the changes the parent
+     * makes while it saves. */
+    if (pheapIsPersistent()) {
+        redisLog(REDIS_WARNING,"Can't save in background: the dataset lives "
+                               "in the persistent heap, use SAVE instead.");
+        return REDIS_ERR;
+    }
+
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
 
+    tierPrepareFork();
     start = ustime();
     if ((childpid = fork()) == 0) {
         int retval;
@@ -798,7 +808,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             /* If we are using a ziplist and the value is too big, convert
              * the object to a real list. */
             if (o->encoding == REDIS_ENCODING_ZIPLIST &&
-                ele->encoding == REDIS_ENCODING_RAW &&
+                sdsEncodedObject(ele) &&
                 sdslen(ele->ptr) > server.list_max_ziplist_value)
                     listTypeConvert(o,REDIS_ENCODING_LINKEDLIST);
 
@@ -872,7 +882,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             if (rdbLoadDoubleValue(rdb,&score) == -1) return NULL;
 
             /* Don't care about integer-encoded strings. */
-            if (ele->encoding == REDIS_ENCODING_RAW &&
+            if (sdsEncodedObject(ele) &&
                 sdslen(ele->ptr) > maxelelen)
                     maxelelen = sdslen(ele->ptr);
 
@@ -906,10 +916,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             /* Load raw strings */
             field = rdbLoadStringObject(rdb);
             if (field == NULL) return NULL;
-            redisAssert(field->encoding == REDIS_ENCODING_RAW);
+            redisAssert(sdsEncodedObject(field));
             value = rdbLoadStringObject(rdb);
             if (value == NULL) return NULL;
-            redisAssert(field->encoding == REDIS_ENCODING_RAW);
+            redisAssert(sdsEncodedObject(field));
 
             /* Add pair to ziplist */
             o->ptr = ziplistPush(o->ptr, field->ptr, sdslen(field->ptr), ZIPLIST_TAIL);
@@ -1081,7 +1091,7 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
 
 int rdbLoad(char *filename) {
     uint32_t dbid;
-    int type, rdbver;
+    int type, rdbver, persistent;
     redisDb *db = server.db+0;
     char buf[1024];
     long long expiretime, now = mstime();
@@ -1145,9 +1155,10 @@ int rdbLoad(char *filename) {
             db = server.db+dbid;
             continue;
         }
-        /* Read key */
+        /* Read key and value. With the persistent heap they are allocated
+         * in the heap, where the keyspace is (see pheapdb.c). */
+        persistent = zmalloc_set_persistent_scope(1);
         if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
-        /* Read value */
         if ((val = rdbLoadObject(type,&rdb)) == NULL) goto eoferr;
         /* Check if the key already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
@@ -1157,6 +1168,7 @@ int rdbLoad(char *filename) {
         if (server.masterhost == NULL && expiretime != -1 && expiretime < now) {
             decrRefCount(key);
             decrRefCount(val);
+            zmalloc_set_persistent_scope(persistent);
             continue;
         }
         /* Add the new object in the hash table */
@@ -1166,6 +1178,7 @@ int rdbLoad(char *filename) {
         if (expiretime != -1) setExpire(db,key,expiretime);
 
         decrRefCount(key);
+        zmalloc_set_persistent_scope(persistent);
     }
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5 && server.rdb_checksum) {
@@ -1241,6 +1254,9 @@ void bgsaveCommand(redisClient *c) {
         addReplyError(c,"Background save already in progress");
     } else if (server.aof_child_pid != -1) {
         addReplyError(c,"Can't BGSAVE while AOF log rewriting is in progress");
+    } else if (pheapIsPersistent()) {
+        addReplyError(c,"Can't BGSAVE: the dataset lives in the persistent "
+                        "heap, use SAVE instead");
     } else if (rdbSaveBackground(server.rdb_filename) == REDIS_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
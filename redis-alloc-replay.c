@@ -0,0 +1,374 @@
+/* redis-alloc-replay: replay an allocation trace against different allocators.
+ *
+ * The trace is recorded by a running server with "CONFIG SET alloc-trace yes"
+ * (see zmalloc_trace_start()). Every allocator selected is evaluated in a
+ * child process of its own, so that the peak RSS reported by the kernel for
+ * the child only accounts for that allocator. For every allocator we report:
+ *
+ * - Throughput: trace operations replayed per second.
+ * - Peak RSS: maximum resident set size of the child, minus the memory that
+ *   was already resident before the replay and the memory used by the table
+ *   mapping traced pointers to replayed pointers.
+ * - Fragmentation: RSS / used memory at the end of the replay, with the same
+ *   corrections applied to the RSS.
+ *
+ * The allocators available are the ones zmalloc was compiled with (see the
+ * MALLOC option of the Makefile) plus libc, and the persistent heap when a
+ * file for it is given with --pheap-file.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "zmalloc.h"
+#include "pheap.h"
+
+#define REPLAY_BUFFER_RECORDS 4096
+#define REPLAY_COMMIT_EVERY 1024 /* Records between persistent heap commits. */
+
+/* Traced pointers are mapped to the replayed ones with an open addressing
+ * hash table. The table is obtained with mmap() so that it does not share
+ * the heap of the allocator being evaluated. */
+#define REPLAY_EMPTY 0
+#define REPLAY_DELETED 1    /* No allocator returns 1 as a pointer. */
+
+typedef struct replayEntry {
+    uint64_t id;
+    void *ptr;
+} replayEntry;
+
+typedef struct replayResult {
+    unsigned long long ops;     /* Records replayed. */
+    unsigned long long skipped; /* Frees of pointers allocated before tracing. */
+    double seconds;
+    size_t base_rss;            /* RSS before replaying. */
+    size_t table_peak;          /* Max bytes used by the pointers table. */
+    size_t used_memory;         /* zmalloc used memory at the end. */
+    size_t peak_used_memory;
+    size_t rss;                 /* RSS at the end. */
+} replayResult;
+
+static replayEntry *table = NULL;
+static size_t table_size = 0, table_used = 0, table_deleted = 0;
+static size_t table_peak = 0;
+
+static size_t tableBytes(size_t size) {
+    return sizeof(replayEntry)*size;
+}
+
+static replayEntry *tableAlloc(size_t size) {
+    void *p = mmap(NULL,tableBytes(size),PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static size_t tableSlot(uint64_t id, size_t size) {
+    return (size_t)((id >> 4) * 0x9E3779B97F4A7C15ULL) & (size-1);
+}
+
+/* Return the entry of 'id', or the slot where it should be inserted. */
+static replayEntry *tableLookup(uint64_t id) {
+    size_t idx = tableSlot(id,table_size);
+    replayEntry *tomb = NULL;
+
+    while (table[idx].id != REPLAY_EMPTY) {
+        if (table[idx].id == id) return table+idx;
+        if (table[idx].id == REPLAY_DELETED && tomb == NULL) tomb = table+idx;
+        idx = (idx+1) & (table_size-1);
+    }
+    return tomb ? tomb : table+idx;
+}
+
+static void tableResize(size_t size) {
+    replayEntry *old = table;
+    size_t oldsize = table_size, j;
+
+    table = tableAlloc(size);
+    table_size = size;
+    table_deleted = 0;
+    for (j = 0; j < oldsize; j++) {
+        if (old[j].id > REPLAY_DELETED) *tableLookup(old[j].id) = old[j];
+    }
+    if (old) munmap(old,tableBytes(oldsize));
+    if (tableBytes(size) > table_peak) table_peak = tableBytes(size);
+}
+
+static void tableSet(uint64_t id, void *ptr) {
+    replayEntry *e;
+
+    if ((table_used+table_deleted+1)*2 > table_size) {
+        tableResize(table_used*4 > table_size ? table_size*2 : table_size);
+    }
+    e = tableLookup(id);
+    if (e->id == id) {
+        /* Reused before its release was recorded: this only happens
+         * when threads race, the old block is released now. */
+        zfree(e->ptr);
+    } else {
+        if (e->id == REPLAY_DELETED) table_deleted--;
+        table_used++;
+    }
+    e->id = id;
+    e->ptr = ptr;
+}
+
+static void *tableDel(uint64_t id) {
+    replayEntry *e = tableLookup(id);
+
+    if (e->id != id) return NULL;
+    e->id = REPLAY_DELETED;
+    table_used--;
+    table_deleted++;
+    return e->ptr;
+}
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Replay the trace in 'fd' using the current zmalloc backend. */
+static void replay(int fd, replayResult *res) {
+    static zmallocTraceRecord buf[REPLAY_BUFFER_RECORDS];
+    ssize_t nread;
+    long long start;
+    size_t j;
+
+    memset(res,0,sizeof(*res));
+    tableResize(1024);
+    res->base_rss = zmalloc_get_rss();
+    start = ustime();
+    while ((nread = read(fd,buf,sizeof(buf))) > 0) {
+        size_t count = nread/sizeof(zmallocTraceRecord);
+
+        for (j = 0; j < count; j++) {
+            zmallocTraceRecord *r = buf+j;
+            size_t size = r->size ? r->size : 1;
+            void *ptr;
+
+            switch(r->op) {
+            case ZMALLOC_TRACE_MALLOC:
+                tableSet(r->ptr,zmalloc(size));
+                break;
+            case ZMALLOC_TRACE_CALLOC:
+                tableSet(r->ptr,zcalloc(size));
+                break;
+            case ZMALLOC_TRACE_REALLOC:
+                /* A pointer allocated before the trace started is
+                 * reallocated as a new allocation. */
+                ptr = tableDel(r->oldptr);
+                tableSet(r->ptr,zrealloc(ptr,size));
+                break;
+            case ZMALLOC_TRACE_FREE:
+                if ((ptr = tableDel(r->ptr)) != NULL) zfree(ptr);
+                else res->skipped++;
+                break;
+            }
+            if (zmalloc_used_memory() > res->peak_used_memory)
+                res->peak_used_memory = zmalloc_used_memory();
+            if (pheapIsPersistent() && (res->ops % REPLAY_COMMIT_EVERY) == 0)
+                pheapCommit();
+            res->ops++;
+        }
+    }
+    if (nread == -1) {
+        perror("read");
+        exit(1);
+    }
+    res->seconds = (double)(ustime()-start)/1000000;
+    res->used_memory = zmalloc_used_memory();
+    res->rss = zmalloc_get_rss();
+    res->table_peak = table_peak;
+}
+
+/* Replay the trace using 'allocator' in a child process, and print the
+ * results. Returns 0 on success, -1 if the child failed. */
+static int replayWith(const char *filename, const char *allocator,
+                      const char *pheap_file, size_t pheap_size)
+{
+    int pipefd[2], status;
+    struct rusage ru;
+    replayResult res;
+    pid_t pid;
+
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        zmallocTraceHeader hdr;
+        int fd = open(filename,O_RDONLY);
+
+        close(pipefd[0]);
+        if (fd == -1 || read(fd,&hdr,sizeof(hdr)) != sizeof(hdr)) {
+            fprintf(stderr,"Can't read %s\n", filename);
+            _exit(1);
+        }
+        if (!strcasecmp(allocator,"pheap")) {
+            unlink(pheap_file);
+            if (pheapOpen(pheap_file,pheap_size,0) == PHEAP_ERR) {
+                fprintf(stderr,"Can't open the persistent heap %s: %s\n",
+                    pheap_file, strerror(errno));
+                _exit(1);
+            }
+        }
+        if (zmalloc_set_backend(allocator) == -1) {
+            fprintf(stderr,"Allocator %s not available\n", allocator);
+            _exit(1);
+        }
+        replay(fd,&res);
+        if (write(pipefd[1],&res,sizeof(res)) != sizeof(res)) _exit(1);
+        if (!strcasecmp(allocator,"pheap")) unlink(pheap_file);
+        _exit(0);
+    }
+
+    close(pipefd[1]);
+    if (read(pipefd[0],&res,sizeof(res)) != sizeof(res)) {
+        close(pipefd[0]);
+        waitpid(pid,NULL,0);
+        return -1;
+    }
+    close(pipefd[0]);
+    if (wait4(pid,&status,0,&ru) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) return -1;
+
+    {
+        /* ru_maxrss is in kilobytes. */
+        size_t overhead = res.base_rss + res.table_peak;
+        size_t peak_rss = (size_t)ru.ru_maxrss*1024;
+        size_t rss = res.rss;
+
+        peak_rss = peak_rss > overhead ? peak_rss-overhead : 0;
+        rss = rss > overhead ? rss-overhead : 0;
+        printf("%-10s %14.0f %14.2f %14.2f %10.2f %10llu\n", allocator,
+            res.seconds ? res.ops/res.seconds : 0,
+            (double)res.peak_used_memory/(1024*1024),
+            (double)peak_rss/(1024*1024),
+            res.used_memory ? (double)rss/res.used_memory : 0,
+            res.skipped);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+"Usage: redis-alloc-replay [options] <trace> [allocator ...]\n"
+"  --pheap-file <file>  Also replay against the persistent heap using <file>\n"
+"  --pheap-size <bytes> Size of the persistent heap (default 1GB)\n"
+"\n"
+"Allocators: libc, jemalloc, tcmalloc (when compiled in), pheap.\n"
+"Without allocators every available one is used.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *defaults[] = {"libc","jemalloc","tcmalloc",NULL};
+    const char *pheap_file = NULL, *filename = NULL;
+    size_t pheap_size = 1024*1024*1024;
+    const char **allocators;
+    zmallocTraceHeader hdr;
+    int j, fd, numalloc = 0, errors = 0;
+
+    allocators = malloc(sizeof(char*)*(argc+4));
+    for (j = 1; j < argc; j++) {
+        int lastarg = j == argc-1;
+
+        if (!strcmp(argv[j],"--pheap-file") && !lastarg) {
+            pheap_file = argv[++j];
+        } else if (!strcmp(argv[j],"--pheap-size") && !lastarg) {
+            pheap_size = strtoull(argv[++j],NULL,10);
+        } else if (argv[j][0] == '-') {
+            usage();
+        } else if (filename == NULL) {
+            filename = argv[j];
+        } else {
+            allocators[numalloc++] = argv[j];
+        }
+    }
+    if (filename == NULL) usage();
+    if (numalloc == 0) {
+        for (j = 0; defaults[j]; j++) {
+            if (zmalloc_get_backend(defaults[j]))
+                allocators[numalloc++] = defaults[j];
+        }
+        if (pheap_file) allocators[numalloc++] = "pheap";
+    }
+    for (j = 0; j < numalloc; j++) {
+        if (!strcasecmp(allocators[j],"pheap") && pheap_file == NULL) {
+            fprintf(stderr,"The pheap allocator requires --pheap-file\n");
+            exit(1);
+        }
+    }
+
+    if ((fd = open(filename,O_RDONLY)) == -1) {
+        fprintf(stderr,"Can't open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    if (read(fd,&hdr,sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic,ZMALLOC_TRACE_MAGIC,sizeof(hdr.magic)) != 0 ||
+        hdr.record_size != sizeof(zmallocTraceRecord))
+    {
+        fprintf(stderr,"%s is not a valid allocation trace\n", filename);
+        exit(1);
+    }
+    close(fd);
+
+    printf("%-10s %14s %14s %14s %10s %10s\n", "allocator", "ops/sec",
+        "peak_used_MB", "peak_rss_MB", "frag", "skipped");
+    fflush(stdout);
+    for (j = 0; j < numalloc; j++) {
+        if (replayWith(filename,allocators[j],pheap_file,pheap_size) == -1) {
+            fprintf(stderr,"Replay with %s failed\n", allocators[j]);
+            errors++;
+        }
+    }
+    free(allocators);
+    return errors ? 1 : 0;
+}
@@ -125,6 +125,7 @@ struct redisCommand redisCommandTable[] = {
     {"append",appendCommand,3,"wm",0,NULL,1,1,1,0,0},
     {"strlen",strlenCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"del",delCommand,-2,"w",0,NULL,1,-1,1,0,0},
+    {"unlink",unlinkCommand,-2,"w",0,NULL,1,-1,1,0,0},
     {"exists",existsCommand,2,"rF",0,NULL,1,1,1,0,0},
     {"setbit",setbitCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"getbit",getbitCommand,3,"rF",0,NULL,1,1,1,0,0},
@@ -234,8 +235,8 @@ struct redisCommand redisCommandTable[] = {
     {"sync",syncCommand,1,"ars",0,NULL,0,0,0,0,0},
     {"psync",syncCommand,3,"ars",0,NULL,0,0,0,0,0},
     {"replconf",replconfCommand,-1,"arslt",0,NULL,0,0,0,0,0},
-    {"flushdb",flushdbCommand,1,"w",0,NULL,0,0,0,0,0},
-    {"flushall",flushallCommand,1,"w",0,NULL,0,0,0,0,0},
+    {"flushdb",flushdbCommand,-1,"w",0,NULL,0,0,0,0,0},
+    {"flushall",flushallCommand,-1,"w",0,NULL,0,0,0,0,0},
     {"sort",sortCommand,-2,"wm",0,NULL,1,1,1,0,0},
     {"info",infoCommand,-1,"rlt",0,NULL,0,0,0,0,0},
     {"monitor",monitorCommand,1,"ars",0,NULL,0,0,0,0,0},
@@ -439,6 +440,12 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Keys of db->dict may live in the arena of the db, that is the privdata. */
+void dictDbKeyDestructor(void *privdata, void *val)
+{
+    dbFreeKey(privdata,val);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -480,7 +487,7 @@ int dictEncObjKeyCompare(void *privdata, const void *key1,
 unsigned int dictEncObjHash(const void *key) {
     robj *o = (robj*) key;
 
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
     } else {
         if (o->encoding == REDIS_ENCODING_INT) {
@@ -526,7 +533,7 @@ dictType dbDictType = {
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
+    dictDbKeyDestructor,        /* key destructor */
     dictRedisObjectDestructor   /* val destructor */
 };
 
@@ -606,10 +613,13 @@ int htNeedsResize(dict *dict) {
 /* If the percentage of used slots in the HT reaches REDIS_HT_MINFILL
  * we resize the hash table to save memory */
 void tryResizeHashTables(int dbid) {
+    int persistent = zmalloc_set_persistent_scope(1);
+
     if (htNeedsResize(server.db[dbid].dict))
         dictResize(server.db[dbid].dict);
     if (htNeedsResize(server.db[dbid].expires))
         dictResize(server.db[dbid].expires);
+    zmalloc_set_persistent_scope(persistent);
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -666,7 +676,10 @@ int activeExpireCycleTryExpire(redisDb *db, struct dictEntry *de, long long now)
         robj *keyobj = createStringObject(key,sdslen(key));
 
         propagateExpire(db,keyobj);
-        dbDelete(db,keyobj);
+        if (server.lazyfree_lazy_expire)
+            dbAsyncDelete(db,keyobj);
+        else
+            dbSyncDelete(db,keyobj);
         notifyKeyspaceEvent(REDIS_NOTIFY_EXPIRED,
             "expired",keyobj,db->id);
         decrRefCount(keyobj);
@@ -875,9 +888,13 @@ int clientsCronHandleTimeout(redisClient *c) {
  *
  * The function always returns 0 as it never terminates the client. */
 int clientsCronResizeQueryBuffer(redisClient *c) {
-    size_t querybuf_size = sdsAllocSize(c->querybuf);
+    size_t querybuf_size;
     time_t idletime = server.unixtime - c->lastinteraction;
 
+    /* Idle clients have no query buffer, see clientReleaseQueryBuffer(). */
+    if (c->querybuf == NULL) return 0;
+    querybuf_size = sdsAllocSize(c->querybuf);
+
     /* There are two conditions to resize the query buffer:
      * 1) Query buffer is > BIG_ARG and too big for latest peak.
      * 2) Client is inactive and the buffer is bigger than 1k. */
@@ -968,6 +985,15 @@ void databasesCron(void) {
             }
         }
     }
+
+    /* Install the tables allocated in background, request the next ones. */
+    rehashCron();
+
+    /* Move cold values to the second memory tier. */
+    tierCron();
+
+    /* Move values out of sparsely used pages if fragmentation is high. */
+    activeDefragCycle();
 }
 
 /* We take a cached value of the unix time in the global state because with
@@ -1104,9 +1130,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             }
             updateDictResizePolicy();
         }
-    } else {
+    } else if (!pheapIsPersistent()) {
         /* If there is not a background saving/rewrite in progress check if
-         * we have to save/rewrite now */
+         * we have to save/rewrite now. This is not possible when the dataset
+         * lives in the persistent heap, see rdbSaveBackground(). */
          for (j = 0; j < server.saveparamslen; j++) {
             struct saveparam *sp = server.saveparams+j;
 
@@ -1160,6 +1187,12 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Close clients that need to be closed asynchronous */
     freeClientsInAsyncFreeQueue();
 
+    /* Write the allocation trace recorded so far, if enabled. */
+    allocTraceCron();
+
+    /* Drop the references the lazy free thread left to us. */
+    lazyfreeCron();
+
     /* Replication cron function -- used to reconnect to master and
      * to detect transfer failures. */
     run_with_period(1000) replicationCron();
@@ -1181,6 +1214,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     listNode *ln;
     redisClient *c;
 
+    /* Read and execute the queries of the clients queued for the I/O
+     * threads. */
+    handleClientsWithPendingReads();
+
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
     if (server.active_expire_enabled && server.masterhost == NULL)
@@ -1204,6 +1241,16 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
+
+    /* Commit the persistent heap transaction: every command executed in
+     * this iteration of the event loop completed, so the blocks they freed
+     * can be released. */
+    pheapCommit();
+
+    /* Write the replies queued for the I/O threads. This is done last, so
+     * that replies are sent only once the AOF was written and the heap
+     * transaction committed. */
+    handleClientsWithPendingWrites();
 }
 
 /* =========================== Server initialization ======================== */
@@ -1344,6 +1391,29 @@ void initServerConfig(void) {
     server.pidfile = zstrdup(REDIS_DEFAULT_PID_FILE);
     server.rdb_filename = zstrdup(REDIS_DEFAULT_RDB_FILENAME);
     server.aof_filename = zstrdup(REDIS_DEFAULT_AOF_FILENAME);
+    server.pheap_file = zstrdup(REDIS_DEFAULT_PHEAP_FILE);
+    server.pheap_size = REDIS_DEFAULT_PHEAP_SIZE;
+    server.hugepages = REDIS_DEFAULT_HUGEPAGES;
+    server.keyspace_buckets = REDIS_DEFAULT_KEYSPACE_BUCKETS;
+    server.hash_function = dictGetHashFunction();
+    server.tier_enabled = REDIS_DEFAULT_TIERING;
+    server.tier_file = zstrdup(REDIS_DEFAULT_TIER_FILE);
+    server.tier_size = REDIS_DEFAULT_TIER_SIZE;
+    server.tier_cold_age = REDIS_DEFAULT_TIER_COLD_AGE;
+    server.alloc_trace = REDIS_DEFAULT_ALLOC_TRACE;
+    server.active_defrag_enabled = REDIS_DEFAULT_ACTIVE_DEFRAG;
+    server.active_defrag_threshold = REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD;
+    server.active_defrag_cycle = REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE;
+    server.active_defrag_running = 0;
+    server.lazyfree_lazy_eviction = REDIS_DEFAULT_LAZYFREE_LAZY_EVICTION;
+    server.lazyfree_lazy_expire = REDIS_DEFAULT_LAZYFREE_LAZY_EXPIRE;
+    server.lazyfree_lazy_server_del = REDIS_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.rehash_prealloc = REDIS_DEFAULT_REHASH_PREALLOC;
+    server.io_threads_num = REDIS_DEFAULT_IO_THREADS_NUM;
+    server.io_threads_do_reads = REDIS_DEFAULT_IO_THREADS_DO_READS;
+    server.alloc_trace_file = zstrdup(REDIS_DEFAULT_ALLOC_TRACE_FILE);
+    server.alloc_trace_fd = -1;
+    server.pheap_root = NULL;
     server.requirepass = NULL;
     server.rdb_compression = REDIS_DEFAULT_RDB_COMPRESSION;
     server.rdb_checksum = REDIS_DEFAULT_RDB_CHECKSUM;
@@ -1597,6 +1667,14 @@ void resetServerStats(void) {
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
     server.stat_evictedkeys = 0;
+    server.stat_io_reads_processed = 0;
+    server.stat_io_writes_processed = 0;
+    server.stat_querybuf_pool_hits = 0;
+    server.stat_querybuf_pool_misses = 0;
+    server.stat_tier_demoted = 0;
+    server.stat_tier_promoted = 0;
+    server.stat_active_defrag_hits = 0;
+    server.stat_active_defrag_reclaimed = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_fork_time = 0;
@@ -1612,7 +1690,7 @@ void resetServerStats(void) {
 }
 
 void initServer(void) {
-    int j;
+    int j, persistent;
 
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
@@ -1623,9 +1701,25 @@ void initServer(void) {
             server.syslog_facility);
     }
 
+    /* The hash function is selected by loadServerAllocatorConfig(), or by
+     * pheapDbInit() as the one of the heap image, before anything is
+     * hashed: a different "hash-function" in an included file is late. */
+    if (server.hash_function != dictGetHashFunction()) {
+        redisLog(REDIS_WARNING,
+            "hash-function %s ignored, using %s: it must be set in the main "
+            "config file or with --hash-function, and a persistent heap "
+            "image keeps the function it was created with.",
+            dictHashFunctionName(server.hash_function),
+            dictHashFunctionName(dictGetHashFunction()));
+        server.hash_function = dictGetHashFunction();
+    }
+    dictSetTableFreeFunction(rehashFreeTable);
+
     server.current_client = NULL;
     server.clients = listCreate();
     server.clients_to_close = listCreate();
+    server.clients_pending_write = listCreate();
+    server.clients_pending_read = listCreate();
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
@@ -1635,7 +1729,6 @@ void initServer(void) {
     createSharedObjects();
     adjustOpenFilesLimit();
     server.el = aeCreateEventLoop(server.maxclients+REDIS_EVENTLOOP_FDSET_INCR);
-    server.db = zmalloc(sizeof(redisDb)*server.dbnum);
 
     /* Open the TCP listening socket for the user commands. */
     if (server.port != 0 &&
@@ -1660,16 +1753,27 @@ void initServer(void) {
         exit(1);
     }
 
-    /* Create the Redis databases, and initialize other internal state. */
+    /* Create the Redis databases, and initialize other internal state.
+     * With the persistent heap the databases and their dicts are allocated
+     * in the heap, see pheapdb.c. */
+    persistent = zmalloc_set_persistent_scope(1);
+    server.db = zmalloc(sizeof(redisDb)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) {
+        server.db[j].arena = zarena_create();
+        dbCreateDicts(server.db+j);
+    }
+    /* With the persistent heap the keyspace lives in the heap image: store
+     * in the heap root where to find it. */
+    pheapDbCreateRoot();
+    zmalloc_set_persistent_scope(persistent);
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
-        server.db[j].expires = dictCreate(&keyptrDictType,NULL);
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&setDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
     }
+    if (server.tier_enabled) tierInit();
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
@@ -1741,6 +1845,11 @@ void initServer(void) {
     slowlogInit();
     latencyMonitorInit();
     bioInit();
+    initThreadedIO();
+
+    /* The allocation trace is flushed by a bio thread, so it can only be
+     * started now. */
+    if (server.alloc_trace && startAllocTrace() == REDIS_ERR) exit(1);
 }
 
 /* Populates the Redis Command Table starting from the hard coded list
@@ -1896,6 +2005,7 @@ void forceCommandPropagation(redisClient *c, int flags) {
 void call(redisClient *c, int flags) {
     long long dirty, start, duration;
     int client_old_flags = c->flags;
+    int persistent;
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
      * not generated from reading an AOF. */
@@ -1911,7 +2021,9 @@ void call(redisClient *c, int flags) {
     redisOpArrayInit(&server.also_propagate);
     dirty = server.dirty;
     start = ustime();
+    persistent = pheapDbBeginCommand(c);
     c->cmd->proc(c);
+    zmalloc_set_persistent_scope(persistent);
     duration = ustime()-start;
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
@@ -2196,6 +2308,10 @@ int prepareForShutdown(int flags) {
             return REDIS_ERR;
         }
     }
+    if (pheapIsPersistent()) {
+        redisLog(REDIS_NOTICE,"Syncing the persistent heap on disk.");
+        pheapMarkClean();
+    }
     if (server.daemonize) {
         redisLog(REDIS_NOTICE,"Removing the pid file.");
         unlink(server.pidfile);
@@ -2492,10 +2608,17 @@ sds genRedisInfoString(char *section) {
             "connected_clients:%lu\r\n"
             "client_longest_output_list:%lu\r\n"
             "client_biggest_input_buf:%lu\r\n"
-            "blocked_clients:%d\r\n",
+            "blocked_clients:%d\r\n"
+            "querybuf_pool_size:%d\r\n"
+            "querybuf_pool_hit_rate:%.2f\r\n",
             listLength(server.clients)-listLength(server.slaves),
             lol, bib,
-            server.bpop_blocked_clients);
+            server.bpop_blocked_clients,
+            queryBufferPoolSize(),
+            (server.stat_querybuf_pool_hits+server.stat_querybuf_pool_misses) ?
+                (double)server.stat_querybuf_pool_hits*100/
+                (server.stat_querybuf_pool_hits+
+                 server.stat_querybuf_pool_misses) : 0);
     }
 
     /* Memory */
@@ -2523,7 +2646,12 @@ sds genRedisInfoString(char *section) {
             "used_memory_peak_human:%s\r\n"
             "used_memory_lua:%lld\r\n"
             "mem_fragmentation_ratio:%.2f\r\n"
-            "mem_allocator:%s\r\n",
+            "mem_allocator:%s\r\n"
+            "active_defrag_running:%d\r\n"
+            "active_defrag_hits:%lld\r\n"
+            "active_defrag_reclaimed_bytes:%lld\r\n"
+            "lazyfree_pending_objects:%zu\r\n"
+            "lazyfree_pending_bytes:%zu\r\n",
             zmalloc_used,
             hmem,
             server.resident_set_size,
@@ -2531,8 +2659,70 @@ sds genRedisInfoString(char *section) {
             peak_hmem,
             ((long long)lua_gc(server.lua,LUA_GCCOUNT,0))*1024LL,
             zmalloc_get_fragmentation_ratio(server.resident_set_size),
-            ZMALLOC_LIB
+            zmalloc_backend_name(),
+            server.active_defrag_running,
+            server.stat_active_defrag_hits,
+            server.stat_active_defrag_reclaimed,
+            lazyfreeGetPendingObjects(),
+            lazyfreeGetPendingBytes()
             );
+        if (pheapIsPersistent()) {
+            pheapStats ps;
+
+            pheapGetStats(&ps);
+            info = sdscatprintf(info,
+                "pheap_size:%zu\r\n"
+                "pheap_used:%zu\r\n"
+                "pheap_top:%zu\r\n"
+                "pheap_free_blocks:%zu\r\n"
+                "pheap_dax:%d\r\n"
+                "pheap_log_commits:%zu\r\n"
+                "pheap_log_recovered:%zu\r\n"
+                "pheap_flushed_bytes:%zu\r\n",
+                ps.size, ps.used, ps.top, ps.free_blocks, ps.dax,
+                ps.commits, ps.log_recovered, ps.flushed);
+        }
+        if (zmalloc_huge_pages_enabled()) {
+            size_t mapped, hugetlb_maps, thp_maps;
+
+            zmalloc_get_huge_stats(&mapped,&hugetlb_maps,&thp_maps);
+            info = sdscatprintf(info,
+                "huge_pages_mapped:%zu\r\n"
+                "huge_pages_hugetlb_maps:%zu\r\n"
+                "huge_pages_thp_maps:%zu\r\n",
+                mapped, hugetlb_maps, thp_maps);
+        }
+        for (j = 0; zmalloc_get_slab(j); j++) {
+            zslab *slab = zmalloc_get_slab(j);
+            size_t capacity = zmalloc_slab_capacity(slab);
+
+            info = sdscatprintf(info,
+                "slab_%s:size=%zu,objects=%zu,pages=%zu,occupancy=%.2f\r\n",
+                slab->name, slab->size, slab->objects, slab->pages,
+                capacity ? (float)slab->objects/capacity : 0);
+        }
+        if (server.db[0].arena) {
+            size_t arenas = 0;
+
+            for (j = 0; j < server.dbnum; j++)
+                arenas += zarena_used_memory(server.db[j].arena);
+            info = sdscatprintf(info,"used_memory_db_arenas:%zu\r\n",arenas);
+        }
+        if (server.tier_enabled) {
+            size_t tier_used = zmalloc_tier_used_memory();
+
+            info = sdscatprintf(info,
+                "used_memory_dram:%zu\r\n"
+                "used_memory_tier:%zu\r\n"
+                "tier_size:%lld\r\n"
+                "tier_demoted_values:%lld\r\n"
+                "tier_promoted_values:%lld\r\n",
+                zmalloc_used-tier_used,
+                tier_used,
+                server.tier_size,
+                server.stat_tier_demoted,
+                server.stat_tier_promoted);
+        }
     }
 
     /* Persistence */
@@ -2639,7 +2829,9 @@ sds genRedisInfoString(char *section) {
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
-            "latest_fork_usec:%lld\r\n",
+            "latest_fork_usec:%lld\r\n"
+            "io_threaded_reads_processed:%lld\r\n"
+            "io_threaded_writes_processed:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getOperationsPerSecond(),
@@ -2653,7 +2845,9 @@ sds genRedisInfoString(char *section) {
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
             listLength(server.pubsub_patterns),
-            server.stat_fork_time);
+            server.stat_fork_time,
+            server.stat_io_reads_processed,
+            server.stat_io_writes_processed);
     }
 
     /* Replication */
@@ -2805,19 +2999,58 @@ sds genRedisInfoString(char *section) {
         }
     }
 
+    /* Allocator size classes */
+    if (allsections || !strcasecmp(section,"allocator")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        unsigned long long trace_records, trace_dropped;
+
+        info = sdscatprintf(info, "# Allocator\r\nallocator:%s\r\n",
+            zmalloc_backend_name());
+        zmalloc_trace_get_stats(&trace_records,&trace_dropped);
+        info = sdscatprintf(info,
+            "alloc_trace:%d\r\n"
+            "alloc_trace_records:%llu\r\n"
+            "alloc_trace_dropped:%llu\r\n",
+            server.alloc_trace_fd != -1, trace_records, trace_dropped);
+        for (j = 0; j < ZMALLOC_NUM_CLASSES; j++) {
+            zmallocClassStats cs;
+
+            zmalloc_get_class_stats(j,&cs);
+            if (!cs.allocs && !cs.reallocs && !cs.bytes) continue;
+            if (cs.size)
+                info = sdscatprintf(info,"class_%zu:",cs.size);
+            else
+                info = sdscatprintf(info,"class_inf:");
+            info = sdscatprintf(info,
+                "allocs=%llu,frees=%llu,reallocs=%llu,bytes=%zu\r\n",
+                cs.allocs, cs.frees, cs.reallocs, cs.bytes);
+        }
+    }
+
     /* Key space */
     if (allsections || defsections || !strcasecmp(section,"keyspace")) {
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info, "# Keyspace\r\n");
         for (j = 0; j < server.dbnum; j++) {
+            redisDb *db = server.db+j;
             long long keys, vkeys;
 
-            keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            keys = dictSize(db->dict);
+            vkeys = dictSize(db->expires);
             if (keys || vkeys) {
+                /* Rehashing progress is the percentage of buckets of the
+                 * main dict already moved to the new table. */
+                double progress = dictIsRehashing(db->dict) ?
+                    (double)db->dict->rehashidx*100/db->dict->ht[0].size : 0;
+
                 info = sdscatprintf(info,
-                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
-                    j, keys, vkeys, server.db[j].avg_ttl);
+                    "db%d:keys=%lld,expires=%lld,avg_ttl=%lld,"
+                    "table_bytes=%zu,rehashing=%d,rehash_progress=%.2f,"
+                    "prealloc_bytes=%zu\r\n",
+                    j, keys, vkeys, db->avg_ttl,
+                    dictTableMemory(db->dict)+dictTableMemory(db->expires),
+                    dictIsRehashing(db->dict) || dictIsRehashing(db->expires),
+                    progress, rehashPendingBytes(db));
             }
         }
     }
@@ -2865,7 +3098,7 @@ void monitorCommand(redisClient *c) {
  * used by the server.
  */
 int freeMemoryIfNeeded(void) {
-    size_t mem_used, mem_tofree, mem_freed;
+    size_t mem_used, mem_tofree, mem_freed, pending;
     int slaves = listLength(server.slaves);
     mstime_t latency;
 
@@ -2891,6 +3124,13 @@ int freeMemoryIfNeeded(void) {
         mem_used -= aofRewriteBufferSize();
     }
 
+    /* With tiering maxmemory only limits the memory used in DRAM. */
+    mem_used -= zmalloc_tier_used_memory();
+
+    /* Values handed to the lazy free thread are as good as released. */
+    pending = lazyfreeGetPendingBytes();
+    mem_used = (pending < mem_used) ? mem_used-pending : 0;
+
     /* Check if we are over the memory limit. */
     if (mem_used <= server.maxmemory) return REDIS_OK;
 
@@ -2986,10 +3226,18 @@ int freeMemoryIfNeeded(void) {
                  * that otherwise we would never exit the loop.
                  *
                  * AOF and Output buffer memory will be freed eventually so
-                 * we only care about memory used by the key space. */
-                delta = (long long) zmalloc_used_memory();
-                dbDelete(db,keyobj);
-                delta -= (long long) zmalloc_used_memory();
+                 * we only care about memory used by the key space.
+                 *
+                 * A value released in background is accounted as soon as
+                 * it is added to the pending lazy free bytes. */
+                delta = (long long) zmalloc_used_memory() -
+                        (long long) lazyfreeGetPendingBytes();
+                if (server.lazyfree_lazy_eviction)
+                    dbAsyncDelete(db,keyobj);
+                else
+                    dbSyncDelete(db,keyobj);
+                delta -= (long long) zmalloc_used_memory() -
+                         (long long) lazyfreeGetPendingBytes();
                 mem_freed += delta;
                 server.stat_evictedkeys++;
                 notifyKeyspaceEvent(REDIS_NOTIFY_EVICTED, "evicted",
@@ -3181,6 +3429,7 @@ int checkForSentinelMode(int argc, char **argv) {
 /* Function called at startup to load RDB or AOF file in memory. */
 void loadDataFromDisk(void) {
     long long start = ustime();
+    if (pheapDbLoad() == REDIS_OK) return;
     if (server.aof_state == REDIS_AOF_ON) {
         if (loadAppendOnlyFile(server.aof_filename) == REDIS_OK)
             redisLog(REDIS_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
@@ -3213,7 +3462,12 @@ void redisSetProcTitle(char *title) {
 }
 
 int main(int argc, char **argv) {
-    struct timeval tv;
+    unsigned char hashseed[DICT_HASH_SEED_LEN];
+
+    /* The allocator backend must be selected before the first zmalloc()
+     * call, since memory can't be freed by a different allocator. The
+     * hash function as well before anything is hashed. */
+    loadServerAllocatorConfig(argc,argv);
 
     /* We need to initialize our libraries, and the server configuration. */
 #ifdef INIT_SETPROCTITLE_REPLACEMENT
@@ -3223,9 +3477,10 @@ int main(int argc, char **argv) {
     zmalloc_enable_thread_safeness();
     zmalloc_set_oom_handler(redisOutOfMemoryHandler);
     srand(time(NULL)^getpid());
-    gettimeofday(&tv,NULL);
-    dictSetHashFunctionSeed(tv.tv_sec^tv.tv_usec^getpid());
+    getRandomBytes(hashseed,sizeof(hashseed));
+    dictSetHashFunctionSeed(hashseed);
     server.sentinel_mode = checkForSentinelMode(argc,argv);
+    pheapDbInit();
     initServerConfig();
 
     /* We need to init sentinel right now as parsing the configuration file
@@ -3291,6 +3546,21 @@ int main(int argc, char **argv) {
     } else {
         redisLog(REDIS_WARNING, "Warning: no config file specified, using the default config. In order to specify a config file use %s /path/to/%s.conf", argv[0], server.sentinel_mode ? "sentinel" : "redis");
     }
+    /* A dataset in the persistent heap can't be saved in background nor
+     * replicated, see loadServerAllocatorConfig(). */
+    if (pheapIsPersistent() && !server.sentinel_mode) {
+        if (server.saveparamslen) {
+            redisLog(REDIS_WARNING,"The persistent heap allocator can't be "
+                "used with save points: remove the save directives or use "
+                "save \"\". Exiting.");
+            exit(1);
+        }
+        if (server.masterhost) {
+            redisLog(REDIS_WARNING,"The persistent heap allocator can't be "
+                "used in a slave: remove the slaveof directive. Exiting.");
+            exit(1);
+        }
+    }
     if (server.daemonize) daemonize();
     initServer();
     if (server.daemonize) createPidFile();
@@ -65,6 +65,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
 #include "sparkline.h" /* ASII graphs API */
+#include "pheap.h"   /* Persistent heap allocator */
 
 /* Error codes */
 #define REDIS_OK                0
@@ -81,6 +82,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_CONFIGLINE_MAX    1024
 #define REDIS_DBCRON_DBS_PER_CALL 16
 #define REDIS_MAX_WRITE_PER_EVENT (1024*64)
+#define REDIS_IO_THREADS_MAX_NUM 128
 #define REDIS_SHARED_SELECT_CMDS 10
 #define REDIS_SHARED_INTEGERS 10000
 #define REDIS_SHARED_BULKHDR_LEN 32
@@ -130,6 +132,29 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_BINDADDR_MAX 16
 #define REDIS_MIN_RESERVED_FDS 32
 #define REDIS_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
+#define REDIS_DEFAULT_PHEAP_FILE "redis.heap"
+#define REDIS_DEFAULT_PHEAP_SIZE PHEAP_DEFAULT_SIZE
+#define REDIS_DEFAULT_HUGEPAGES 0
+#define REDIS_DEFAULT_KEYSPACE_BUCKETS 0
+#define REDIS_DEFAULT_HASH_FUNCTION DICT_HASH_SIPHASH
+#define REDIS_DEFAULT_TIERING 0
+#define REDIS_DEFAULT_TIER_FILE "redis.tier"
+#define REDIS_DEFAULT_TIER_SIZE (4LL*1024*1024*1024) /* 4 GB */
+#define REDIS_DEFAULT_TIER_COLD_AGE 3600   /* Seconds without access. */
+#define REDIS_DEFAULT_ALLOC_TRACE 0
+#define REDIS_DEFAULT_ACTIVE_DEFRAG 0
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_THRESHOLD 10 /* Fragmentation percent. */
+#define REDIS_DEFAULT_ACTIVE_DEFRAG_CYCLE 25 /* CPU percent of cron period. */
+#define REDIS_DEFAULT_LAZYFREE_LAZY_EVICTION 0
+#define REDIS_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
+#define REDIS_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define REDIS_DEFAULT_REHASH_PREALLOC 0
+#define REDIS_DEFAULT_IO_THREADS_NUM 1 /* Main thread only. */
+#define REDIS_DEFAULT_IO_THREADS_DO_READS 0
+#define REDIS_DEFAULT_ALLOC_TRACE_FILE "alloc.trace"
+#define REDIS_TIER_SAMPLES 20           /* Keys sampled per DB every cron. */
+#define REDIS_TIER_CRON_TIME_LIMIT 1000 /* Microseconds per cron call. */
+#define REDIS_ALLOCATOR_OPTION_MAX 256
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -141,6 +166,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define REDIS_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define REDIS_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define REDIS_REPLY_REF_MIN_BYTES (1024*4) /* Zero copy replies, see addReply() */
+#define REDIS_REPLY_POOL_MAX 512  /* Free reply chunks kept for reuse */
+#define REDIS_QUERYBUF_POOL_MAX 512 /* Free query buffers kept for reuse */
 #define REDIS_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define REDIS_MBULK_BIG_ARG     (1024*32)
 #define REDIS_LONGSTR_SIZE      21          /* Bytes needed for long -> str */
@@ -188,6 +216,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
 #define REDIS_ENCODING_INTSET 6  /* Encoded as intset */
 #define REDIS_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+#define REDIS_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
+
+/* Strings up to this length are stored with the EMBSTR encoding, so that
+ * the object and the sds fit a 64 bytes allocation. */
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 44
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -242,6 +275,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define REDIS_PRE_PSYNC (1<<16)   /* Instance don't understand PSYNC. */
 #define REDIS_READONLY (1<<17)    /* Cluster client is in read-only state. */
 #define REDIS_PUBSUB (1<<18)      /* Client is in Pub/Sub mode. */
+#define REDIS_PENDING_WRITE (1<<19) /* In server.clients_pending_write. */
+#define REDIS_PENDING_READ (1<<20)  /* In server.clients_pending_read. */
+#define REDIS_IO_ERROR (1<<21)    /* An I/O thread failed reading or writing:
+                                     the client is freed by the main thread. */
+#define REDIS_PENDING_COMMAND (1<<22) /* Query parsed by an I/O thread. */
 
 /* Client request types */
 #define REDIS_REQ_INLINE 1
@@ -410,16 +448,35 @@ typedef struct redisObject {
     _var.ptr = _ptr; \
 } while(0);
 
+/* True if the string object 'objptr' holds an sds (raw or embedded). */
+#define sdsEncodedObject(objptr) (objptr->encoding == REDIS_ENCODING_RAW || \
+                                  objptr->encoding == REDIS_ENCODING_EMBSTR)
+
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP) */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    zarena *arena;              /* Keys and entries of dict and expires */
     int id;
     long long avg_ttl;          /* Average TTL, just for stats */
 } redisDb;
 
+/* Root of the persistent heap (see pheap.c): when Redis runs with the
+ * "pheap" allocator this is what allows to find the keyspace again in the
+ * heap image after a restart. The magic changes every time the layout of
+ * the objects stored in the heap changes (version 2: compact sds headers,
+ * version 3: selectable hash function with a 128 bit seed). */
+#define REDIS_HEAP_ROOT_MAGIC 0x5244424845415033ULL /* "RDBHEAP3" */
+typedef struct redisHeapRoot {
+    uint64_t magic;
+    int hash_function;          /* DICT_HASH_* the dicts were hashed with. */
+    uint8_t hash_seed[DICT_HASH_SEED_LEN]; /* Seed of the hash function. */
+    int dbnum;
+    redisDb *db;
+} redisHeapRoot;
+
 /* Client MULTI/EXEC state */
 typedef struct multiCmd {
     robj **argv;
@@ -461,6 +518,22 @@ typedef struct readyList {
 
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a liked list. */
+/* Node of the reply list of a client. Byte chunks hold the protocol in
+ * 'buf': most are REDIS_REPLY_CHUNK_BYTES allocations recycled through a
+ * pool shared by all the clients. Reference chunks hold no bytes, but a
+ * reference to a string object whose sds is written as it is, so that big
+ * values are not copied. */
+typedef struct clientReplyBlock {
+    robj *obj;          /* Referenced object, NULL for byte chunks. */
+    size_t size;        /* Capacity of 'buf'. */
+    size_t used;        /* Bytes used in 'buf'. */
+    size_t memory;      /* Bytes accounted in the client reply_bytes. */
+    char buf[];
+} clientReplyBlock;
+
+#define replyBlockData(b) ((b)->obj ? (char*)(b)->obj->ptr : (b)->buf)
+#define replyBlockLen(b) ((b)->obj ? sdslen((b)->obj->ptr) : (b)->used)
+
 typedef struct redisClient {
     uint64_t id;            /* Client incremental unique ID. */
     int fd;
@@ -476,9 +549,11 @@ typedef struct redisClient {
     int multibulklen;       /* number of multi bulk arguments left to read */
     long bulklen;           /* length of bulk argument in multi bulk request */
     list *reply;
-    unsigned long reply_bytes; /* Tot bytes of objects in reply list */
+    unsigned long reply_bytes; /* Tot memory of the reply list chunks */
     int sentlen;            /* Amount of bytes already sent in the current
                                buffer or object being sent. */
+    int sentnodes;          /* Reply list nodes written but not yet released,
+                               see writeToClient(). */
     time_t ctime;           /* Client creation time */
     time_t lastinteraction; /* time of the last interaction, used for timeout */
     time_t obuf_soft_limit_reached_time;
@@ -618,6 +693,9 @@ struct redisServer {
     int sofd;                   /* Unix socket file descriptor */
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
+    list *clients_pending_write; /* Clients with replies to write, served by
+                                    the I/O threads before sleeping. */
+    list *clients_pending_read; /* Clients with data to read, same. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     redisClient *current_client; /* Current client, only used on crash report */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
@@ -637,6 +715,10 @@ struct redisServer {
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_tier_demoted;    /* Values moved to the second tier */
+    long long stat_tier_promoted;   /* Values moved back to DRAM */
+    long long stat_active_defrag_hits;  /* Allocations moved by defrag */
+    long long stat_active_defrag_reclaimed; /* RSS bytes released by defrag */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     size_t stat_peak_memory;        /* Max used memory record */
@@ -646,6 +728,10 @@ struct redisServer {
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    long long stat_io_reads_processed;  /* Reads performed by I/O threads */
+    long long stat_io_writes_processed; /* Writes performed by I/O threads */
+    long long stat_querybuf_pool_hits;  /* Query buffers taken from the pool */
+    long long stat_querybuf_pool_misses;/* Query buffers allocated */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
@@ -706,6 +792,37 @@ struct redisServer {
     time_t rdb_save_time_start;     /* Current RDB save start time. */
     int lastbgsave_status;          /* REDIS_OK or REDIS_ERR */
     int stop_writes_on_bgsave_err;  /* Don't allow writes if can't BGSAVE */
+    /* Persistent heap */
+    char *pheap_file;               /* File backing the persistent heap */
+    long long pheap_size;           /* Size of the persistent heap file */
+    redisHeapRoot *pheap_root;      /* Root stored in the persistent heap */
+    int hugepages;                  /* Keyspace in huge page arenas */
+    int keyspace_buckets;           /* Bucketed hash tables for the keyspace */
+    int hash_function;              /* DICT_HASH_* of the dict hash functions */
+    /* Tiered memory */
+    int tier_enabled;               /* Move cold values to a second tier */
+    char *tier_file;                /* File backing the second tier */
+    long long tier_size;            /* Size of the second tier */
+    int tier_cold_age;              /* Idle seconds before demoting a value */
+    /* Active defragmentation */
+    int active_defrag_enabled;      /* Move values out of sparse pages */
+    int active_defrag_threshold;    /* Min fragmentation percent to start */
+    int active_defrag_cycle;        /* Max CPU percent used by the cycle */
+    int active_defrag_running;      /* A keyspace scan is in progress */
+    /* Lazy freeing */
+    int lazyfree_lazy_eviction;     /* Evicted values are freed in background */
+    int lazyfree_lazy_expire;       /* Expired values are freed in background */
+    int lazyfree_lazy_server_del;   /* Same for values deleted by dbDelete() */
+    /* Keyspace tables */
+    int rehash_prealloc;            /* Allocate the next tables in background */
+    /* Threaded I/O */
+    int io_threads_num;             /* I/O threads, including the main one */
+    int io_threads_do_reads;        /* Also read and parse queries in threads */
+    int io_threads_active;          /* Enough clients to wake up the threads */
+    /* Allocation trace */
+    int alloc_trace;                /* Record allocations to alloc_trace_file */
+    char *alloc_trace_file;         /* Where the allocation trace is written */
+    int alloc_trace_fd;             /* Trace file descriptor, -1 if not active */
     /* Propagation of commands in AOF / replication */
     redisOpArray also_propagate;    /* Additional command to propagate. */
     /* Logging */
@@ -903,6 +1020,7 @@ extern struct sharedObjectsStruct shared;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType dbDictType;
+extern dictType keyptrDictType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
@@ -915,6 +1033,7 @@ extern dictType replScriptCacheDictType;
 /* Utils */
 long long ustime(void);
 long long mstime(void);
+void getRandomBytes(unsigned char *p, unsigned int len);
 void getRandomHexChars(char *p, unsigned int len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
@@ -948,6 +1067,9 @@ void addReplyLongLong(redisClient *c, long long ll);
 void addReplyMultiBulkLen(redisClient *c, long length);
 void copyClientOutputBuffer(redisClient *dst, redisClient *src);
 void *dupClientReplyValue(void *o);
+void freeClientReplyValue(void *o);
+int queryBufferPoolSize(void);
+size_t zmalloc_size_sds(sds s);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 void formatPeerId(char *peerid, size_t peerid_len, char *ip, int port);
@@ -965,6 +1087,11 @@ char *getClientTypeName(int class);
 void flushSlavesOutputBuffers(void);
 void disconnectSlaves(void);
 int processEventsWhileBlocked(void);
+int writeToClient(redisClient *c, int handler_installed);
+void unlinkClientFromPendingLists(redisClient *c);
+void initThreadedIO(void);
+int handleClientsWithPendingReads(void);
+int handleClientsWithPendingWrites(void);
 
 #ifdef __GNUC__
 void addReplyErrorFormat(redisClient *c, const char *fmt, ...)
@@ -1010,17 +1137,20 @@ void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
 robj *resetRefCount(robj *obj);
 void freeStringObject(robj *o);
+void freeObjectStruct(robj *o);
 void freeListObject(robj *o);
 void freeSetObject(robj *o);
 void freeZsetObject(robj *o);
 void freeHashObject(robj *o);
 robj *createObject(int type, void *ptr);
 robj *createStringObject(char *ptr, size_t len);
+robj *createEmbeddedStringObject(char *ptr, size_t len);
 robj *dupStringObject(robj *o);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
+size_t getStringObjectSdsUsedMemory(robj *o);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongDouble(long double value);
 robj *createListObject(void);
@@ -1189,6 +1319,42 @@ sds keyspaceEventsFlagsToString(int flags);
 
 /* Configuration */
 void loadServerConfig(char *filename, char *options);
+void loadServerAllocatorConfig(int argc, char **argv);
+
+/* Persistent heap keyspace */
+void pheapDbInit(void);
+void pheapDbCreateRoot(void);
+int pheapDbLoad(void);
+int pheapDbBeginCommand(redisClient *c);
+
+/* Tiered memory */
+void tierInit(void);
+int tierDemote(robj *o);
+void tierPromote(robj *o);
+void tierPrepareFork(void);
+void tierCron(void);
+
+/* Active defragmentation */
+void activeDefragCycle(void);
+robj *defragObject(robj *o);
+
+/* Lazy freeing */
+size_t lazyfreeGetFreeEffort(robj *obj);
+size_t lazyfreeEstimateObject(robj *o);
+void lazyfreeObject(robj *obj);
+int dbAsyncDelete(redisDb *db, robj *key);
+long long emptyDbAsync(redisDb *db);
+void lazyfreeCron(void);
+void lazyfreeDoJob(void *arg);
+size_t lazyfreeGetPendingObjects(void);
+size_t lazyfreeGetPendingBytes(void);
+
+/* Keyspace tables allocation */
+void rehashCron(void);
+int rehashResize(redisDb *db, int expires, unsigned long size);
+size_t rehashPendingBytes(redisDb *db);
+void rehashFreeTable(void *table, size_t bytes);
+void rehashDoJob(void *arg, void *table, size_t bytes);
 void appendServerSaveParams(time_t seconds, int changes);
 void resetServerSaveParams(void);
 struct rewriteConfigState; /* Forward declaration to export API. */
@@ -1206,14 +1372,20 @@ robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(redisClient *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply);
+void lookupKeysRead(redisDb *db, robj **keys, robj **vals, int count);
+void dbPrefetchKeys(redisDb *db, robj **keys, int count, int step);
 void dbAdd(redisDb *db, robj *key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
+int dbSyncDelete(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 long long emptyDb(void(callback)(void*));
+long long emptyDbKeys(redisDb *db, void(callback)(void*));
+void dbCreateDicts(redisDb *db);
+void dbFreeKey(redisDb *db, sds key);
 int selectDb(redisClient *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
@@ -1256,6 +1428,7 @@ void setexCommand(redisClient *c);
 void psetexCommand(redisClient *c);
 void getCommand(redisClient *c);
 void delCommand(redisClient *c);
+void unlinkCommand(redisClient *c);
 void existsCommand(redisClient *c);
 void setbitCommand(redisClient *c);
 void getbitCommand(redisClient *c);
@@ -1417,6 +1590,9 @@ void sigsegvHandler(int sig, siginfo_t *info, void *secret);
 sds genRedisInfoString(char *section);
 void enableWatchdog(int period);
 void disableWatchdog(void);
+int startAllocTrace(void);
+void stopAllocTrace(void);
+void allocTraceCron(void);
 void watchdogScheduleSignal(int period);
 void redisLogHexDump(int level, char *descr, void *value, size_t len);
 
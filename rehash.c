@@ -0,0 +1,224 @@
+/* Background allocation of the keyspace hash tables.
+ *
+ * When a hash table of a database fills up, dict.c allocates a table twice
+ * as big and moves the elements incrementally. For a keyspace of hundreds of
+ * millions of keys the new table is gigabytes: allocating it is cheap, but
+ * every page is faulted in (and zeroed by the kernel) the first time a
+ * rehashing step writes to it, adding latency to the commands performing
+ * the steps for the whole duration of the rehashing. Releasing the old
+ * table at the end unmaps all its pages at once.
+ *
+ * With "rehash-prealloc" enabled, databasesCron() requests the next table of
+ * the main dict and of the expires of every database when they reach
+ * REHASH_PREALLOC_FILL percent of their capacity. A REDIS_BIO_DICT_TABLE job
+ * allocates the table and faults its pages in, and rehashCron() installs it
+ * with dictExpandWithTable(), starting the rehashing a bit before dict.c
+ * would, with a table that is already mapped. The old tables are released
+ * by the same thread. If the dict expanded by itself meanwhile, the table
+ * is installed only if still bigger than the current one.
+ *
+ * DEBUG DICT-RESIZE uses the same path to size the table of a database in
+ * advance, before a bulk load, so that it is never rehashed while loading.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+#include "bio.h"
+
+/* The next table is requested when a table is filled at this percentage. */
+#define REHASH_PREALLOC_FILL 75
+
+/* Smaller tables are allocated and released by dict.c as usual. */
+#define REHASH_PREALLOC_MIN_BYTES (1024*1024)
+
+/* Page size used to fault in the pages of a new table. */
+#define REHASH_PAGE_SIZE 4096
+
+typedef struct rehashJob {
+    dict *d;            /* Dict the table is for. Not accessed by the bio
+                           thread, only compared with the current one. */
+    unsigned long size; /* Elements the table is sized for. */
+    size_t bytes;       /* Size of the table. */
+    void *table;        /* The table, once allocated. */
+    int done;           /* Set by the bio thread once 'table' is ready. */
+} rehashJob;
+
+static pthread_mutex_t rehash_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pending jobs, two for every database: main dict and expires. Only the
+ * main thread accesses the array, the 'done' field of the jobs is
+ * protected by rehash_mutex. */
+static rehashJob **rehash_jobs = NULL;
+
+static rehashJob **rehashJobSlot(redisDb *db, int expires) {
+    if (rehash_jobs == NULL)
+        rehash_jobs = zcalloc(sizeof(rehashJob*)*server.dbnum*2);
+    return &rehash_jobs[db->id*2+(expires != 0)];
+}
+
+/* Request a table for 'size' elements for the main dict (or the expires)
+ * of 'db', unless one was already requested. */
+static void rehashSubmit(redisDb *db, int expires, unsigned long size) {
+    rehashJob **slot = rehashJobSlot(db,expires), *job;
+    dict *d = expires ? db->expires : db->dict;
+
+    if (*slot) return;
+    job = zcalloc(sizeof(*job));
+    job->d = d;
+    job->size = size;
+    job->bytes = dictExpandBytes(d,size);
+    *slot = job;
+    bioCreateBackgroundJob(REDIS_BIO_DICT_TABLE,job,NULL,NULL);
+}
+
+/* Install the table of the job of the main dict (or the expires) of 'db' if
+ * it is ready. Tables for dicts that were replaced (FLUSHALL ASYNC), or that
+ * expanded by themselves to the same size meanwhile, are released. */
+static void rehashInstall(redisDb *db, int expires) {
+    rehashJob **slot = rehashJobSlot(db,expires), *job = *slot;
+    dict *d = expires ? db->expires : db->dict;
+    int done;
+
+    if (job == NULL) return;
+    pthread_mutex_lock(&rehash_mutex);
+    done = job->done;
+    pthread_mutex_unlock(&rehash_mutex);
+    if (!done) return;
+
+    if (job->d == d && dictIsRehashing(d)) return; /* Try again later. */
+    if (job->d != d || dictSize(d) > job->size ||
+        job->bytes <= dictTableMemory(d) ||
+        dictExpandWithTable(d,job->size,job->table) == DICT_ERR)
+    {
+        zfree_huge(job->table,job->bytes);
+    }
+    zfree(job);
+    *slot = NULL;
+}
+
+/* Request the next table of 'd' if it is full enough. */
+static void rehashCheck(redisDb *db, int expires) {
+    dict *d = expires ? db->expires : db->dict;
+    unsigned long slots = dictSlots(d);
+
+    if (dictIsRehashing(d) || slots == 0 ||
+        dictSize(d) < slots*REHASH_PREALLOC_FILL/100 ||
+        dictExpandBytes(d,slots*2) < REHASH_PREALLOC_MIN_BYTES) return;
+    rehashSubmit(db,expires,slots*2);
+}
+
+/* Called by databasesCron(). Tables are installed only when there are no
+ * children, like dict.c expands tables only then, in order to avoid the
+ * copy-on-write of the memory the rehashing touches. */
+void rehashCron(void) {
+    int j;
+
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (rehash_jobs) {
+            rehashInstall(db,0);
+            rehashInstall(db,1);
+        }
+        if (server.rehash_prealloc && !pheapIsPersistent()) {
+            rehashCheck(db,0);
+            rehashCheck(db,1);
+        }
+    }
+}
+
+/* Size the table of the main dict (or the expires) of 'db' for 'size'
+ * elements, allocating it in background. Returns REDIS_ERR if the table
+ * would not be bigger than the current one, or if one is already being
+ * allocated.
+ *
+ * With the persistent heap the tables of the keyspace are heap blocks, that
+ * only the main thread can allocate and release: nothing is done in
+ * background, and REDIS_ERR is returned. */
+int rehashResize(redisDb *db, int expires, unsigned long size) {
+    dict *d = expires ? db->expires : db->dict;
+
+    if (pheapIsPersistent() ||
+        *rehashJobSlot(db,expires) != NULL || size < dictSize(d) ||
+        dictExpandBytes(d,size) <= dictTableMemory(d)) return REDIS_ERR;
+    rehashSubmit(db,expires,size);
+    return REDIS_OK;
+}
+
+/* Bytes of the tables being allocated for 'db', or allocated and not yet
+ * installed. */
+size_t rehashPendingBytes(redisDb *db) {
+    size_t bytes = 0;
+    int j;
+
+    if (rehash_jobs == NULL) return 0;
+    for (j = 0; j <= 1; j++) {
+        rehashJob *job = *rehashJobSlot(db,j);
+        if (job) bytes += job->bytes;
+    }
+    return bytes;
+}
+
+/* Old table release function of dict.c (see dictSetTableFreeFunction()):
+ * big tables are unmapped by the bio thread. */
+void rehashFreeTable(void *table, size_t bytes) {
+    if (!server.rehash_prealloc || bytes < REHASH_PREALLOC_MIN_BYTES ||
+        pheapIsPersistent())
+    {
+        zfree_huge(table,bytes);
+        return;
+    }
+    bioCreateBackgroundJob(REDIS_BIO_DICT_TABLE,NULL,table,(void*)bytes);
+}
+
+/* ----------------------------- Bio thread side ---------------------------- */
+
+/* Allocate the table of 'job', or release 'table' if 'job' is NULL. */
+void rehashDoJob(void *arg, void *table, size_t bytes) {
+    rehashJob *job = arg;
+    char *p, *end;
+
+    if (job == NULL) {
+        zfree_huge(table,bytes);
+        return;
+    }
+
+    /* Write every page, so that the kernel maps and zeroes it now. */
+    p = zmalloc_huge_calloc(job->bytes);
+    for (end = p+job->bytes; p < end; p += REHASH_PAGE_SIZE)
+        *(volatile char*)p = 0;
+
+    pthread_mutex_lock(&rehash_mutex);
+    job->table = end-job->bytes;
+    job->done = 1;
+    pthread_mutex_unlock(&rehash_mutex);
+}
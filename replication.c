@@ -428,6 +428,18 @@ void syncCommand(redisClient *c) {
         return;
     }
 
+    /* A full resynchronization needs a BGSAVE, that is not possible when
+     * the dataset lives in the persistent heap (see rdbSaveBackground()).
+     * Partial resynchronizations are not possible either, since the
+     * backlog is only created by the first full one. */
+    if (pheapIsPersistent()) {
+        redisLog(REDIS_WARNING,"Refusing SYNC from a slave: the dataset "
+                               "lives in the persistent heap.");
+        addReplyError(c,"Can't SYNC: the dataset lives in the persistent "
+                        "heap, that can't be saved in background");
+        return;
+    }
+
     redisLog(REDIS_NOTICE,"Slave asks for synchronization");
 
     /* Try a partial resynchronization if this is a PSYNC command.
@@ -1281,6 +1293,13 @@ void slaveofCommand(redisClient *c) {
     } else {
         long port;
 
+        /* No replication with the persistent heap, see
+         * loadServerAllocatorConfig(). */
+        if (pheapIsPersistent()) {
+            addReplyError(c,"Can't replicate: the dataset lives in the "
+                            "persistent heap");
+            return;
+        }
         if ((getLongFromObjectOrReply(c, c->argv[2], &port, NULL) != REDIS_OK))
             return;
 
@@ -1405,6 +1424,7 @@ void replicationCacheMaster(redisClient *c) {
      * the socket of the new connection with the master during PSYNC. */
     aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
     aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+    unlinkClientFromPendingLists(c);
     close(c->fd);
 
     /* Set fd to -1 so that we can safely call freeClient(c) later. */
@@ -0,0 +1,184 @@
+/* SipHash is a keyed hash function designed by Jean-Philippe Aumasson and
+ * Daniel J. Bernstein: without knowing the 128 bit key an attacker can't
+ * produce keys colliding in the hash tables, so hash flooding attacks are
+ * not possible. This is SipHash-1-3 (one compression round per 8 bytes of
+ * input and three finalization rounds), that is much faster than the
+ * original SipHash-2-4 while still considered safe for hash tables.
+ *
+ * siphash_nocase() is the case insensitive variant, hashing the input as if
+ * the ASCII letters were all lower case, without copying it.
+ *
+ * The rounds follow the SipHash reference implementation, that is in the
+ * public domain (CC0).
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdint.h>
+#include <string.h>
+
+/* The number of rounds can be changed at compile time in order to check the
+ * implementation against the SipHash-2-4 reference test vectors. */
+#ifndef SIPHASH_C_ROUNDS
+#define SIPHASH_C_ROUNDS 1
+#endif
+#ifndef SIPHASH_D_ROUNDS
+#define SIPHASH_D_ROUNDS 3
+#endif
+
+#define ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);              \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                                 \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                                 \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);              \
+    } while(0)
+
+/* Load 8 bytes as a little endian 64 bit integer. On little endian targets
+ * the compiler turns this into a single unaligned load. */
+static inline uint64_t sipLoad64(const uint8_t *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+/* Turn the upper case ASCII letters of the 8 bytes in 'w' into lower case,
+ * all at once: the high bit of every byte of 'upper' is set only if the
+ * byte is between 'A' and 'Z'. Bytes >= 0x80 are left untouched, like
+ * tolower() does in the C locale. */
+static inline uint64_t sipLower64(uint64_t w) {
+    uint64_t low7 = w & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t upper = (low7 + 0x3f3f3f3f3f3f3f3fULL) &
+                     ~(low7 + 0x2525252525252525ULL) &
+                     ~w & 0x8080808080808080ULL;
+    return w | (upper >> 2);
+}
+
+static inline uint64_t siphashGeneric(const uint8_t *in, const size_t inlen,
+                                      const uint8_t *k, int nocase)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL;
+    uint64_t v1 = 0x646f72616e646f6dULL;
+    uint64_t v2 = 0x6c7967656e657261ULL;
+    uint64_t v3 = 0x7465646279746573ULL;
+    uint64_t k0 = sipLoad64(k);
+    uint64_t k1 = sipLoad64(k + 8);
+    uint64_t m, b = 0;
+    const uint8_t *end = in + inlen - (inlen % 8);
+    int left = inlen & 7, i;
+
+    v3 ^= k1;
+    v2 ^= k0;
+    v1 ^= k1;
+    v0 ^= k0;
+
+    for (; in != end; in += 8) {
+        m = sipLoad64(in);
+        if (nocase) m = sipLower64(m);
+        v3 ^= m;
+        for (i = 0; i < SIPHASH_C_ROUNDS; i++) SIPROUND;
+        v0 ^= m;
+    }
+
+    switch (left) {
+    case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t)in[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t)in[0]); break;
+    case 0: break;
+    }
+    /* Lower the tail before adding the length byte, that would be turned
+     * into lower case too if between 'A' and 'Z'. */
+    if (nocase) b = sipLower64(b);
+    b |= ((uint64_t)inlen) << 56;
+
+    v3 ^= b;
+    for (i = 0; i < SIPHASH_C_ROUNDS; i++) SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (i = 0; i < SIPHASH_D_ROUNDS; i++) SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Hash 'inlen' bytes at 'in' with the 16 bytes key 'k'. */
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    return siphashGeneric(in,inlen,k,0);
+}
+
+uint64_t siphash_nocase(const uint8_t *in, const size_t inlen,
+                        const uint8_t *k)
+{
+    return siphashGeneric(in,inlen,k,1);
+}
+
+/* Test main: check the reference vectors of SipHash-2-4 (the key is the
+ * bytes 0..15, the messages the bytes 0..len-1), and that the case
+ * insensitive variant matches the plain one on lower case input.
+ *
+ *   gcc -DSIPHASH_TEST_MAIN -DSIPHASH_C_ROUNDS=2 -DSIPHASH_D_ROUNDS=4 \
+ *       siphash.c -o siphash-test */
+#ifdef SIPHASH_TEST_MAIN
+#include <stdio.h>
+int main(void) {
+    uint8_t k[16];
+    char *a = "Hello World! This Is A Mixed-Case Key @[`{ \xc9\xe9 0123456789"
+              "AND IT IS LONGER THAN 90 BYTES, ALL THE LENGTH BYTES ARE USED",
+         *b = "hello world! this is a mixed-case key @[`{ \xc9\xe9 0123456789"
+              "and it is longer than 90 bytes, all the length bytes are used";
+    size_t len = strlen(a);
+    int j, err = 0;
+
+    for (j = 0; j < 16; j++) k[j] = j;
+#if SIPHASH_C_ROUNDS == 2 && SIPHASH_D_ROUNDS == 4
+    uint8_t in[15];
+
+    for (j = 0; j < 15; j++) in[j] = j;
+    printf("726fdb47dd0e0e31 == %016llx\n",
+        (unsigned long long) siphash(in,0,k));
+    printf("a129ca6149be45e5 == %016llx\n",
+        (unsigned long long) siphash(in,15,k));
+    err |= siphash(in,0,k) != 0x726fdb47dd0e0e31ULL;
+    err |= siphash(in,15,k) != 0xa129ca6149be45e5ULL;
+#endif
+    for (j = 0; j <= (int)len; j++) {
+        if (siphash_nocase((uint8_t*)a,j,k) != siphash((uint8_t*)b,j,k) ||
+            siphash_nocase((uint8_t*)b,j,k) != siphash((uint8_t*)b,j,k))
+        {
+            printf("nocase mismatch at length %d\n", j);
+            err = 1;
+        }
+    }
+    printf("%s\n", err ? "FAILED" : "OK");
+    return err;
+}
+#endif
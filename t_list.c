@@ -38,7 +38,7 @@
  * objects are never too long. */
 void listTypeTryConversion(robj *subject, robj *value) {
     if (subject->encoding != REDIS_ENCODING_ZIPLIST) return;
-    if (value->encoding == REDIS_ENCODING_RAW &&
+    if (sdsEncodedObject(value) &&
         sdslen(value->ptr) > server.list_max_ziplist_value)
             listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
 }
@@ -232,7 +232,7 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
 int listTypeEqual(listTypeEntry *entry, robj *o) {
     listTypeIterator *li = entry->li;
     if (li->encoding == REDIS_ENCODING_ZIPLIST) {
-        redisAssertWithInfo(NULL,o,o->encoding == REDIS_ENCODING_RAW);
+        redisAssertWithInfo(NULL,o,sdsEncodedObject(o));
         return ziplistCompare(entry->zi,o->ptr,sdslen(o->ptr));
     } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
         return equalStringObjects(o,listNodeValue(entry->ln));
@@ -982,7 +982,13 @@ void handleClientsBlockedOnLists(void) {
                 if (de) {
                     list *clients = dictGetVal(de);
                     int numclients = listLength(clients);
+                    int persistent;
 
+                    /* The popped values may be pushed to the target list
+                     * of BRPOPLPUSH, like write commands they must be
+                     * allocated in the persistent heap if the keyspace is
+                     * there (see pheapDbBeginCommand()). */
+                    persistent = zmalloc_set_persistent_scope(1);
                     while(numclients--) {
                         listNode *clientnode = listFirst(clients);
                         redisClient *receiver = clientnode->value;
@@ -1014,6 +1020,7 @@ void handleClientsBlockedOnLists(void) {
                             break;
                         }
                     }
+                    zmalloc_set_persistent_scope(persistent);
                 }
 
                 if (listTypeLength(o) == 0) dbDelete(rl->db,rl->key);
@@ -495,7 +495,7 @@ void srandmemberWithCountCommand(redisClient *c) {
 
             if (encoding == REDIS_ENCODING_INTSET) {
                 retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
-            } else if (ele->encoding == REDIS_ENCODING_RAW) {
+            } else if (sdsEncodedObject(ele)) {
                 retval = dictAdd(d,dupStringObject(ele),NULL);
             } else if (ele->encoding == REDIS_ENCODING_INT) {
                 retval = dictAdd(d,
@@ -527,7 +527,7 @@ void srandmemberWithCountCommand(redisClient *c) {
             encoding = setTypeRandomElement(set,&ele,&llele);
             if (encoding == REDIS_ENCODING_INTSET) {
                 ele = createStringObjectFromLongLong(llele);
-            } else if (ele->encoding == REDIS_ENCODING_RAW) {
+            } else if (sdsEncodedObject(ele)) {
                 ele = dupStringObject(ele);
             } else if (ele->encoding == REDIS_ENCODING_INT) {
                 ele = createStringObjectFromLongLong((long)ele->ptr);
@@ -602,7 +602,11 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
     int encoding;
 
     for (j = 0; j < setnum; j++) {
-        robj *setobj = dstkey ?
+        robj *setobj;
+
+        if (j % DICT_FIND_BATCH == 0)
+            dbPrefetchKeys(c->db,setkeys+j,setnum-j,1);
+        setobj = dstkey ?
             lookupKeyWrite(c->db,setkeys[j]) :
             lookupKeyRead(c->db,setkeys[j]);
         if (!setobj) {
@@ -747,7 +751,11 @@ void sunionDiffGenericCommand(redisClient *c, robj **setkeys, int setnum, robj *
     int diff_algo = 1;
 
     for (j = 0; j < setnum; j++) {
-        robj *setobj = dstkey ?
+        robj *setobj;
+
+        if (j % DICT_FIND_BATCH == 0)
+            dbPrefetchKeys(c->db,setkeys+j,setnum-j,1);
+        setobj = dstkey ?
             lookupKeyWrite(c->db,setkeys[j]) :
             lookupKeyRead(c->db,setkeys[j]);
         if (!setobj) {
@@ -267,18 +267,23 @@ void getrangeCommand(redisClient *c) {
 }
 
 void mgetCommand(redisClient *c) {
-    int j;
+    robj *vals[DICT_FIND_BATCH];
+    int j, i, n;
 
     addReplyMultiBulkLen(c,c->argc-1);
-    for (j = 1; j < c->argc; j++) {
-        robj *o = lookupKeyRead(c->db,c->argv[j]);
-        if (o == NULL) {
-            addReply(c,shared.nullbulk);
-        } else {
-            if (o->type != REDIS_STRING) {
+    for (j = 1; j < c->argc; j += n) {
+        n = c->argc-j < DICT_FIND_BATCH ? c->argc-j : DICT_FIND_BATCH;
+        lookupKeysRead(c->db,c->argv+j,vals,n);
+        for (i = 0; i < n; i++) {
+            robj *o = vals[i];
+            if (o == NULL) {
                 addReply(c,shared.nullbulk);
             } else {
-                addReplyBulk(c,o);
+                if (o->type != REDIS_STRING) {
+                    addReply(c,shared.nullbulk);
+                } else {
+                    addReplyBulk(c,o);
+                }
             }
         }
     }
@@ -295,6 +300,8 @@ void msetGenericCommand(redisClient *c, int nx) {
      * set nothing at all if at least one already key exists. */
     if (nx) {
         for (j = 1; j < c->argc; j += 2) {
+            if ((j-1)/2 % DICT_FIND_BATCH == 0)
+                dbPrefetchKeys(c->db,c->argv+j,(c->argc-j)/2,2);
             if (lookupKeyWrite(c->db,c->argv[j]) != NULL) {
                 busykeys++;
             }
@@ -306,6 +313,8 @@ void msetGenericCommand(redisClient *c, int nx) {
     }
 
     for (j = 1; j < c->argc; j += 2) {
+        if ((j-1)/2 % DICT_FIND_BATCH == 0)
+            dbPrefetchKeys(c->db,c->argv+j,(c->argc-j)/2,2);
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
         setKey(c->db,c->argv[j],c->argv[j+1]);
         notifyKeyspaceEvent(REDIS_NOTIFY_STRING,"set",c->argv[j],c->db->id);
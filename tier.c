@@ -0,0 +1,161 @@
+/* Tiered memory: cold values are moved to a second, slower memory tier.
+ *
+ * When "tiering" is enabled a volatile persistent heap (see pheap.c) is
+ * opened on "tier-file", typically on a file system backed by non volatile
+ * memory, and used as second zmalloc tier. A cron job samples keys at random
+ * (like the eviction code does) and moves the payload of the values that were
+ * not accessed for more than "tier-cold-age" seconds into the second tier.
+ * Values are moved back to DRAM as soon as they are looked up.
+ *
+ * Only the contiguous payloads are moved: the sds of raw strings, ziplists
+ * and intsets. The robj itself remains in DRAM, so that updating the LRU
+ * clock on access never touches the slow tier, and so do the keys. Since
+ * every access promotes the value, memory in the second tier is never
+ * modified in place.
+ *
+ * The tier is a shared mapping: a forked child would see the blocks freed by
+ * the parent reused by new values, so while a child is running frees in the
+ * second tier are deferred and no value is demoted.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "redis.h"
+
+/* Open the second tier. Called by initServer() when tiering is enabled. */
+void tierInit(void) {
+    if (pheapIsOpen()) {
+        redisLog(REDIS_WARNING,"Tiering can't be enabled when the dataset "
+                               "already lives in the persistent heap.");
+        exit(1);
+    }
+    if (pheapOpen(server.tier_file,server.tier_size,PHEAP_VOLATILE) ==
+        PHEAP_ERR)
+    {
+        redisLog(REDIS_WARNING,"Can't open the tier file %s: %s",
+            server.tier_file, strerror(errno));
+        exit(1);
+    }
+    zmalloc_set_tier(pheapBackend.name,pheapOwns);
+    redisLog(REDIS_NOTICE,"Second memory tier of %lld bytes opened on %s",
+        server.tier_size, server.tier_file);
+}
+
+/* Return the allocation holding the payload of 'o', and set '*len' to the
+ * number of bytes to copy in order to move it. NULL is returned if the
+ * payload of this kind of object can't be moved. */
+static void *tierPayload(robj *o, size_t *len) {
+    switch(o->encoding) {
+    case REDIS_ENCODING_RAW:
+        if (o->type != REDIS_STRING) return NULL;
+        *len = sdsHdrSize(((char*)o->ptr)[-1])+sdslen(o->ptr)+1;
+        return sdsAllocPtr(o->ptr);
+    case REDIS_ENCODING_ZIPLIST:
+        *len = ziplistBlobLen(o->ptr);
+        return o->ptr;
+    case REDIS_ENCODING_INTSET:
+        *len = intsetBlobLen(o->ptr);
+        return o->ptr;
+    default:
+        return NULL;
+    }
+}
+
+/* Replace the payload of 'o' with the copy at 'dst'. */
+static void tierMovePayload(robj *o, void *src, void *dst, size_t len) {
+    memcpy(dst,src,len);
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        /* The copy has no free space at the end. */
+        o->ptr = (char*)dst+((char*)o->ptr-(char*)src);
+        sdssetalloc(o->ptr,sdslen(o->ptr));
+    } else {
+        o->ptr = dst;
+    }
+    zfree(src);
+}
+
+/* Move the payload of 'o' to the second tier. Returns REDIS_OK if the value
+ * was demoted, REDIS_ERR if it can't be moved or the tier is full. */
+int tierDemote(robj *o) {
+    size_t len;
+    void *src, *dst;
+
+    if ((src = tierPayload(o,&len)) == NULL || zmalloc_in_tier(src))
+        return REDIS_ERR;
+    if ((dst = zmalloc_tier_alloc(len)) == NULL) return REDIS_ERR;
+    tierMovePayload(o,src,dst,len);
+    server.stat_tier_demoted++;
+    return REDIS_OK;
+}
+
+/* Move the payload of 'o' back to DRAM if it is in the second tier. Called
+ * by lookupKey() for every value accessed. */
+void tierPromote(robj *o) {
+    size_t len;
+    void *src;
+
+    if ((src = tierPayload(o,&len)) == NULL || !zmalloc_in_tier(src)) return;
+    tierMovePayload(o,src,zmalloc(len),len);
+    server.stat_tier_promoted++;
+}
+
+/* Called before forking a child that will read the dataset. */
+void tierPrepareFork(void) {
+    if (server.tier_enabled) pheapDeferFrees(1);
+}
+
+/* Called by databasesCron(): sample keys of a few databases and demote the
+ * cold values, stopping when the time limit is reached. */
+void tierCron(void) {
+    static unsigned int current_db = 0;
+    long long start = ustime();
+    int j, dbs_per_call = REDIS_DBCRON_DBS_PER_CALL;
+
+    if (!server.tier_enabled) return;
+    /* While a child is reading the tier we neither free nor allocate. */
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+    pheapDeferFrees(0);
+
+    if (dbs_per_call > server.dbnum) dbs_per_call = server.dbnum;
+    for (j = 0; j < dbs_per_call; j++) {
+        redisDb *db = server.db+(current_db % server.dbnum);
+        int k;
+
+        current_db++;
+        for (k = 0; k < REDIS_TIER_SAMPLES && dictSize(db->dict); k++) {
+            dictEntry *de = dictGetRandomKey(db->dict);
+            robj *o = dictGetVal(de);
+
+            if (estimateObjectIdleTime(o) >= (unsigned long)server.tier_cold_age)
+                tierDemote(o);
+        }
+        if (ustime()-start > REDIS_TIER_CRON_TIME_LIMIT) break;
+    }
+}
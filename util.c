@@ -423,20 +423,16 @@ int d2string(char *buf, size_t len, double value) {
     return len;
 }
 
-/* Generate the Redis "Run ID", a SHA1-sized random number that identifies a
- * given execution of Redis, so that if you are talking with an instance
- * having run_id == A, and you reconnect and it has run_id == B, you can be
- * sure that it is either a different instance or it was restarted. */
-void getRandomHexChars(char *p, unsigned int len) {
+/* Fill 'p' with 'len' random bytes read from /dev/urandom. */
+void getRandomBytes(unsigned char *p, unsigned int len) {
     FILE *fp = fopen("/dev/urandom","r");
-    char *charset = "0123456789abcdef";
     unsigned int j;
 
     if (fp == NULL || fread(p,len,1,fp) == 0) {
         /* If we can't read from /dev/urandom, do some reasonable effort
          * in order to create some entropy, since this function is used to
          * generate run_id and cluster instance IDs */
-        char *x = p;
+        unsigned char *x = p;
         unsigned int l = len;
         struct timeval tv;
         pid_t pid = getpid();
@@ -463,10 +459,21 @@ void getRandomHexChars(char *p, unsigned int len) {
         for (j = 0; j < len; j++)
             p[j] ^= rand();
     }
+    if (fp) fclose(fp);
+}
+
+/* Generate the Redis "Run ID", a SHA1-sized random number that identifies a
+ * given execution of Redis, so that if you are talking with an instance
+ * having run_id == A, and you reconnect and it has run_id == B, you can be
+ * sure that it is either a different instance or it was restarted. */
+void getRandomHexChars(char *p, unsigned int len) {
+    char *charset = "0123456789abcdef";
+    unsigned int j;
+
+    getRandomBytes((unsigned char*)p,len);
     /* Turn it into hex digits taking just 4 bits out of 8 for every byte. */
     for (j = 0; j < len; j++)
         p[j] = charset[p[j] & 0x0F];
-    if (fp) fclose(fp);
 }
 
 /* Given the filename, return the absolute path as an SDS string, or NULL
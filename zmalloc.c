@@ -28,6 +28,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -40,33 +41,16 @@ void zlibc_free(void *ptr) {
 }
 
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 #include "config.h"
 #include "zmalloc.h"
 
-#ifdef HAVE_MALLOC_SIZE
-#define PREFIX_SIZE (0)
-#else
-#if defined(__sun) || defined(__sparc) || defined(__sparc__)
-#define PREFIX_SIZE (sizeof(long long))
-#else
-#define PREFIX_SIZE (sizeof(size_t))
-#endif
-#endif
-
-/* Explicitly override malloc/free etc when using tcmalloc. */
-#if defined(USE_TCMALLOC)
-#define malloc(size) tc_malloc(size)
-#define calloc(count,size) tc_calloc(count,size)
-#define realloc(ptr,size) tc_realloc(ptr,size)
-#define free(ptr) tc_free(ptr)
-#elif defined(USE_JEMALLOC)
-#define malloc(size) je_malloc(size)
-#define calloc(count,size) je_calloc(count,size)
-#define realloc(ptr,size) je_realloc(ptr,size)
-#define free(ptr) je_free(ptr)
-#endif
-
 #if defined(__ATOMIC_RELAXED)
 #define update_zmalloc_stat_add(__n) __atomic_add_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
 #define update_zmalloc_stat_sub(__n) __atomic_sub_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
@@ -88,27 +72,136 @@ void zlibc_free(void *ptr) {
 
 #endif
 
-#define update_zmalloc_stat_alloc(__n) do { \
-    size_t _n = (__n); \
-    if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
+/* Used memory is accounted in per thread counters, so that threads don't
+ * contend for the same cache line at every allocation: every thread, the
+ * first time it allocates or frees, gets a counter slot that only that thread
+ * updates, with plain stores. zmalloc_used_memory() aggregates the slots
+ * lazily. A thread may release memory allocated by another thread, so a
+ * single slot can wrap below zero, but the sum modulo 2^64 is exact.
+ *
+ * The aggregated value is not a snapshot: updates performed by other threads
+ * while the slots are summed may be missed. The error is thus bounded by the
+ * size of the allocations in flight in the other threads (bio threads only
+ * allocate a few small objects per job), that is fine for maxmemory.
+ *
+ * The counters of the size classes (see zmalloc_class_of()) live in the
+ * same slots, and are aggregated only when INFO asks for them.
+ *
+ * Threads that don't find a free slot, and compilers without thread local
+ * storage, use the old shared counter updated atomically once
+ * zmalloc_enable_thread_safeness() is called. */
+#if defined(__GNUC__) && defined(__ATOMIC_RELAXED) && !defined(ZMALLOC_NO_TLS)
+#define ZMALLOC_HAVE_TLS 1
+#endif
+
+#define ZMALLOC_MAX_THREADS 64
+
+/* Bytes are accounted modulo 2^64 like 'used', since a thread may free the
+ * memory of another thread. */
+typedef struct zmallocClassCounters {
+    unsigned long long allocs, frees, reallocs, bytes;
+} zmallocClassCounters;
+
+typedef struct zmallocThreadCounter {
+    size_t used;
+    char padding[64-sizeof(size_t)]; /* Avoid false sharing between slots. */
+    zmallocClassCounters classes[ZMALLOC_NUM_CLASSES];
+}
+#ifdef __GNUC__
+__attribute__((aligned(64))) /* The classes of a slot end on their line. */
+#endif
+zmallocThreadCounter;
+
+#if defined(__ATOMIC_RELAXED)
+#define zmalloc_counter_load(__p) __atomic_load_n((__p),__ATOMIC_RELAXED)
+#else
+#define zmalloc_counter_load(__p) (*(volatile unsigned long long*)(__p))
+#endif
+
+#ifdef ZMALLOC_HAVE_TLS
+static zmallocThreadCounter zmalloc_counters[ZMALLOC_MAX_THREADS];
+static int zmalloc_counters_used = 0;
+static zmallocThreadCounter zmalloc_shared_counter; /* No slot available. */
+static __thread zmallocThreadCounter *zmalloc_counter = NULL;
+
+static zmallocThreadCounter *zmalloc_thread_counter(void) {
+    int slot;
+
+    if (zmalloc_counter) return zmalloc_counter;
+    slot = __atomic_fetch_add(&zmalloc_counters_used,1,__ATOMIC_RELAXED);
+    if (slot < ZMALLOC_MAX_THREADS)
+        zmalloc_counter = zmalloc_counters+slot;
+    else
+        zmalloc_counter = &zmalloc_shared_counter;
+    return zmalloc_counter;
+}
+
+#define update_zmalloc_stat_thread(__n) do { \
+    zmallocThreadCounter *_c = zmalloc_thread_counter(); \
+    if (_c != &zmalloc_shared_counter) \
+        __atomic_store_n(&_c->used, _c->used + (__n), __ATOMIC_RELAXED); \
+    else \
+        update_zmalloc_stat_add(__n); \
+} while(0)
+
+/* Add '__n' to the counter '__field' of the class '__cls' of the calling
+ * thread. Only the owner writes a slot, so a plain store is enough, but
+ * the threads sharing zmalloc_shared_counter need an atomic add. */
+#define update_zmalloc_class_counter(__cls,__field,__n) do { \
+    zmallocThreadCounter *_t = zmalloc_thread_counter(); \
+    unsigned long long *_p = &_t->classes[__cls].__field; \
+    if (_t != &zmalloc_shared_counter) \
+        __atomic_store_n(_p, *_p + (__n), __ATOMIC_RELAXED); \
+    else \
+        __atomic_add_fetch(_p, (__n), __ATOMIC_RELAXED); \
+} while(0)
+#else
+#define update_zmalloc_stat_thread(__n) do { \
     if (zmalloc_thread_safe) { \
-        update_zmalloc_stat_add(_n); \
+        update_zmalloc_stat_add(__n); \
     } else { \
-        used_memory += _n; \
+        used_memory += (__n); \
     } \
 } while(0)
 
+/* Without thread local storage the class counters are shared, and only
+ * updated atomically if the compiler can do it without a lock. */
+static zmallocThreadCounter zmalloc_shared_counter;
+#if defined(HAVE_ATOMIC)
+#define update_zmalloc_class_counter(__cls,__field,__n) \
+    __sync_add_and_fetch(&zmalloc_shared_counter.classes[__cls].__field,(__n))
+#else
+#define update_zmalloc_class_counter(__cls,__field,__n) \
+    (zmalloc_shared_counter.classes[__cls].__field += (__n))
+#endif
+#endif
+
+#define update_zmalloc_stat_alloc(__n) do { \
+    size_t _n = (__n); \
+    if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
+    update_zmalloc_stat_thread(_n); \
+} while(0)
+
 #define update_zmalloc_stat_free(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    if (zmalloc_thread_safe) { \
-        update_zmalloc_stat_sub(_n); \
-    } else { \
-        used_memory -= _n; \
-    } \
+    update_zmalloc_stat_thread(-_n); \
+} while(0)
+
+#if defined(__ATOMIC_RELAXED)
+#define update_zmalloc_tier_stat(__n) __atomic_add_fetch(&used_memory_tier, (__n), __ATOMIC_RELAXED)
+#elif defined(HAVE_ATOMIC)
+#define update_zmalloc_tier_stat(__n) __sync_add_and_fetch(&used_memory_tier, (__n))
+#else
+#define update_zmalloc_tier_stat(__n) do { \
+    pthread_mutex_lock(&used_memory_mutex); \
+    used_memory_tier += (__n); \
+    pthread_mutex_unlock(&used_memory_mutex); \
 } while(0)
+#endif
 
 static size_t used_memory = 0;
+static size_t used_memory_tier = 0;
 static int zmalloc_thread_safe = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -121,95 +214,718 @@ static void zmalloc_default_oom(size_t size) {
 
 static void (*zmalloc_oom_handler)(size_t) = zmalloc_default_oom;
 
-void *zmalloc(size_t size) {
-    void *ptr = malloc(size+PREFIX_SIZE);
+/* ----------------------------- Size classes -------------------------------- */
 
-    if (!ptr) zmalloc_oom_handler(size);
-#ifdef HAVE_MALLOC_SIZE
-    update_zmalloc_stat_alloc(zmalloc_size(ptr));
-    return ptr;
+/* Allocations are accounted per size class of their usable size: 8 bytes
+ * steps up to 128 bytes, then four classes for every power of two up to
+ * 1 MB, and a last class for everything bigger. The classes don't need to
+ * match the ones of the backend: they are only used for statistics.
+ *
+ * Every thread updates its own counters (see zmallocThreadCounter), that
+ * zmalloc_get_class_stats() sums. CONFIG RESETSTAT can't write the slots of
+ * other threads: it takes a snapshot that is then subtracted instead. */
+
+#define ZMALLOC_SMALL_CLASSES 16
+#define ZMALLOC_SMALL_MAX 128
+
+static zmallocClassCounters zmalloc_classes_reset[ZMALLOC_NUM_CLASSES];
+
+static inline int zmalloc_class_of(size_t size) {
+    int lg;
+
+    if (size <= ZMALLOC_SMALL_MAX) return size ? (int)((size-1)>>3) : 0;
+    if (size > ZMALLOC_CLASS_MAX) return ZMALLOC_NUM_CLASSES-1;
+    lg = 63-__builtin_clzll((unsigned long long)size-1);
+    return ZMALLOC_SMALL_CLASSES + (lg-7)*4 +
+           (int)(((size-1)-((size_t)1<<lg)) >> (lg-2));
+}
+
+#define update_zmalloc_class_alloc(__n) do { \
+    int _cls = zmalloc_class_of(__n); \
+    update_zmalloc_class_counter(_cls,allocs,1); \
+    update_zmalloc_class_counter(_cls,bytes,(__n)); \
+} while(0)
+
+#define update_zmalloc_class_free(__n) do { \
+    int _cls = zmalloc_class_of(__n); \
+    update_zmalloc_class_counter(_cls,frees,1); \
+    update_zmalloc_class_counter(_cls,bytes,-(unsigned long long)(__n)); \
+} while(0)
+
+/* Return the biggest usable size of the class 'cls', or 0 for the last
+ * class, that has no upper bound. */
+size_t zmalloc_class_size(int cls) {
+    int lg;
+
+    if (cls < ZMALLOC_SMALL_CLASSES) return (size_t)(cls+1)*8;
+    if (cls >= ZMALLOC_NUM_CLASSES-1) return 0;
+    cls -= ZMALLOC_SMALL_CLASSES;
+    lg = 7 + cls/4;
+    return ((size_t)1<<lg) + (size_t)(cls%4+1)*((size_t)1<<(lg-2));
+}
+
+/* Sum the counters of the class 'cls' of all the threads in 'c'. */
+static void zmalloc_sum_class_counters(int cls, zmallocClassCounters *c) {
+    zmallocClassCounters *t = &zmalloc_shared_counter.classes[cls];
+
+    c->allocs = zmalloc_counter_load(&t->allocs);
+    c->frees = zmalloc_counter_load(&t->frees);
+    c->reallocs = zmalloc_counter_load(&t->reallocs);
+    c->bytes = zmalloc_counter_load(&t->bytes);
+#ifdef ZMALLOC_HAVE_TLS
+    {
+        int j, slots = __atomic_load_n(&zmalloc_counters_used,__ATOMIC_RELAXED);
+
+        if (slots > ZMALLOC_MAX_THREADS) slots = ZMALLOC_MAX_THREADS;
+        for (j = 0; j < slots; j++) {
+            t = &zmalloc_counters[j].classes[cls];
+            c->allocs += zmalloc_counter_load(&t->allocs);
+            c->frees += zmalloc_counter_load(&t->frees);
+            c->reallocs += zmalloc_counter_load(&t->reallocs);
+            c->bytes += zmalloc_counter_load(&t->bytes);
+        }
+    }
+#endif
+}
+
+void zmalloc_get_class_stats(int cls, zmallocClassStats *stats) {
+    zmallocClassCounters c;
+
+    zmalloc_sum_class_counters(cls,&c);
+    stats->size = zmalloc_class_size(cls);
+    stats->allocs = c.allocs-zmalloc_classes_reset[cls].allocs;
+    stats->frees = c.frees-zmalloc_classes_reset[cls].frees;
+    stats->reallocs = c.reallocs-zmalloc_classes_reset[cls].reallocs;
+    stats->bytes = (long long)c.bytes > 0 ? (size_t)c.bytes : 0;
+}
+
+/* Reset the counters of calls. Bytes in use are not reset. */
+void zmalloc_reset_class_stats(void) {
+    int j;
+
+    for (j = 0; j < ZMALLOC_NUM_CLASSES; j++)
+        zmalloc_sum_class_counters(j,zmalloc_classes_reset+j);
+}
+
+/* ------------------------------ libc backend ------------------------------ */
+
+/* When the libc allocator has no way to report the size of an allocation we
+ * store a header with the requested size as the first bytes of every block,
+ * and return to the caller a pointer just after the header. */
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define LIBC_HAVE_MALLOC_SIZE 1
+#define PREFIX_SIZE (0)
+#elif defined(__sun) || defined(__sparc) || defined(__sparc__)
+#define PREFIX_SIZE (sizeof(long long))
 #else
-    *((size_t*)ptr) = size;
-    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
-    return (char*)ptr+PREFIX_SIZE;
+#define PREFIX_SIZE (sizeof(size_t))
 #endif
+
+#ifdef LIBC_HAVE_MALLOC_SIZE
+static void *zlibc_malloc(size_t size) {
+    return malloc(size);
 }
 
-void *zcalloc(size_t size) {
-    void *ptr = calloc(1, size+PREFIX_SIZE);
+static void *zlibc_calloc(size_t size) {
+    return calloc(1,size);
+}
 
-    if (!ptr) zmalloc_oom_handler(size);
-#ifdef HAVE_MALLOC_SIZE
-    update_zmalloc_stat_alloc(zmalloc_size(ptr));
-    return ptr;
+static void *zlibc_realloc(void *ptr, size_t size) {
+    return realloc(ptr,size);
+}
+
+static void zlibc_backend_free(void *ptr) {
+    free(ptr);
+}
+
+static size_t zlibc_usable_size(void *ptr) {
+    return malloc_size(ptr);
+}
 #else
+static void *zlibc_malloc(size_t size) {
+    void *ptr = malloc(size+PREFIX_SIZE);
+
+    if (!ptr) return NULL;
     *((size_t*)ptr) = size;
-    update_zmalloc_stat_alloc(size+PREFIX_SIZE);
     return (char*)ptr+PREFIX_SIZE;
-#endif
 }
 
-void *zrealloc(void *ptr, size_t size) {
-#ifndef HAVE_MALLOC_SIZE
-    void *realptr;
-#endif
-    size_t oldsize;
-    void *newptr;
+static void *zlibc_calloc(size_t size) {
+    void *ptr = calloc(1,size+PREFIX_SIZE);
 
-    if (ptr == NULL) return zmalloc(size);
-#ifdef HAVE_MALLOC_SIZE
-    oldsize = zmalloc_size(ptr);
-    newptr = realloc(ptr,size);
-    if (!newptr) zmalloc_oom_handler(size);
+    if (!ptr) return NULL;
+    *((size_t*)ptr) = size;
+    return (char*)ptr+PREFIX_SIZE;
+}
 
-    update_zmalloc_stat_free(oldsize);
-    update_zmalloc_stat_alloc(zmalloc_size(newptr));
-    return newptr;
-#else
-    realptr = (char*)ptr-PREFIX_SIZE;
-    oldsize = *((size_t*)realptr);
-    newptr = realloc(realptr,size+PREFIX_SIZE);
-    if (!newptr) zmalloc_oom_handler(size);
+static void *zlibc_realloc(void *ptr, size_t size) {
+    void *realptr = (char*)ptr-PREFIX_SIZE;
+    void *newptr = realloc(realptr,size+PREFIX_SIZE);
 
+    if (!newptr) return NULL;
     *((size_t*)newptr) = size;
-    update_zmalloc_stat_free(oldsize);
-    update_zmalloc_stat_alloc(size);
     return (char*)newptr+PREFIX_SIZE;
-#endif
 }
 
-/* Provide zmalloc_size() for systems where this function is not provided by
- * malloc itself, given that in that case we store a header with this
- * information as the first bytes of every allocation. */
-#ifndef HAVE_MALLOC_SIZE
-size_t zmalloc_size(void *ptr) {
+static void zlibc_backend_free(void *ptr) {
+    free((char*)ptr-PREFIX_SIZE);
+}
+
+/* Assume at least that all the allocations are padded at sizeof(long) by
+ * the underlying allocator. */
+static size_t zlibc_usable_size(void *ptr) {
     void *realptr = (char*)ptr-PREFIX_SIZE;
     size_t size = *((size_t*)realptr);
-    /* Assume at least that all the allocations are padded at sizeof(long) by
-     * the underlying allocator. */
+
     if (size&(sizeof(long)-1)) size += sizeof(long)-(size&(sizeof(long)-1));
     return size+PREFIX_SIZE;
 }
 #endif
 
-void zfree(void *ptr) {
-#ifndef HAVE_MALLOC_SIZE
-    void *realptr;
-    size_t oldsize;
+/* Note that when Redis is linked against tcmalloc the libc symbols are
+ * overridden, so this backend will actually use tcmalloc as well. */
+static zmallocBackend zmalloc_libc_backend = {
+    "libc",
+    zlibc_malloc,
+    zlibc_calloc,
+    zlibc_realloc,
+    zlibc_backend_free,
+    zlibc_usable_size,
+    NULL,
+    NULL
+};
+
+/* ---------------------------- jemalloc backend ---------------------------- */
+
+#if defined(USE_JEMALLOC)
+static void *zje_calloc(size_t size) {
+    return je_calloc(1,size);
+}
+
+static size_t zje_usable_size(void *ptr) {
+    return je_malloc_usable_size(ptr);
+}
+
+static void zje_stats(void (*write_cb)(void *privdata, const char *s),
+                      void *privdata)
+{
+    je_malloc_stats_print(write_cb,privdata,NULL);
+}
+
+#if (JEMALLOC_VERSION_MAJOR == 5 && JEMALLOC_VERSION_MINOR >= 2) || \
+    (JEMALLOC_VERSION_MAJOR > 5)
+/* Return true if 'ptr' sits in a slab that is less used than the average of
+ * the slabs of its size class, and is not the current slab of the class,
+ * from which new regions are allocated. */
+static int zje_defrag_hint(void *ptr) {
+    struct {
+        size_t nfree, nregs, size;  /* Slab of 'ptr'. */
+        size_t bin_nfree, bin_nregs; /* All the slabs of the size class. */
+        void *slabcur_addr;
+    } util;
+    size_t len = sizeof(util);
+    char *slabcur;
+
+    if (je_mallctl("experimental.utilization.query",&util,&len,
+                   &ptr,sizeof(ptr)) != 0) return 0;
+    /* Large allocations have a single region, and full slabs can't get
+     * any denser. */
+    if (util.nregs <= 1 || util.nfree == 0 || util.bin_nregs == 0) return 0;
+    slabcur = util.slabcur_addr;
+    if (slabcur && (char*)ptr >= slabcur && (char*)ptr < slabcur+util.size)
+        return 0;
+    return (util.nregs-util.nfree)*util.bin_nregs <
+           (util.bin_nregs-util.bin_nfree)*util.nregs;
+}
+#define ZJE_DEFRAG_HINT zje_defrag_hint
+#else
+#define ZJE_DEFRAG_HINT NULL
 #endif
 
-    if (ptr == NULL) return;
-#ifdef HAVE_MALLOC_SIZE
-    update_zmalloc_stat_free(zmalloc_size(ptr));
-    free(ptr);
+static zmallocBackend zmalloc_jemalloc_backend = {
+    "jemalloc",
+    je_malloc,
+    zje_calloc,
+    je_realloc,
+    je_free,
+    zje_usable_size,
+    zje_stats,
+    ZJE_DEFRAG_HINT
+};
+#endif
+
+/* ---------------------------- tcmalloc backend ---------------------------- */
+
+#if defined(USE_TCMALLOC)
+static void *ztc_calloc(size_t size) {
+    return tc_calloc(1,size);
+}
+
+static size_t ztc_usable_size(void *ptr) {
+    return tc_malloc_size(ptr);
+}
+
+static zmallocBackend zmalloc_tcmalloc_backend = {
+    "tcmalloc",
+    tc_malloc,
+    ztc_calloc,
+    tc_realloc,
+    tc_free,
+    ztc_usable_size,
+    NULL,
+    NULL
+};
+#endif
+
+/* ---------------------------- Backends registry --------------------------- */
+
+#define ZMALLOC_MAX_BACKENDS 16
+
+static zmallocBackend *zmalloc_backends[ZMALLOC_MAX_BACKENDS] = {
+#if defined(USE_JEMALLOC)
+    &zmalloc_jemalloc_backend,
+#elif defined(USE_TCMALLOC)
+    &zmalloc_tcmalloc_backend,
+#endif
+    &zmalloc_libc_backend
+};
+
+/* The default backend is the one Redis was compiled to use (see the MALLOC
+ * option of the Makefile). */
+#if defined(USE_JEMALLOC)
+static zmallocBackend *zmalloc_backend = &zmalloc_jemalloc_backend;
+#elif defined(USE_TCMALLOC)
+static zmallocBackend *zmalloc_backend = &zmalloc_tcmalloc_backend;
+#else
+static zmallocBackend *zmalloc_backend = &zmalloc_libc_backend;
+#endif
+
+/* Add a new backend to the table of the ones selectable with
+ * zmalloc_set_backend(). Returns 0 on success, -1 if a backend with the
+ * same name already exists or the table is full. */
+int zmalloc_register_backend(zmallocBackend *backend) {
+    int j;
+
+    for (j = 0; j < ZMALLOC_MAX_BACKENDS; j++) {
+        if (zmalloc_backends[j] == NULL) {
+            zmalloc_backends[j] = backend;
+            return 0;
+        }
+        if (!strcasecmp(zmalloc_backends[j]->name,backend->name)) break;
+    }
+    return -1;
+}
+
+/* Lookup a registered backend by name. Returns NULL if not found. */
+zmallocBackend *zmalloc_get_backend(const char *name) {
+    int j;
+
+    for (j = 0; j < ZMALLOC_MAX_BACKENDS && zmalloc_backends[j]; j++) {
+        if (!strcasecmp(zmalloc_backends[j]->name,name))
+            return zmalloc_backends[j];
+    }
+    return NULL;
+}
+
+/* Select the backend used by all the next zmalloc calls.
+ *
+ * Memory obtained from one backend can't be released using another one, so
+ * switching is only possible before anything was allocated: this is why
+ * the selection must happen at startup. Returns 0 on success, otherwise -1
+ * is returned and errno is set to ENOENT if no such backend exists, or to
+ * EBUSY if there is memory already allocated with the current backend. */
+int zmalloc_set_backend(const char *name) {
+    zmallocBackend *backend = zmalloc_get_backend(name);
+
+    if (backend == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (backend == zmalloc_backend) return 0;
+    if (zmalloc_used_memory() != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    zmalloc_backend = backend;
+    return 0;
+}
+
+const char *zmalloc_backend_name(void) {
+    return zmalloc_backend->name;
+}
+
+/* Emit the allocator specific statistics, if the backend provides them. */
+void zmalloc_backend_stats(void (*write_cb)(void *privdata, const char *s),
+                           void *privdata)
+{
+    if (zmalloc_backend->stats) {
+        zmalloc_backend->stats(write_cb,privdata);
+    } else {
+        write_cb(privdata,"No statistics available for this allocator.\n");
+    }
+}
+
+/* ------------------------------ Second tier ------------------------------- */
+
+/* A second backend can be used as a slower memory tier where cold data is
+ * moved (see tier.c). Memory is only allocated in the tier explicitly with
+ * zmalloc_tier_alloc(), but it can be released by zfree() like any other
+ * allocation: the 'owns' callback tells what backend a pointer belongs to. */
+static zmallocBackend *zmalloc_tier = NULL;
+static int (*zmalloc_tier_owns)(void *ptr) = NULL;
+
+/* The persistent backend is where the data that must survive a restart is
+ * allocated (see pheap.c). A thread allocates from it only while it is in a
+ * persistent scope, see zmalloc_set_persistent_scope(). Like for the tier,
+ * the 'owns' callback tells what backend a pointer belongs to. */
+static zmallocBackend *zmalloc_persistent = NULL;
+static int (*zmalloc_persistent_owns)(void *ptr) = NULL;
+#ifdef ZMALLOC_HAVE_TLS
+static __thread int zmalloc_persistent_scope = 0;
+#else
+static int zmalloc_persistent_scope = 0;
+#endif
+
+#define zmalloc_backend_of(ptr) \
+    ((zmalloc_tier && zmalloc_tier_owns(ptr)) ? zmalloc_tier : \
+     (zmalloc_persistent && zmalloc_persistent_owns(ptr)) ? \
+     zmalloc_persistent : zmalloc_backend)
+
+/* Backend new allocations of the calling thread come from. */
+#define zmalloc_alloc_backend() \
+    (zmalloc_persistent_scope ? zmalloc_persistent : zmalloc_backend)
+
+/* Use the registered backend 'name' as second tier. Returns 0 on success,
+ * or -1 with errno set to ENOENT if no such backend exists. */
+int zmalloc_set_tier(const char *name, int (*owns)(void *ptr)) {
+    zmallocBackend *backend = zmalloc_get_backend(name);
+
+    if (backend == NULL || backend == zmalloc_backend) {
+        errno = ENOENT;
+        return -1;
+    }
+    zmalloc_tier_owns = owns;
+    zmalloc_tier = backend;
+    return 0;
+}
+
+/* Allocate memory in the second tier. Unlike zmalloc() NULL is returned
+ * when the tier is full, since the caller can just keep the data where it
+ * is. */
+void *zmalloc_tier_alloc(size_t size) {
+    void *ptr;
+    size_t usable;
+
+    if (zmalloc_tier == NULL || (ptr = zmalloc_tier->malloc(size)) == NULL)
+        return NULL;
+    usable = zmalloc_tier->usable_size(ptr);
+    update_zmalloc_stat_alloc(usable);
+    update_zmalloc_tier_stat(usable);
+    return ptr;
+}
+
+int zmalloc_in_tier(void *ptr) {
+    return zmalloc_tier && zmalloc_tier_owns(ptr);
+}
+
+/* Use the registered backend 'name' as persistent backend. Returns 0 on
+ * success, or -1 with errno set to ENOENT if no such backend exists. */
+int zmalloc_set_persistent(const char *name, int (*owns)(void *ptr)) {
+    zmallocBackend *backend = zmalloc_get_backend(name);
+
+    if (backend == NULL || backend == zmalloc_backend) {
+        errno = ENOENT;
+        return -1;
+    }
+    zmalloc_persistent_owns = owns;
+    zmalloc_persistent = backend;
+    return 0;
+}
+
+/* Enter (if 'persistent' is true) or leave the persistent scope of the
+ * calling thread. While in the scope zmalloc() and zcalloc() allocate from
+ * the persistent backend, if one was set. zrealloc() always keeps the
+ * memory in the backend it belongs to. Returns the previous state, so that
+ * scopes can be nested:
+ *
+ *   int old = zmalloc_set_persistent_scope(1);
+ *   ... create the data ...
+ *   zmalloc_set_persistent_scope(old);
+ *
+ * Compilers without thread local storage have a single scope for all the
+ * threads, so only the main thread should enter it. */
+int zmalloc_set_persistent_scope(int persistent) {
+    int old = zmalloc_persistent_scope;
+
+    zmalloc_persistent_scope = persistent && zmalloc_persistent != NULL;
+    return old;
+}
+
+int zmalloc_is_persistent(void *ptr) {
+    return zmalloc_persistent && zmalloc_persistent_owns(ptr);
+}
+
+size_t zmalloc_tier_used_memory(void) {
+    if (zmalloc_tier == NULL) return 0;
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+    return update_zmalloc_tier_stat(0);
 #else
-    realptr = (char*)ptr-PREFIX_SIZE;
-    oldsize = *((size_t*)realptr);
-    update_zmalloc_stat_free(oldsize+PREFIX_SIZE);
-    free(realptr);
+    {
+        size_t um;
+
+        pthread_mutex_lock(&used_memory_mutex);
+        um = used_memory_tier;
+        pthread_mutex_unlock(&used_memory_mutex);
+        return um;
+    }
 #endif
 }
 
+/* ---------------------------- Allocation trace ---------------------------- */
+
+/* When tracing is enabled every zmalloc(), zcalloc(), zrealloc() and zfree()
+ * appends a fixed size record to an in memory ring buffer. The ring is
+ * drained by zmalloc_trace_flush(), that the caller is expected to invoke
+ * periodically from a background thread: recording never performs I/O. If
+ * the ring is full because the flushing thread can't keep up, records are
+ * dropped and counted, so a trace with drops should not be replayed.
+ *
+ * The ring is shared by all the threads, so the records are appended under
+ * a mutex. This is only paid while tracing: otherwise the cost is a single
+ * branch in every call. The ring is mapped directly with mmap() the first
+ * time tracing is started and never released, so that recording never
+ * recurses into the allocator. */
+
+#define ZMALLOC_TRACE_RING (1<<18) /* Records, must be a power of two. */
+
+static int zmalloc_tracing = 0;
+static zmallocTraceRecord *zmalloc_trace_ring = NULL;
+static unsigned long long zmalloc_trace_head = 0; /* Next record to write. */
+static unsigned long long zmalloc_trace_tail = 0; /* Next record to flush. */
+static unsigned long long zmalloc_trace_dropped = 0;
+static unsigned long long zmalloc_trace_epoch = 0;
+static pthread_mutex_t zmalloc_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long zmalloc_trace_nstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void zmalloc_trace(int op, void *ptr, void *oldptr, size_t size) {
+    unsigned long long now = zmalloc_trace_nstime();
+    zmallocTraceRecord *r;
+
+    pthread_mutex_lock(&zmalloc_trace_mutex);
+    if (zmalloc_trace_head-zmalloc_trace_tail == ZMALLOC_TRACE_RING) {
+        zmalloc_trace_dropped++;
+    } else {
+        r = zmalloc_trace_ring+(zmalloc_trace_head & (ZMALLOC_TRACE_RING-1));
+        r->time = now-zmalloc_trace_epoch;
+        r->ptr = (uintptr_t)ptr;
+        r->oldptr = (uintptr_t)oldptr;
+        r->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+        r->op = op;
+        memset(r->reserved,0,sizeof(r->reserved));
+        zmalloc_trace_head++;
+    }
+    pthread_mutex_unlock(&zmalloc_trace_mutex);
+}
+
+#define zmalloc_trace_op(op,ptr,oldptr,size) do { \
+    if (zmalloc_tracing) zmalloc_trace(op,ptr,oldptr,size); \
+} while(0)
+
+/* Start recording. The ring must have been completely flushed if tracing
+ * was already used before, since it restarts from an empty state. Returns
+ * 0 on success, -1 if the ring can't be allocated. */
+int zmalloc_trace_start(void) {
+    if (zmalloc_tracing) return 0;
+    if (zmalloc_trace_ring == NULL) {
+        void *ring = mmap(NULL,sizeof(zmallocTraceRecord)*ZMALLOC_TRACE_RING,
+                          PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,
+                          -1,0);
+        if (ring == MAP_FAILED) return -1;
+        zmalloc_trace_ring = ring;
+    }
+    pthread_mutex_lock(&zmalloc_trace_mutex);
+    zmalloc_trace_head = zmalloc_trace_tail = 0;
+    zmalloc_trace_dropped = 0;
+    zmalloc_trace_epoch = zmalloc_trace_nstime();
+    pthread_mutex_unlock(&zmalloc_trace_mutex);
+    zmalloc_tracing = 1;
+    return 0;
+}
+
+/* Stop recording. Records still in the ring can be flushed after this call. */
+void zmalloc_trace_stop(void) {
+    zmalloc_tracing = 0;
+}
+
+int zmalloc_trace_enabled(void) {
+    return zmalloc_tracing;
+}
+
+/* Return the number of records waiting to be flushed. */
+size_t zmalloc_trace_pending(void) {
+    size_t pending;
+
+    pthread_mutex_lock(&zmalloc_trace_mutex);
+    pending = zmalloc_trace_head-zmalloc_trace_tail;
+    pthread_mutex_unlock(&zmalloc_trace_mutex);
+    return pending;
+}
+
+/* Write the records in the ring to 'fd'. Only one thread at a time can
+ * flush, but recording continues while the records are written. Returns
+ * the number of records written, or -1 on write error: in this case the
+ * records that could not be written are discarded anyway. */
+long long zmalloc_trace_flush(int fd) {
+    unsigned long long head, tail, written = 0;
+    int err = 0;
+
+    if (zmalloc_trace_ring == NULL) return 0;
+    pthread_mutex_lock(&zmalloc_trace_mutex);
+    head = zmalloc_trace_head;
+    tail = zmalloc_trace_tail;
+    pthread_mutex_unlock(&zmalloc_trace_mutex);
+
+    while (tail != head) {
+        size_t idx = tail & (ZMALLOC_TRACE_RING-1);
+        size_t count = head-tail, len, done = 0;
+        char *p;
+
+        if (count > ZMALLOC_TRACE_RING-idx) count = ZMALLOC_TRACE_RING-idx;
+        p = (char*)(zmalloc_trace_ring+idx);
+        len = count*sizeof(zmallocTraceRecord);
+        while (!err && done < len) {
+            ssize_t nwritten = write(fd,p+done,len-done);
+
+            if (nwritten == -1 && errno == EINTR) continue;
+            if (nwritten <= 0) err = 1;
+            else done += nwritten;
+        }
+        if (!err) written += count;
+        tail += count;
+        pthread_mutex_lock(&zmalloc_trace_mutex);
+        zmalloc_trace_tail = tail;
+        pthread_mutex_unlock(&zmalloc_trace_mutex);
+    }
+    return err ? -1 : (long long)written;
+}
+
+/* Records appended since tracing was started, and records dropped because
+ * the ring was full. */
+void zmalloc_trace_get_stats(unsigned long long *records,
+                             unsigned long long *dropped)
+{
+    pthread_mutex_lock(&zmalloc_trace_mutex);
+    *records = zmalloc_trace_head;
+    *dropped = zmalloc_trace_dropped;
+    pthread_mutex_unlock(&zmalloc_trace_mutex);
+}
+
+/* ------------------------------ zmalloc API ------------------------------- */
+
+void *zmalloc(size_t size) {
+    zmallocBackend *backend = zmalloc_alloc_backend();
+    void *ptr = backend->malloc(size);
+    size_t usable;
+
+    if (!ptr) zmalloc_oom_handler(size);
+    usable = backend->usable_size(ptr);
+    update_zmalloc_stat_alloc(usable);
+    update_zmalloc_class_alloc(usable);
+    zmalloc_trace_op(ZMALLOC_TRACE_MALLOC,ptr,NULL,size);
+    return ptr;
+}
+
+void *zcalloc(size_t size) {
+    zmallocBackend *backend = zmalloc_alloc_backend();
+    void *ptr = backend->calloc(size);
+    size_t usable;
+
+    if (!ptr) zmalloc_oom_handler(size);
+    usable = backend->usable_size(ptr);
+    update_zmalloc_stat_alloc(usable);
+    update_zmalloc_class_alloc(usable);
+    zmalloc_trace_op(ZMALLOC_TRACE_CALLOC,ptr,NULL,size);
+    return ptr;
+}
+
+void *zrealloc(void *ptr, size_t size) {
+    zmallocBackend *backend;
+    size_t oldsize;
+    void *newptr;
+
+    if (ptr == NULL) return zmalloc(size);
+    if (zmalloc_in_tier(ptr)) {
+        /* Memory in the second tier is never modified in place: move it
+         * back to the main backend. The tier is not accounted in the size
+         * classes, so only the new allocation enters them. */
+        oldsize = zmalloc_tier->usable_size(ptr);
+        newptr = zmalloc_backend->malloc(size);
+        if (!newptr) zmalloc_oom_handler(size);
+        memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+        update_zmalloc_stat_free(oldsize);
+        update_zmalloc_tier_stat(-oldsize);
+        zmalloc_tier->free(ptr);
+    } else {
+        backend = zmalloc_backend_of(ptr);
+        oldsize = backend->usable_size(ptr);
+        newptr = backend->realloc(ptr,size);
+        if (!newptr) zmalloc_oom_handler(size);
+        update_zmalloc_stat_free(oldsize);
+        update_zmalloc_class_counter(zmalloc_class_of(oldsize),bytes,
+                                     -(unsigned long long)oldsize);
+    }
+    zmalloc_trace_op(ZMALLOC_TRACE_REALLOC,newptr,ptr,size);
+
+    size = zmalloc_backend_of(newptr)->usable_size(newptr);
+    update_zmalloc_stat_alloc(size);
+    update_zmalloc_class_counter(zmalloc_class_of(size),bytes,size);
+    update_zmalloc_class_counter(zmalloc_class_of(size),reallocs,1);
+    return newptr;
+}
+
+size_t zmalloc_size(void *ptr) {
+    return zmalloc_backend_of(ptr)->usable_size(ptr);
+}
+
+void zfree(void *ptr) {
+    zmallocBackend *backend;
+    size_t size;
+
+    if (ptr == NULL) return;
+    zmalloc_trace_op(ZMALLOC_TRACE_FREE,ptr,NULL,0);
+    backend = zmalloc_backend_of(ptr);
+    size = backend->usable_size(ptr);
+    update_zmalloc_stat_free(size);
+    if (backend == zmalloc_tier) update_zmalloc_tier_stat(-size);
+    else update_zmalloc_class_free(size);
+    backend->free(ptr);
+}
+
+/* Move the allocation at 'ptr' if the backend says this would reduce the
+ * fragmentation. Returns the new pointer, in which case 'ptr' was released,
+ * or NULL if the allocation was not moved. The whole usable size is copied,
+ * so this works for any kind of data. */
+void *zmalloc_defrag(void *ptr) {
+    size_t size;
+    void *newptr;
+
+    if (zmalloc_backend->defrag_hint == NULL ||
+        zmalloc_backend_of(ptr) != zmalloc_backend ||
+        !zmalloc_backend->defrag_hint(ptr)) return NULL;
+    size = zmalloc_backend->usable_size(ptr);
+    newptr = zmalloc(size);
+    memcpy(newptr,ptr,size);
+    zfree(ptr);
+    return newptr;
+}
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
@@ -234,6 +950,15 @@ size_t zmalloc_used_memory(void) {
         um = used_memory;
     }
 
+#ifdef ZMALLOC_HAVE_TLS
+    {
+        int j, slots = __atomic_load_n(&zmalloc_counters_used,__ATOMIC_RELAXED);
+
+        if (slots > ZMALLOC_MAX_THREADS) slots = ZMALLOC_MAX_THREADS;
+        for (j = 0; j < slots; j++)
+            um += __atomic_load_n(&zmalloc_counters[j].used,__ATOMIC_RELAXED);
+    }
+#endif
     return um;
 }
 
@@ -245,6 +970,574 @@ void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
     zmalloc_oom_handler = oom_handler;
 }
 
+/* ------------------------------ Huge pages -------------------------------- */
+
+/* With tens of GB of small objects most of the time of a lookup is spent in
+ * TLB misses. When huge pages are enabled the structures of the keyspace
+ * that are walked at every lookup, that is the pages of the slab caches
+ * (objects, hash table entries, list nodes) and the big hash tables, are
+ * mapped using 2 MB pages: MAP_HUGETLB is tried first, and if no huge page
+ * is reserved in the system we fall back to a 2 MB aligned mapping advised
+ * with MADV_HUGEPAGE, that transparent huge pages may back.
+ *
+ * After fork() a huge page written by the parent is copied as a whole, so
+ * everything that is written continuously while a child is saving (query
+ * and reply buffers, the AOF and replication buffers) keeps being allocated
+ * by the backend with normal pages.
+ *
+ * Huge pages must be enabled before anything is allocated, and are not
+ * used with the persistent heap. */
+
+#define ZMALLOC_HUGE_PAGE_SIZE (2*1024*1024)
+#define zmalloc_huge_round(size) \
+    (((size)+ZMALLOC_HUGE_PAGE_SIZE-1) & ~((size_t)ZMALLOC_HUGE_PAGE_SIZE-1))
+
+static int zmalloc_huge_enabled = 0;
+static size_t zmalloc_huge_mapped = 0;     /* Bytes currently mapped. */
+static size_t zmalloc_huge_hugetlb_maps = 0; /* Mappings with MAP_HUGETLB. */
+static size_t zmalloc_huge_thp_maps = 0;     /* Mappings left to THP. */
+static pthread_mutex_t zmalloc_huge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void zmalloc_enable_huge_pages(int enable) {
+    zmalloc_huge_enabled = enable;
+}
+
+int zmalloc_huge_pages_enabled(void) {
+    return zmalloc_huge_enabled;
+}
+
+/* Map 'size' bytes, a multiple of the huge page size, aligned to the huge
+ * page size. Returns NULL on out of memory. */
+static void *zmalloc_huge_map(size_t size) {
+    char *p, *aligned;
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL,size,PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if (p != MAP_FAILED) {
+        pthread_mutex_lock(&zmalloc_huge_mutex);
+        zmalloc_huge_mapped += size;
+        zmalloc_huge_hugetlb_maps++;
+        pthread_mutex_unlock(&zmalloc_huge_mutex);
+        return p;
+    }
+#endif
+    p = mmap(NULL,size+ZMALLOC_HUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (p == MAP_FAILED) return NULL;
+    aligned = (char*)(((uintptr_t)p + ZMALLOC_HUGE_PAGE_SIZE-1) &
+                      ~((uintptr_t)ZMALLOC_HUGE_PAGE_SIZE-1));
+    if (aligned != p) munmap(p,aligned-p);
+    munmap(aligned+size,p+ZMALLOC_HUGE_PAGE_SIZE-aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned,size,MADV_HUGEPAGE);
+#endif
+    pthread_mutex_lock(&zmalloc_huge_mutex);
+    zmalloc_huge_mapped += size;
+    zmalloc_huge_thp_maps++;
+    pthread_mutex_unlock(&zmalloc_huge_mutex);
+    return aligned;
+}
+
+static void zmalloc_huge_unmap(void *ptr, size_t size) {
+    munmap(ptr,size);
+    pthread_mutex_lock(&zmalloc_huge_mutex);
+    zmalloc_huge_mapped -= size;
+    pthread_mutex_unlock(&zmalloc_huge_mutex);
+}
+
+/* Allocate 'size' zeroed bytes for a big table. Tables smaller than a huge
+ * page, or all of them if huge pages are disabled, are just zcalloc()ed.
+ * The memory must be released with zfree_huge() passing the same size. */
+void *zmalloc_huge_calloc(size_t size) {
+    void *ptr;
+
+    if (!zmalloc_huge_enabled || size < ZMALLOC_HUGE_PAGE_SIZE)
+        return zcalloc(size);
+    size = zmalloc_huge_round(size);
+    if ((ptr = zmalloc_huge_map(size)) == NULL) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(size);
+    return ptr;
+}
+
+void zfree_huge(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    if (!zmalloc_huge_enabled || size < ZMALLOC_HUGE_PAGE_SIZE) {
+        zfree(ptr);
+        return;
+    }
+    size = zmalloc_huge_round(size);
+    update_zmalloc_stat_free(size);
+    zmalloc_huge_unmap(ptr,size);
+}
+
+void zmalloc_get_huge_stats(size_t *mapped, size_t *hugetlb_maps,
+                            size_t *thp_maps)
+{
+    pthread_mutex_lock(&zmalloc_huge_mutex);
+    *mapped = zmalloc_huge_mapped;
+    *hugetlb_maps = zmalloc_huge_hugetlb_maps;
+    *thp_maps = zmalloc_huge_thp_maps;
+    pthread_mutex_unlock(&zmalloc_huge_mutex);
+}
+
+/* ------------------------------ Slab caches ------------------------------- */
+
+/* Small fixed size structures allocated millions of times (objects, hash
+ * table entries, list nodes) are served by slab caches: every cache carves
+ * objects of a single size out of ZSLAB_PAGE_SIZE pages obtained directly
+ * with mmap(), aligned to their size so that the page of an object is found
+ * masking its address. Free objects are kept in a per page free list, so
+ * allocating and releasing is O(1), objects of the same type are densely
+ * packed, and they don't fragment the heap of the general purpose allocator.
+ *
+ * Pages with free objects are linked in the 'partial' list of the cache.
+ * A page that becomes completely free is kept as spare if there is not one
+ * already, otherwise it is returned to the operating system.
+ *
+ * A cache is not locked: it must be used by a single thread, the first that
+ * allocates from it. Other threads can release objects, but these are just
+ * pushed on the lock free 'remote' stack, and reclaimed by the owner the
+ * next time it runs out of free objects. A thread may release millions of
+ * objects at once (see lazyfree.c), so they are reclaimed ZSLAB_DRAIN_BATCH
+ * at a time, and the owner can reclaim the rest incrementally calling
+ * zmalloc_drain_slabs() from time to time.
+ *
+ * used_memory accounts the size of the objects, while the unused part of
+ * the pages is reported by the cache statistics.
+ *
+ * With huge pages enabled the pages are carved from 2 MB arenas shared by
+ * all the caches. Pages that become free can't be unmapped individually, so
+ * they are kept in a list and reused by any cache.
+ *
+ * Every cache also links all its pages together, so that zslab_drop() can
+ * release them at once without looking at the objects. */
+
+#define ZSLAB_PAGE_SIZE (64*1024)
+#define ZSLAB_MAX_CACHES 16
+#define ZSLAB_DRAIN_BATCH 1024
+
+typedef struct zslabPage {
+    zslab *slab;
+    struct zslabPage *prev, *next;  /* Links in the partial list. */
+    struct zslabPage *allprev, *allnext; /* Links in the list of all pages. */
+    void *freelist;                 /* Released objects. */
+    unsigned int inuse;             /* Allocated objects. */
+    unsigned int unused;            /* Objects never allocated so far. */
+} zslabPage;
+
+#define ZSLAB_HDR_SIZE ((sizeof(zslabPage)+15) & ~(size_t)15)
+#define zslabPageOf(ptr) \
+    ((zslabPage*)((uintptr_t)(ptr) & ~((uintptr_t)ZSLAB_PAGE_SIZE-1)))
+#define zslabCapacity(slab) ((ZSLAB_PAGE_SIZE-ZSLAB_HDR_SIZE)/(slab)->size)
+
+static zslab *zslab_caches[ZSLAB_MAX_CACHES];
+static int zslab_enabled = 1;
+
+/* Huge page arenas. Pages are mapped rarely, so a mutex is fine. */
+static char *zslab_arena = NULL, *zslab_arena_end = NULL;
+static zslabPage *zslab_free_pages = NULL;
+static pthread_mutex_t zslab_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Enable or disable the slab caches: when disabled zslab_alloc() and
+ * zslab_free() are just zmalloc() and zfree(). This must be called before
+ * anything is allocated from a cache. */
+void zmalloc_enable_slabs(int enable) {
+    zslab_enabled = enable;
+}
+
+/* Number of objects the pages currently mapped by 'slab' can hold. */
+size_t zmalloc_slab_capacity(zslab *slab) {
+    return slab->pages*zslabCapacity(slab);
+}
+
+/* Return the j-th slab cache that was used so far, or NULL. */
+zslab *zmalloc_get_slab(int j) {
+    return (j >= 0 && j < ZSLAB_MAX_CACHES) ? zslab_caches[j] : NULL;
+}
+
+static void zslab_unlink(zslab *slab, zslabPage *page) {
+    if (page->prev) page->prev->next = page->next;
+    else slab->partial = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+static void zslab_link(zslab *slab, zslabPage *page) {
+    page->prev = NULL;
+    page->next = slab->partial;
+    if (page->next) page->next->prev = page;
+    slab->partial = page;
+}
+
+/* Get a page from the huge page arenas, or NULL. */
+static char *zslab_arena_page(void) {
+    char *p = NULL;
+
+    pthread_mutex_lock(&zslab_arena_mutex);
+    if (zslab_free_pages) {
+        p = (char*)zslab_free_pages;
+        zslab_free_pages = zslab_free_pages->next;
+    } else {
+        if (zslab_arena == zslab_arena_end) {
+            zslab_arena = zmalloc_huge_map(ZMALLOC_HUGE_PAGE_SIZE);
+            zslab_arena_end = zslab_arena ?
+                              zslab_arena+ZMALLOC_HUGE_PAGE_SIZE : NULL;
+        }
+        if (zslab_arena) {
+            p = zslab_arena;
+            zslab_arena += ZSLAB_PAGE_SIZE;
+        }
+    }
+    pthread_mutex_unlock(&zslab_arena_mutex);
+    return p;
+}
+
+/* Map a new page aligned to its size, or return NULL. */
+static zslabPage *zslab_new_page(zslab *slab) {
+    char *p, *aligned;
+    zslabPage *page;
+
+    if (zmalloc_huge_enabled) {
+        if ((aligned = zslab_arena_page()) == NULL) return NULL;
+    } else {
+        p = mmap(NULL,ZSLAB_PAGE_SIZE*2,PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANON,-1,0);
+        if (p == MAP_FAILED) return NULL;
+        aligned = (char*)(((uintptr_t)p + ZSLAB_PAGE_SIZE-1) &
+                          ~((uintptr_t)ZSLAB_PAGE_SIZE-1));
+        if (aligned != p) munmap(p,aligned-p);
+        munmap(aligned+ZSLAB_PAGE_SIZE,p+ZSLAB_PAGE_SIZE-aligned);
+    }
+
+    page = (zslabPage*)aligned;
+    page->slab = slab;
+    page->prev = page->next = NULL;
+    page->allprev = NULL;
+    page->allnext = slab->all;
+    if (page->allnext) page->allnext->allprev = page;
+    slab->all = page;
+    page->freelist = NULL;
+    page->inuse = 0;
+    page->unused = zslabCapacity(slab);
+    slab->pages++;
+    return page;
+}
+
+/* Give back to the system (or to the huge page arenas) a page of 'slab'. */
+static void zslab_unmap_page(zslab *slab, zslabPage *page) {
+    if (page->allprev) page->allprev->allnext = page->allnext;
+    else slab->all = page->allnext;
+    if (page->allnext) page->allnext->allprev = page->allprev;
+    if (zmalloc_huge_enabled) {
+        pthread_mutex_lock(&zslab_arena_mutex);
+        page->next = zslab_free_pages;
+        zslab_free_pages = page;
+        pthread_mutex_unlock(&zslab_arena_mutex);
+    } else {
+        munmap(page,ZSLAB_PAGE_SIZE);
+    }
+    slab->pages--;
+}
+
+static void zslab_release(zslab *slab, void *ptr) {
+    zslabPage *page = zslabPageOf(ptr);
+
+    *(void**)ptr = page->freelist;
+    page->freelist = ptr;
+    if (page->inuse == zslabCapacity(slab)) zslab_link(slab,page);
+    page->inuse--;
+    slab->objects--;
+    if (page->inuse == 0) {
+        zslab_unlink(slab,page);
+        if (slab->spare == NULL) {
+            slab->spare = page;
+        } else {
+            zslab_unmap_page(slab,page);
+        }
+    }
+}
+
+/* Reclaim up to 'count' objects released by other threads. The remote
+ * stack is taken as a whole and moved to the 'drained' list, that only the
+ * owner accesses, then consumed incrementally. Returns the number of objects
+ * reclaimed. */
+static size_t zslab_drain_remote(zslab *slab, size_t count) {
+    size_t reclaimed = 0;
+    void *ptr;
+
+    while(reclaimed < count) {
+        if (slab->drained == NULL) {
+            if (slab->remote == NULL) break;
+#if defined(__ATOMIC_RELAXED)
+            slab->drained = __atomic_exchange_n(&slab->remote,NULL,
+                                                __ATOMIC_ACQUIRE);
+#elif defined(HAVE_ATOMIC)
+            slab->drained = __sync_lock_test_and_set(&slab->remote,NULL);
+#else
+            pthread_mutex_lock(&used_memory_mutex);
+            slab->drained = slab->remote;
+            slab->remote = NULL;
+            pthread_mutex_unlock(&used_memory_mutex);
+#endif
+        }
+        ptr = slab->drained;
+        slab->drained = *(void**)ptr;
+        zslab_release(slab,ptr);
+        reclaimed++;
+    }
+    return reclaimed;
+}
+
+void *zslab_alloc(zslab *slab) {
+    zslabPage *page;
+    void *ptr;
+
+    if (!zslab_enabled) return zmalloc(slab->size);
+    if (slab->partial == NULL) {
+        if (!slab->registered) {
+            int j;
+
+            slab->owner = pthread_self();
+            for (j = 0; j < ZSLAB_MAX_CACHES; j++) {
+                if (zslab_caches[j] == NULL) {
+                    zslab_caches[j] = slab;
+                    break;
+                }
+            }
+            slab->registered = 1;
+        }
+        if (slab->remote || slab->drained)
+            zslab_drain_remote(slab,ZSLAB_DRAIN_BATCH);
+    }
+    if ((page = slab->partial) == NULL) {
+        if (slab->spare) {
+            page = slab->spare;
+            slab->spare = NULL;
+        } else if ((page = zslab_new_page(slab)) == NULL) {
+            zmalloc_oom_handler(slab->size);
+            return NULL;
+        }
+        zslab_link(slab,page);
+    }
+
+    if (page->freelist) {
+        ptr = page->freelist;
+        page->freelist = *(void**)ptr;
+    } else {
+        /* Objects never used are carved from the end of the page, so that
+         * a new page is not touched all at once. */
+        page->unused--;
+        ptr = (char*)page + ZSLAB_HDR_SIZE + page->unused*slab->size;
+    }
+    if (++page->inuse == zslabCapacity(slab)) zslab_unlink(slab,page);
+    slab->objects++;
+    update_zmalloc_stat_alloc(slab->size);
+    return ptr;
+}
+
+void zslab_free(zslab *slab, void *ptr) {
+    if (ptr == NULL) return;
+    if (!zslab_enabled) {
+        zfree(ptr);
+        return;
+    }
+    update_zmalloc_stat_free(slab->size);
+    if (!pthread_equal(pthread_self(),slab->owner)) {
+#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+        void *head;
+
+        do {
+            head = slab->remote;
+            *(void**)ptr = head;
+        } while(!__sync_bool_compare_and_swap(&slab->remote,head,ptr));
+#else
+        pthread_mutex_lock(&used_memory_mutex);
+        *(void**)ptr = slab->remote;
+        slab->remote = ptr;
+        pthread_mutex_unlock(&used_memory_mutex);
+#endif
+        return;
+    }
+    zslab_release(slab,ptr);
+}
+
+/* Move the object at 'ptr' if its page is less used than the page new
+ * objects are allocated from, so that sparse pages can eventually be
+ * released. Returns the new object, or NULL if it was not moved. Like
+ * zslab_alloc(), only the owner thread can call this function. */
+void *zslab_defrag(zslab *slab, void *ptr) {
+    zslabPage *page, *head;
+    void *newptr;
+
+    if (!zslab_enabled) return zmalloc_defrag(ptr);
+    page = zslabPageOf(ptr);
+    head = slab->partial;
+    if (head == NULL || page == head || page->inuse >= head->inuse)
+        return NULL;
+    newptr = zslab_alloc(slab);
+    memcpy(newptr,ptr,slab->size);
+    zslab_free(slab,ptr);
+    return newptr;
+}
+
+/* Release all the objects of 'slab' at once, unmapping its pages. The
+ * objects are not visited at all, so the caller must be sure nothing
+ * references them anymore. Only the owner thread can call this function, or
+ * any thread once no other thread can reach the cache: no allocation, free
+ * or reclaim may run on it concurrently. The pages shared with the other
+ * caches (see zslab_unmap_page()) are protected by their own mutex. */
+void zslab_drop(zslab *slab) {
+    if (!zslab_enabled) return;
+    zslab_drain_remote(slab,(size_t)-1);
+    update_zmalloc_stat_free(slab->objects*slab->size);
+    while(slab->all) zslab_unmap_page(slab,slab->all);
+    slab->objects = 0;
+    slab->partial = slab->spare = NULL;
+}
+
+/* Reclaim up to 'count' objects released by other threads to the caches
+ * owned by the calling thread. Returns the number of objects reclaimed: if
+ * it is 'count' there may be more to reclaim. */
+size_t zmalloc_drain_slabs(size_t count) {
+    size_t reclaimed = 0;
+    int j;
+
+    if (!zslab_enabled) return 0;
+    for (j = 0; j < ZSLAB_MAX_CACHES && reclaimed < count; j++) {
+        zslab *slab = zslab_caches[j];
+
+        if (slab == NULL) break;
+        if (!pthread_equal(pthread_self(),slab->owner)) continue;
+        reclaimed += zslab_drain_remote(slab,count-reclaimed);
+    }
+    return reclaimed;
+}
+
+/* ---------------------------- Arenas ---------------------------------------
+ * An arena is a set of slab caches, one per size class, plus a list of the
+ * allocations too big for the classes. Objects can be released one by one
+ * with zarena_free(), or all together with zarena_drop(), that returns the
+ * pages of the caches without touching the objects: this is how a database
+ * can be flushed without releasing every key.
+ *
+ * Like slab caches, an arena must be used only by the thread that created
+ * it. Arenas are not available when the slab caches are disabled. */
+
+#define ZARENA_NUM_CLASSES 9
+
+static const size_t zarena_class_size[ZARENA_NUM_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256
+};
+
+typedef struct zarenaLarge {
+    struct zarenaLarge *prev, *next;
+} zarenaLarge;
+
+struct zarena {
+    zslab classes[ZARENA_NUM_CLASSES];
+    zarenaLarge *large;     /* Allocations bigger than the biggest class. */
+    size_t large_used;      /* Memory used by the large allocations. */
+};
+
+static int zarena_class(size_t size) {
+    int j;
+
+    for (j = 0; j < ZARENA_NUM_CLASSES; j++)
+        if (size <= zarena_class_size[j]) return j;
+    return -1;
+}
+
+/* Create a new arena, or return NULL if slab caches are disabled. */
+zarena *zarena_create(void) {
+    zarena *arena;
+    int j;
+
+    if (!zslab_enabled) return NULL;
+    arena = zcalloc(sizeof(*arena));
+    for (j = 0; j < ZARENA_NUM_CLASSES; j++) {
+        zslab *slab = arena->classes+j;
+
+        slab->name = "arena";
+        slab->size = zarena_class_size[j];
+        slab->owner = pthread_self();
+        slab->registered = 1; /* Not listed among the shared caches. */
+    }
+    return arena;
+}
+
+void *zarena_alloc(zarena *arena, size_t size) {
+    int j = zarena_class(size);
+    zarenaLarge *l;
+
+    if (j != -1) return zslab_alloc(arena->classes+j);
+    l = zmalloc(sizeof(*l)+size);
+    l->prev = NULL;
+    l->next = arena->large;
+    if (l->next) l->next->prev = l;
+    arena->large = l;
+    arena->large_used += zmalloc_size(l);
+    return l+1;
+}
+
+/* Release an object of the arena. 'size' must be the one requested to
+ * zarena_alloc(). */
+void zarena_free(zarena *arena, void *ptr, size_t size) {
+    int j = zarena_class(size);
+    zarenaLarge *l;
+
+    if (ptr == NULL) return;
+    if (j != -1) {
+        zslab_free(arena->classes+j,ptr);
+        return;
+    }
+    l = ((zarenaLarge*)ptr)-1;
+    if (l->prev) l->prev->next = l->next;
+    else arena->large = l->next;
+    if (l->next) l->next->prev = l->prev;
+    arena->large_used -= zmalloc_size(l);
+    zfree(l);
+}
+
+/* Return the cache of the arena serving objects of 'size' bytes, so that
+ * other modules can allocate from it directly (see dictSetEntrySlab()). */
+zslab *zarena_slab(zarena *arena, size_t size) {
+    int j = zarena_class(size);
+
+    return (j == -1) ? NULL : arena->classes+j;
+}
+
+/* Release all the objects of the arena at once. The same rules of
+ * zslab_drop() apply about the threads that can call it. */
+void zarena_drop(zarena *arena) {
+    int j;
+
+    for (j = 0; j < ZARENA_NUM_CLASSES; j++)
+        zslab_drop(arena->classes+j);
+    while(arena->large) {
+        zarenaLarge *next = arena->large->next;
+
+        zfree(arena->large);
+        arena->large = next;
+    }
+    arena->large_used = 0;
+}
+
+/* Release all the objects of the arena and the arena itself. */
+void zarena_release(zarena *arena) {
+    zarena_drop(arena);
+    zfree(arena);
+}
+
+size_t zarena_used_memory(zarena *arena) {
+    size_t used = arena->large_used;
+    int j;
+
+    for (j = 0; j < ZARENA_NUM_CLASSES; j++)
+        used += arena->classes[j].objects*arena->classes[j].size;
+    return used;
+}
+
 /* Get the RSS information in an OS-specific way.
  *
  * WARNING: the function zmalloc_get_rss() is not designed to be fast
@@ -352,3 +1645,84 @@ size_t zmalloc_get_private_dirty(void) {
     return 0;
 }
 #endif
+
+#ifdef ZMALLOC_TEST_MAIN
+/* used_memory accounting microbenchmark. Compile and run with:
+ *
+ *   gcc -O2 -DZMALLOC_TEST_MAIN zmalloc.c -lpthread -o zmalloc-bench
+ *   ./zmalloc-bench
+ *
+ * Every thread updates the used memory counters BENCH_OPS times, using the
+ * shared atomic counter (what every allocation did before per thread
+ * counters, once bio threads were started) and the per thread counters.
+ * The cost of full zmalloc() + zfree() pairs is reported as well. */
+#include <sys/time.h>
+
+#define BENCH_OPS 10000000
+#define BENCH_MAX_THREADS 8
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static void *benchAtomic(void *arg) {
+    long j;
+
+    (void)arg;
+    for (j = 0; j < BENCH_OPS; j++) {
+        update_zmalloc_stat_add(16);
+        update_zmalloc_stat_sub(16);
+    }
+    return NULL;
+}
+
+static void *benchPerThread(void *arg) {
+    long j;
+
+    (void)arg;
+    for (j = 0; j < BENCH_OPS; j++) {
+        update_zmalloc_stat_alloc(16);
+        update_zmalloc_stat_free(16);
+    }
+    return NULL;
+}
+
+static void *benchMalloc(void *arg) {
+    long j;
+
+    (void)arg;
+    for (j = 0; j < BENCH_OPS/10; j++) zfree(zmalloc(16));
+    return NULL;
+}
+
+/* Run 'fn' in 'threads' threads and return the ns per call, every
+ * iteration performing two calls. */
+static double bench(void *(*fn)(void*), int threads, long ops) {
+    pthread_t tid[BENCH_MAX_THREADS];
+    long long start = usec();
+    int j;
+
+    for (j = 0; j < threads; j++) pthread_create(tid+j,NULL,fn,NULL);
+    for (j = 0; j < threads; j++) pthread_join(tid[j],NULL);
+    return (double)(usec()-start)*1000/(ops*2);
+}
+
+int main(void) {
+    int threads;
+
+    zmalloc_enable_thread_safeness();
+    printf("%-8s %18s %18s %18s\n", "threads", "atomic ns/call",
+        "per-thread ns/call", "zmalloc+zfree ns");
+    for (threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+        double atomic = bench(benchAtomic,threads,BENCH_OPS);
+        double local = bench(benchPerThread,threads,BENCH_OPS);
+        double calls = bench(benchMalloc,threads,BENCH_OPS/10);
+
+        printf("%-8d %18.2f %18.2f %18.2f\n", threads, atomic, local, calls);
+    }
+    printf("used_memory at exit: %zu\n", zmalloc_used_memory());
+    return 0;
+}
+#endif
@@ -31,6 +31,9 @@
 #ifndef __ZMALLOC_H
 #define __ZMALLOC_H
 
+#include <pthread.h>
+#include <stdint.h>
+
 /* Double expansion needed for stringification of macro values. */
 #define __xstr(s) __str(s)
 #define __str(s) #s
@@ -40,7 +43,7 @@
 #include <google/tcmalloc.h>
 #if (TC_VERSION_MAJOR == 1 && TC_VERSION_MINOR >= 6) || (TC_VERSION_MAJOR > 1)
 #define HAVE_MALLOC_SIZE 1
-#define zmalloc_size(p) tc_malloc_size(p)
+#define ZMALLOC_DEFAULT_BACKEND "tcmalloc"
 #else
 #error "Newer version of tcmalloc required"
 #endif
@@ -50,26 +53,104 @@
 #include <jemalloc/jemalloc.h>
 #if (JEMALLOC_VERSION_MAJOR == 2 && JEMALLOC_VERSION_MINOR >= 1) || (JEMALLOC_VERSION_MAJOR > 2)
 #define HAVE_MALLOC_SIZE 1
-#define zmalloc_size(p) je_malloc_usable_size(p)
+#define ZMALLOC_DEFAULT_BACKEND "jemalloc"
 #else
 #error "Newer version of jemalloc required"
 #endif
-
-#elif defined(__APPLE__)
-#include <malloc/malloc.h>
-#define HAVE_MALLOC_SIZE 1
-#define zmalloc_size(p) malloc_size(p)
 #endif
 
 #ifndef ZMALLOC_LIB
 #define ZMALLOC_LIB "libc"
+#define ZMALLOC_DEFAULT_BACKEND "libc"
 #endif
 
+/* Allocator backend. Every zmalloc call is dispatched through the methods of
+ * the currently selected backend, so that different allocators linked into
+ * the same binary can be compared without rebuilding.
+ *
+ * 'usable_size' must return the number of bytes actually reserved for the
+ * allocation, since this is what is accounted in used_memory. 'stats' is
+ * optional and emits a human readable report of the allocator internals
+ * calling 'write_cb' one or more times. 'defrag_hint' is optional as well,
+ * and tells if moving the allocation at 'ptr' elsewhere would reduce the
+ * fragmentation, because it sits in a run of blocks less used than the
+ * average (see zmalloc_defrag()). */
+typedef struct zmallocBackend {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    size_t (*usable_size)(void *ptr);
+    void (*stats)(void (*write_cb)(void *privdata, const char *s),
+                  void *privdata);
+    int (*defrag_hint)(void *ptr);
+} zmallocBackend;
+
+/* Slab cache for objects of a fixed size, see zslab_alloc(). Caches are
+ * statically declared with ZSLAB_INIT. */
+typedef struct zslab {
+    const char *name;
+    size_t size;            /* Size of the objects. */
+    size_t objects;         /* Objects allocated. */
+    size_t pages;           /* Pages mapped, including the spare one. */
+    struct zslabPage *partial;  /* Pages with free objects. */
+    struct zslabPage *spare;    /* Completely free page kept around. */
+    struct zslabPage *all;      /* All the pages, see zslab_drop(). */
+    void *remote;           /* Objects released by other threads. */
+    void *drained;          /* Taken from 'remote', not yet reclaimed. */
+    pthread_t owner;        /* Thread allocating from the cache. */
+    int registered;
+} zslab;
+
+#define ZSLAB_INIT(name,type) {name, (sizeof(type)+7) & ~(size_t)7, 0, 0, \
+                               NULL, NULL, NULL, NULL, NULL, 0, 0}
+
+/* Arena of objects that can be released all at once, see zarena_create(). */
+typedef struct zarena zarena;
+
+/* Statistics of the allocations of a given size class. */
+#define ZMALLOC_NUM_CLASSES 69
+#define ZMALLOC_CLASS_MAX (1024*1024)
+
+typedef struct zmallocClassStats {
+    size_t size;                    /* Biggest size of the class, 0 = inf. */
+    unsigned long long allocs;      /* zmalloc() and zcalloc() calls. */
+    unsigned long long frees;       /* zfree() calls. */
+    unsigned long long reallocs;    /* zrealloc() calls ending in the class. */
+    size_t bytes;                   /* Bytes currently allocated. */
+} zmallocClassStats;
+
+/* Allocation trace, see zmalloc_trace_start(). A trace file is composed of a
+ * zmallocTraceHeader followed by the records, in the byte order of the host
+ * that recorded them. */
+#define ZMALLOC_TRACE_MAGIC "ZMTRACE1"
+#define ZMALLOC_TRACE_MALLOC 0
+#define ZMALLOC_TRACE_CALLOC 1
+#define ZMALLOC_TRACE_REALLOC 2
+#define ZMALLOC_TRACE_FREE 3
+
+typedef struct zmallocTraceHeader {
+    char magic[8];              /* ZMALLOC_TRACE_MAGIC, not null terminated. */
+    uint32_t record_size;       /* sizeof(zmallocTraceRecord). */
+    uint32_t reserved;
+} zmallocTraceHeader;
+
+typedef struct zmallocTraceRecord {
+    uint64_t time;      /* Nanoseconds since the trace was started. */
+    uint64_t ptr;       /* Pointer returned, or released by ZMALLOC_TRACE_FREE. */
+    uint64_t oldptr;    /* Pointer passed to zrealloc(), otherwise 0. */
+    uint32_t size;      /* Requested size, 0 for ZMALLOC_TRACE_FREE. */
+    uint8_t op;         /* ZMALLOC_TRACE_* opcode. */
+    uint8_t reserved[3];
+} zmallocTraceRecord;
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
+size_t zmalloc_size(void *ptr);
 size_t zmalloc_used_memory(void);
 void zmalloc_enable_thread_safeness(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
@@ -78,8 +159,50 @@ size_t zmalloc_get_rss(void);
 size_t zmalloc_get_private_dirty(void);
 void zlibc_free(void *ptr);
 
-#ifndef HAVE_MALLOC_SIZE
-size_t zmalloc_size(void *ptr);
-#endif
+int zmalloc_register_backend(zmallocBackend *backend);
+int zmalloc_set_backend(const char *name);
+zmallocBackend *zmalloc_get_backend(const char *name);
+const char *zmalloc_backend_name(void);
+void zmalloc_backend_stats(void (*write_cb)(void *privdata, const char *s),
+                           void *privdata);
+int zmalloc_set_tier(const char *name, int (*owns)(void *ptr));
+void *zmalloc_tier_alloc(size_t size);
+int zmalloc_in_tier(void *ptr);
+size_t zmalloc_tier_used_memory(void);
+int zmalloc_set_persistent(const char *name, int (*owns)(void *ptr));
+int zmalloc_set_persistent_scope(int persistent);
+int zmalloc_is_persistent(void *ptr);
+void *zslab_alloc(zslab *slab);
+void zslab_free(zslab *slab, void *ptr);
+void zmalloc_enable_slabs(int enable);
+zslab *zmalloc_get_slab(int j);
+size_t zmalloc_slab_capacity(zslab *slab);
+void *zmalloc_defrag(void *ptr);
+void zmalloc_enable_huge_pages(int enable);
+int zmalloc_huge_pages_enabled(void);
+void *zmalloc_huge_calloc(size_t size);
+void zfree_huge(void *ptr, size_t size);
+void zmalloc_get_huge_stats(size_t *mapped, size_t *hugetlb_maps,
+                            size_t *thp_maps);
+void *zslab_defrag(zslab *slab, void *ptr);
+void zslab_drop(zslab *slab);
+size_t zmalloc_drain_slabs(size_t count);
+zarena *zarena_create(void);
+void *zarena_alloc(zarena *arena, size_t size);
+void zarena_free(zarena *arena, void *ptr, size_t size);
+zslab *zarena_slab(zarena *arena, size_t size);
+void zarena_drop(zarena *arena);
+void zarena_release(zarena *arena);
+size_t zarena_used_memory(zarena *arena);
+size_t zmalloc_class_size(int cls);
+void zmalloc_get_class_stats(int cls, zmallocClassStats *stats);
+void zmalloc_reset_class_stats(void);
+int zmalloc_trace_start(void);
+void zmalloc_trace_stop(void);
+int zmalloc_trace_enabled(void);
+size_t zmalloc_trace_pending(void);
+long long zmalloc_trace_flush(int fd);
+void zmalloc_trace_get_stats(unsigned long long *records,
+                             unsigned long long *dropped);
 
 #endif /* __ZMALLOC_H */